@@ -0,0 +1,31 @@
+#ifndef XMPPD_ADMIT_H
+#define XMPPD_ADMIT_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "config.h"
+
+/*
+ * Connection admission control, shared by all reactors: a global and a
+ * per-IP token bucket on the accept rate, and a cap on sessions that have
+ * connected but not yet authenticated. A reconnect storm is turned away
+ * at accept time instead of piling up handshakes.
+ */
+
+enum {
+    ADMIT_OK = 0,
+    ADMIT_RATE,         /* global accept rate exceeded */
+    ADMIT_IP_RATE,      /* per-IP accept rate exceeded */
+    ADMIT_PREAUTH       /* too many unauthenticated sessions */
+};
+
+void admit_init(const config_t *cfg);
+
+/* Decide on a freshly accepted connection at time now (ms). On ADMIT_OK
+ * the connection counts as pre-auth until admit_preauth_done. */
+int  admit_connection(const struct sockaddr_in *addr, uint64_t now);
+
+/* A pre-auth session authenticated or went away */
+void admit_preauth_done(void);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef XMPPD_ARENA_H
+#define XMPPD_ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator for data that lives as long as one stanza. Allocations
+ * are carved out of the newest block and never freed one by one;
+ * arena_reset hands everything back at once. The first block is kept
+ * across resets, so a stream of ordinary stanzas allocates nothing once
+ * it is warm; blocks chained on for a large stanza go at the next reset.
+ * Not thread-safe: each session owns its arena.
+ */
+
+#define ARENA_BLOCK_SIZE 2048   /* usable bytes of the block that is kept */
+
+typedef struct arena_block {
+    struct arena_block *next;   /* older block */
+    size_t              size;   /* usable bytes */
+    size_t              used;
+} arena_block_t;
+
+typedef struct arena {
+    arena_block_t *head;        /* newest block, allocated from */
+    void          *last;        /* most recent allocation, for arena_grow */
+} arena_t;
+
+void  arena_init(arena_t *a);
+void  arena_reset(arena_t *a);
+void  arena_destroy(arena_t *a);
+
+/* Uninitialized memory aligned for any object, or NULL */
+void *arena_alloc(arena_t *a, size_t size);
+
+/* NUL-terminated copy of s[0..len), or NULL */
+char *arena_strndup(arena_t *a, const char *s, size_t len);
+
+/* Enlarge an allocation of old_size bytes to new_size, in place when it
+ * is the most recent one and there is room, else by copying. Returns
+ * the (possibly moved) allocation, or NULL with ptr left as it was. */
+void *arena_grow(arena_t *a, void *ptr, size_t old_size, size_t new_size);
+
+#endif
@@ -2,8 +2,8 @@
 #define XMPPD_AUTH_H
 
 #include "session.h"
-#include <libxml/tree.h>
+#include "xml.h"
 
-void auth_handle_sasl(session_t *s, xmlNodePtr stanza);
+void auth_handle_sasl(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr);
 
 #endif
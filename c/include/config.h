@@ -1,6 +1,20 @@
 #ifndef XMPPD_CONFIG_H
 #define XMPPD_CONFIG_H
 
+/* Event loop implementations (io_backend) */
+#define IO_BACKEND_EPOLL 0
+#define IO_BACKEND_URING 1
+
+/* Where accounts, rosters and offline messages are kept (storage) */
+#define STORAGE_FILES 0     /* a directory per user in the datadir */
+#define STORAGE_MMAP  1     /* one memory-mapped store, <datadir>/xmppd.db */
+
+/* What to do with a session whose queued output passes out_high_watermark
+ * (slow_consumer_policy) */
+#define SLOW_POLICY_DROP       0    /* shed presence and chat states */
+#define SLOW_POLICY_THROTTLE   1    /* stop reading from its senders */
+#define SLOW_POLICY_DISCONNECT 2
+
 typedef struct config {
     char domain[256];
     int  port;
@@ -8,6 +22,31 @@ typedef struct config {
     char datadir[1024];
     char logfile[1024];
     int  loglevel;
+    int  threads;           /* reactor threads, one listener each */
+    int  io_backend;        /* IO_BACKEND_*; io_uring falls back to epoll */
+    int  storage;           /* STORAGE_* */
+    int  storage_threads;   /* storage workers, at least 1 */
+
+    /* Session deadlines in seconds, 0 disables */
+    int  handshake_timeout; /* connect to resource bind */
+    int  idle_timeout;      /* silence before a XEP-0199 ping */
+    int  ping_timeout;      /* wait for anything after the ping */
+    int  write_timeout;     /* queued output making no progress */
+
+    /* Outbound backpressure in bytes; a zero high mark disables it */
+    long out_high_watermark;    /* queued output that triggers the policy */
+    long out_low_watermark;     /* drained below this, the session recovers */
+    int  slow_policy;           /* SLOW_POLICY_* */
+
+    long max_stanza_size;   /* bytes of XML in one stanza, 0 for no limit */
+
+    /* Connection admission; rates are per second, 0 disables a limit */
+    int  listen_backlog;
+    long accept_rate;           /* new connections, all addresses */
+    long accept_burst;
+    long accept_rate_per_ip;
+    long accept_burst_per_ip;
+    long max_preauth;           /* connected but not yet authenticated */
 } config_t;
 
 void config_defaults(config_t *cfg);
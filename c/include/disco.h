@@ -2,9 +2,9 @@
 #define XMPPD_DISCO_H
 
 #include "session.h"
-#include <libxml/tree.h>
+#include "xml.h"
 
-void disco_handle_info(session_t *s, xmlNodePtr stanza);
-void disco_handle_items(session_t *s, xmlNodePtr stanza);
+void disco_handle_info(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr);
+void disco_handle_items(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr);
 
 #endif
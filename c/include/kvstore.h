@@ -0,0 +1,82 @@
+#ifndef XMPPD_KVSTORE_H
+#define XMPPD_KVSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Embedded key-value store in a single memory-mapped file: a B+tree of
+ * KV_PAGE_SIZE pages, kept ordered by key with memcmp. Pages are never
+ * changed in place once committed. A write transaction copies the pages
+ * it modifies to free pages and commits by syncing them, then writing
+ * the new root to the older of two meta pages and syncing again. A crash
+ * leaves the tree of the last complete commit, found by the meta page
+ * with the highest transaction number and a valid checksum.
+ *
+ * Transactions are serialized: within a process by a mutex, across
+ * processes (the server and useradd) by flock on the file. Pages freed
+ * by a commit are reused by later ones; the free list is rebuilt by
+ * walking the tree when the store is opened or another process has
+ * committed. Values larger than KV_INLINE_MAX go to runs of overflow
+ * pages. Leaves left underfull by deletes are not merged, only removed
+ * once empty.
+ *
+ * Self-contained (no logging or config) so that tools can link it.
+ */
+
+#define KV_PAGE_SIZE   4096
+#define KV_MAX_KEY     511              /* bytes in a key */
+#define KV_INLINE_MAX  1024             /* larger values get overflow pages */
+#define KV_MAX_VALUE   (16u << 20)      /* largest value */
+#define KV_MAP_SIZE    (1ull << 36)     /* address space reserved for the file */
+
+typedef struct kv_store kv_store_t;
+
+/* Called by kv_scan for each key in order; return non-zero to stop */
+typedef int (*kv_scan_fn)(void *ctx, const void *key, size_t klen,
+                          const void *val, size_t vlen);
+
+/* Open the store at path, creating it if create is set. Returns NULL
+ * with the reason in err if it cannot be opened or is not a store. */
+kv_store_t *kv_open(const char *path, int create, char *err, size_t errlen);
+void        kv_close(kv_store_t *kv);
+
+/* Why the last call on kv failed */
+const char *kv_error(const kv_store_t *kv);
+
+/* Start a transaction (blocking while another runs), and end it. A read
+ * transaction sees the last commit; changes need a write transaction.
+ * kv_commit returns -1 if the changes could not be made durable, in
+ * which case they are rolled back. */
+int  kv_begin(kv_store_t *kv, int write);
+int  kv_commit(kv_store_t *kv);
+void kv_abort(kv_store_t *kv);
+
+/* Look up key. Returns 1 with *val pointing into the map (valid until
+ * the next change or the end of the transaction), 0 if absent, -1 on
+ * error. */
+int kv_get(kv_store_t *kv, const void *key, size_t klen,
+           const void **val, size_t *vlen);
+
+/* Insert or replace. Returns 0, or -1 on error (the transaction should
+ * then be aborted). */
+int kv_put(kv_store_t *kv, const void *key, size_t klen,
+           const void *val, size_t vlen);
+
+/* Remove key. Returns 1 if it was there, 0 if not, -1 on error. */
+int kv_del(kv_store_t *kv, const void *key, size_t klen);
+
+/* Visit the keys starting with prefix, in order, until fn returns
+ * non-zero. The store must not be changed meanwhile. Returns the number
+ * of keys visited, or -1 on error. */
+long kv_scan(kv_store_t *kv, const void *prefix, size_t plen,
+             kv_scan_fn fn, void *ctx);
+
+/* Keys xmppd keeps in its store, each followed by the username */
+#define KV_KEY_USER     "u:"    /* password */
+#define KV_KEY_ROSTER   "r:"    /* encoded roster items */
+#define KV_KEY_QUEUE    "q:"    /* next offline sequence, 8 bytes big-endian */
+#define KV_KEY_OFFLINE  "o:"    /* then ':' and the sequence: one message */
+#define KV_STORE_FILE   "xmppd.db"  /* in the datadir */
+
+#endif
@@ -2,10 +2,17 @@
 #define XMPPD_MESSAGE_H
 
 #include "session.h"
-#include <libxml/tree.h>
+#include "xml.h"
 
-void handle_message(session_t *s, xmlNodePtr stanza);
-void message_store_offline(const char *username, xmlNodePtr stanza);
+void handle_message(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr);
+/* Queue a <message/> as it would go out on the wire to be stored for
+ * later, stamped with a delay element; seg is referenced, not taken */
+void message_store_offline(const char *username, outseg_t *seg);
+/* Send the session its stored messages, suspending it till they are in */
 void message_deliver_offline(session_t *s);
+/* Called once the output holding them has been written: the delivered
+ * messages are removed from the store. Messages of a session that goes
+ * before then stay stored for its next login. */
+void message_offline_sent(session_t *s);
 
 #endif
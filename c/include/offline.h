@@ -0,0 +1,56 @@
+#ifndef XMPPD_OFFLINE_H
+#define XMPPD_OFFLINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Offline message store. A user's queue is one append-only log,
+ * <datadir>/<user>/offline/messages.log, of records made of an 8-byte
+ * header (payload length and sequence number, little-endian) and the
+ * stanza as it is to be sent. Delivery reads from a cursor, and once the
+ * messages are out moves it on, truncating the log once it has caught
+ * up; logs left with a long delivered prefix are compacted by a
+ * background thread. The cursor and
+ * next sequence number are kept in messages.idx beside the log. A
+ * message is synced to the log before it counts as stored, and the
+ * index is only written once the log it refers to is on disk.
+ *
+ * An in-memory index per user (next sequence, pending count, log size)
+ * makes storing O(1). It is checked against the log's inode and size
+ * whenever the log is opened, so a log changed behind our back is
+ * rescanned. A queue still in the old one-file-per-message layout
+ * (NNNN.xml) is moved into the log whenever the log is recovered; the
+ * index also records the highest file moved, so a move cut short is
+ * resumed without duplicates.
+ */
+
+#define OFFLINE_MAX_RECORD   (1 << 20)  /* largest stored stanza */
+#define OFFLINE_DELIVER_MAX  1024       /* messages delivered per login */
+#define OFFLINE_COMPACT_MIN  65536      /* delivered bytes worth compacting */
+
+/* Called with each pending message, oldest first. Returns non-zero to
+ * stop; that message then stays queued. */
+typedef int (*offline_fn)(void *ctx, const char *data, size_t len);
+
+/* Start and stop the compaction thread */
+int  offline_init(void);
+void offline_shutdown(void);
+
+/* Append one message, given in pieces, to username's queue. Returns its
+ * sequence number, or -1 on error. Safe from any thread. */
+int64_t offline_append(const char *username, const struct iovec *iov, int iovcnt);
+
+/* Pass up to max of username's pending messages to fn, leaving them
+ * queued. Returns the number taken, or -1 on error; *last is then the
+ * sequence number of the last one. */
+int offline_peek(const char *username, int max, offline_fn fn, void *ctx,
+                 int64_t *last);
+
+/* Remove username's pending messages up to sequence number last, once
+ * they have been delivered. Those already removed are skipped. Returns
+ * the number removed, or -1 on error. */
+int offline_ack(const char *username, int64_t last);
+
+#endif
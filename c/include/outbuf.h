@@ -0,0 +1,71 @@
+#ifndef XMPPD_OUTBUF_H
+#define XMPPD_OUTBUF_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+#define OUTBUF_SEG_SIZE 4096    /* bytes per owned segment, header included */
+#define OUTBUF_IOV_MAX  16      /* iovecs handed to one writev/sendmsg */
+
+/*
+ * Refcounted block of outbound bytes. Segments filled by outbuf_append
+ * belong to one chain; shared segments (outseg_new) are immutable and can
+ * sit on any number of chains, on any reactor, at once.
+ */
+typedef struct outseg {
+    atomic_int refs;
+    int        shared;          /* never appended to */
+    size_t     len;             /* bytes used */
+    size_t     cap;
+    char       data[];
+} outseg_t;
+
+typedef struct outbuf_node {
+    struct outbuf_node *next;
+    outseg_t           *seg;
+    size_t              off;    /* bytes of seg already written */
+} outbuf_node_t;
+
+/*
+ * Outbound queue of a session. Partial writes only advance the head's
+ * offset; segments are released as soon as they are fully written, so an
+ * idle session holds no output memory at all.
+ */
+typedef struct outbuf {
+    outbuf_node_t *head;
+    outbuf_node_t *tail;
+    size_t         len;         /* unwritten bytes */
+} outbuf_t;
+
+/* Shared payload holding a copy of data, with one reference */
+outseg_t *outseg_new(const char *data, size_t len);
+
+/* Shared payload of len bytes for the caller to fill in before queuing
+ * it anywhere, with one reference */
+outseg_t *outseg_reserve(size_t len);
+void      outseg_ref(outseg_t *seg);
+void      outseg_unref(outseg_t *seg);
+
+/* Copy data onto the end of the chain. Returns -1 on allocation failure. */
+int  outbuf_append(outbuf_t *ob, const char *data, size_t len);
+
+/* Room for len contiguous bytes at the end of the chain, already counted
+ * as queued, for the caller to fill in at once. NULL on allocation
+ * failure. */
+char *outbuf_reserve(outbuf_t *ob, size_t len);
+
+/* Queue a shared segment without copying; takes a reference */
+int  outbuf_attach(outbuf_t *ob, outseg_t *seg);
+
+/* Describe up to max iovecs of unwritten data, starting at the head.
+ * Returns the number filled in. */
+int  outbuf_iov(const outbuf_t *ob, struct iovec *iov, int max);
+
+/* Drop n written bytes from the head, releasing drained segments */
+void outbuf_consume(outbuf_t *ob, size_t n);
+
+/* Release everything queued */
+void outbuf_clear(outbuf_t *ob);
+
+#endif
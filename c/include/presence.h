@@ -2,10 +2,10 @@
 #define XMPPD_PRESENCE_H
 
 #include "session.h"
-#include <libxml/tree.h>
+#include "xml.h"
 
 /* Main presence dispatcher */
-void handle_presence(session_t *s, xmlNodePtr stanza);
+void handle_presence(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr);
 
 /* Broadcast unavailable on disconnect */
 void presence_broadcast_unavailable(session_t *s);
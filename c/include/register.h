@@ -1,6 +1,6 @@
 #ifndef XMPPD_REGISTER_H
 #define XMPPD_REGISTER_H
 #include "session.h"
-#include <libxml/tree.h>
-void register_handle_iq(session_t *s, xmlNodePtr stanza);
+#include "xml.h"
+void register_handle_iq(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr);
 #endif
@@ -2,17 +2,37 @@
 #define XMPPD_ROSTER_H
 
 #include "session.h"
-#include <libxml/tree.h>
+#include "xml.h"
+
+/* Returns 1 if the session's roster cache is loaded. Otherwise it is
+ * loaded on a storage thread and 0 returned: the stanza being handled
+ * has been suspended (stanza_suspend) and is handled again once the
+ * roster is in. */
+int roster_ensure(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr);
+
+/* Changes to a roster, as stored (store.h roster_update) */
+#define ROSTER_SET     1    /* add the item, or replace the one with its jid */
+#define ROSTER_REMOVE  2    /* remove the item with its jid */
+
+/* Queue one change the session has made to its roster cache to be
+ * stored, after the user's storage work already queued; item is as it
+ * is now (only its jid for ROSTER_REMOVE). Returns -1 if it could not
+ * be queued. */
+int roster_save_item(session_t *s, int op, const roster_item_t *item);
+
+/* Load roster / store one change for a user who may or may not be
+ * online; these do the I/O on the calling thread */
+int roster_load_for_user(const char *username, roster_t *r);
+int roster_update_for_user(const char *username, int op, const roster_item_t *item);
 
-/* Load roster from disk into session's roster cache */
-int roster_load(session_t *s);
+/* Make the change to r. Returns 0, -1 if r is full. */
+int roster_apply(roster_t *r, int op, const roster_item_t *item);
 
-/* Save session's roster cache to disk */
-int roster_save(session_t *s);
+/* Make room for n items */
+int roster_reserve(roster_t *r, int n);
 
-/* Load/save roster for a user who may or may not be online */
-int roster_load_for_user(const char *username, roster_t *r);
-int roster_save_for_user(const char *username, roster_t *r);
+/* Release a roster's items */
+void roster_free(roster_t *r);
 
 /* Find an item in a roster by JID */
 roster_item_t *roster_find_item(roster_t *r, const char *jid);
@@ -25,7 +45,7 @@ int roster_add_item(roster_t *r, const char *jid, const char *name,
 int roster_remove_item(roster_t *r, const char *jid);
 
 /* Handle roster IQ stanzas (get/set) */
-void roster_handle_iq(session_t *s, xmlNodePtr stanza);
+void roster_handle_iq(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr);
 
 /* Send a roster push for a single item to a session */
 void roster_push(session_t *s, roster_item_t *item);
@@ -0,0 +1,55 @@
+#ifndef XMPPD_ROSTERLOG_H
+#define XMPPD_ROSTERLOG_H
+
+#include "roster.h"
+
+/*
+ * Roster journal of the files store. A change to a roster is one record
+ * appended to <datadir>/<user>/roster.journal: an 8-byte header (payload
+ * length and operation, little-endian), then the item's jid, name and
+ * subscription, each NUL-terminated, and its ask flag. Records are
+ * buffered in memory and written behind: a commit thread picks up every
+ * user with changes once ROSTERLOG_COMMIT_MS has passed since the first,
+ * writes them all, then syncs them all. Changes that could not be
+ * written stay in memory and are tried again after ROSTERLOG_RETRY_MS,
+ * twice as long after each failure up to ROSTERLOG_RETRY_MAX_MS.
+ *
+ * roster.xml stays the snapshot. It is rewritten from snapshot and
+ * journal, and the journal emptied, once the journal has grown past
+ * ROSTERLOG_SNAPSHOT_MIN or has held changes for ROSTERLOG_SNAPSHOT_AGE.
+ * A record states an item as it is after the change (roster_apply), so
+ * replaying one twice (a crash between the snapshot and the truncate)
+ * does no harm.
+ * Loading replays the journal, then the changes not yet written, over
+ * the snapshot; a record torn by a crash is dropped.
+ */
+
+#define ROSTERLOG_COMMIT_MS     5       /* group commit window */
+#define ROSTERLOG_SNAPSHOT_MIN  16384   /* journal bytes worth a snapshot */
+#define ROSTERLOG_SNAPSHOT_AGE  300     /* seconds a journal goes without one */
+#define ROSTERLOG_RETRY_MS      100     /* first wait after a failed write */
+#define ROSTERLOG_RETRY_MAX_MS  30000
+
+/* Read and write a snapshot: load adds to r, which is empty; save
+ * replaces the snapshot with r, on disk before it returns 0, since the
+ * journal is emptied after it */
+typedef int (*rosterlog_load_fn)(const char *username, roster_t *r);
+typedef int (*rosterlog_save_fn)(const char *username, const roster_t *r);
+
+/* Start the commit thread, and stop it once everything pending is
+ * written, or has failed once more and is logged as lost */
+int  rosterlog_init(rosterlog_load_fn load, rosterlog_save_fn save);
+void rosterlog_shutdown(void);
+
+/* Queue one change (ROSTER_SET or ROSTER_REMOVE) to username's roster.
+ * Returns 0, or -1 if out of memory. Safe from any thread. */
+int rosterlog_append(const char *username, int op, const roster_item_t *item);
+
+/* Add username's roster, snapshot and journal, to r, which is empty */
+int rosterlog_load(const char *username, roster_t *r);
+
+/* Drop username's journal and changes not yet written (the account is
+ * being deleted) */
+void rosterlog_forget(const char *username);
+
+#endif
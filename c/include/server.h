@@ -3,20 +3,61 @@
 
 #include "config.h"
 #include "session.h"
-#include <poll.h>
+#include "wheel.h"
 
-#define MAX_CLIENTS 16   /* 1 listener + 15 client slots */
+#define SESSION_TABLE_INIT 64    /* initial session table size, grows by doubling */
+#define MAX_EVENTS         256   /* epoll events handled per wakeup */
+#define ACCEPT_BATCH       64    /* connections accepted per wakeup */
+#define MAX_WAIT_MS        1000  /* longest sleep without a timer due */
+#define MAX_REACTORS       256   /* upper bound for --threads */
+#define URING_ENTRIES      1024  /* io_uring submission queue size per reactor */
+#define URING_BUFS         256   /* provided receive buffers per reactor (power of 2) */
+#define URING_BUF_SIZE     8192  /* bytes per provided receive buffer */
+
+/* Work run once on each reactor thread */
+typedef void (*reactor_task_fn)(void *arg, size_t len);
 
 int  server_init(config_t *cfg);
 void server_run(void);
 void server_shutdown(void);
 
-/* Access to poll/session arrays (needed by session module) */
-struct pollfd *server_get_pollfd(int index);
-session_t    **server_get_sessions(void);
-int            server_get_nfds(void);
+/* Access to the calling reactor's session table (needed by session and
+ * presence modules). The table is sparse: slots of closed sessions are
+ * NULL until reused. */
+session_t **server_get_sessions(void);
+int         server_get_nslots(void);
+
+/* Queue a session's pending output for flushing at the end of the
+ * current event loop iteration */
+void server_want_write(session_t *s);
+
+/* Stop reading from a session (its read_holds just became non-zero), and
+ * queue it to carry on at the end of the iteration once they are gone */
+void server_pause_read(session_t *s);
+void server_want_read(session_t *s);
+
+/* Read a session again at the end of the iteration: it used up its read
+ * budget with input left in the socket (epoll) */
+void server_read_more(session_t *s);
 
-/* Remove a session from the poll set (called during teardown) */
+/* Unregister a session from its reactor (called during teardown).
+ * The session is destroyed once the current batch of events is done. */
 void server_remove_session(session_t *s);
 
+/* Monotonic clock in milliseconds, sampled once per event loop wakeup */
+uint64_t server_now(void);
+
+/* Timers on the calling reactor's wheel; fn runs on that reactor */
+void server_timer_arm(wheel_timer_t *t, uint64_t delay_ms);
+void server_timer_cancel(wheel_timer_t *t);
+
+/* Run fn(target, arg, len) on the reactor owning ref. Runs inline when
+ * that is the calling reactor; otherwise arg is copied into the owner's
+ * inbox and run from its event loop, in posting order per sender. */
+void server_post(const session_ref_t *ref, session_task_fn fn,
+                 const void *arg, size_t len);
+
+/* Run fn(arg, len) on every reactor, the calling one inline */
+void server_post_all(reactor_task_fn fn, const void *arg, size_t len);
+
 #endif
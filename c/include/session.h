@@ -2,11 +2,18 @@
 #define XMPPD_SESSION_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
 #include <libxml/tree.h>
 #include <libxml/parser.h>
-
-#define READ_BUF_SIZE  8192
-#define WRITE_BUF_INIT 8192
+#include "outbuf.h"
+#include "slab.h"
+#include "wheel.h"
+#include "arena.h"
+#include "xml.h"
+
+#define READ_CHUNK_SIZE 65536  /* largest single read (per-thread buffer) */
+#define READ_BUDGET     8      /* reads per wakeup before the others get a turn */
 #define MAX_ROSTER_ITEMS 128
 
 enum session_state {
@@ -25,23 +32,83 @@ typedef struct roster_item {
     int  ask_subscribe;
 } roster_item_t;
 
+/* Items are allocated when the roster is first loaded, sized to it */
 typedef struct roster {
-    roster_item_t items[MAX_ROSTER_ITEMS];
+    roster_item_t *items;
     int count;
+    int cap;
     int loaded;
 } roster_t;
 
+/* A handle on a session that may be owned by another reactor thread.
+ * Only the owning reactor dereferences it (see server_post). */
+typedef struct session_ref {
+    int      reactor;           /* owning reactor index */
+    int      slot;              /* slot in that reactor's session table */
+    uint64_t serial;            /* guards against the slot being reused */
+} session_ref_t;
+
+struct session;
+struct deferred_stanza;
+
+/* Work run on the reactor that owns a session. target is NULL if the
+ * session has gone away by the time the task runs. */
+typedef void (*session_task_fn)(struct session *target, void *arg, size_t len);
+
 typedef struct session {
     int fd;
     int state;
-    int poll_index;             /* index into pollfds array */
 
-    /* TCP buffers */
-    char   read_buf[READ_BUF_SIZE];
-    size_t read_len;
-    char  *write_buf;
-    size_t write_len;
-    size_t write_cap;
+    /* Reactor registration (owned by server.c) */
+    slab_t         *slab;           /* pool the session was allocated from */
+    int             reactor;        /* owning reactor index */
+    uint64_t        serial;         /* process-wide unique session number */
+    int             slot;           /* index into session table, -1 if none */
+    int             flush_queued;   /* on the reactor's pending-flush list */
+    struct session *next_flush;     /* pending-flush list link */
+    struct session *next_dead;      /* graveyard list link */
+    int             io_pending;     /* io_uring requests still referring to us */
+
+    /* Deadlines, on the owning reactor's timer wheel */
+    wheel_timer_t   read_timer;     /* handshake, idle ping, ping reply */
+    wheel_timer_t   write_timer;    /* queued output making no progress */
+    uint64_t        last_read;      /* ms; anything received counts */
+    uint64_t        last_write;     /* ms; last output progress */
+    int             ping_pending;   /* XEP-0199 ping sent, nothing back yet */
+
+    /* Outbound backpressure (slow_consumer_policy). A congested session
+     * has passed the high watermark and not yet drained to the low one;
+     * under the throttle policy it pauses the sessions feeding it. */
+    int             congested;
+    session_ref_t  *holds;          /* senders whose reading we paused */
+    int             nholds;
+    int             holds_cap;
+    int             read_holds;     /* congested sessions pausing our reading */
+    int             read_blocked;   /* socket left unread while paused (epoll) */
+    int             read_queued;    /* on the reactor's pending-read list */
+    struct session *next_read;      /* pending-read list link */
+    int             more_queued;    /* on the reactor's still-readable list */
+    struct session *next_more;      /* still-readable list link */
+    outbuf_t        held_in;        /* received while paused (io_uring) */
+    int             held_eof;       /* ... followed by end of stream */
+    int             recv_armed;     /* io_uring multishot recv outstanding */
+
+    /* io_uring send in flight: the iovecs point into the head of out,
+     * which is only consumed when the send completes */
+    int             send_inflight;
+    struct msghdr   send_msg;
+    struct iovec    send_iov[OUTBUF_IOV_MAX];
+
+    /* Output queued for the socket */
+    outbuf_t out;
+    uint64_t out_sent;              /* bytes written to the socket, ever */
+
+    /* Offline messages up to sequence number offline_last were queued
+     * before output byte offline_sent_at: they leave the store once it
+     * has been written (message.h) */
+    int      offline_unacked;
+    int64_t  offline_last;
+    uint64_t offline_sent_at;
 
     /* JID */
     char jid_local[256];
@@ -49,35 +116,117 @@ typedef struct session {
     char jid_resource[256];
 
     /* XML parser */
-    xmlParserCtxtPtr xml_ctx;
-    xmlNodePtr       current_stanza;
-    xmlNodePtr       current_node;
+    xml_parser_t     xml_ctx;
+    arena_t          arena;         /* the stanza being parsed */
+    xml_node_t      *current_stanza;
+    stanza_header_t *current_header;
+    xml_node_t      *current_node;
     int              stanza_depth;
+    uint64_t         parser_fed;    /* bytes given to the current parser */
+    uint64_t         stanza_start;  /* parser offset of the current stanza */
+    uint64_t         stanza_end;    /* ... and of its end, once complete */
+    int              stanza_verbatim; /* its bytes can be forwarded as is */
+
+    /* Input fed to the parser that a stanza may still need verbatim:
+     * bytes from carry_base on, from earlier chunks (a stanza split
+     * across reads), and the chunk being parsed, in place */
+    const char      *feed_chunk;
+    size_t           feed_len;
+    char            *carry;
+    size_t           carry_len;
+    size_t           carry_cap;
+    uint64_t         carry_base;
 
     /* Auth state */
     int authenticated;
+    int preauth;                /* counted by admission control until authenticated */
+    int in_directory;           /* bare JID registered in the bound-session directory */
     int parser_reset_pending;   /* set by auth to defer parser reset */
     int teardown_pending;       /* set to defer session_teardown past xmlParseChunk */
     int in_xml_parse;           /* non-zero while xmlParseChunk is on the call stack */
 
+    /* Waiting on storage (storage.h): stanzas that come in meanwhile are
+     * copied aside, in order, and reading stops until they are handled */
+    int                     suspended;      /* session_suspend nesting */
+    int                     suspend_hold;   /* one of read_holds is ours */
+    struct deferred_stanza *deferred;
+    struct deferred_stanza *deferred_tail;
+
     /* Presence */
     int        available;
     int        initial_presence_sent;
-    xmlNodePtr presence_stanza;
+    outseg_t  *presence_stanza;     /* wire form, from set, shared by every
+                                     * contact it is queued for */
 
     /* Roster cache */
     roster_t roster;
 } session_t;
 
-session_t *session_create(int fd);
+/* Allocate a session for fd from the calling reactor's pool */
+session_t *session_create(slab_t *slab, int fd);
 void       session_destroy(session_t *s);
 void       session_write(session_t *s, const char *data, size_t len);
 void       session_write_str(session_t *s, const char *str);
+void       session_write_seg(session_t *s, outseg_t *seg);
+
+/* Write in place: room for len bytes at the end of the output queue,
+ * then session_commit once they are filled in. NULL (and the session
+ * torn down) if out of memory. */
+char      *session_reserve(session_t *s, size_t len);
+void       session_commit(session_t *s, const char *data, size_t len);
 int        session_flush(session_t *s);
-session_t *session_find_by_jid(const char *bare_jid);
+
+/* Account for n bytes of output written by the reactor (n may be 0 to
+ * just start the stalled-output deadline when output is queued) */
+void       session_sent(session_t *s, size_t n);
+
+/* Bound-session directory, shared by all reactors */
+void session_get_ref(session_t *s, session_ref_t *ref);
+int  session_ref_equal(const session_ref_t *a, const session_ref_t *b);
+
+/* Find the session bound to jid's bare JID (any resource is ignored) */
+int  session_lookup(const char *jid, session_ref_t *ref);
+
+/* Write data to a session owned by any reactor. The bytes are copied
+ * once into a shared segment that the target queues as is. Droppable
+ * output may be shed if the target is a slow consumer. */
+void session_deliver(const session_ref_t *ref, const char *data, size_t len,
+                     int droppable);
+
+/* Queue a shared segment on a session owned by any reactor */
+void session_deliver_seg(const session_ref_t *ref, outseg_t *seg, int droppable);
+
+/* The session whose input is being handled on this thread, which is
+ * what any output produced now is charged to. Returns 0 if none. */
+int  session_sender(session_ref_t *ref);
+
+/* Apply the slow-consumer policy to output routed to s from sender (may
+ * be NULL). Returns 0 if the output should be shed instead of queued. */
+int  session_admit(session_t *s, const session_ref_t *sender, int droppable);
+
+/* Process input held back while reading was paused, then carry on
+ * reading (called by the reactor once the last pause is lifted) */
+void session_resume_read(session_t *s);
+
+/* Hold off handling stanzas from s until the matching session_resume,
+ * when those that came in meanwhile are handled. Nests. */
+void session_suspend(session_t *s);
+void session_resume(session_t *s);
+
+/* Log the slow-consumer counters */
+void session_log_backpressure(void);
+
+/* Run fn on the reactor owning the session bound to bare_jid, or inline
+ * with target == NULL when no such session exists. arg is copied. */
+void session_run_on(const char *bare_jid, session_task_fn fn,
+                    const void *arg, size_t len);
+
+/* Refuse the current stanza for exceeding max_stanza_size */
+void session_stanza_too_big(session_t *s);
 
 /* Called by server event loop */
 void session_on_readable(session_t *s);
+void session_on_recv(session_t *s, const char *data, size_t len);
 void session_on_writable(session_t *s);
 
 /* Mark a session for teardown (called from various modules) */
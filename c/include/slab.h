@@ -0,0 +1,34 @@
+#ifndef XMPPD_SLAB_H
+#define XMPPD_SLAB_H
+
+#include <stddef.h>
+
+/*
+ * Pool of fixed-size objects, carved out of chunks of SLAB_CHUNK_OBJS at a
+ * time. Freed objects go on a free list and are handed out again before a
+ * new chunk is allocated; chunks are only released by slab_destroy. Not
+ * thread-safe: each reactor owns its pools.
+ */
+
+#define SLAB_CHUNK_OBJS 64
+
+typedef struct slab_chunk {
+    struct slab_chunk *next;
+} slab_chunk_t;
+
+typedef struct slab {
+    size_t        obj_size;     /* rounded up to keep objects aligned */
+    void         *free_list;    /* next pointer stored in the object */
+    slab_chunk_t *chunks;
+    size_t        nchunks;
+    size_t        in_use;
+} slab_t;
+
+void  slab_init(slab_t *slab, size_t obj_size);
+void  slab_destroy(slab_t *slab);
+
+/* Zeroed object, or NULL if a new chunk could not be allocated */
+void *slab_alloc(slab_t *slab);
+void  slab_free(slab_t *slab, void *obj);
+
+#endif
@@ -4,8 +4,49 @@
 #include "session.h"
 #include <libxml/tree.h>
 
-/* Route a complete stanza to the appropriate handler */
-void stanza_route(session_t *s, xmlNodePtr stanza);
+/* Session phases a handler accepts */
+#define STANZA_PREAUTH  0x1     /* before SASL succeeds */
+#define STANZA_AUTHED   0x2     /* authenticated, no resource bound yet */
+#define STANZA_BOUND    0x4     /* resource bound */
+#define STANZA_ANY      (STANZA_PREAUTH | STANZA_AUTHED | STANZA_BOUND)
+
+#define STANZA_TABLE_SIZE 64    /* slots per handler table, a power of two */
+
+typedef void (*stanza_handler_fn)(session_t *s, xml_node_t *stanza,
+                                  const stanza_header_t *hdr);
+
+/* Handle top-level <name xmlns=ns> stanzas in the given phases; one in
+ * any other phase is refused with a not-authorized stream error. Call
+ * before the reactors start. Returns -1 if the table is full or the
+ * element is already taken. */
+int stanza_register(const char *name, const char *ns, unsigned phases,
+                    stanza_handler_fn fn);
+
+/* Handle get/set IQs whose payload is in ns; outside the given phases
+ * they get a not-allowed error */
+int stanza_register_iq(const char *ns, unsigned phases, stanza_handler_fn fn);
+
+/* Register the built-in handlers (call once at startup) */
+int stanza_init(void);
+
+/* Route a complete stanza to the appropriate handler, along with the
+ * header taken from it while it was parsed */
+void stanza_route(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr);
+
+/* Keep a copy of the stanza, or with stanza NULL the end of the stream,
+ * to be handled once the session is no longer suspended, after those
+ * already waiting */
+void stanza_defer(session_t *s, const xml_node_t *stanza, const stanza_header_t *hdr);
+
+/* Called by a handler that has to wait on storage for the stanza it was
+ * given: suspend the session and handle the stanza again, from the
+ * start, ahead of any others once it resumes */
+void stanza_suspend(session_t *s, const xml_node_t *stanza, const stanza_header_t *hdr);
+
+/* Handle the stanzas kept while the session was suspended, until there
+ * are none left or it is suspended again */
+void stanza_replay(session_t *s);
+void stanza_free_deferred(session_t *s);
 
 /* Serialize an xmlNode to a malloc'd string */
 char *stanza_serialize(xmlNodePtr node, size_t *out_len);
@@ -13,8 +54,25 @@ char *stanza_serialize(xmlNodePtr node, size_t *out_len);
 /* Serialize and send a stanza via session_write */
 void stanza_send(session_t *s, xmlNodePtr node);
 
+/* Whether a slow consumer may be spared the stanza: available presence
+ * (superseded by the next one) and bodyless chat state notifications */
+int stanza_droppable(const xml_node_t *node);
+
+/* An inbound stanza as it goes out to other sessions, from the sender's
+ * full JID: the bytes received with from spliced in, or re-serialized if
+ * they cannot be used as they are. One reference; NULL if out of memory. */
+outseg_t *stanza_wire(session_t *s, xml_node_t *stanza);
+
+/* Pass an inbound stanza on to a session owned by any reactor, from the
+ * sender's full JID */
+void stanza_forward(session_t *s, const session_ref_t *target, xml_node_t *stanza);
+
 /* Build and send a stanza-level error response */
-void stanza_send_error(session_t *s, xmlNodePtr original,
+void stanza_send_error(session_t *s, const xml_node_t *original,
                        const char *error_type, const char *condition);
 
+/* The same for a stanza of which only the element name and id are kept */
+void stanza_error(session_t *s, const char *tag, const char *id,
+                  const char *error_type, const char *condition);
+
 #endif
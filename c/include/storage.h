@@ -0,0 +1,35 @@
+#ifndef XMPPD_STORAGE_H
+#define XMPPD_STORAGE_H
+
+#include <stddef.h>
+#include "config.h"
+#include "session.h"
+
+/*
+ * Storage worker pool (storage_threads), so that the reactors never wait
+ * on the disk. A job is run on the worker its key (the username whose
+ * data it touches) hashes to, so one user's jobs run one at a time and
+ * in the order they were submitted; its completion then goes back to
+ * the reactor owning the session that asked, through that reactor's
+ * inbox and eventfd, like any other server_post.
+ */
+
+/* Runs on a storage thread; may change arg for the completion to see */
+typedef void (*storage_work_fn)(void *arg, size_t len);
+
+/* Start and stop the workers (at least one, whatever storage_threads
+ * says). Stopping runs the jobs still queued. */
+int  storage_init(const config_t *cfg);
+void storage_shutdown(void);
+
+/* Run work(arg, len) on the worker owning key, then done(target, arg,
+ * len) on the reactor owning ref. ref and done may be NULL when there is
+ * nothing to report. arg is copied. Jobs never run on the caller, and
+ * done never before this returns. Returns -1, with nothing run, if the
+ * job could not be queued (no workers, out of memory); the caller then
+ * undoes what it set up for it. */
+int  storage_submit(const char *key, const session_ref_t *ref,
+                    storage_work_fn work, session_task_fn done,
+                    const void *arg, size_t len);
+
+#endif
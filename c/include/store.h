@@ -0,0 +1,56 @@
+#ifndef XMPPD_STORE_H
+#define XMPPD_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "config.h"
+#include "session.h"
+#include "offline.h"
+
+/*
+ * Where accounts, rosters and offline queues are kept (storage option).
+ * "files" is the directory per user under the datadir: user.conf,
+ * roster.xml with its journal (rosterlog.h) and the offline log. "mmap"
+ * is one crash-safe kvstore file, <datadir>/xmppd.db, holding all of it.
+ * Every call is safe from any thread.
+ */
+typedef struct store_backend {
+    const char *name;
+    int  (*open)(const config_t *cfg);
+    void (*close)(void);
+
+    int  (*user_exists)(const char *username);
+    /* Copy the password into buf. Returns 1, 0 if there is no such user,
+     * -1 on error. */
+    int  (*user_password)(const char *username, char *buf, size_t size);
+    /* Returns 0, -1 if the user exists, -3 on I/O error */
+    int  (*user_create)(const char *username, const char *password);
+    /* Return 0, or -1 on I/O error */
+    int  (*user_set_password)(const char *username, const char *password);
+    int  (*user_delete)(const char *username);
+
+    /* Add the user's contacts to r, which is empty; no roster is no
+     * contacts. Update stores one change (roster.h ROSTER_SET etc.). */
+    int  (*roster_load)(const char *username, roster_t *r);
+    int  (*roster_update)(const char *username, int op, const roster_item_t *item);
+
+    /* As offline_append, offline_peek and offline_ack */
+    int64_t (*offline_append)(const char *username, const struct iovec *iov,
+                              int iovcnt);
+    int     (*offline_peek)(const char *username, int max, offline_fn fn,
+                            void *ctx, int64_t *last);
+    int     (*offline_ack)(const char *username, int64_t last);
+} store_backend_t;
+
+extern const store_backend_t store_files;
+extern const store_backend_t store_mmap;
+
+/* The backend in use, set by store_open */
+extern const store_backend_t *g_store;
+
+/* Open the backend cfg->storage names, and close it */
+int  store_open(const config_t *cfg);
+void store_close(void);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef XMPPD_TEMPLATE_H
+#define XMPPD_TEMPLATE_H
+
+#include <stddef.h>
+#include "outbuf.h"
+
+/* Forward declaration */
+typedef struct session session_t;
+
+/*
+ * Server replies whose shape never changes, rendered once at startup and
+ * filled in per reply. A source is the stanza as it goes out, with slots
+ * in braces:
+ *
+ *   {N}         argument N, escaped
+ *   { name=N}   the attribute name="argument N", left out if it is NULL
+ *   {domain}    the server's domain, escaped when the template is compiled
+ *
+ * Arguments are passed as an array indexed by N.
+ */
+typedef enum {
+    TMPL_IQ_RESULT,             /* id */
+    TMPL_IQ_RESULT_FROM,        /* id */
+    TMPL_IQ_RESULT_FROM_TO,     /* id, to */
+    TMPL_BIND_RESULT,           /* id, jid */
+    TMPL_REGISTER_FORM,         /* id, to */
+    TMPL_DISCO_INFO,            /* to, id */
+    TMPL_DISCO_ITEMS,           /* to, id */
+    TMPL_ROSTER_RESULT_START,   /* id, to */
+    TMPL_ROSTER_ITEM,           /* jid, name, subscription, ask */
+    TMPL_ROSTER_RESULT_END,
+    TMPL_ROSTER_PUSH,           /* id, to, jid, name, subscription, ask */
+    TMPL_STANZA_ERROR,          /* element, id, to, type, condition */
+    TMPL_PRESENCE,              /* type, from, to */
+    TMPL_PING,                  /* to, id */
+    TMPL_COUNT
+} tmpl_id_t;
+
+#define TMPL_MAX_ARGS 8
+
+/* Compile every template for the configured domain (call once at
+ * startup, before any reactor runs). Returns -1 on error. */
+int  tmpl_init(void);
+void tmpl_cleanup(void);
+
+/* Bytes the template renders to with args */
+size_t tmpl_len(tmpl_id_t id, const char *const *args);
+
+/* Render into out, which must have room for tmpl_len bytes; returns the
+ * end of what was written */
+char *tmpl_render(tmpl_id_t id, const char *const *args, char *out);
+
+/* Render straight into the session's output queue */
+void tmpl_send(session_t *s, tmpl_id_t id, const char *const *args);
+
+/* Render into a shared segment, for session_deliver_seg. One reference;
+ * NULL if out of memory. */
+outseg_t *tmpl_seg(tmpl_id_t id, const char *const *args);
+
+#endif
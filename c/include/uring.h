@@ -0,0 +1,69 @@
+#ifndef XMPPD_URING_H
+#define XMPPD_URING_H
+
+/*
+ * Minimal io_uring wrapper over the raw syscalls: one submission and
+ * completion queue pair plus one ring of provided receive buffers. Only
+ * built when HAVE_IO_URING is defined (see the Makefile).
+ */
+
+#ifdef HAVE_IO_URING
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+typedef struct uring {
+    int fd;
+
+    /* Submission queue */
+    void                *sq_map;
+    size_t               sq_map_len;
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned             sq_mask;
+    unsigned             sq_entries;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t               sqes_len;
+    unsigned             sq_local_tail;     /* SQEs handed out, not yet published */
+    unsigned             sq_submitted;      /* tail last published to the kernel */
+
+    /* Completion queue (shares sq_map on all kernels we accept) */
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned             cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* Provided buffer ring for multishot recv (buffer group 0) */
+    struct io_uring_buf_ring *br;
+    size_t               br_len;
+    char                *bufs;
+    unsigned             buf_count;
+    unsigned             buf_size;
+} uring_t;
+
+/* Set up a ring with the given SQ size and a buffer ring of buf_count
+ * buffers (a power of two) of buf_size bytes each. Returns -1 if the
+ * kernel lacks any feature the server relies on. */
+int  uring_init(uring_t *u, unsigned entries, unsigned buf_count, unsigned buf_size);
+void uring_close(uring_t *u);
+
+/* Next free SQE (zeroed), submitting queued ones first if the SQ is full */
+struct io_uring_sqe *uring_get_sqe(uring_t *u);
+
+/* Publish queued SQEs and wait for at least one completion, or until
+ * timeout_ms passes (-1 waits indefinitely). Returns 0 or -errno. */
+int  uring_submit_and_wait(uring_t *u, int timeout_ms);
+
+/* Completion iteration: peek returns NULL when the CQ is empty */
+struct io_uring_cqe *uring_peek_cqe(uring_t *u);
+void uring_cqe_seen(uring_t *u);
+
+/* Receive buffers */
+char *uring_buf(uring_t *u, unsigned bid);
+void  uring_buf_recycle(uring_t *u, unsigned bid);
+
+#endif /* HAVE_IO_URING */
+
+#endif
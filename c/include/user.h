@@ -3,7 +3,10 @@
 
 #include <stddef.h>
 
+/* Lookups go through the user cache (usercache.h) */
 int  user_exists(const char *username);
+/* 1 if username exists, 0 if not, -1 if that would take asking the store */
+int  user_cached(const char *username);
 int  user_check_password(const char *username, const char *password);
 void user_get_datapath(const char *username, char *path, size_t pathsize);
 
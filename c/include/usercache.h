@@ -0,0 +1,49 @@
+#ifndef XMPPD_USERCACHE_H
+#define XMPPD_USERCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+/*
+ * In-memory directory of accounts in front of the store (user.h fills it
+ * lazily): whether each username looked up exists and, once it has
+ * logged in, its password. Names found missing are kept too, up to
+ * USERCACHE_MAX_MISSING of them.
+ *
+ * Changes made behind the server's back, by useradd or by hand, are
+ * picked up through inotify on the datadir. With storage = files a user
+ * directory being created, removed or renamed drops that name, and each
+ * cached account's directory is watched for its user.conf changing. With
+ * storage = mmap, another process closing xmppd.db after writing drops
+ * everything. Without inotify nothing is cached.
+ *
+ * Fill with the generation read before asking the store, so that an
+ * answer overtaken by a change is not cached.
+ */
+
+#define USERCACHE_MAX_MISSING  65536
+
+/* Start and stop the inotify watcher; the cache is emptied either way */
+int  usercache_init(const config_t *cfg);
+void usercache_shutdown(void);
+
+/* 1 if username is known to exist, 0 known not to, -1 if not cached */
+int usercache_exists(const char *username);
+
+/* As usercache_exists; with 1 the password is copied into buf, unless it
+ * is not cached either, which is -1 */
+int usercache_password(const char *username, char *buf, size_t size);
+
+/* Current generation, moved on by every invalidation */
+uint64_t usercache_generation(void);
+
+/* Record what the store said, unless invalidated since gen. password is
+ * NULL if it was not asked for. */
+void usercache_fill(const char *username, int exists, const char *password,
+                    uint64_t gen);
+
+/* Drop what is cached about username (the server changed it) */
+void usercache_forget(const char *username);
+
+#endif
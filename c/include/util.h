@@ -18,4 +18,8 @@ int base64_decode(const char *in, size_t in_len,
 /* Random ID generation */
 void generate_id(char *buf, size_t len);
 
+/* fsync a file, or a directory so that renames into it are durable.
+ * Returns 0 or -1 with errno set. */
+int fsync_path(const char *path);
+
 #endif
@@ -0,0 +1,54 @@
+#ifndef XMPPD_WHEEL_H
+#define XMPPD_WHEEL_H
+
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel with millisecond ticks: WHEEL_LEVELS levels of
+ * WHEEL_SLOTS slots, each level WHEEL_SLOTS times coarser than the one
+ * below. Arming and cancelling are O(1); timers on the upper levels are
+ * moved down as their slot comes due. Not thread-safe: each reactor owns
+ * one wheel and only its thread touches it.
+ */
+
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4              /* 2^24 ms (~4.6 h) before clamping */
+
+struct wheel_timer;
+typedef void (*wheel_fn)(struct wheel_timer *t);
+
+/* Embedded in the object it times; fn recovers the owner with offsetof */
+typedef struct wheel_timer {
+    struct wheel_timer  *next;
+    struct wheel_timer **pprev;     /* NULL when not armed */
+    uint64_t             expires;   /* absolute time, ms */
+    unsigned             where;     /* level * WHEEL_SLOTS + slot */
+    wheel_fn             fn;
+} wheel_timer_t;
+
+typedef struct wheel {
+    uint64_t       now;             /* last tick processed */
+    unsigned       count;           /* armed timers */
+    uint64_t       occupied[WHEEL_LEVELS];  /* non-empty slot bitmaps */
+    wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheel_t;
+
+void wheel_init(wheel_t *w, uint64_t now);
+
+/* (Re)arm t to fire at absolute time expires; past times fire next tick */
+void wheel_arm(wheel_t *w, wheel_timer_t *t, uint64_t expires);
+void wheel_cancel(wheel_t *w, wheel_timer_t *t);
+
+static inline int wheel_armed(const wheel_timer_t *t) {
+    return t->pprev != 0;
+}
+
+/* Milliseconds from now until the wheel next needs to run (a timer
+ * expiring or an upper slot moving down), or -1 if nothing is armed */
+int  wheel_timeout(const wheel_t *w, uint64_t now);
+
+/* Run every timer due at or before now */
+void wheel_advance(wheel_t *w, uint64_t now);
+
+#endif
@@ -1,25 +1,136 @@
 #ifndef XMPPD_XML_H
 #define XMPPD_XML_H
 
-#include <libxml/tree.h>
+#include <stddef.h>
+#include "arena.h"
 
 /* Forward declaration */
 typedef struct session session_t;
 
+/*
+ * Inbound stanza, built from the SAX events in the session's arena. It
+ * is only valid until stanza_route returns, after which the arena is
+ * reset; anything kept longer must be copied or serialized. Character
+ * data is stored unescaped, as text nodes among the element children.
+ */
+enum xml_node_type {
+    XML_NODE_ELEMENT = 0,
+    XML_NODE_TEXT
+};
+
+typedef struct xml_attr {
+    struct xml_attr *next;
+    const char      *name;          /* local name */
+    const char      *prefix;        /* NULL if unprefixed */
+    const char      *value;
+} xml_attr_t;
+
+/* Namespace declaration written out with an element */
+typedef struct xml_nsdef {
+    struct xml_nsdef *next;
+    const char       *prefix;       /* NULL for the default namespace */
+    const char       *uri;
+} xml_nsdef_t;
+
+typedef struct xml_node {
+    int              type;
+    const char      *name;          /* local name (elements) */
+    const char      *prefix;        /* NULL if unprefixed */
+    const char      *ns;            /* namespace URI, "" if none */
+    xml_attr_t      *attrs;         /* in document order */
+    xml_nsdef_t     *nsdefs;
+    struct xml_node *parent;
+    struct xml_node *children;
+    struct xml_node *last_child;
+    struct xml_node *next;
+    char            *text;          /* text nodes, NUL-terminated */
+    size_t           text_len;
+} xml_node_t;
+
+/*
+ * Routing header of a stanza, taken from its start tag while it is
+ * parsed: the unprefixed to, from, type and id attributes (NULL if
+ * absent) and to split up as a JID. Lives in the arena with the tree;
+ * from is as received, even once stanza_wire has replaced it.
+ */
+typedef struct stanza_header {
+    const char *to;
+    const char *from;
+    const char *type;
+    const char *id;
+    int         to_valid;       /* to is present and parses as a JID */
+    const char *to_local;       /* "" if none, or to is not valid */
+    const char *to_domain;
+    const char *to_resource;
+} stanza_header_t;
+
+/* Stream parser of a session: libxml2's push parser, or with NATIVE_XML
+ * the scanner in xmlscan.h */
+#ifdef NATIVE_XML
+typedef struct xml_scanner *xml_parser_t;
+#else
+typedef struct _xmlParserCtxt *xml_parser_t;
+#endif
+
+#define XML_PARSER_POOL_MAX 64     /* idle push parsers kept per thread */
+#define XML_PARSER_DICT_MAX 1024   /* names a parser may intern and be reused */
+
 /* Initialize the global SAX handler (call once at startup) */
 void xml_init_sax_handler(void);
 
-/* Create/reset/destroy push parser for a session */
+/* Create/reset/destroy push parser for a session. Parsers come from and
+ * go back to the calling thread's pool, reset in place. */
 void xml_parser_create(session_t *s);
 void xml_parser_reset(session_t *s);
 void xml_parser_destroy(session_t *s);
 
-/* Feed TCP data to the push parser */
-void xml_feed(session_t *s, const char *data, int len);
+/* Stop the session's parser from a SAX callback: nothing more of the
+ * stream is reported */
+void xml_parser_stop(session_t *s);
+
+/* Free the calling thread's idle parsers */
+void xml_parser_pool_drain(void);
+
+/* Heap used by one idle push parser, measured once (0 if unknown) */
+size_t xml_parser_footprint(void);
+
+/* Feed TCP data to the push parser, keeping what a stanza in progress
+ * may need verbatim */
+void xml_feed(session_t *s, const char *data, size_t len);
+
+/* The complete stanza being routed exactly as received, or NULL if its
+ * bytes cannot stand on their own (it relies on namespaces declared in
+ * the stream header other than jabber:client). Valid until the stanza's
+ * routing returns. */
+const char *xml_stanza_bytes(session_t *s, size_t *len);
+
+/* Stanza tree accessors. Returned strings point into the tree. */
+const char *xml_get_attr(const xml_node_t *node, const char *name);
+xml_node_t *xml_first_child(const xml_node_t *node);
+xml_node_t *xml_find_child(const xml_node_t *node, const char *name);
+xml_node_t *xml_find_child_ns(const xml_node_t *node, const char *name, const char *ns);
+
+/* Add or replace an attribute, the value copied into a. Returns -1 if
+ * the arena is out of memory. */
+int xml_set_attr(arena_t *a, xml_node_t *node, const char *name, const char *value);
+
+/* Copy of node and everything under it into a, to outlive the stanza's
+ * routing; the copy has no parent. Returns NULL if out of memory. */
+xml_node_t *xml_clone(arena_t *a, const xml_node_t *node);
+
+/* Text content of node and its descendants, concatenated ("" if none) */
+const char *xml_text(arena_t *a, const xml_node_t *node);
+
+/* Value escaped for an attribute, in a unless nothing needed escaping.
+ * Returns NULL if out of memory. */
+const char *xml_escape_attr(arena_t *a, const char *value, size_t *out_len);
+
+/* Length of value[0..len) escaped for an attribute, and the escaping
+ * itself written to out, which must have room; returns the end */
+size_t xml_attr_escaped_len(const char *value, size_t len);
+char  *xml_attr_escape(char *out, const char *value, size_t len);
 
-/* DOM helper utilities */
-const char *xml_get_attr(xmlNodePtr node, const char *name);
-xmlNodePtr  xml_find_child(xmlNodePtr node, const char *name);
-xmlNodePtr  xml_find_child_ns(xmlNodePtr node, const char *name, const char *ns);
+/* Serialize node into a, NUL-terminated. Returns NULL if out of memory. */
+char *xml_serialize(arena_t *a, const xml_node_t *node, size_t *out_len);
 
 #endif
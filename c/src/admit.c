@@ -0,0 +1,123 @@
+#include "admit.h"
+#include "log.h"
+#include <string.h>
+#include <pthread.h>
+
+#define ADMIT_IP_SLOTS   4096       /* per-IP buckets (power of two) */
+#define ADMIT_REPORT_MS  1000       /* least interval between reject reports */
+
+/* Token bucket in thousandths of a token so that refills stay integral
+ * at millisecond resolution */
+typedef struct bucket {
+    int64_t  tokens;
+    uint64_t stamp;     /* ms of the last refill */
+} bucket_t;
+
+typedef struct ip_bucket {
+    uint32_t addr;      /* network byte order; 0 if unused */
+    bucket_t bucket;
+} ip_bucket_t;
+
+static pthread_mutex_t admit_lock = PTHREAD_MUTEX_INITIALIZER;
+static long        rate, burst, ip_rate, ip_burst, max_preauth;
+static bucket_t    global_bucket;
+static ip_bucket_t ip_buckets[ADMIT_IP_SLOTS];
+static long        preauth = 0;
+
+/* Rejections since the last report */
+static unsigned long rejected[ADMIT_PREAUTH + 1];
+static uint64_t      last_report = 0;
+
+static void bucket_refill(bucket_t *b, long r, long cap, uint64_t now) {
+    if (now > b->stamp) {
+        b->tokens += (int64_t)(now - b->stamp) * r;
+        if (b->tokens > (int64_t)cap * 1000)
+            b->tokens = (int64_t)cap * 1000;
+        b->stamp = now;
+    }
+}
+
+static int bucket_take(bucket_t *b, long r, long cap, uint64_t now) {
+    if (r <= 0)
+        return 1;
+    bucket_refill(b, r, cap, now);
+    if (b->tokens < 1000)
+        return 0;
+    b->tokens -= 1000;
+    return 1;
+}
+
+/* Bucket for addr. The table is direct-mapped; a slot is handed to a new
+ * address once its owner's bucket has refilled (nothing is lost then),
+ * until which the two addresses share it. */
+static bucket_t *ip_bucket(uint32_t addr, uint64_t now) {
+    uint32_t h = addr * 2654435761u;
+    ip_bucket_t *e = &ip_buckets[(h >> 20) & (ADMIT_IP_SLOTS - 1)];
+    if (e->addr != addr) {
+        bucket_refill(&e->bucket, ip_rate, ip_burst, now);
+        if (e->addr == 0 || e->bucket.tokens >= (int64_t)ip_burst * 1000) {
+            e->addr = addr;
+            e->bucket.tokens = (int64_t)ip_burst * 1000;
+            e->bucket.stamp = now;
+        }
+    }
+    return &e->bucket;
+}
+
+void admit_init(const config_t *cfg) {
+    rate = cfg->accept_rate;
+    burst = cfg->accept_burst > 0 ? cfg->accept_burst : 1;
+    ip_rate = cfg->accept_rate_per_ip;
+    ip_burst = cfg->accept_burst_per_ip > 0 ? cfg->accept_burst_per_ip : 1;
+    max_preauth = cfg->max_preauth;
+
+    memset(ip_buckets, 0, sizeof(ip_buckets));
+    global_bucket.tokens = (int64_t)burst * 1000;
+    global_bucket.stamp = 0;
+    preauth = 0;
+}
+
+static void admit_report(uint64_t now) {
+    if (now - last_report < ADMIT_REPORT_MS)
+        return;
+    last_report = now;
+    log_write(LOG_WARN, "Connections refused: %lu over accept_rate, %lu over "
+              "accept_rate_per_ip, %lu over max_preauth (%ld pre-auth)",
+              rejected[ADMIT_RATE], rejected[ADMIT_IP_RATE],
+              rejected[ADMIT_PREAUTH], preauth);
+    memset(rejected, 0, sizeof(rejected));
+}
+
+int admit_connection(const struct sockaddr_in *addr, uint64_t now) {
+    int verdict = ADMIT_OK;
+
+    pthread_mutex_lock(&admit_lock);
+    if (global_bucket.stamp == 0)
+        global_bucket.stamp = now;
+
+    /* Cheapest refusal first; the global bucket is only charged for
+     * connections that get in */
+    if (max_preauth > 0 && preauth >= max_preauth)
+        verdict = ADMIT_PREAUTH;
+    else if (ip_rate > 0 &&
+             !bucket_take(ip_bucket(addr->sin_addr.s_addr, now), ip_rate, ip_burst, now))
+        verdict = ADMIT_IP_RATE;
+    else if (!bucket_take(&global_bucket, rate, burst, now))
+        verdict = ADMIT_RATE;
+
+    if (verdict == ADMIT_OK) {
+        preauth++;
+    } else {
+        rejected[verdict]++;
+        admit_report(now);
+    }
+    pthread_mutex_unlock(&admit_lock);
+    return verdict;
+}
+
+void admit_preauth_done(void) {
+    pthread_mutex_lock(&admit_lock);
+    if (preauth > 0)
+        preauth--;
+    pthread_mutex_unlock(&admit_lock);
+}
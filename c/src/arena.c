@@ -0,0 +1,92 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+
+#define ARENA_ALIGN     alignof(max_align_t)
+#define ARENA_HDR_SIZE  ((sizeof(arena_block_t) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+static char *block_data(arena_block_t *b) {
+    return (char *)b + ARENA_HDR_SIZE;
+}
+
+void arena_init(arena_t *a) {
+    memset(a, 0, sizeof(*a));
+}
+
+void arena_reset(arena_t *a) {
+    /* Keep the oldest block if it is a standard one */
+    arena_block_t *b = a->head;
+    while (b && b->next) {
+        arena_block_t *older = b->next;
+        free(b);
+        b = older;
+    }
+    if (b && b->size != ARENA_BLOCK_SIZE) {
+        free(b);
+        b = NULL;
+    }
+    if (b)
+        b->used = 0;
+    a->head = b;
+    a->last = NULL;
+}
+
+void arena_destroy(arena_t *a) {
+    while (a->head) {
+        arena_block_t *b = a->head;
+        a->head = b->next;
+        free(b);
+    }
+    a->last = NULL;
+}
+
+static void *arena_take(arena_t *a, size_t size, size_t align) {
+    arena_block_t *b = a->head;
+    if (b) {
+        size_t off = (b->used + align - 1) & ~(align - 1);
+        if (off <= b->size && size <= b->size - off) {
+            b->used = off + size;
+            return a->last = block_data(b) + off;
+        }
+    }
+
+    size_t need = size < ARENA_BLOCK_SIZE ? ARENA_BLOCK_SIZE : size;
+    b = malloc(ARENA_HDR_SIZE + need);
+    if (!b)
+        return NULL;
+    b->next = a->head;
+    b->size = need;
+    b->used = size;
+    a->head = b;
+    return a->last = block_data(b);
+}
+
+void *arena_alloc(arena_t *a, size_t size) {
+    return arena_take(a, size, ARENA_ALIGN);
+}
+
+char *arena_strndup(arena_t *a, const char *s, size_t len) {
+    char *copy = arena_take(a, len + 1, 1);
+    if (copy) {
+        memcpy(copy, s, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+void *arena_grow(arena_t *a, void *ptr, size_t old_size, size_t new_size) {
+    arena_block_t *b = a->head;
+    if (ptr && ptr == a->last) {
+        size_t off = (size_t)((char *)ptr - block_data(b));
+        if (new_size <= b->size - off) {
+            b->used = off + new_size;
+            return ptr;
+        }
+    }
+
+    void *moved = arena_take(a, new_size, ARENA_ALIGN);
+    if (moved && ptr)
+        memcpy(moved, ptr, old_size);
+    return moved;
+}
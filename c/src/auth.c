@@ -2,32 +2,85 @@
 #include "session.h"
 #include "config.h"
 #include "user.h"
+#include "admit.h"
+#include "storage.h"
+#include "stream.h"
 #include "xml.h"
 #include "log.h"
 #include "util.h"
 #include <string.h>
-#include <libxml/tree.h>
 
-void auth_handle_sasl(session_t *s, xmlNodePtr stanza) {
+/* SASL PLAIN credentials on their way to the store, and the verdict */
+typedef struct auth_check {
+    char username[256];
+    char password[1024];
+    int  ok;
+} auth_check_t;
+
+static void auth_check_work(void *arg, size_t len) {
+    (void)len;
+    auth_check_t *ac = arg;
+    ac->ok = user_check_password(ac->username, ac->password);
+}
+
+/* Back on the session's reactor */
+static void auth_check_done(session_t *s, void *arg, size_t len) {
+    (void)len;
+    auth_check_t *ac = arg;
+    if (!s)
+        return;
+
+    if (!ac->ok) {
+        log_write(LOG_INFO, "Authentication failed for user '%s' from fd %d",
+                  ac->username, s->fd);
+        session_write_str(s,
+            "<failure xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>"
+            "<not-authorized/>"
+            "</failure>");
+        session_resume(s);
+        return;
+    }
+
+    /* Success */
+    log_write(LOG_INFO, "User '%s' authenticated on fd %d", ac->username, s->fd);
+
+    snprintf(s->jid_local, sizeof(s->jid_local), "%s", ac->username);
+    snprintf(s->jid_domain, sizeof(s->jid_domain), "%s", g_config.domain);
+    s->authenticated = 1;
+    if (s->preauth) {
+        s->preauth = 0;
+        admit_preauth_done();
+    }
+    s->state = STATE_AUTHENTICATED;
+
+    session_write_str(s,
+        "<success xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/>");
+
+    /* The client restarts the stream after this. Leave the parser reset
+     * to when the stanzas still waiting have been handled, which may be
+     * once an xmlParseChunk on the stack has returned. */
+    s->parser_reset_pending = 1;
+    session_resume(s);
+}
+
+void auth_handle_sasl(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr) {
+    (void)hdr;
     /* Check mechanism attribute */
-    xmlChar *mechanism = xmlGetProp(stanza, (const xmlChar *)"mechanism");
-    if (!mechanism || xmlStrcmp(mechanism, (const xmlChar *)"PLAIN") != 0) {
+    const char *mechanism = xml_get_attr(stanza, "mechanism");
+    if (!mechanism || strcmp(mechanism, "PLAIN") != 0) {
         log_write(LOG_WARN, "Unsupported SASL mechanism from fd %d: %s",
-                  s->fd, mechanism ? (char *)mechanism : "(none)");
-        if (mechanism) xmlFree(mechanism);
+                  s->fd, mechanism ? mechanism : "(none)");
         session_write_str(s,
             "<failure xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>"
             "<invalid-mechanism/>"
             "</failure>");
         return;
     }
-    xmlFree(mechanism);
 
     /* Get base64-encoded content */
-    xmlChar *b64_content = xmlNodeGetContent(stanza);
-    if (!b64_content || xmlStrlen(b64_content) == 0) {
+    const char *b64_content = xml_text(&s->arena, stanza);
+    if (b64_content[0] == '\0') {
         log_write(LOG_WARN, "Empty SASL PLAIN payload from fd %d", s->fd);
-        if (b64_content) xmlFree(b64_content);
         session_write_str(s,
             "<failure xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>"
             "<not-authorized/>"
@@ -38,9 +91,8 @@ void auth_handle_sasl(session_t *s, xmlNodePtr stanza) {
     /* Base64 decode */
     unsigned char decoded[4096];
     size_t decoded_len = 0;
-    int rc = base64_decode((const char *)b64_content, xmlStrlen(b64_content),
+    int rc = base64_decode(b64_content, strlen(b64_content),
                            decoded, &decoded_len);
-    xmlFree(b64_content);
 
     if (rc < 0 || decoded_len < 3) {
         log_write(LOG_WARN, "Invalid base64 in SASL PLAIN from fd %d", s->fd);
@@ -93,8 +145,11 @@ void auth_handle_sasl(session_t *s, xmlNodePtr stanza) {
 
     log_write(LOG_DEBUG, "SASL PLAIN auth attempt: user='%s' fd=%d", authcid, s->fd);
 
-    /* Validate credentials */
-    if (!user_check_password(authcid, passwd)) {
+    /* Validate credentials on a storage thread; nothing more from the
+     * stream is handled until the answer is back */
+    auth_check_t ac;
+    memset(&ac, 0, sizeof(ac));
+    if (strlen(authcid) >= sizeof(ac.username) || strlen(passwd) >= sizeof(ac.password)) {
         log_write(LOG_INFO, "Authentication failed for user '%s' from fd %d",
                   authcid, s->fd);
         session_write_str(s,
@@ -103,20 +158,13 @@ void auth_handle_sasl(session_t *s, xmlNodePtr stanza) {
             "</failure>");
         return;
     }
+    memcpy(ac.username, authcid, strlen(authcid) + 1);
+    memcpy(ac.password, passwd, strlen(passwd) + 1);
 
-    /* Success */
-    log_write(LOG_INFO, "User '%s' authenticated on fd %d", authcid, s->fd);
-
-    snprintf(s->jid_local, sizeof(s->jid_local), "%s", authcid);
-    snprintf(s->jid_domain, sizeof(s->jid_domain), "%s", g_config.domain);
-    s->authenticated = 1;
-    s->state = STATE_AUTHENTICATED;
-
-    session_write_str(s,
-        "<success xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/>");
-
-    /* Defer parser reset — we're inside an xmlParseChunk callback,
-     * so we can't destroy the parser context from under it.
-     * session_on_readable will handle the reset after xmlParseChunk returns. */
-    s->parser_reset_pending = 1;
+    session_ref_t self;
+    session_get_ref(s, &self);
+    session_suspend(s);
+    if (storage_submit(ac.username, &self, auth_check_work, auth_check_done,
+                       &ac, sizeof(ac)) < 0)
+        stream_send_error(s, "resource-constraint");
 }
@@ -15,6 +15,24 @@ void config_defaults(config_t *cfg) {
     snprintf(cfg->datadir, sizeof(cfg->datadir), "./data");
     snprintf(cfg->logfile, sizeof(cfg->logfile), "./xmppd.log");
     cfg->loglevel = LOG_INFO;
+    cfg->threads = 1;
+    cfg->io_backend = IO_BACKEND_EPOLL;
+    cfg->storage = STORAGE_FILES;
+    cfg->storage_threads = 2;
+    cfg->handshake_timeout = 30;
+    cfg->idle_timeout = 300;
+    cfg->ping_timeout = 60;
+    cfg->write_timeout = 60;
+    cfg->out_high_watermark = 1024 * 1024;
+    cfg->out_low_watermark = 256 * 1024;
+    cfg->slow_policy = SLOW_POLICY_DROP;
+    cfg->max_stanza_size = 256 * 1024;
+    cfg->listen_backlog = 1024;
+    cfg->accept_rate = 500;
+    cfg->accept_burst = 1000;
+    cfg->accept_rate_per_ip = 20;
+    cfg->accept_burst_per_ip = 50;
+    cfg->max_preauth = 5000;
 }
 
 static char *trim(char *s) {
@@ -32,6 +50,22 @@ static int parse_loglevel(const char *s) {
     return LOG_INFO;
 }
 
+static int parse_io_backend(const char *s) {
+    if (strcasecmp(s, "io_uring") == 0) return IO_BACKEND_URING;
+    return IO_BACKEND_EPOLL;
+}
+
+static int parse_storage(const char *s) {
+    if (strcasecmp(s, "mmap") == 0) return STORAGE_MMAP;
+    return STORAGE_FILES;
+}
+
+static int parse_slow_policy(const char *s) {
+    if (strcasecmp(s, "throttle") == 0)   return SLOW_POLICY_THROTTLE;
+    if (strcasecmp(s, "disconnect") == 0) return SLOW_POLICY_DISCONNECT;
+    return SLOW_POLICY_DROP;
+}
+
 int config_load(const char *path, config_t *cfg) {
     FILE *fp = fopen(path, "r");
     if (!fp)
@@ -67,9 +101,49 @@ int config_load(const char *path, config_t *cfg) {
             snprintf(cfg->logfile, sizeof(cfg->logfile), "%s", val);
         else if (strcmp(key, "loglevel") == 0)
             cfg->loglevel = parse_loglevel(val);
+        else if (strcmp(key, "threads") == 0)
+            cfg->threads = atoi(val);
+        else if (strcmp(key, "io_backend") == 0)
+            cfg->io_backend = parse_io_backend(val);
+        else if (strcmp(key, "storage") == 0)
+            cfg->storage = parse_storage(val);
+        else if (strcmp(key, "storage_threads") == 0)
+            cfg->storage_threads = atoi(val);
+        else if (strcmp(key, "handshake_timeout") == 0)
+            cfg->handshake_timeout = atoi(val);
+        else if (strcmp(key, "idle_timeout") == 0)
+            cfg->idle_timeout = atoi(val);
+        else if (strcmp(key, "ping_timeout") == 0)
+            cfg->ping_timeout = atoi(val);
+        else if (strcmp(key, "write_timeout") == 0)
+            cfg->write_timeout = atoi(val);
+        else if (strcmp(key, "out_high_watermark") == 0)
+            cfg->out_high_watermark = atol(val);
+        else if (strcmp(key, "out_low_watermark") == 0)
+            cfg->out_low_watermark = atol(val);
+        else if (strcmp(key, "slow_consumer_policy") == 0)
+            cfg->slow_policy = parse_slow_policy(val);
+        else if (strcmp(key, "max_stanza_size") == 0)
+            cfg->max_stanza_size = atol(val);
+        else if (strcmp(key, "listen_backlog") == 0)
+            cfg->listen_backlog = atoi(val);
+        else if (strcmp(key, "accept_rate") == 0)
+            cfg->accept_rate = atol(val);
+        else if (strcmp(key, "accept_burst") == 0)
+            cfg->accept_burst = atol(val);
+        else if (strcmp(key, "accept_rate_per_ip") == 0)
+            cfg->accept_rate_per_ip = atol(val);
+        else if (strcmp(key, "accept_burst_per_ip") == 0)
+            cfg->accept_burst_per_ip = atol(val);
+        else if (strcmp(key, "max_preauth") == 0)
+            cfg->max_preauth = atol(val);
     }
 
     fclose(fp);
+
+    /* The session has to drain some before it counts as recovered */
+    if (cfg->out_low_watermark >= cfg->out_high_watermark)
+        cfg->out_low_watermark = cfg->out_high_watermark / 4;
     return 0;
 }
 
@@ -81,6 +155,9 @@ int config_parse_args(int argc, char **argv, config_t *cfg) {
         { "datadir",  required_argument, NULL, 'D' },
         { "logfile",  required_argument, NULL, 'l' },
         { "loglevel", required_argument, NULL, 'L' },
+        { "threads",  required_argument, NULL, 't' },
+        { "io-backend", required_argument, NULL, 'b' },
+        { "storage",  required_argument, NULL, 'S' },
         { "help",     no_argument,       NULL, 'h' },
         { NULL, 0, NULL, 0 }
     };
@@ -89,7 +166,7 @@ int config_parse_args(int argc, char **argv, config_t *cfg) {
     const char *config_path = NULL;
     optind = 1;
     int opt;
-    while ((opt = getopt_long(argc, argv, "c:d:p:D:l:L:h", long_opts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "c:d:p:D:l:L:t:b:S:h", long_opts, NULL)) != -1) {
         if (opt == 'c')
             config_path = optarg;
     }
@@ -103,7 +180,7 @@ int config_parse_args(int argc, char **argv, config_t *cfg) {
 
     /* Second pass: CLI overrides */
     optind = 1;
-    while ((opt = getopt_long(argc, argv, "c:d:p:D:l:L:h", long_opts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "c:d:p:D:l:L:t:b:S:h", long_opts, NULL)) != -1) {
         switch (opt) {
         case 'c':
             break; /* already handled */
@@ -122,6 +199,15 @@ int config_parse_args(int argc, char **argv, config_t *cfg) {
         case 'L':
             cfg->loglevel = parse_loglevel(optarg);
             break;
+        case 't':
+            cfg->threads = atoi(optarg);
+            break;
+        case 'b':
+            cfg->io_backend = parse_io_backend(optarg);
+            break;
+        case 'S':
+            cfg->storage = parse_storage(optarg);
+            break;
         case 'h':
             printf("Usage: xmppd [options]\n"
                    "  -c, --config <path>     Config file (default: ./xmppd.conf)\n"
@@ -130,6 +216,9 @@ int config_parse_args(int argc, char **argv, config_t *cfg) {
                    "  -D, --datadir <path>    Data directory\n"
                    "  -l, --logfile <path>    Log file path\n"
                    "  -L, --loglevel <level>  Log level (DEBUG/INFO/WARN/ERROR)\n"
+                   "  -t, --threads <n>       Reactor threads (default: 1)\n"
+                   "  -b, --io-backend <name> Event loop: epoll or io_uring (default: epoll)\n"
+                   "  -S, --storage <name>    User data: files or mmap (default: files)\n"
                    "  -h, --help              Show usage\n");
             return 1;
         default:
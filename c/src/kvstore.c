@@ -0,0 +1,1070 @@
+#define _GNU_SOURCE     /* pread, pwrite, fdatasync, flock */
+#include "kvstore.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#define KV_MAGIC        "XMPPDKV1"
+#define KV_VERSION      1
+#define KV_MAX_DEPTH    32          /* tree levels, far more than 2^64 keys need */
+#define KV_GROW_PAGES   256         /* least the file grows by (1 MiB) */
+#define KV_MAP_MIN      (1ull << 28)
+
+/* Page kinds */
+#define P_LEAF          0x1
+#define P_BRANCH        0x2
+#define P_OVERFLOW      0x4
+
+/* Entry flags */
+#define E_BIG           0x1         /* value is in overflow pages */
+#define E_CHILD         0x2         /* branch entry: data is the child page */
+
+typedef struct meta {
+    char     magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint64_t txnid;
+    uint64_t root;          /* 0 for an empty tree */
+    uint64_t npages;        /* pages in use, meta pages included */
+    uint64_t checksum;      /* FNV-1a of the fields above */
+} meta_t;
+
+/* Header of every page but the metas. Branch and leaf pages have a slot
+ * array after it growing up, and the entries it points to growing down
+ * from the end of the page; an overflow run has the value after it. */
+typedef struct node {
+    uint16_t flags;
+    uint16_t n;             /* entries */
+    uint16_t lower;         /* end of the slot array */
+    uint16_t upper;         /* start of the entries */
+    uint32_t pages;         /* overflow: pages in the run */
+    uint32_t pad;
+    uint16_t slots[];       /* entry offsets, in key order */
+} node_t;
+
+#define NODE_HDR        offsetof(node_t, slots)
+
+/* Entry: this header, the key, then the inline value or a page number.
+ * The first key of a branch is never compared: its child holds all keys
+ * below the second. */
+typedef struct ent_hdr {
+    uint16_t klen;
+    uint16_t flags;
+    uint32_t vlen;
+} ent_hdr_t;
+
+#define ENT_HDR         sizeof(ent_hdr_t)
+#define ENT_MAX         (ENT_HDR + KV_MAX_KEY + KV_INLINE_MAX)
+
+/* Set of page numbers (0 is never one), open addressing */
+typedef struct pgset {
+    uint64_t *slots;
+    size_t    cap;
+    size_t    count;
+} pgset_t;
+
+typedef struct pglist {
+    uint64_t *pg;
+    size_t    count;
+    size_t    cap;
+} pglist_t;
+
+struct kv_store {
+    int             fd;
+    uint8_t        *map;
+    size_t          map_size;
+    uint64_t        file_pages;     /* pages the file has room for */
+    pthread_mutex_t lock;
+    char            err[256];
+
+    meta_t          meta;           /* last commit seen */
+    int             meta_slot;
+    uint64_t        free_txnid;     /* commit the free list is for, 0 if none */
+    pglist_t        free;           /* pages not in the tree below npages */
+
+    int             in_txn;
+    int             write;
+    int             changed;        /* it has allocated or freed pages */
+    uint64_t        root;
+    uint64_t        npages;
+    pgset_t         dirty;          /* pages allocated by this transaction */
+    size_t          sys_page;       /* msync granularity */
+    pglist_t        freed;          /* committed pages it let go */
+};
+
+typedef struct split {
+    int      happened;
+    uint8_t  key[KV_MAX_KEY];
+    size_t   klen;
+    uint64_t right;
+} split_t;
+
+static void kv_fail(kv_store_t *kv, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(kv->err, sizeof(kv->err), fmt, ap);
+    va_end(ap);
+}
+
+static uint64_t meta_sum(const meta_t *m) {
+    const uint8_t *p = (const uint8_t *)m;
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < offsetof(meta_t, checksum); i++)
+        h = (h ^ p[i]) * 1099511628211ull;
+    return h;
+}
+
+static int meta_valid(const meta_t *m) {
+    return memcmp(m->magic, KV_MAGIC, 8) == 0 && m->version == KV_VERSION &&
+           m->page_size == KV_PAGE_SIZE && m->npages >= 2 &&
+           m->root < m->npages && m->checksum == meta_sum(m);
+}
+
+/* ---- page sets and lists ---- */
+
+static size_t pg_hash(uint64_t p, size_t cap) {
+    return (size_t)((p * 0x9e3779b97f4a7c15ull) >> 17) & (cap - 1);
+}
+
+static int pgset_add(pgset_t *s, uint64_t p) {
+    if ((s->count + 1) * 2 > s->cap) {
+        size_t ncap = s->cap ? s->cap * 2 : 256;
+        uint64_t *n = calloc(ncap, sizeof(*n));
+        if (!n)
+            return -1;
+        for (size_t i = 0; i < s->cap; i++) {
+            if (!s->slots[i])
+                continue;
+            size_t j = pg_hash(s->slots[i], ncap);
+            while (n[j])
+                j = (j + 1) & (ncap - 1);
+            n[j] = s->slots[i];
+        }
+        free(s->slots);
+        s->slots = n;
+        s->cap = ncap;
+    }
+    size_t j = pg_hash(p, s->cap);
+    while (s->slots[j]) {
+        if (s->slots[j] == p)
+            return 0;
+        j = (j + 1) & (s->cap - 1);
+    }
+    s->slots[j] = p;
+    s->count++;
+    return 0;
+}
+
+static int pgset_has(const pgset_t *s, uint64_t p) {
+    if (!s->count)
+        return 0;
+    for (size_t j = pg_hash(p, s->cap); s->slots[j]; j = (j + 1) & (s->cap - 1))
+        if (s->slots[j] == p)
+            return 1;
+    return 0;
+}
+
+static void pgset_clear(pgset_t *s) {
+    if (s->count)
+        memset(s->slots, 0, s->cap * sizeof(*s->slots));
+    s->count = 0;
+}
+
+static int pglist_push(pglist_t *l, uint64_t p) {
+    if (l->count == l->cap) {
+        size_t ncap = l->cap ? l->cap * 2 : 256;
+        uint64_t *n = realloc(l->pg, ncap * sizeof(*n));
+        if (!n)
+            return -1;
+        l->pg = n;
+        l->cap = ncap;
+    }
+    l->pg[l->count++] = p;
+    return 0;
+}
+
+static int cmp_pgno(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* ---- pages and entries ---- */
+
+static node_t *page(const kv_store_t *kv, uint64_t pgno) {
+    return (node_t *)(kv->map + pgno * KV_PAGE_SIZE);
+}
+
+static uint8_t *ent(node_t *n, int i) {
+    return (uint8_t *)n + n->slots[i];
+}
+
+static ent_hdr_t ent_hdr(const uint8_t *e) {
+    ent_hdr_t h;
+    memcpy(&h, e, sizeof(h));
+    return h;
+}
+
+static size_t ent_size(const uint8_t *e) {
+    ent_hdr_t h = ent_hdr(e);
+    return ENT_HDR + h.klen + ((h.flags & (E_BIG | E_CHILD)) ? 8 : h.vlen);
+}
+
+static uint64_t ent_pgno(const uint8_t *e) {
+    uint64_t p;
+    memcpy(&p, e + ENT_HDR + ent_hdr(e).klen, 8);
+    return p;
+}
+
+static void ent_set_pgno(uint8_t *e, uint64_t p) {
+    memcpy(e + ENT_HDR + ent_hdr(e).klen, &p, 8);
+}
+
+static size_t ent_make(uint8_t *e, const void *key, size_t klen, uint16_t flags,
+                       uint32_t vlen, const void *data, size_t dlen)
+{
+    ent_hdr_t h = { (uint16_t)klen, flags, vlen };
+    memcpy(e, &h, sizeof(h));
+    memcpy(e + ENT_HDR, key, klen);
+    if (dlen)
+        memcpy(e + ENT_HDR + klen, data, dlen);
+    return ENT_HDR + klen + dlen;
+}
+
+static int keycmp(const void *a, size_t alen, const void *b, size_t blen) {
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    return c ? c : (alen > blen) - (alen < blen);
+}
+
+/* Index of the first entry whose key is >= key */
+static int node_search(node_t *n, const void *key, size_t klen, int *exact) {
+    int lo = 0, hi = n->n;
+    *exact = 0;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        uint8_t *e = ent(n, mid);
+        int c = keycmp(e + ENT_HDR, ent_hdr(e).klen, key, klen);
+        if (c == 0) {
+            *exact = 1;
+            return mid;
+        }
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Index of the branch entry whose child covers key */
+static int branch_index(node_t *n, const void *key, size_t klen) {
+    int lo = 1, hi = n->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        uint8_t *e = ent(n, mid);
+        if (keycmp(e + ENT_HDR, ent_hdr(e).klen, key, klen) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+static void node_init(node_t *n, uint16_t flags) {
+    memset(n, 0, NODE_HDR);
+    n->flags = flags;
+    n->lower = NODE_HDR;
+    n->upper = KV_PAGE_SIZE;
+}
+
+/* Pack the entries against the end of the page, reclaiming the holes
+ * left by removals */
+static void node_compact(node_t *n) {
+    uint8_t tmp[KV_PAGE_SIZE];
+    memcpy(tmp, n, KV_PAGE_SIZE);
+    node_t *t = (node_t *)tmp;
+    uint16_t upper = KV_PAGE_SIZE;
+    for (int i = 0; i < t->n; i++) {
+        size_t sz = ent_size(ent(t, i));
+        upper -= (uint16_t)sz;
+        memcpy((uint8_t *)n + upper, ent(t, i), sz);
+        n->slots[i] = upper;
+    }
+    n->upper = upper;
+}
+
+static int node_insert(node_t *n, int idx, const uint8_t *e, size_t sz) {
+    if ((size_t)(n->upper - n->lower) < sz + 2) {
+        node_compact(n);
+        if ((size_t)(n->upper - n->lower) < sz + 2)
+            return -1;
+    }
+    memmove(&n->slots[idx + 1], &n->slots[idx], (size_t)(n->n - idx) * 2);
+    n->upper -= (uint16_t)sz;
+    memcpy((uint8_t *)n + n->upper, e, sz);
+    n->slots[idx] = n->upper;
+    n->n++;
+    n->lower += 2;
+    return 0;
+}
+
+static void node_remove(node_t *n, int idx) {
+    memmove(&n->slots[idx], &n->slots[idx + 1], (size_t)(n->n - idx - 1) * 2);
+    n->n--;
+    n->lower -= 2;
+}
+
+/* ---- allocation ---- */
+
+/* Make the file hold npages, growing it by a quarter at a time */
+static int file_reserve(kv_store_t *kv, uint64_t npages) {
+    if (npages <= kv->file_pages)
+        return 0;
+    uint64_t max = kv->map_size / KV_PAGE_SIZE;
+    uint64_t want = kv->file_pages + kv->file_pages / 4;
+    if (want < kv->file_pages + KV_GROW_PAGES)
+        want = kv->file_pages + KV_GROW_PAGES;
+    if (want < npages)
+        want = npages;
+    if (want > max)
+        want = npages;
+    if (want > max) {
+        kv_fail(kv, "store full (%llu pages)", (unsigned long long)max);
+        return -1;
+    }
+    if (ftruncate(kv->fd, (off_t)(want * KV_PAGE_SIZE)) < 0) {
+        kv_fail(kv, "cannot grow store: %s", strerror(errno));
+        return -1;
+    }
+    kv->file_pages = want;
+    return 0;
+}
+
+/* A page for this transaction to write, or 0 on error */
+static uint64_t page_alloc(kv_store_t *kv) {
+    uint64_t p;
+    kv->changed = 1;
+    if (kv->free.count) {
+        p = kv->free.pg[--kv->free.count];
+    } else {
+        if (file_reserve(kv, kv->npages + 1) < 0)
+            return 0;
+        p = kv->npages++;
+    }
+    if (pgset_add(&kv->dirty, p) < 0) {
+        pglist_push(&kv->free, p);
+        kv_fail(kv, "out of memory");
+        return 0;
+    }
+    return p;
+}
+
+/* Note a run of count pages from p as this transaction's */
+static uint64_t run_mark(kv_store_t *kv, uint64_t p, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++) {
+        if (pgset_add(&kv->dirty, p + i) < 0) {
+            kv_fail(kv, "out of memory");
+            return 0;
+        }
+    }
+    return p;
+}
+
+/* count contiguous pages for an overflow value, or 0 on error */
+static uint64_t run_alloc(kv_store_t *kv, uint64_t count) {
+    pglist_t *f = &kv->free;
+    kv->changed = 1;
+    if (f->count >= count) {
+        qsort(f->pg, f->count, sizeof(*f->pg), cmp_pgno);
+        for (size_t i = 0, start = 0; i < f->count; i++) {
+            if (i > start && f->pg[i] != f->pg[i - 1] + 1)
+                start = i;
+            if (i - start + 1 == count) {
+                uint64_t p = f->pg[start];
+                memmove(&f->pg[start], &f->pg[i + 1],
+                        (f->count - i - 1) * sizeof(*f->pg));
+                f->count -= count;
+                return run_mark(kv, p, count);
+            }
+        }
+    }
+    if (file_reserve(kv, kv->npages + count) < 0)
+        return 0;
+    uint64_t p = kv->npages;
+    kv->npages += count;
+    return run_mark(kv, p, count);
+}
+
+/* Let go of count pages from pgno. Pages of this transaction are free at
+ * once; committed ones only after the commit, as a crash before it needs
+ * them. */
+static int pages_free(kv_store_t *kv, uint64_t pgno, uint64_t count) {
+    kv->changed = 1;
+    for (uint64_t i = 0; i < count; i++) {
+        pglist_t *l = pgset_has(&kv->dirty, pgno + i) ? &kv->free : &kv->freed;
+        if (pglist_push(l, pgno + i) < 0) {
+            kv_fail(kv, "out of memory");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int value_free(kv_store_t *kv, const uint8_t *e) {
+    if (!(ent_hdr(e).flags & E_BIG))
+        return 0;
+    uint64_t p = ent_pgno(e);
+    return pages_free(kv, p, page(kv, p)->pages);
+}
+
+/* Make *pgno writable in this transaction, copying it if committed */
+static int touch(kv_store_t *kv, uint64_t *pgno) {
+    if (pgset_has(&kv->dirty, *pgno))
+        return 0;
+    uint64_t p = page_alloc(kv);
+    if (!p)
+        return -1;
+    memcpy(page(kv, p), page(kv, *pgno), KV_PAGE_SIZE);
+    if (pages_free(kv, *pgno, 1) < 0)
+        return -1;
+    *pgno = p;
+    return 0;
+}
+
+/* Mark pgno and what hangs off it in bits; -1 if the tree is damaged */
+static int walk(kv_store_t *kv, uint64_t pgno, int depth, uint8_t *bits) {
+    if (pgno < 2 || pgno >= kv->npages || depth >= KV_MAX_DEPTH ||
+        (bits[pgno / 8] & (1u << (pgno % 8))))
+        return -1;
+    bits[pgno / 8] |= (uint8_t)(1u << (pgno % 8));
+
+    node_t *n = page(kv, pgno);
+    if (!(n->flags & (P_LEAF | P_BRANCH)))
+        return -1;
+    for (int i = 0; i < n->n; i++) {
+        uint8_t *e = ent(n, i);
+        if (n->flags & P_BRANCH) {
+            if (walk(kv, ent_pgno(e), depth + 1, bits) < 0)
+                return -1;
+        } else if (ent_hdr(e).flags & E_BIG) {
+            uint64_t p = ent_pgno(e);
+            if (p < 2 || p >= kv->npages || !(page(kv, p)->flags & P_OVERFLOW) ||
+                page(kv, p)->pages > kv->npages - p)
+                return -1;
+            for (uint64_t j = p; j < p + page(kv, p)->pages; j++)
+                bits[j / 8] |= (uint8_t)(1u << (j % 8));
+        }
+    }
+    return 0;
+}
+
+/* The free list for the last commit: the pages the tree does not use */
+static int free_rebuild(kv_store_t *kv) {
+    uint8_t *bits = calloc(kv->npages / 8 + 1, 1);
+    if (!bits) {
+        kv_fail(kv, "out of memory");
+        return -1;
+    }
+    if (kv->root && walk(kv, kv->root, 0, bits) < 0) {
+        free(bits);
+        kv_fail(kv, "store is damaged");
+        return -1;
+    }
+    kv->free.count = 0;
+    for (uint64_t p = kv->npages; p-- > 2;) {
+        if (!(bits[p / 8] & (1u << (p % 8))) && pglist_push(&kv->free, p) < 0) {
+            free(bits);
+            kv_fail(kv, "out of memory");
+            return -1;
+        }
+    }
+    free(bits);
+    kv->free_txnid = kv->meta.txnid;
+    return 0;
+}
+
+/* ---- open and transactions ---- */
+
+static int meta_read(kv_store_t *kv) {
+    int best = -1;
+    meta_t m[2];
+    for (int i = 0; i < 2; i++) {
+        if (pread(kv->fd, &m[i], sizeof(m[i]), (off_t)i * KV_PAGE_SIZE) !=
+            (ssize_t)sizeof(m[i]) || !meta_valid(&m[i]))
+            continue;
+        if (best < 0 || m[i].txnid > m[best].txnid)
+            best = i;
+    }
+    if (best < 0) {
+        kv_fail(kv, "no valid meta page");
+        return -1;
+    }
+    kv->meta = m[best];
+    kv->meta_slot = best;
+    return 0;
+}
+
+static int meta_write(kv_store_t *kv, meta_t *m, int slot) {
+    m->checksum = meta_sum(m);
+    if (pwrite(kv->fd, m, sizeof(*m), (off_t)slot * KV_PAGE_SIZE) != (ssize_t)sizeof(*m) ||
+        fdatasync(kv->fd) < 0) {
+        kv_fail(kv, "cannot write meta page: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Lay out an empty store in a new file */
+static int store_create(kv_store_t *kv) {
+    if (ftruncate(kv->fd, 2 * KV_PAGE_SIZE) < 0) {
+        kv_fail(kv, "cannot size store: %s", strerror(errno));
+        return -1;
+    }
+    meta_t m;
+    memset(&m, 0, sizeof(m));
+    memcpy(m.magic, KV_MAGIC, 8);
+    m.version = KV_VERSION;
+    m.page_size = KV_PAGE_SIZE;
+    m.npages = 2;
+    if (meta_write(kv, &m, 1) < 0)
+        return -1;
+    m.txnid = 1;
+    return meta_write(kv, &m, 0);
+}
+
+kv_store_t *kv_open(const char *path, int create, char *err, size_t errlen) {
+    kv_store_t *kv = calloc(1, sizeof(*kv));
+    if (!kv) {
+        snprintf(err, errlen, "out of memory");
+        return NULL;
+    }
+    pthread_mutex_init(&kv->lock, NULL);
+    long sys_page = sysconf(_SC_PAGESIZE);
+    kv->sys_page = sys_page > 0 ? (size_t)sys_page : KV_PAGE_SIZE;
+    kv->fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+    if (kv->fd < 0) {
+        snprintf(err, errlen, "%s: %s", path, strerror(errno));
+        pthread_mutex_destroy(&kv->lock);
+        free(kv);
+        return NULL;
+    }
+
+    struct stat st;
+    int ok = flock(kv->fd, LOCK_EX) == 0 && fstat(kv->fd, &st) == 0;
+    if (!ok) {
+        kv_fail(kv, "%s", strerror(errno));
+    } else if (st.st_size == 0 && create) {
+        ok = store_create(kv) == 0 && fstat(kv->fd, &st) == 0;
+    } else if (st.st_size < 2 * KV_PAGE_SIZE) {
+        kv_fail(kv, "not a store");
+        ok = 0;
+    }
+
+    if (ok) {
+        /* Address space for the largest file, so pages never move; less
+         * where the reservation is refused */
+        kv->map_size = KV_MAP_SIZE;
+        kv->map = MAP_FAILED;
+        while (kv->map_size >= KV_MAP_MIN && kv->map_size >= (size_t)st.st_size) {
+            kv->map = mmap(NULL, kv->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                           kv->fd, 0);
+            if (kv->map != MAP_FAILED)
+                break;
+            kv->map_size /= 2;
+        }
+        if (kv->map == MAP_FAILED) {
+            kv->map = NULL;
+            kv_fail(kv, "cannot map store: %s", strerror(errno));
+            ok = 0;
+        }
+    }
+    ok = ok && meta_read(kv) == 0;
+    flock(kv->fd, LOCK_UN);
+
+    if (!ok) {
+        snprintf(err, errlen, "%s: %s", path, kv->err);
+        kv_close(kv);
+        return NULL;
+    }
+    return kv;
+}
+
+void kv_close(kv_store_t *kv) {
+    if (!kv)
+        return;
+    if (kv->in_txn)
+        kv_abort(kv);
+    if (kv->map)
+        munmap(kv->map, kv->map_size);
+    close(kv->fd);
+    free(kv->free.pg);
+    free(kv->freed.pg);
+    free(kv->dirty.slots);
+    pthread_mutex_destroy(&kv->lock);
+    free(kv);
+}
+
+const char *kv_error(const kv_store_t *kv) {
+    return kv->err;
+}
+
+static void txn_end(kv_store_t *kv) {
+    pgset_clear(&kv->dirty);
+    kv->freed.count = 0;
+    kv->in_txn = 0;
+    kv->changed = 0;
+    flock(kv->fd, LOCK_UN);
+    pthread_mutex_unlock(&kv->lock);
+}
+
+int kv_begin(kv_store_t *kv, int write) {
+    pthread_mutex_lock(&kv->lock);
+    struct stat st;
+    if (flock(kv->fd, write ? LOCK_EX : LOCK_SH) < 0) {
+        kv_fail(kv, "cannot lock store: %s", strerror(errno));
+        pthread_mutex_unlock(&kv->lock);
+        return -1;
+    }
+    if (meta_read(kv) < 0 || fstat(kv->fd, &st) < 0) {
+        flock(kv->fd, LOCK_UN);
+        pthread_mutex_unlock(&kv->lock);
+        return -1;
+    }
+    kv->file_pages = (uint64_t)st.st_size / KV_PAGE_SIZE;
+    kv->root = kv->meta.root;
+    kv->npages = kv->meta.npages;
+    kv->write = write;
+    kv->in_txn = 1;
+    if ((uint64_t)st.st_size > kv->map_size || kv->npages > kv->file_pages) {
+        kv_fail(kv, "store larger than its mapping");
+        kv->free_txnid = 0;
+        txn_end(kv);
+        return -1;
+    }
+    if (write && kv->free_txnid != kv->meta.txnid && free_rebuild(kv) < 0) {
+        txn_end(kv);
+        return -1;
+    }
+    return 0;
+}
+
+void kv_abort(kv_store_t *kv) {
+    if (!kv->in_txn)
+        return;
+    /* The free list may have lost pages to this transaction */
+    if (kv->write && kv->changed)
+        kv->free_txnid = 0;
+    txn_end(kv);
+}
+
+/* msync the pages this transaction wrote, each run of neighbours (to
+ * whole system pages) at once. Sorts the dirty set in place, so it is
+ * only good for clearing afterwards. */
+static int dirty_sync(kv_store_t *kv) {
+    pgset_t *d = &kv->dirty;
+    size_t n = 0;
+    for (size_t i = 0; i < d->cap && n < d->count; i++)
+        if (d->slots[i])
+            d->slots[n++] = d->slots[i];
+    qsort(d->slots, n, sizeof(*d->slots), cmp_pgno);
+
+    size_t mask = kv->sys_page - 1;
+    for (size_t i = 0; i < n; ) {
+        size_t start = (size_t)d->slots[i] * KV_PAGE_SIZE & ~mask;
+        size_t end = ((size_t)d->slots[i] + 1) * KV_PAGE_SIZE;
+        for (i++; i < n && ((size_t)d->slots[i] * KV_PAGE_SIZE & ~mask) <= end; i++)
+            end = ((size_t)d->slots[i] + 1) * KV_PAGE_SIZE;
+        end = (end + mask) & ~mask;
+        if (msync(kv->map + start, end - start, MS_SYNC) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int kv_commit(kv_store_t *kv) {
+    if (!kv->in_txn)
+        return -1;
+    if (!kv->write || !kv->changed) {
+        txn_end(kv);
+        return 0;
+    }
+
+    /* The new pages reach the disk before the meta page pointing to them */
+    if (dirty_sync(kv) < 0) {
+        kv_fail(kv, "cannot sync store: %s", strerror(errno));
+        kv_abort(kv);
+        return -1;
+    }
+
+    for (size_t i = 0; i < kv->freed.count; i++) {
+        if (pglist_push(&kv->free, kv->freed.pg[i]) < 0) {
+            kv->free_txnid = 0;
+            break;
+        }
+    }
+    /* Free pages at the end of the file are given back to the end */
+    if (kv->free.count)
+        qsort(kv->free.pg, kv->free.count, sizeof(*kv->free.pg), cmp_pgno);
+    while (kv->free.count && kv->free.pg[kv->free.count - 1] == kv->npages - 1) {
+        kv->free.count--;
+        kv->npages--;
+    }
+
+    meta_t m = kv->meta;
+    m.txnid++;
+    m.root = kv->root;
+    m.npages = kv->npages;
+    int slot = 1 - kv->meta_slot;
+    if (meta_write(kv, &m, slot) < 0) {
+        kv->free_txnid = 0;
+        txn_end(kv);
+        return -1;
+    }
+    if (kv->free_txnid == kv->meta.txnid)
+        kv->free_txnid = m.txnid;
+    kv->meta = m;
+    kv->meta_slot = slot;
+    txn_end(kv);
+    return 0;
+}
+
+/* ---- operations ---- */
+
+static const void *value_of(const kv_store_t *kv, const uint8_t *e, size_t *vlen) {
+    ent_hdr_t h = ent_hdr(e);
+    *vlen = h.vlen;
+    if (h.flags & E_BIG)
+        return (const uint8_t *)page(kv, ent_pgno(e)) + NODE_HDR;
+    return e + ENT_HDR + h.klen;
+}
+
+int kv_get(kv_store_t *kv, const void *key, size_t klen,
+           const void **val, size_t *vlen)
+{
+    if (!kv->in_txn) {
+        kv_fail(kv, "no transaction");
+        return -1;
+    }
+    uint64_t p = kv->root;
+    for (int depth = 0; p; depth++) {
+        node_t *n = page(kv, p);
+        if (depth >= KV_MAX_DEPTH || p >= kv->npages) {
+            kv_fail(kv, "store is damaged");
+            return -1;
+        }
+        if (n->flags & P_BRANCH) {
+            p = ent_pgno(ent(n, branch_index(n, key, klen)));
+            continue;
+        }
+        int exact;
+        int i = node_search(n, key, klen, &exact);
+        if (!exact)
+            return 0;
+        *val = value_of(kv, ent(n, i), vlen);
+        return 1;
+    }
+    return 0;
+}
+
+/* Insert entry e into the node of the leaf for key, splitting the node
+ * if it is full: its upper half then goes to a new page reported in sp */
+static int split_insert(kv_store_t *kv, uint64_t pgno, int idx,
+                        const uint8_t *e, size_t sz, split_t *sp)
+{
+    node_t *n = page(kv, pgno);
+    if (node_insert(n, idx, e, sz) == 0)
+        return 0;
+
+    uint8_t tmp[KV_PAGE_SIZE];
+    memcpy(tmp, n, KV_PAGE_SIZE);
+    node_t *t = (node_t *)tmp;
+    int total = t->n + 1;
+#define SPLIT_ENT(j) ((j) < idx ? ent(t, j) : (j) == idx ? e : ent(t, (j) - 1))
+
+    /* The split point leaving the fuller half least full */
+    size_t sum = 0, left = 0, best = (size_t)-1;
+    for (int j = 0; j < total; j++)
+        sum += ent_size(SPLIT_ENT(j)) + 2;
+    int k = 1;
+    for (int j = 1; j < total; j++) {
+        left += ent_size(SPLIT_ENT(j - 1)) + 2;
+        size_t fuller = left > sum - left ? left : sum - left;
+        if (fuller < best) {
+            best = fuller;
+            k = j;
+        }
+    }
+
+    uint64_t rp = page_alloc(kv);
+    if (!rp)
+        return -1;
+    node_t *r = page(kv, rp);
+    node_init(n, t->flags);
+    node_init(r, t->flags);
+    for (int j = 0; j < total; j++) {
+        const uint8_t *x = SPLIT_ENT(j);
+        node_t *to = j < k ? n : r;
+        if (node_insert(to, to->n, x, ent_size(x)) < 0) {
+            kv_fail(kv, "entry does not fit a page");
+            return -1;
+        }
+    }
+    const uint8_t *sep = SPLIT_ENT(k);
+#undef SPLIT_ENT
+    sp->happened = 1;
+    sp->klen = ent_hdr(sep).klen;
+    memcpy(sp->key, sep + ENT_HDR, sp->klen);
+    sp->right = rp;
+    return 0;
+}
+
+static int put_rec(kv_store_t *kv, uint64_t *pgno, int depth, const void *key,
+                   size_t klen, const uint8_t *e, size_t sz, split_t *sp)
+{
+    if (depth >= KV_MAX_DEPTH || *pgno >= kv->npages) {
+        kv_fail(kv, "store is damaged");
+        return -1;
+    }
+    if (touch(kv, pgno) < 0)
+        return -1;
+    node_t *n = page(kv, *pgno);
+
+    if (n->flags & P_LEAF) {
+        int exact;
+        int i = node_search(n, key, klen, &exact);
+        if (exact) {
+            if (value_free(kv, ent(n, i)) < 0)
+                return -1;
+            node_remove(n, i);
+        }
+        return split_insert(kv, *pgno, i, e, sz, sp);
+    }
+
+    int i = branch_index(n, key, klen);
+    uint64_t child = ent_pgno(ent(n, i));
+    split_t csp;
+    csp.happened = 0;
+    if (put_rec(kv, &child, depth + 1, key, klen, e, sz, &csp) < 0)
+        return -1;
+    n = page(kv, *pgno);
+    ent_set_pgno(ent(n, i), child);
+    if (!csp.happened)
+        return 0;
+
+    uint8_t be[ENT_HDR + KV_MAX_KEY + 8];
+    size_t bsz = ent_make(be, csp.key, csp.klen, E_CHILD, 0, &csp.right, 8);
+    return split_insert(kv, *pgno, i + 1, be, bsz, sp);
+}
+
+static int check_write(kv_store_t *kv, size_t klen) {
+    if (!kv->in_txn || !kv->write) {
+        kv_fail(kv, "no write transaction");
+        return -1;
+    }
+    if (klen == 0 || klen > KV_MAX_KEY) {
+        kv_fail(kv, "bad key length %zu", klen);
+        return -1;
+    }
+    return 0;
+}
+
+int kv_put(kv_store_t *kv, const void *key, size_t klen,
+           const void *val, size_t vlen)
+{
+    if (check_write(kv, klen) < 0)
+        return -1;
+    if (vlen > KV_MAX_VALUE) {
+        kv_fail(kv, "value too large (%zu bytes)", vlen);
+        return -1;
+    }
+
+    uint8_t e[ENT_MAX];
+    size_t sz;
+    if (vlen > KV_INLINE_MAX) {
+        uint64_t count = (NODE_HDR + vlen + KV_PAGE_SIZE - 1) / KV_PAGE_SIZE;
+        uint64_t p = run_alloc(kv, count);
+        if (!p)
+            return -1;
+        node_t *o = page(kv, p);
+        node_init(o, P_OVERFLOW);
+        o->pages = (uint32_t)count;
+        memcpy((uint8_t *)o + NODE_HDR, val, vlen);
+        sz = ent_make(e, key, klen, E_BIG, (uint32_t)vlen, &p, 8);
+    } else {
+        sz = ent_make(e, key, klen, 0, (uint32_t)vlen, val, vlen);
+    }
+
+    if (!kv->root) {
+        uint64_t p = page_alloc(kv);
+        if (!p)
+            return -1;
+        node_init(page(kv, p), P_LEAF);
+        kv->root = p;
+    }
+    split_t sp;
+    sp.happened = 0;
+    if (put_rec(kv, &kv->root, 0, key, klen, e, sz, &sp) < 0)
+        return -1;
+    if (sp.happened) {
+        /* The root split: a new root above the two halves */
+        uint64_t p = page_alloc(kv);
+        if (!p)
+            return -1;
+        node_t *n = page(kv, p);
+        node_init(n, P_BRANCH);
+        uint8_t be[ENT_HDR + KV_MAX_KEY + 8];
+        node_insert(n, 0, be, ent_make(be, "", 0, E_CHILD, 0, &kv->root, 8));
+        node_insert(n, 1, be, ent_make(be, sp.key, sp.klen, E_CHILD, 0, &sp.right, 8));
+        kv->root = p;
+    }
+    return 0;
+}
+
+/* Remove key below *pgno; *empty is set if the node is left without
+ * entries (and so should go) */
+static int del_rec(kv_store_t *kv, uint64_t *pgno, int depth, const void *key,
+                   size_t klen, int *empty)
+{
+    if (depth >= KV_MAX_DEPTH || *pgno >= kv->npages) {
+        kv_fail(kv, "store is damaged");
+        return -1;
+    }
+    node_t *n = page(kv, *pgno);
+    int i, r = 1, child_empty = 0;
+    uint64_t child = 0;
+
+    if (n->flags & P_LEAF) {
+        int exact;
+        i = node_search(n, key, klen, &exact);
+        if (!exact)
+            return 0;
+    } else {
+        i = branch_index(n, key, klen);
+        child = ent_pgno(ent(n, i));
+        r = del_rec(kv, &child, depth + 1, key, klen, &child_empty);
+        if (r <= 0)
+            return r;
+    }
+
+    if (touch(kv, pgno) < 0)
+        return -1;
+    n = page(kv, *pgno);
+    if (n->flags & P_LEAF) {
+        if (value_free(kv, ent(n, i)) < 0)
+            return -1;
+        node_remove(n, i);
+    } else if (child_empty) {
+        if (pages_free(kv, child, 1) < 0)
+            return -1;
+        node_remove(n, i);
+    } else {
+        ent_set_pgno(ent(n, i), child);
+    }
+    *empty = n->n == 0;
+    return r;
+}
+
+int kv_del(kv_store_t *kv, const void *key, size_t klen) {
+    if (check_write(kv, klen) < 0)
+        return -1;
+    if (!kv->root)
+        return 0;
+
+    int empty = 0;
+    int r = del_rec(kv, &kv->root, 0, key, klen, &empty);
+    if (r <= 0)
+        return r;
+    if (empty) {
+        if (pages_free(kv, kv->root, 1) < 0)
+            return -1;
+        kv->root = 0;
+    }
+    /* Drop roots left with a single child */
+    while (kv->root && (page(kv, kv->root)->flags & P_BRANCH) &&
+           page(kv, kv->root)->n == 1) {
+        uint64_t old = kv->root;
+        kv->root = ent_pgno(ent(page(kv, old), 0));
+        if (pages_free(kv, old, 1) < 0)
+            return -1;
+    }
+    return 1;
+}
+
+long kv_scan(kv_store_t *kv, const void *prefix, size_t plen,
+             kv_scan_fn fn, void *ctx)
+{
+    if (!kv->in_txn) {
+        kv_fail(kv, "no transaction");
+        return -1;
+    }
+    if (!kv->root)
+        return 0;
+
+    /* Path from the root to the current leaf entry */
+    struct { uint64_t pgno; int idx; } st[KV_MAX_DEPTH];
+    int d = 0;
+    uint64_t p = kv->root;
+    for (;;) {
+        if (d >= KV_MAX_DEPTH || p >= kv->npages) {
+            kv_fail(kv, "store is damaged");
+            return -1;
+        }
+        node_t *n = page(kv, p);
+        st[d].pgno = p;
+        if (n->flags & P_LEAF) {
+            int exact;
+            st[d].idx = node_search(n, prefix, plen, &exact);
+            break;
+        }
+        st[d].idx = branch_index(n, prefix, plen);
+        p = ent_pgno(ent(n, st[d].idx));
+        d++;
+    }
+
+    long count = 0;
+    for (;;) {
+        node_t *n = page(kv, st[d].pgno);
+        if (st[d].idx >= n->n) {
+            /* Leaf done: up to the next unvisited child, down its left edge */
+            int up = d;
+            while (up > 0) {
+                up--;
+                if (++st[up].idx < page(kv, st[up].pgno)->n)
+                    break;
+                if (up == 0)
+                    return count;
+            }
+            if (up == d)
+                return count;
+            while (!(page(kv, st[up].pgno)->flags & P_LEAF)) {
+                uint64_t c = ent_pgno(ent(page(kv, st[up].pgno), st[up].idx));
+                if (++up >= KV_MAX_DEPTH || c >= kv->npages) {
+                    kv_fail(kv, "store is damaged");
+                    return -1;
+                }
+                st[up].pgno = c;
+                st[up].idx = 0;
+            }
+            d = up;
+            continue;
+        }
+
+        uint8_t *e = ent(n, st[d].idx);
+        ent_hdr_t h = ent_hdr(e);
+        if (h.klen < plen || memcmp(e + ENT_HDR, prefix, plen) != 0)
+            return count;
+        size_t vlen;
+        const void *val = value_of(kv, e, &vlen);
+        count++;
+        if (fn(ctx, e + ENT_HDR, h.klen, val, vlen))
+            return count;
+        st[d].idx++;
+    }
+}
@@ -40,6 +40,8 @@ void log_write(int level, const char *fmt, ...) {
     char ts[32];
     log_timestamp(ts, sizeof(ts));
 
+    /* Keep the line together when several reactor threads log at once */
+    flockfile(log_fp);
     fprintf(log_fp, "[%s] [%s] ", ts, level_names[level]);
 
     va_list ap;
@@ -49,6 +51,7 @@ void log_write(int level, const char *fmt, ...) {
 
     fprintf(log_fp, "\n");
     fflush(log_fp);
+    funlockfile(log_fp);
 }
 
 void log_xml_in(const char *data, size_t len) {
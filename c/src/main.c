@@ -2,6 +2,8 @@
 #include "log.h"
 #include "server.h"
 #include "xml.h"
+#include "template.h"
+#include "stanza.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <libxml/parser.h>
@@ -23,8 +25,16 @@ int main(int argc, char **argv) {
     xmlInitParser();
     xml_init_sax_handler();
 
+    if (tmpl_init() < 0 || stanza_init() < 0) {
+        tmpl_cleanup();
+        log_close();
+        xmlCleanupParser();
+        return 1;
+    }
+
     if (server_init(&g_config) < 0) {
         log_write(LOG_ERROR, "Failed to initialize server");
+        tmpl_cleanup();
         log_close();
         xmlCleanupParser();
         return 1;
@@ -33,6 +43,7 @@ int main(int argc, char **argv) {
     server_run();
     server_shutdown();
 
+    tmpl_cleanup();
     xmlCleanupParser();
     log_write(LOG_INFO, "xmppd shutting down");
     log_close();
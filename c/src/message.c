@@ -1,192 +1,330 @@
 #include "message.h"
 #include "stanza.h"
+#include "server.h"
 #include "config.h"
 #include "user.h"
 #include "log.h"
 #include "util.h"
 #include "xml.h"
+#include "store.h"
+#include "storage.h"
+#include "stream.h"
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include <stdlib.h>
-#include <dirent.h>
-#include <unistd.h>
 #include <time.h>
-#include <sys/stat.h>
-#include <libxml/parser.h>
-#include <libxml/tree.h>
-
-void handle_message(session_t *s, xmlNodePtr stanza) {
-    xmlChar *to_attr = xmlGetProp(stanza, (const xmlChar *)"to");
-    xmlChar *type_attr = xmlGetProp(stanza, (const xmlChar *)"type");
-    const char *to = to_attr ? (const char *)to_attr : "";
-    const char *type = type_attr ? (const char *)type_attr : "normal";
-
-    /* Parse target JID */
-    char local[256], domain[256], resource[256];
-    if (jid_parse(to, local, sizeof(local), domain, sizeof(domain),
-                  resource, sizeof(resource)) < 0 || local[0] == '\0') {
+
+/* A message on its way to another reactor, with what is needed to store
+ * it offline should the recipient have gone by the time it arrives */
+typedef struct message_delivery {
+    char          username[256];
+    int           store_offline;
+    int           droppable;        /* chat state only */
+    int           has_sender;
+    session_ref_t sender;
+    outseg_t     *seg;              /* one reference, the task's */
+} message_delivery_t;
+
+/* A message for a user who is not online, and whether they exist */
+typedef struct offline_store {
+    char      username[256];
+    int       check;            /* answer the sender if there is no such user */
+    int       store;
+    int       missing;          /* set by the storage thread */
+    int       has_id;
+    outseg_t *seg;              /* one reference, the job's */
+    char      id[];             /* the message's, to answer with */
+} offline_store_t;
+
+static void offline_submit(session_t *sender, const char *username, const char *id,
+                           outseg_t *seg, int store);
+
+static void message_deliver_task(session_t *target, void *arg, size_t len) {
+    (void)len;
+    message_delivery_t *md = arg;
+
+    if (target) {
+        if (session_admit(target, md->has_sender ? &md->sender : NULL, md->droppable))
+            session_write_seg(target, md->seg);
+    } else if (md->store_offline) {
+        message_store_offline(md->username, md->seg);
+    }
+    outseg_unref(md->seg);
+}
+
+static void message_deliver_to(const session_ref_t *target, const char *username,
+                               outseg_t *seg, int droppable, int store_offline)
+{
+    message_delivery_t md;
+    memset(&md, 0, sizeof(md));
+    snprintf(md.username, sizeof(md.username), "%s", username);
+    md.store_offline = store_offline;
+    md.droppable = droppable;
+    md.has_sender = session_sender(&md.sender);
+    md.seg = seg;
+    outseg_ref(seg);
+    server_post(target, message_deliver_task, &md, sizeof(md));
+}
+
+void handle_message(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr) {
+    const char *type = hdr->type ? hdr->type : "normal";
+    const char *local = hdr->to_local;
+    const char *domain = hdr->to_domain;
+
+    /* Target JID, parsed with the start tag */
+    if (!hdr->to_valid || local[0] == '\0') {
         stanza_send_error(s, stanza, "modify", "jid-malformed");
-        if (to_attr) xmlFree(to_attr);
-        if (type_attr) xmlFree(type_attr);
         return;
     }
 
     /* Verify domain is ours */
     if (strcmp(domain, g_config.domain) != 0) {
         stanza_send_error(s, stanza, "cancel", "item-not-found");
-        if (to_attr) xmlFree(to_attr);
-        if (type_attr) xmlFree(type_attr);
         return;
     }
 
-    /* Check user exists */
-    if (!user_exists(local)) {
+    /* No such user, as far as the user cache knows: no need to ask the
+     * store (nobody by that name can be online either) */
+    int known = user_cached(local);
+    if (known == 0) {
         stanza_send_error(s, stanza, "cancel", "item-not-found");
-        if (to_attr) xmlFree(to_attr);
-        if (type_attr) xmlFree(type_attr);
         return;
     }
 
-    /* Set from to sender's full JID */
-    char from_jid[768];
-    jid_full(s->jid_local, s->jid_domain, s->jid_resource,
-             from_jid, sizeof(from_jid));
-    xmlSetProp(stanza, (const xmlChar *)"from", (const xmlChar *)from_jid);
+    /* From the sender's full JID */
+    outseg_t *seg = stanza_wire(s, stanza);
+    if (!seg) {
+        log_write(LOG_ERROR, "Out of memory relaying message from fd %d", s->fd);
+        return;
+    }
 
     /* Look up recipient */
-    char bare[512];
-    jid_bare(local, domain, bare, sizeof(bare));
-    session_t *target = session_find_by_jid(bare);
+    session_ref_t target;
 
-    if (target) {
+    if (session_lookup(hdr->to, &target)) {
         /* Deliver immediately to connected user */
-        stanza_send(target, stanza);
-    } else if (strcmp(type, "error") != 0) {
-        /* Store offline (for chat/normal, never for error) */
-        message_store_offline(local, stanza);
+        message_deliver_to(&target, local, seg, stanza_droppable(stanza),
+                           strcmp(type, "error") != 0);
+    } else {
+        /* Store offline (for chat/normal, never for error), provided
+         * there is such a user; the sender hears if there is not. A
+         * user the cache knows of needs no checking. */
+        int store = strcmp(type, "error") != 0;
+        if (known < 0)
+            offline_submit(s, local, hdr->id, seg, store);
+        else if (store)
+            offline_submit(NULL, local, NULL, seg, 1);
     }
-
-    if (to_attr) xmlFree(to_attr);
-    if (type_attr) xmlFree(type_attr);
+    outseg_unref(seg);
 }
 
-void message_store_offline(const char *username, xmlNodePtr stanza) {
-    char dir[1280];
-    snprintf(dir, sizeof(dir), "%s/%s/offline", g_config.datadir, username);
-
-    /* Ensure offline directory exists */
-    mkdir(dir, 0755);
-
-    /* Find next sequence number */
-    int max_seq = 0;
-    DIR *dp = opendir(dir);
-    if (dp) {
-        struct dirent *de;
-        while ((de = readdir(dp)) != NULL) {
-            if (de->d_name[0] == '.')
-                continue;
-            int seq = atoi(de->d_name);
-            if (seq > max_seq)
-                max_seq = seq;
-        }
-        closedir(dp);
-    }
-
-    /* Add delay element (XEP-0203) */
-    xmlNodePtr delay = xmlNewChild(stanza, NULL, (const xmlChar *)"delay", NULL);
-    xmlNsPtr delay_ns = xmlNewNs(delay, (const xmlChar *)"urn:xmpp:delay", NULL);
-    xmlSetNs(delay, delay_ns);
-    xmlNewProp(delay, (const xmlChar *)"from", (const xmlChar *)g_config.domain);
-
+/* Storage thread: stamp the message and append it to the user's queue */
+static void offline_store_record(const char *username, const char *xml, size_t xml_len) {
+    /* Add delay element (XEP-0203) as the last child, ahead of the end
+     * tag; an empty <message .../> is given one */
     char stamp[32];
     time_t now = time(NULL);
     struct tm tm;
     gmtime_r(&now, &tm);
     strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", &tm);
-    xmlNewProp(delay, (const xmlChar *)"stamp", (const xmlChar *)stamp);
 
-    /* Serialize and write to file */
-    size_t xml_len;
-    char *xml = stanza_serialize(stanza, &xml_len);
-    if (!xml) {
-        log_write(LOG_ERROR, "Failed to serialize offline message for %s", username);
-        return;
+    char delay[512];
+    int delay_len = snprintf(delay, sizeof(delay),
+                             "<delay xmlns=\"urn:xmpp:delay\" from=\"%s\" stamp=\"%s\"/>",
+                             g_config.domain, stamp);
+
+    int empty = xml_len >= 2 && memcmp(xml + xml_len - 2, "/>", 2) == 0;
+    size_t head_len = empty ? xml_len - 2 : xml_len;
+    if (!empty) {
+        while (head_len > 0 && xml[head_len - 1] != '<')
+            head_len--;
+        if (head_len == 0) {
+            log_write(LOG_ERROR, "Malformed offline message for %s", username);
+            return;
+        }
+        head_len--;
     }
 
-    char path[1536];
-    snprintf(path, sizeof(path), "%s/%04d.xml", dir, max_seq + 1);
+    /* Written as one record: head, delay, end tag */
+    struct iovec iov[4];
+    int n = 0;
+    iov[n++] = (struct iovec){ (void *)xml, head_len };
+    if (empty)
+        iov[n++] = (struct iovec){ ">", 1 };
+    iov[n++] = (struct iovec){ delay, (size_t)delay_len };
+    if (empty)
+        iov[n++] = (struct iovec){ "</message>", 10 };
+    else
+        iov[n++] = (struct iovec){ (void *)(xml + head_len), xml_len - head_len };
 
-    FILE *fp = fopen(path, "w");
-    if (fp) {
-        fwrite(xml, 1, xml_len, fp);
-        fclose(fp);
-        log_write(LOG_INFO, "Stored offline message for %s: %s", username, path);
-    } else {
-        log_write(LOG_ERROR, "Failed to write offline message: %s", path);
-    }
+    int64_t seq = g_store->offline_append(username, iov, n);
+    if (seq >= 0)
+        log_write(LOG_INFO, "Stored offline message %lld for %s", (long long)seq, username);
+    else
+        log_write(LOG_ERROR, "Failed to store offline message for %s", username);
+}
 
-    free(xml);
+static void offline_store_work(void *arg, size_t len) {
+    (void)len;
+    offline_store_t *os = arg;
+    if (os->check && !user_exists(os->username))
+        os->missing = 1;
+    else if (os->store)
+        offline_store_record(os->username, os->seg->data, os->seg->len);
+    outseg_unref(os->seg);
+    os->seg = NULL;
 }
 
-void message_deliver_offline(session_t *s) {
-    char dir[1280];
-    snprintf(dir, sizeof(dir), "%s/%s/offline", g_config.datadir, s->jid_local);
+/* Back on the sender's reactor */
+static void offline_store_done(session_t *sender, void *arg, size_t len) {
+    (void)len;
+    offline_store_t *os = arg;
+    if (sender && os->missing)
+        stanza_error(sender, "message", os->has_id ? os->id : NULL,
+                     "cancel", "item-not-found");
+}
 
-    DIR *dp = opendir(dir);
-    if (!dp)
+/* Queue seg for username's offline queue. With a sender, check that the
+ * user exists and answer the message id with item-not-found if not;
+ * store is 0 to only check. */
+static void offline_submit(session_t *sender, const char *username, const char *id,
+                           outseg_t *seg, int store)
+{
+    size_t id_len = id ? strlen(id) : 0;
+    size_t len = sizeof(offline_store_t) + id_len + 1;
+    offline_store_t *os = calloc(1, len);
+    if (!os) {
+        log_write(LOG_ERROR, "Failed to allocate offline message for %s", username);
         return;
-
-    /* Collect filenames and sort */
-    char filenames[256][64];
-    int count = 0;
-
-    struct dirent *de;
-    while ((de = readdir(dp)) != NULL && count < 256) {
-        if (de->d_name[0] == '.')
-            continue;
-        size_t len = strlen(de->d_name);
-        if (len < 5 || strcmp(de->d_name + len - 4, ".xml") != 0)
-            continue;
-        snprintf(filenames[count], sizeof(filenames[count]), "%s", de->d_name);
-        count++;
     }
-    closedir(dp);
+    snprintf(os->username, sizeof(os->username), "%s", username);
+    os->check = sender != NULL;
+    os->store = store;
+    os->has_id = id != NULL;
+    if (id)
+        memcpy(os->id, id, id_len + 1);
+    os->seg = seg;
+    outseg_ref(seg);
 
-    if (count == 0)
-        return;
+    session_ref_t ref;
+    if (sender)
+        session_get_ref(sender, &ref);
+    if (storage_submit(os->username, sender ? &ref : NULL, offline_store_work,
+                       offline_store_done, os, len) < 0)
+        outseg_unref(seg);
+    free(os);
+}
 
-    /* Sort by filename (numeric order) */
-    for (int i = 0; i < count - 1; i++) {
-        for (int j = i + 1; j < count; j++) {
-            if (strcmp(filenames[i], filenames[j]) > 0) {
-                char tmp[64];
-                memcpy(tmp, filenames[i], sizeof(tmp));
-                memcpy(filenames[i], filenames[j], sizeof(tmp));
-                memcpy(filenames[j], tmp, sizeof(tmp));
-            }
+void message_store_offline(const char *username, outseg_t *seg) {
+    offline_submit(NULL, username, NULL, seg, 1);
+}
+
+/* --- Delivery on login --- */
+
+/* A user's pending messages, read on a storage thread: each a 4-byte
+ * length followed by the stanza. They stay queued until they have gone
+ * out, up to sequence number last. */
+typedef struct offline_batch {
+    char    username[256];
+    char   *data;
+    size_t  len;
+    size_t  cap;
+    int     count;
+    int64_t last;
+    int     short_mem;          /* stopped for want of memory */
+} offline_batch_t;
+
+static int offline_batch_add(void *ctx, const char *data, size_t len) {
+    offline_batch_t *b = ctx;
+    if (b->len + 4 + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + 4 + len)
+            cap *= 2;
+        char *p = realloc(b->data, cap);
+        if (!p) {
+            b->short_mem = 1;
+            return 1;
         }
+        b->data = p;
+        b->cap = cap;
     }
+    uint32_t n = (uint32_t)len;
+    memcpy(b->data + b->len, &n, 4);
+    memcpy(b->data + b->len + 4, data, len);
+    b->len += 4 + len;
+    b->count++;
+    return 0;
+}
+
+static void offline_drain_work(void *arg, size_t len) {
+    (void)len;
+    offline_batch_t *b = arg;
+    g_store->offline_peek(b->username, OFFLINE_DELIVER_MAX, offline_batch_add, b,
+                          &b->last);
+    if (b->short_mem)
+        log_write(LOG_ERROR, "Out of memory: only %d offline messages taken for %s",
+                  b->count, b->username);
+}
 
-    /* Deliver each message */
-    for (int i = 0; i < count; i++) {
-        char path[1536];
-        snprintf(path, sizeof(path), "%s/%s", dir, filenames[i]);
+/* Storage thread: the messages have gone out, off the queue with them */
+static void offline_ack_work(void *arg, size_t len) {
+    (void)len;
+    offline_batch_t *b = arg;
+    if (g_store->offline_ack(b->username, b->last) < 0)
+        log_write(LOG_ERROR, "Failed to remove delivered offline messages of %s",
+                  b->username);
+}
 
-        xmlDocPtr doc = xmlReadFile(path, NULL, 0);
-        if (!doc) {
-            log_write(LOG_WARN, "Failed to parse offline message: %s", path);
-            unlink(path);
-            continue;
-        }
+/* Back on the session's reactor. If the session went away the messages
+ * are left where they are for its next login. */
+static void offline_drain_done(session_t *s, void *arg, size_t len) {
+    (void)len;
+    offline_batch_t *b = arg;
+    if (!s) {
+        free(b->data);
+        return;
+    }
 
-        xmlNodePtr root = xmlDocGetRootElement(doc);
-        if (root) {
-            stanza_send(s, root);
-            log_write(LOG_INFO, "Delivered offline message to %s: %s",
-                      s->jid_local, filenames[i]);
-        }
+    for (size_t off = 0; off < b->len; ) {
+        uint32_t n;
+        memcpy(&n, b->data + off, 4);
+        session_write(s, b->data + off + 4, n);
+        off += 4 + n;
+    }
+    free(b->data);
+    b->data = NULL;
 
-        xmlFreeDoc(doc);
-        unlink(path);
+    /* They stay stored until the socket has taken the last byte of them:
+     * a session torn down with them still queued leaves them for the
+     * next login */
+    if (b->count > 0 && s->state != STATE_DISCONNECTED) {
+        s->offline_unacked = 1;
+        s->offline_last = b->last;
+        s->offline_sent_at = s->out_sent + s->out.len;
+        log_write(LOG_INFO, "Delivering %d offline messages to %s", b->count, s->jid_local);
     }
+    session_resume(s);
+}
+
+void message_offline_sent(session_t *s) {
+    offline_batch_t b;
+    memset(&b, 0, sizeof(b));
+    snprintf(b.username, sizeof(b.username), "%s", s->jid_local);
+    b.last = s->offline_last;
+    s->offline_unacked = 0;
+    storage_submit(b.username, NULL, offline_ack_work, NULL, &b, sizeof(b));
+}
+
+void message_deliver_offline(session_t *s) {
+    offline_batch_t b;
+    memset(&b, 0, sizeof(b));
+    snprintf(b.username, sizeof(b.username), "%s", s->jid_local);
+
+    /* The session's next stanzas wait for these to go out */
+    session_ref_t self;
+    session_get_ref(s, &self);
+    session_suspend(s);
+    if (storage_submit(b.username, &self, offline_drain_work, offline_drain_done,
+                       &b, sizeof(b)) < 0)
+        stream_send_error(s, "resource-constraint");
 }
@@ -0,0 +1,710 @@
+#define _GNU_SOURCE     /* pread, ftruncate, fdatasync */
+#include "offline.h"
+#include "config.h"
+#include "log.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#define OFFLINE_BUCKETS  256        /* index hash chains (power of two) */
+#define OFFLINE_HDR      8          /* record header: length, sequence */
+#define OFFLINE_CHUNK    65536      /* bytes read at a time */
+#define OFFLINE_MIGRATE_MAX 65536   /* NNNN.xml files moved per recovery */
+#define OFFLINE_OPEN_MAX 256        /* logs whose fd is kept open */
+
+/* In-memory index entry of one user's log. Entries live until shutdown,
+ * so the compactor may hold on to them. */
+typedef struct offline_log {
+    struct offline_log *next;           /* hash chain */
+    struct offline_log *next_compact;   /* compaction queue link */
+    pthread_mutex_t     lock;           /* the files and everything below */
+    char                username[256];
+    int                 fd;             /* the log kept open, or -1 */
+    int                 valid;          /* fields describe the log at ino/size */
+    ino_t               ino;
+    off_t               size;
+    off_t               cursor;         /* first undelivered record */
+    uint32_t            pending;        /* records from the cursor on */
+    uint32_t            next_seq;
+    long                migrated;       /* highest NNNN.xml in the log, or -1 */
+    int                 compact_queued;
+} offline_log_t;
+
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static offline_log_t  *index_buckets[OFFLINE_BUCKETS];
+static atomic_int      open_logs = 0;   /* entries with fd >= 0 */
+
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  compact_cond = PTHREAD_COND_INITIALIZER;
+static offline_log_t  *compact_queue = NULL;
+static int             compact_stop = 0;
+static int             compact_running = 0;
+static pthread_t       compact_thread;
+
+static void put_le32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static uint32_t get_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+           (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void offline_path(char *buf, size_t size, const char *username,
+                         const char *name)
+{
+    snprintf(buf, size, "%s/%s/offline%s%s", g_config.datadir, username,
+             name ? "/" : "", name ? name : "");
+}
+
+/* The index entry for username, created on first use */
+static offline_log_t *log_get(const char *username) {
+    uint32_t h = 2166136261u;
+    for (const char *p = username; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    offline_log_t **head = &index_buckets[h & (OFFLINE_BUCKETS - 1)];
+
+    pthread_mutex_lock(&index_lock);
+    offline_log_t *l;
+    for (l = *head; l; l = l->next)
+        if (strcmp(l->username, username) == 0)
+            break;
+    if (!l && (l = calloc(1, sizeof(*l))) != NULL) {
+        pthread_mutex_init(&l->lock, NULL);
+        snprintf(l->username, sizeof(l->username), "%s", username);
+        l->fd = -1;
+        l->migrated = -1;
+        l->next = *head;
+        *head = l;
+    }
+    pthread_mutex_unlock(&index_lock);
+    if (!l)
+        log_write(LOG_ERROR, "Out of memory indexing offline log of %s", username);
+    return l;
+}
+
+/* Persist the cursor, the next sequence number and the highest old file
+ * migrated into the log (a third field, absent from indexes written
+ * before there was one). Written aside, synced and
+ * renamed so that a crash leaves the old index or the new one; the log
+ * it refers to must be on disk already. Returns -1 on error. */
+static int index_save(const offline_log_t *l) {
+    char dir[1536], path[1536], tmp[1600];
+    offline_path(dir, sizeof(dir), l->username, NULL);
+    offline_path(path, sizeof(path), l->username, "messages.idx");
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        log_write(LOG_ERROR, "Failed to write offline index: %s", tmp);
+        return -1;
+    }
+    fprintf(fp, "%lld %u %ld\n", (long long)l->cursor, l->next_seq, l->migrated);
+    int ok = fflush(fp) == 0 && fdatasync(fileno(fp)) == 0;
+    if (fclose(fp) != 0 || !ok || rename(tmp, path) < 0 || fsync_path(dir) < 0) {
+        log_write(LOG_ERROR, "Failed to write offline index: %s", path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static void index_load(offline_log_t *l) {
+    char path[1536];
+    offline_path(path, sizeof(path), l->username, "messages.idx");
+    l->cursor = 0;
+    l->next_seq = 1;
+    l->migrated = -1;
+
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return;
+    long long cursor;
+    unsigned seq;
+    long migrated;
+    int n = fscanf(fp, "%lld %u %ld", &cursor, &seq, &migrated);
+    if (n >= 2 && cursor >= 0) {
+        l->cursor = (off_t)cursor;
+        l->next_seq = seq;
+        if (n == 3 && migrated >= 0)
+            l->migrated = migrated;
+    }
+    fclose(fp);
+}
+
+/* Append one record at the end of the log, which fd has open for
+ * appending; the caller syncs it. Returns -1 (the log left as it was)
+ * on error. */
+static int record_append(offline_log_t *l, int fd, const struct iovec *iov,
+                         int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if (len > OFFLINE_MAX_RECORD) {
+        log_write(LOG_WARN, "Offline message for %s too large (%zu bytes)",
+                  l->username, len);
+        return -1;
+    }
+
+    unsigned char hdr[OFFLINE_HDR];
+    put_le32(hdr, (uint32_t)len);
+    put_le32(hdr + 4, l->next_seq);
+
+    struct iovec v[8];
+    if (iovcnt > 7)
+        return -1;
+    v[0].iov_base = hdr;
+    v[0].iov_len = sizeof(hdr);
+    memcpy(v + 1, iov, (size_t)iovcnt * sizeof(*iov));
+
+    ssize_t n = writev(fd, v, iovcnt + 1);
+    if (n != (ssize_t)(sizeof(hdr) + len)) {
+        log_write(LOG_ERROR, "Failed to append to offline log of %s: %s",
+                  l->username, n < 0 ? strerror(errno) : "short write");
+        if (n > 0 && ftruncate(fd, l->size) < 0)
+            log_write(LOG_ERROR, "Failed to drop partial offline record of %s",
+                      l->username);
+        return -1;
+    }
+    l->size += (off_t)(sizeof(hdr) + len);
+    l->pending++;
+    l->next_seq++;
+    return 0;
+}
+
+typedef struct old_file {
+    long seq;
+    int  moved;                 /* in the log, to be unlinked once recorded */
+    char name[64];
+} old_file_t;
+
+static int cmp_old_file(const void *a, const void *b) {
+    long x = ((const old_file_t *)a)->seq, y = ((const old_file_t *)b)->seq;
+    return (x > y) - (x < y);
+}
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/* Move a queue kept as NNNN.xml files, one per message, into the log,
+ * lowest first. Files at or below l->migrated are in the log already
+ * (the last run stopped before unlinking them) and only go; the others
+ * are appended, at most OFFLINE_MIGRATE_MAX of them, the rest left for
+ * the next recovery. l->migrated is saved with the log synced before
+ * any file goes, so an interrupted run is taken up where it stopped. */
+static void migrate_files(offline_log_t *l, int fd) {
+    char dir[1536];
+    offline_path(dir, sizeof(dir), l->username, NULL);
+    DIR *dp = opendir(dir);
+    if (!dp)
+        return;
+
+    old_file_t *files = NULL;
+    size_t count = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL) {
+        char *end;
+        long seq = strtol(de->d_name, &end, 10);
+        size_t len = strlen(de->d_name);
+        if (end == de->d_name || strcmp(end, ".xml") != 0 || seq < 0 ||
+            len >= sizeof(files->name))
+            continue;
+        if (count == cap) {
+            size_t ncap = cap ? cap * 2 : 16;
+            old_file_t *n = realloc(files, ncap * sizeof(*n));
+            if (!n)
+                break;
+            files = n;
+            cap = ncap;
+        }
+        files[count].seq = seq;
+        files[count].moved = 0;
+        memcpy(files[count].name, de->d_name, len + 1);
+        count++;
+    }
+    closedir(dp);
+
+    char *data = count ? malloc(OFFLINE_MAX_RECORD) : NULL;
+    if (!data) {
+        free(files);
+        return;
+    }
+    qsort(files, count, sizeof(*files), cmp_old_file);
+
+    size_t moved = 0, left = 0;
+    long last = l->migrated;
+    for (size_t i = 0; i < count; i++) {
+        char path[1600];
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i].name);
+        if (files[i].seq <= l->migrated) {
+            unlink(path);
+            continue;
+        }
+        if (moved == OFFLINE_MIGRATE_MAX) {
+            left = count - i;
+            break;
+        }
+        FILE *fp = fopen(path, "r");
+        if (!fp) {
+            log_write(LOG_ERROR, "Failed to read offline message to migrate: %s", path);
+            break;
+        }
+        size_t len = fread(data, 1, OFFLINE_MAX_RECORD, fp);
+        int whole = feof(fp);
+        fclose(fp);
+        /* Could never be stored nor delivered: it goes with the rest */
+        if (!whole) {
+            log_write(LOG_WARN, "Offline message too large to migrate, dropped: %s",
+                      path);
+            files[i].moved = 1;
+            last = files[i].seq;
+            continue;
+        }
+
+        /* The stanza alone: the files may carry an XML declaration */
+        const char *p = data, *end = data + len;
+        while (p < end && is_space(*p))
+            p++;
+        if (end - p > 5 && memcmp(p, "<?xml", 5) == 0) {
+            const char *q = memchr(p, '>', (size_t)(end - p));
+            p = q ? q + 1 : end;
+        }
+        while (p < end && is_space(*p))
+            p++;
+        while (end > p && is_space(end[-1]))
+            end--;
+
+        if (end > p) {
+            struct iovec v = { (void *)p, (size_t)(end - p) };
+            if (record_append(l, fd, &v, 1) < 0)
+                break;
+        }
+        files[i].moved = 1;
+        last = files[i].seq;
+        moved++;
+    }
+    free(data);
+
+    /* The files go only once the log holding them is on disk and the
+     * index says they are in it */
+    if (last == l->migrated) {
+        free(files);
+        return;
+    }
+    if (moved > 0 && fdatasync(fd) < 0) {
+        log_write(LOG_ERROR, "Failed to sync offline log of %s: %s",
+                  l->username, strerror(errno));
+        free(files);
+        return;
+    }
+    l->migrated = last;
+    if (index_save(l) == 0) {
+        for (size_t i = 0; i < count; i++) {
+            char path[1600];
+            snprintf(path, sizeof(path), "%s/%s", dir, files[i].name);
+            if (files[i].moved)
+                unlink(path);
+        }
+    }
+    free(files);
+    log_write(LOG_INFO, "Migrated %zu offline messages of %s into the log%s",
+              moved, l->username, left ? ", more on the next recovery" : "");
+}
+
+/* Rebuild the index entry from the log (and move any old files into it),
+ * dropping a record torn by a crash */
+static void log_recover(offline_log_t *l, int fd, const struct stat *st) {
+    index_load(l);
+    l->size = st->st_size;
+    l->pending = 0;
+    if (l->cursor > l->size)
+        l->cursor = 0;
+
+    off_t off = l->cursor;
+    uint32_t last_seq = 0;
+    while (off + OFFLINE_HDR <= l->size) {
+        unsigned char hdr[OFFLINE_HDR];
+        if (pread(fd, hdr, sizeof(hdr), off) != (ssize_t)sizeof(hdr))
+            break;
+        uint32_t len = get_le32(hdr);
+        if (len > OFFLINE_MAX_RECORD || off + OFFLINE_HDR + (off_t)len > l->size)
+            break;
+        last_seq = get_le32(hdr + 4);
+        l->pending++;
+        off += OFFLINE_HDR + (off_t)len;
+    }
+    if (off != l->size) {
+        log_write(LOG_WARN, "Offline log of %s: dropping %lld bytes of torn record",
+                  l->username, (long long)(l->size - off));
+        if (ftruncate(fd, off) == 0)
+            l->size = off;
+    }
+    if (last_seq >= l->next_seq)
+        l->next_seq = last_seq + 1;
+    if (l->next_seq == 0)
+        l->next_seq = 1;
+
+    migrate_files(l, fd);
+
+    struct stat now;
+    l->ino = fstat(fd, &now) == 0 ? now.st_ino : st->st_ino;
+    l->valid = 1;
+}
+
+static void log_drop_fd(offline_log_t *l) {
+    if (l->fd >= 0) {
+        close(l->fd);
+        l->fd = -1;
+        atomic_fetch_sub(&open_logs, 1);
+    }
+}
+
+/* Open the log for appending and reading, creating it if need be, with
+ * the index entry brought up to date. The fd is kept in l->fd while
+ * fewer than OFFLINE_OPEN_MAX logs are open, and used again as long as
+ * the path still names the same, still linked, file. Called with
+ * l->lock held; hand the fd back with log_release. */
+static int log_open(offline_log_t *l) {
+    char dir[1536], path[1536];
+    offline_path(dir, sizeof(dir), l->username, NULL);
+    offline_path(path, sizeof(path), l->username, "messages.log");
+
+    struct stat st, fst;
+    if (l->fd >= 0) {
+        if (l->valid && stat(path, &st) == 0 && st.st_ino == l->ino &&
+            fstat(l->fd, &fst) == 0 && fst.st_ino == st.st_ino && fst.st_nlink > 0) {
+            if (l->size != st.st_size)
+                log_recover(l, l->fd, &st);
+            return l->fd;
+        }
+        log_drop_fd(l);
+    }
+
+    int fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) {
+        /* New queue: the directory entries have to last as the log does */
+        char userdir[1536];
+        snprintf(userdir, sizeof(userdir), "%s/%s", g_config.datadir, l->username);
+        mkdir(dir, 0755);
+        fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (fd >= 0 && (fsync_path(dir) < 0 || fsync_path(userdir) < 0)) {
+            log_write(LOG_ERROR, "Failed to sync %s: %s", dir, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    if (fd < 0) {
+        log_write(LOG_ERROR, "Failed to open offline log %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        log_write(LOG_ERROR, "Failed to stat offline log %s", path);
+        close(fd);
+        return -1;
+    }
+    if (!l->valid || l->ino != st.st_ino || l->size != st.st_size)
+        log_recover(l, fd, &st);
+
+    if (atomic_fetch_add(&open_logs, 1) < OFFLINE_OPEN_MAX)
+        l->fd = fd;
+    else
+        atomic_fetch_sub(&open_logs, 1);
+    return fd;
+}
+
+/* Done with an fd from log_open */
+static void log_release(offline_log_t *l, int fd) {
+    if (fd != l->fd)
+        close(fd);
+}
+
+static void compact_enqueue(offline_log_t *l) {
+    if (l->compact_queued)
+        return;
+    l->compact_queued = 1;
+    pthread_mutex_lock(&compact_lock);
+    l->next_compact = compact_queue;
+    compact_queue = l;
+    pthread_cond_signal(&compact_cond);
+    pthread_mutex_unlock(&compact_lock);
+}
+
+int64_t offline_append(const char *username, const struct iovec *iov, int iovcnt) {
+    offline_log_t *l = log_get(username);
+    if (!l)
+        return -1;
+
+    pthread_mutex_lock(&l->lock);
+    int64_t seq = -1;
+    int fd = log_open(l);
+    if (fd >= 0) {
+        off_t before = l->size;
+        seq = l->next_seq;
+        if (record_append(l, fd, iov, iovcnt) < 0) {
+            seq = -1;
+        } else if (fdatasync(fd) < 0) {
+            /* Not known to be on disk, so not stored: take it back */
+            log_write(LOG_ERROR, "Failed to sync offline log of %s: %s",
+                      l->username, strerror(errno));
+            if (ftruncate(fd, before) == 0) {
+                l->size = before;
+                l->pending--;
+                l->next_seq--;
+            } else {
+                l->valid = 0;
+            }
+            seq = -1;
+        }
+        log_release(l, fd);
+    }
+    pthread_mutex_unlock(&l->lock);
+    return seq;
+}
+
+int offline_peek(const char *username, int max, offline_fn fn, void *ctx,
+                 int64_t *last)
+{
+    offline_log_t *l = log_get(username);
+    if (!l)
+        return -1;
+
+    pthread_mutex_lock(&l->lock);
+    int fd = log_open(l);
+    if (fd < 0) {
+        pthread_mutex_unlock(&l->lock);
+        return -1;
+    }
+
+    int taken = 0;
+    char *buf = NULL;
+    size_t cap = 0, have = 0, at = 0;   /* buf[at, have) is unparsed */
+    off_t off = l->cursor, next_read = l->cursor;
+
+    while (taken < max && off < l->size) {
+        /* Enough of the log in buf for the next record's header and body */
+        size_t need = OFFLINE_HDR;
+        if (have - at >= OFFLINE_HDR)
+            need += get_le32((unsigned char *)buf + at);
+        if (have - at < need) {
+            memmove(buf, buf + at, have - at);
+            have -= at;
+            at = 0;
+            size_t want = need > OFFLINE_CHUNK ? need : OFFLINE_CHUNK;
+            if (want > cap) {
+                char *n = realloc(buf, want);
+                if (!n) {
+                    log_write(LOG_ERROR, "Out of memory reading offline log of %s",
+                              l->username);
+                    break;
+                }
+                buf = n;
+                cap = want;
+            }
+            ssize_t n = pread(fd, buf + have, cap - have, next_read);
+            if (n <= 0) {
+                log_write(LOG_ERROR, "Failed to read offline log of %s", l->username);
+                break;
+            }
+            have += (size_t)n;
+            next_read += n;
+            continue;
+        }
+
+        if (fn(ctx, buf + at + OFFLINE_HDR, need - OFFLINE_HDR))
+            break;
+        *last = get_le32((unsigned char *)buf + at + 4);
+        at += need;
+        off += (off_t)need;
+        taken++;
+    }
+    free(buf);
+    log_release(l, fd);
+    pthread_mutex_unlock(&l->lock);
+    return taken;
+}
+
+/* Whether sequence number a comes after b, allowing for wrap-around */
+static int seq_after(uint32_t a, uint32_t b) {
+    return (uint32_t)(a - b - 1) < 0x80000000u;
+}
+
+int offline_ack(const char *username, int64_t last) {
+    offline_log_t *l = log_get(username);
+    if (!l)
+        return -1;
+
+    pthread_mutex_lock(&l->lock);
+    int fd = log_open(l);
+    if (fd < 0) {
+        pthread_mutex_unlock(&l->lock);
+        return -1;
+    }
+
+    /* Step over the records from the cursor up to last */
+    int removed = 0;
+    off_t off = l->cursor;
+    while (off + OFFLINE_HDR <= l->size) {
+        unsigned char hdr[OFFLINE_HDR];
+        if (pread(fd, hdr, sizeof(hdr), off) != (ssize_t)sizeof(hdr)) {
+            log_write(LOG_ERROR, "Failed to read offline log of %s", l->username);
+            break;
+        }
+        if (seq_after(get_le32(hdr + 4), (uint32_t)last))
+            break;
+        off += OFFLINE_HDR + (off_t)get_le32(hdr);
+        removed++;
+    }
+
+    if (removed > 0) {
+        l->cursor = off;
+        l->pending -= (uint32_t)removed;
+        if (l->cursor == l->size) {
+            /* Caught up: start the log over. The empty log is synced
+             * before the index says so, or a crash in between could
+             * leave a cursor of 0 on the old records. */
+            if (ftruncate(fd, 0) == 0 && fdatasync(fd) == 0) {
+                l->size = l->cursor = 0;
+                l->pending = 0;
+            }
+        } else if (l->cursor >= OFFLINE_COMPACT_MIN && l->cursor * 2 >= l->size) {
+            compact_enqueue(l);
+        }
+        index_save(l);
+    }
+    log_release(l, fd);
+    pthread_mutex_unlock(&l->lock);
+    return removed;
+}
+
+/* Rewrite the log without its delivered prefix */
+static void compact(offline_log_t *l) {
+    pthread_mutex_lock(&l->lock);
+    l->compact_queued = 0;
+    int fd = log_open(l);
+    if (fd < 0 || l->cursor == 0) {
+        if (fd >= 0)
+            log_release(l, fd);
+        pthread_mutex_unlock(&l->lock);
+        return;
+    }
+
+    char path[1536], tmp[1600];
+    offline_path(path, sizeof(path), l->username, "messages.log");
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    char *buf = malloc(OFFLINE_CHUNK);
+    off_t off = l->cursor;
+    int ok = out >= 0 && buf;
+    while (ok && off < l->size) {
+        ssize_t n = pread(fd, buf, OFFLINE_CHUNK, off);
+        ok = n > 0 && write(out, buf, (size_t)n) == n;
+        off += n > 0 ? n : 0;
+    }
+    free(buf);
+    if (ok && fdatasync(out) < 0)
+        ok = 0;
+    if (out >= 0 && close(out) < 0)
+        ok = 0;
+
+    if (ok) {
+        /* The new log is on disk before the index goes, and the index
+         * before the rename: a crash in between then costs delivered
+         * messages being sent again, never a cursor into the middle of
+         * the new log */
+        char dir[1536];
+        offline_path(dir, sizeof(dir), l->username, NULL);
+        off_t dead = l->cursor;
+        l->cursor = 0;
+        if (index_save(l) == 0 && rename(tmp, path) == 0) {
+            if (fsync_path(dir) < 0)
+                log_write(LOG_ERROR, "Failed to sync %s: %s", dir, strerror(errno));
+            /* The fd held on to is the old log now */
+            struct stat st;
+            log_release(l, fd);
+            log_drop_fd(l);
+            fd = -1;
+            if (stat(path, &st) == 0) {
+                l->ino = st.st_ino;
+                l->size = st.st_size;
+            } else {
+                l->valid = 0;
+            }
+            log_write(LOG_DEBUG, "Compacted offline log of %s: %lld bytes reclaimed",
+                      l->username, (long long)dead);
+        } else {
+            l->cursor = dead;
+            index_save(l);
+            ok = 0;
+        }
+    }
+    if (!ok) {
+        log_write(LOG_ERROR, "Failed to compact offline log %s", path);
+        unlink(tmp);
+    }
+    if (fd >= 0)
+        log_release(l, fd);
+    pthread_mutex_unlock(&l->lock);
+}
+
+static void *compact_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&compact_lock);
+    for (;;) {
+        while (!compact_queue && !compact_stop)
+            pthread_cond_wait(&compact_cond, &compact_lock);
+        if (compact_stop)
+            break;
+        offline_log_t *l = compact_queue;
+        compact_queue = l->next_compact;
+        pthread_mutex_unlock(&compact_lock);
+        compact(l);
+        pthread_mutex_lock(&compact_lock);
+    }
+    pthread_mutex_unlock(&compact_lock);
+    return NULL;
+}
+
+int offline_init(void) {
+    compact_stop = 0;
+    if (pthread_create(&compact_thread, NULL, compact_main, NULL) != 0) {
+        log_write(LOG_ERROR, "Failed to start offline log compaction thread");
+        return -1;
+    }
+    compact_running = 1;
+    return 0;
+}
+
+void offline_shutdown(void) {
+    if (compact_running) {
+        pthread_mutex_lock(&compact_lock);
+        compact_stop = 1;
+        pthread_cond_signal(&compact_cond);
+        pthread_mutex_unlock(&compact_lock);
+        pthread_join(compact_thread, NULL);
+        compact_running = 0;
+    }
+    compact_queue = NULL;
+
+    for (int i = 0; i < OFFLINE_BUCKETS; i++) {
+        while (index_buckets[i]) {
+            offline_log_t *l = index_buckets[i];
+            index_buckets[i] = l->next;
+            log_drop_fd(l);
+            pthread_mutex_destroy(&l->lock);
+            free(l);
+        }
+    }
+}
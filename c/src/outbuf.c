@@ -0,0 +1,155 @@
+#include "outbuf.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define OUTSEG_DATA_SIZE (OUTBUF_SEG_SIZE - sizeof(outseg_t))
+
+static outseg_t *outseg_alloc(size_t cap) {
+    outseg_t *seg = malloc(sizeof(*seg) + cap);
+    if (!seg)
+        return NULL;
+    atomic_init(&seg->refs, 1);
+    seg->shared = 0;
+    seg->len = 0;
+    seg->cap = cap;
+    return seg;
+}
+
+outseg_t *outseg_new(const char *data, size_t len) {
+    outseg_t *seg = outseg_reserve(len);
+    if (seg)
+        memcpy(seg->data, data, len);
+    return seg;
+}
+
+outseg_t *outseg_reserve(size_t len) {
+    outseg_t *seg = outseg_alloc(len);
+    if (!seg)
+        return NULL;
+    seg->len = len;
+    seg->shared = 1;
+    return seg;
+}
+
+void outseg_ref(outseg_t *seg) {
+    atomic_fetch_add_explicit(&seg->refs, 1, memory_order_relaxed);
+}
+
+void outseg_unref(outseg_t *seg) {
+    if (seg && atomic_fetch_sub_explicit(&seg->refs, 1, memory_order_acq_rel) == 1)
+        free(seg);
+}
+
+static int outbuf_push(outbuf_t *ob, outseg_t *seg) {
+    outbuf_node_t *node = malloc(sizeof(*node));
+    if (!node)
+        return -1;
+    node->next = NULL;
+    node->seg = seg;
+    node->off = 0;
+    if (ob->tail)
+        ob->tail->next = node;
+    else
+        ob->head = node;
+    ob->tail = node;
+    return 0;
+}
+
+int outbuf_append(outbuf_t *ob, const char *data, size_t len) {
+    while (len > 0) {
+        outseg_t *seg = ob->tail ? ob->tail->seg : NULL;
+
+        /* Start a new segment when the tail is full or not ours to fill */
+        if (!seg || seg->shared || seg->len == seg->cap) {
+            seg = outseg_alloc(OUTSEG_DATA_SIZE);
+            if (!seg)
+                return -1;
+            if (outbuf_push(ob, seg) < 0) {
+                free(seg);
+                return -1;
+            }
+        }
+
+        size_t n = seg->cap - seg->len;
+        if (n > len)
+            n = len;
+        memcpy(seg->data + seg->len, data, n);
+        seg->len += n;
+        ob->len += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+char *outbuf_reserve(outbuf_t *ob, size_t len) {
+    outseg_t *seg = ob->tail ? ob->tail->seg : NULL;
+
+    /* Unlike outbuf_append the bytes cannot straddle two segments */
+    if (!seg || seg->shared || seg->cap - seg->len < len) {
+        seg = outseg_alloc(len > OUTSEG_DATA_SIZE ? len : OUTSEG_DATA_SIZE);
+        if (!seg)
+            return NULL;
+        if (outbuf_push(ob, seg) < 0) {
+            free(seg);
+            return NULL;
+        }
+    }
+
+    char *p = seg->data + seg->len;
+    seg->len += len;
+    ob->len += len;
+    return p;
+}
+
+int outbuf_attach(outbuf_t *ob, outseg_t *seg) {
+    if (seg->len == 0)
+        return 0;
+    if (outbuf_push(ob, seg) < 0)
+        return -1;
+    outseg_ref(seg);
+    ob->len += seg->len;
+    return 0;
+}
+
+int outbuf_iov(const outbuf_t *ob, struct iovec *iov, int max) {
+    int n = 0;
+    for (outbuf_node_t *node = ob->head; node && n < max; node = node->next) {
+        if (node->off == node->seg->len)
+            continue;
+        iov[n].iov_base = node->seg->data + node->off;
+        iov[n].iov_len = node->seg->len - node->off;
+        n++;
+    }
+    return n;
+}
+
+void outbuf_consume(outbuf_t *ob, size_t n) {
+    ob->len -= n;
+    while (ob->head) {
+        outbuf_node_t *node = ob->head;
+        size_t avail = node->seg->len - node->off;
+        if (n < avail) {
+            node->off += n;
+            return;
+        }
+        n -= avail;
+
+        ob->head = node->next;
+        if (!ob->head)
+            ob->tail = NULL;
+        outseg_unref(node->seg);
+        free(node);
+    }
+}
+
+void outbuf_clear(outbuf_t *ob) {
+    while (ob->head) {
+        outbuf_node_t *node = ob->head;
+        ob->head = node->next;
+        outseg_unref(node->seg);
+        free(node);
+    }
+    ob->tail = NULL;
+    ob->len = 0;
+}
@@ -1,7 +1,9 @@
 #include "presence.h"
 #include "roster.h"
 #include "stanza.h"
+#include "template.h"
 #include "server.h"
+#include "storage.h"
 #include "config.h"
 #include "log.h"
 #include "xml.h"
@@ -20,28 +22,46 @@ static int sub_has_from(const char *sub) {
     return strcmp(sub, "from") == 0 || strcmp(sub, "both") == 0;
 }
 
+/* Build and deliver a <presence type=... from=... to=...> notification.
+ * Notifications are never droppable. */
+static void deliver_notification(const session_ref_t *target, const char *type,
+                                 const char *from, const char *to)
+{
+    outseg_t *seg = tmpl_seg(TMPL_PRESENCE, (const char *[]){ type, from, to });
+    if (!seg) {
+        log_write(LOG_ERROR, "Out of memory building presence notification");
+        return;
+    }
+    session_deliver_seg(target, seg, 0);
+    outseg_unref(seg);
+}
+
 /* --- Available Presence (initial or update) --- */
 
-static void presence_handle_available(session_t *s, xmlNodePtr stanza) {
+/* Runs on the contact's reactor: answer with the contact's current presence */
+static void presence_probe_task(session_t *contact, void *arg, size_t len) {
+    (void)len;
+    const session_ref_t *requester = arg;
+    if (contact && contact->available && contact->presence_stanza)
+        session_deliver_seg(requester, contact->presence_stanza, 1);
+}
+
+static void presence_handle_available(session_t *s, xml_node_t *stanza) {
     int is_initial = !s->available;
 
     s->available = 1;
 
-    /* Store a copy of the presence stanza */
-    if (s->presence_stanza)
-        xmlFreeNode(s->presence_stanza);
-    s->presence_stanza = xmlCopyNode(stanza, 1);
-
-    /* Set from attribute to our full JID */
-    char full_jid[768];
-    jid_full(s->jid_local, s->jid_domain, s->jid_resource,
-             full_jid, sizeof(full_jid));
-    xmlSetProp(s->presence_stanza, (const xmlChar *)"from",
-               (const xmlChar *)full_jid);
-
-    /* Load roster if not yet loaded */
-    if (!s->roster.loaded)
-        roster_load(s);
+    /* Keep the presence, from our full JID, past the stanza's arena. It is
+     * serialized once: every contact's queue references the same bytes,
+     * and an older copy lives on only while queues still hold it. */
+    outseg_t *seg = stanza_wire(s, stanza);
+    if (seg) {
+        if (s->presence_stanza)
+            outseg_unref(s->presence_stanza);
+        s->presence_stanza = seg;
+    } else {
+        log_write(LOG_ERROR, "Out of memory storing presence for fd %d", s->fd);
+    }
 
     /* Broadcast our presence to contacts with from/both subscription */
     for (int i = 0; i < s->roster.count; i++) {
@@ -49,33 +69,23 @@ static void presence_handle_available(session_t *s, xmlNodePtr stanza) {
         if (!sub_has_from(ri->subscription))
             continue;
 
-        /* Parse contact's bare JID to find their session */
-        char local[256], domain[256], resource[256];
-        jid_parse(ri->jid, local, sizeof(local), domain, sizeof(domain),
-                  resource, sizeof(resource));
-        char bare[512];
-        jid_bare(local, domain, bare, sizeof(bare));
-        session_t *contact = session_find_by_jid(bare);
-        if (contact) {
-            stanza_send(contact, s->presence_stanza);
-        }
+        session_ref_t contact;
+        if (s->presence_stanza && session_lookup(ri->jid, &contact))
+            session_deliver_seg(&contact, s->presence_stanza, 1);
     }
 
-    /* Receive contacts' presence (contacts with to/both subscription) */
+    /* Receive contacts' presence (contacts with to/both subscription).
+     * Each contact's presence lives on its own reactor, so ask it there. */
+    session_ref_t self;
+    session_get_ref(s, &self);
     for (int i = 0; i < s->roster.count; i++) {
         roster_item_t *ri = &s->roster.items[i];
         if (!sub_has_to(ri->subscription))
             continue;
 
-        char local[256], domain[256], resource[256];
-        jid_parse(ri->jid, local, sizeof(local), domain, sizeof(domain),
-                  resource, sizeof(resource));
-        char bare[512];
-        jid_bare(local, domain, bare, sizeof(bare));
-        session_t *contact = session_find_by_jid(bare);
-        if (contact && contact->available && contact->presence_stanza) {
-            stanza_send(s, contact->presence_stanza);
-        }
+        session_ref_t contact;
+        if (session_lookup(ri->jid, &contact))
+            server_post(&contact, presence_probe_task, &self, sizeof(self));
     }
 
     if (is_initial) {
@@ -89,7 +99,7 @@ static void presence_handle_available(session_t *s, xmlNodePtr stanza) {
 
 /* --- Unavailable Presence --- */
 
-static void presence_handle_unavailable(session_t *s, xmlNodePtr stanza) {
+static void presence_handle_unavailable(session_t *s, xml_node_t *stanza) {
     (void)stanza;
     presence_broadcast_unavailable(s);
     s->available = 0;
@@ -99,49 +109,213 @@ void presence_broadcast_unavailable(session_t *s) {
     if (!s->available && !s->initial_presence_sent)
         return;
 
+    /* Presence was never handled, so no contact has heard from us */
+    if (!s->roster.loaded) {
+        s->available = 0;
+        return;
+    }
+
     char full_jid[768];
     jid_full(s->jid_local, s->jid_domain, s->jid_resource,
              full_jid, sizeof(full_jid));
 
-    xmlNodePtr pres = xmlNewNode(NULL, (const xmlChar *)"presence");
-    xmlNewProp(pres, (const xmlChar *)"type", (const xmlChar *)"unavailable");
-    xmlNewProp(pres, (const xmlChar *)"from", (const xmlChar *)full_jid);
-
-    if (!s->roster.loaded)
-        roster_load(s);
+    /* Rendered once, the same bytes go to every contact */
+    outseg_t *pres = tmpl_seg(TMPL_PRESENCE,
+                              (const char *[]){ "unavailable", full_jid, NULL });
+    if (!pres) {
+        log_write(LOG_ERROR, "Out of memory building presence for %s", full_jid);
+        s->available = 0;
+        return;
+    }
 
+    session_ref_t self;
+    session_get_ref(s, &self);
     for (int i = 0; i < s->roster.count; i++) {
         roster_item_t *ri = &s->roster.items[i];
         if (!sub_has_from(ri->subscription))
             continue;
 
-        char local[256], domain[256], resource[256];
-        jid_parse(ri->jid, local, sizeof(local), domain, sizeof(domain),
-                  resource, sizeof(resource));
-        char bare[512];
-        jid_bare(local, domain, bare, sizeof(bare));
-        session_t *contact = session_find_by_jid(bare);
-        if (contact && contact != s) {
-            stanza_send(contact, pres);
-        }
+        session_ref_t contact;
+        if (session_lookup(ri->jid, &contact) && !session_ref_equal(&contact, &self))
+            session_deliver_seg(&contact, pres, 0);
     }
 
-    xmlFreeNode(pres);
+    outseg_unref(pres);
     s->available = 0;
 }
 
+/* --- Contact side of subscription changes --- */
+
+enum {
+    CONTACT_SUBSCRIBED = 0,     /* none->to, from->both, clear ask */
+    CONTACT_UNSUBSCRIBE,        /* from->none, both->to */
+    CONTACT_UNSUBSCRIBED        /* to->none, both->from, clear ask */
+};
+
+/*
+ * The contact's half of a subscription change: update the contact's roster
+ * entry for the sender and notify the contact. Runs on the reactor owning
+ * the contact's session, or inline (target == NULL) when it is offline.
+ */
+typedef struct contact_update {
+    int    op;
+    char   username[256];       /* contact's localpart, for the on-disk roster */
+    char   sender_bare[512];
+    char   target_bare[512];
+    char   sender_full[768];
+    int    sender_available;
+    int    online;              /* the contact has a session to notify */
+    outseg_t *presence;         /* sender's presence (subscribed), referenced */
+} contact_update_t;
+
+static void contact_update_item(roster_item_t *item, int op) {
+    const char *sub = item->subscription;
+    const char *next = NULL;
+
+    switch (op) {
+    case CONTACT_SUBSCRIBED:
+        if (strcmp(sub, "none") == 0)      next = "to";
+        else if (strcmp(sub, "from") == 0) next = "both";
+        item->ask_subscribe = 0;
+        break;
+    case CONTACT_UNSUBSCRIBE:
+        if (strcmp(sub, "from") == 0)      next = "none";
+        else if (strcmp(sub, "both") == 0) next = "to";
+        break;
+    case CONTACT_UNSUBSCRIBED:
+        if (strcmp(sub, "to") == 0)        next = "none";
+        else if (strcmp(sub, "both") == 0) next = "from";
+        item->ask_subscribe = 0;
+        break;
+    }
+    if (next)
+        snprintf(item->subscription, sizeof(item->subscription), "%s", next);
+}
+
+/* Notify the contact of the change, once its roster has it */
+static void contact_notify(session_t *target, contact_update_t *cu, int roster_cached) {
+    outseg_t *presence = cu->presence;
+    session_ref_t self;
+    session_get_ref(target, &self);
+
+    if (cu->op == CONTACT_SUBSCRIBED) {
+        /* Send sender's current presence, then the subscribed notification */
+        if (presence) {
+            session_write_seg(target, presence);
+            outseg_unref(presence);
+        }
+        deliver_notification(&self, "subscribed", cu->sender_bare, cu->target_bare);
+    } else if (roster_cached) {
+        deliver_notification(&self,
+            cu->op == CONTACT_UNSUBSCRIBE ? "unsubscribe" : "unsubscribed",
+            cu->sender_bare, cu->target_bare);
+
+        /* Send unavailable from sender */
+        if (cu->sender_available)
+            deliver_notification(&self, "unavailable", cu->sender_full, NULL);
+    }
+}
+
+/* Storage thread: the contact's roster as stored */
+static void contact_update_work(void *arg, size_t len) {
+    (void)len;
+    contact_update_t *cu = arg;
+
+    roster_t target_roster;
+    memset(&target_roster, 0, sizeof(target_roster));
+    roster_load_for_user(cu->username, &target_roster);
+    roster_item_t *item = roster_find_item(&target_roster, cu->sender_bare);
+    if (item) {
+        contact_update_item(item, cu->op);
+        roster_update_for_user(cu->username, ROSTER_SET, item);
+    }
+    roster_free(&target_roster);
+
+    /* Nobody to tell */
+    if (!cu->online && cu->presence)
+        outseg_unref(cu->presence);
+}
+
+/* Back on the contact's reactor. Its roster may have been loaded while
+ * the change was being stored, from before it: the change is applied to
+ * the cache as well, which does nothing if it is there already. */
+static void contact_update_done(session_t *target, void *arg, size_t len) {
+    (void)len;
+    contact_update_t *cu = arg;
+    if (!target) {
+        if (cu->presence)
+            outseg_unref(cu->presence);
+        return;
+    }
+
+    int roster_cached = target->roster.loaded;
+    if (roster_cached) {
+        roster_item_t *item = roster_find_item(&target->roster, cu->sender_bare);
+        if (item) {
+            contact_update_item(item, cu->op);
+            roster_save_item(target, ROSTER_SET, item);
+            roster_push(target, item);
+        }
+    }
+    contact_notify(target, cu, roster_cached);
+}
+
+static void contact_update_task(session_t *target, void *arg, size_t len) {
+    (void)len;
+    contact_update_t *cu = arg;
+
+    if (target && target->roster.loaded) {
+        /* Use the online session's roster */
+        roster_item_t *item = roster_find_item(&target->roster, cu->sender_bare);
+        if (item) {
+            contact_update_item(item, cu->op);
+            roster_save_item(target, ROSTER_SET, item);
+            roster_push(target, item);
+        }
+        contact_notify(target, cu, 1);
+        return;
+    }
+
+    /* Modify on disk, in line with the contact's other storage work */
+    session_ref_t ref;
+    cu->online = target != NULL;
+    if (target)
+        session_get_ref(target, &ref);
+    if (storage_submit(cu->username, target ? &ref : NULL, contact_update_work,
+                       contact_update_done, cu, sizeof(*cu)) < 0 && cu->presence)
+        outseg_unref(cu->presence);
+}
+
+static void post_contact_update(session_t *s, int op, const char *username,
+                                const char *sender_bare, const char *target_bare)
+{
+    contact_update_t *cu = calloc(1, sizeof(*cu));
+    if (!cu)
+        return;
+
+    cu->op = op;
+    snprintf(cu->username, sizeof(cu->username), "%s", username);
+    snprintf(cu->sender_bare, sizeof(cu->sender_bare), "%s", sender_bare);
+    snprintf(cu->target_bare, sizeof(cu->target_bare), "%s", target_bare);
+    jid_full(s->jid_local, s->jid_domain, s->jid_resource,
+             cu->sender_full, sizeof(cu->sender_full));
+    cu->sender_available = s->available;
+    if (op == CONTACT_SUBSCRIBED && s->available && s->presence_stanza) {
+        cu->presence = s->presence_stanza;
+        outseg_ref(cu->presence);
+    }
+
+    session_run_on(target_bare, contact_update_task, cu, sizeof(*cu));
+
+    free(cu);
+}
+
 /* --- Subscription: subscribe --- */
 
-static void presence_handle_subscribe(session_t *s, xmlNodePtr stanza, const char *to) {
+static void presence_handle_subscribe(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr) {
     (void)stanza;
-    char local[256], domain[256], resource[256];
-    jid_parse(to, local, sizeof(local), domain, sizeof(domain),
-              resource, sizeof(resource));
     char bare[512];
-    jid_bare(local, domain, bare, sizeof(bare));
-
-    if (!s->roster.loaded)
-        roster_load(s);
+    jid_bare(hdr->to_local, hdr->to_domain, bare, sizeof(bare));
 
     /* Ensure sender's roster has an entry for target */
     roster_item_t *item = roster_find_item(&s->roster, bare);
@@ -151,42 +325,33 @@ static void presence_handle_subscribe(session_t *s, xmlNodePtr stanza, const cha
     } else {
         item->ask_subscribe = 1;
     }
-    roster_save(s);
-    roster_push(s, item);
+    if (item) {
+        roster_save_item(s, ROSTER_SET, item);
+        roster_push(s, item);
+    }
 
     /* Deliver to target if online */
-    session_t *target = session_find_by_jid(bare);
-    if (target) {
+    session_ref_t target;
+    if (session_lookup(bare, &target)) {
         char from_bare[512];
         jid_bare(s->jid_local, s->jid_domain, from_bare, sizeof(from_bare));
-
-        xmlNodePtr sub = xmlNewNode(NULL, (const xmlChar *)"presence");
-        xmlNewProp(sub, (const xmlChar *)"type", (const xmlChar *)"subscribe");
-        xmlNewProp(sub, (const xmlChar *)"from", (const xmlChar *)from_bare);
-        xmlNewProp(sub, (const xmlChar *)"to", (const xmlChar *)bare);
-        stanza_send(target, sub);
-        xmlFreeNode(sub);
+        deliver_notification(&target, "subscribe", from_bare, bare);
     }
 }
 
 /* --- Subscription: subscribed (approve) --- */
 
-static void presence_handle_subscribed(session_t *s, xmlNodePtr stanza, const char *to) {
+static void presence_handle_subscribed(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr) {
     (void)stanza;
 
-    char local[256], domain[256], resource[256];
-    jid_parse(to, local, sizeof(local), domain, sizeof(domain),
-              resource, sizeof(resource));
+    const char *local = hdr->to_local;
     char target_bare[512];
-    jid_bare(local, domain, target_bare, sizeof(target_bare));
+    jid_bare(local, hdr->to_domain, target_bare, sizeof(target_bare));
 
     char sender_bare[512];
     jid_bare(s->jid_local, s->jid_domain, sender_bare, sizeof(sender_bare));
 
     /* Update sender's (bob's) roster: none->from, to->both */
-    if (!s->roster.loaded)
-        roster_load(s);
-
     roster_item_t *sender_item = roster_find_item(&s->roster, target_bare);
     if (!sender_item) {
         roster_add_item(&s->roster, target_bare, NULL, "from", 0);
@@ -197,74 +362,28 @@ static void presence_handle_subscribed(session_t *s, xmlNodePtr stanza, const ch
         else if (strcmp(sender_item->subscription, "to") == 0)
             snprintf(sender_item->subscription, sizeof(sender_item->subscription), "both");
     }
-    roster_save(s);
-    roster_push(s, sender_item);
-
-    /* Update target's (alice's) roster: none->to, from->both, clear ask */
-    session_t *target_session = session_find_by_jid(target_bare);
-    roster_t target_roster;
-    memset(&target_roster, 0, sizeof(target_roster));
-
-    if (target_session && target_session->roster.loaded) {
-        /* Use the online session's roster */
-        roster_item_t *target_item = roster_find_item(&target_session->roster, sender_bare);
-        if (target_item) {
-            if (strcmp(target_item->subscription, "none") == 0)
-                snprintf(target_item->subscription, sizeof(target_item->subscription), "to");
-            else if (strcmp(target_item->subscription, "from") == 0)
-                snprintf(target_item->subscription, sizeof(target_item->subscription), "both");
-            target_item->ask_subscribe = 0;
-        }
-        roster_save(target_session);
-        if (target_item)
-            roster_push(target_session, target_item);
-    } else {
-        /* Modify on disk */
-        roster_load_for_user(local, &target_roster);
-        roster_item_t *target_item = roster_find_item(&target_roster, sender_bare);
-        if (target_item) {
-            if (strcmp(target_item->subscription, "none") == 0)
-                snprintf(target_item->subscription, sizeof(target_item->subscription), "to");
-            else if (strcmp(target_item->subscription, "from") == 0)
-                snprintf(target_item->subscription, sizeof(target_item->subscription), "both");
-            target_item->ask_subscribe = 0;
-        }
-        roster_save_for_user(local, &target_roster);
+    if (sender_item) {
+        roster_save_item(s, ROSTER_SET, sender_item);
+        roster_push(s, sender_item);
     }
 
-    /* If target is online, send presence and subscribed notification */
-    if (target_session) {
-        /* Send sender's current presence to target */
-        if (s->available && s->presence_stanza)
-            stanza_send(target_session, s->presence_stanza);
-
-        /* Send subscribed notification */
-        xmlNodePtr notif = xmlNewNode(NULL, (const xmlChar *)"presence");
-        xmlNewProp(notif, (const xmlChar *)"type", (const xmlChar *)"subscribed");
-        xmlNewProp(notif, (const xmlChar *)"from", (const xmlChar *)sender_bare);
-        xmlNewProp(notif, (const xmlChar *)"to", (const xmlChar *)target_bare);
-        stanza_send(target_session, notif);
-        xmlFreeNode(notif);
-    }
+    /* Update target's (alice's) roster: none->to, from->both, clear ask;
+     * if target is online, send presence and subscribed notification */
+    post_contact_update(s, CONTACT_SUBSCRIBED, local, sender_bare, target_bare);
 }
 
 /* --- Subscription: unsubscribe --- */
 
-static void presence_handle_unsubscribe(session_t *s, xmlNodePtr stanza, const char *to) {
+static void presence_handle_unsubscribe(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr) {
     (void)stanza;
 
-    char local[256], domain[256], resource[256];
-    jid_parse(to, local, sizeof(local), domain, sizeof(domain),
-              resource, sizeof(resource));
+    const char *local = hdr->to_local;
     char target_bare[512];
-    jid_bare(local, domain, target_bare, sizeof(target_bare));
+    jid_bare(local, hdr->to_domain, target_bare, sizeof(target_bare));
     char sender_bare[512];
     jid_bare(s->jid_local, s->jid_domain, sender_bare, sizeof(sender_bare));
 
     /* Update sender's roster: to->none, both->from, clear ask */
-    if (!s->roster.loaded)
-        roster_load(s);
-
     roster_item_t *sender_item = roster_find_item(&s->roster, target_bare);
     if (sender_item) {
         if (strcmp(sender_item->subscription, "to") == 0)
@@ -272,147 +391,60 @@ static void presence_handle_unsubscribe(session_t *s, xmlNodePtr stanza, const c
         else if (strcmp(sender_item->subscription, "both") == 0)
             snprintf(sender_item->subscription, sizeof(sender_item->subscription), "from");
         sender_item->ask_subscribe = 0;
-        roster_save(s);
+        roster_save_item(s, ROSTER_SET, sender_item);
         roster_push(s, sender_item);
     }
 
     /* Update target's roster: from->none, both->to */
-    session_t *target_session = session_find_by_jid(target_bare);
-    if (target_session && target_session->roster.loaded) {
-        roster_item_t *target_item = roster_find_item(&target_session->roster, sender_bare);
-        if (target_item) {
-            if (strcmp(target_item->subscription, "from") == 0)
-                snprintf(target_item->subscription, sizeof(target_item->subscription), "none");
-            else if (strcmp(target_item->subscription, "both") == 0)
-                snprintf(target_item->subscription, sizeof(target_item->subscription), "to");
-            roster_save(target_session);
-            roster_push(target_session, target_item);
-        }
-
-        /* Deliver unsubscribe notification */
-        xmlNodePtr notif = xmlNewNode(NULL, (const xmlChar *)"presence");
-        xmlNewProp(notif, (const xmlChar *)"type", (const xmlChar *)"unsubscribe");
-        xmlNewProp(notif, (const xmlChar *)"from", (const xmlChar *)sender_bare);
-        xmlNewProp(notif, (const xmlChar *)"to", (const xmlChar *)target_bare);
-        stanza_send(target_session, notif);
-        xmlFreeNode(notif);
-
-        /* Send unavailable from sender */
-        if (s->available) {
-            char full_jid[768];
-            jid_full(s->jid_local, s->jid_domain, s->jid_resource,
-                     full_jid, sizeof(full_jid));
-            xmlNodePtr unavail = xmlNewNode(NULL, (const xmlChar *)"presence");
-            xmlNewProp(unavail, (const xmlChar *)"type", (const xmlChar *)"unavailable");
-            xmlNewProp(unavail, (const xmlChar *)"from", (const xmlChar *)full_jid);
-            stanza_send(target_session, unavail);
-            xmlFreeNode(unavail);
-        }
-    } else {
-        /* Offline: modify on disk */
-        roster_t target_roster;
-        memset(&target_roster, 0, sizeof(target_roster));
-        roster_load_for_user(local, &target_roster);
-        roster_item_t *target_item = roster_find_item(&target_roster, sender_bare);
-        if (target_item) {
-            if (strcmp(target_item->subscription, "from") == 0)
-                snprintf(target_item->subscription, sizeof(target_item->subscription), "none");
-            else if (strcmp(target_item->subscription, "both") == 0)
-                snprintf(target_item->subscription, sizeof(target_item->subscription), "to");
-            roster_save_for_user(local, &target_roster);
-        }
-    }
+    post_contact_update(s, CONTACT_UNSUBSCRIBE, local, sender_bare, target_bare);
 }
 
 /* --- Subscription: unsubscribed (deny/revoke) --- */
 
-static void presence_handle_unsubscribed(session_t *s, xmlNodePtr stanza, const char *to) {
+static void presence_handle_unsubscribed(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr) {
     (void)stanza;
 
-    char local[256], domain[256], resource[256];
-    jid_parse(to, local, sizeof(local), domain, sizeof(domain),
-              resource, sizeof(resource));
+    const char *local = hdr->to_local;
     char target_bare[512];
-    jid_bare(local, domain, target_bare, sizeof(target_bare));
+    jid_bare(local, hdr->to_domain, target_bare, sizeof(target_bare));
     char sender_bare[512];
     jid_bare(s->jid_local, s->jid_domain, sender_bare, sizeof(sender_bare));
 
     /* Update sender's roster: from->none, both->to */
-    if (!s->roster.loaded)
-        roster_load(s);
-
     roster_item_t *sender_item = roster_find_item(&s->roster, target_bare);
     if (sender_item) {
         if (strcmp(sender_item->subscription, "from") == 0)
             snprintf(sender_item->subscription, sizeof(sender_item->subscription), "none");
         else if (strcmp(sender_item->subscription, "both") == 0)
             snprintf(sender_item->subscription, sizeof(sender_item->subscription), "to");
-        roster_save(s);
+        roster_save_item(s, ROSTER_SET, sender_item);
         roster_push(s, sender_item);
     }
 
     /* Update target's roster: to->none, both->from, clear ask */
-    session_t *target_session = session_find_by_jid(target_bare);
-    if (target_session && target_session->roster.loaded) {
-        roster_item_t *target_item = roster_find_item(&target_session->roster, sender_bare);
-        if (target_item) {
-            if (strcmp(target_item->subscription, "to") == 0)
-                snprintf(target_item->subscription, sizeof(target_item->subscription), "none");
-            else if (strcmp(target_item->subscription, "both") == 0)
-                snprintf(target_item->subscription, sizeof(target_item->subscription), "from");
-            target_item->ask_subscribe = 0;
-            roster_save(target_session);
-            roster_push(target_session, target_item);
-        }
-
-        /* Deliver unsubscribed notification */
-        xmlNodePtr notif = xmlNewNode(NULL, (const xmlChar *)"presence");
-        xmlNewProp(notif, (const xmlChar *)"type", (const xmlChar *)"unsubscribed");
-        xmlNewProp(notif, (const xmlChar *)"from", (const xmlChar *)sender_bare);
-        xmlNewProp(notif, (const xmlChar *)"to", (const xmlChar *)target_bare);
-        stanza_send(target_session, notif);
-        xmlFreeNode(notif);
-
-        /* Send unavailable from sender */
-        if (s->available) {
-            char full_jid[768];
-            jid_full(s->jid_local, s->jid_domain, s->jid_resource,
-                     full_jid, sizeof(full_jid));
-            xmlNodePtr unavail = xmlNewNode(NULL, (const xmlChar *)"presence");
-            xmlNewProp(unavail, (const xmlChar *)"type", (const xmlChar *)"unavailable");
-            xmlNewProp(unavail, (const xmlChar *)"from", (const xmlChar *)full_jid);
-            stanza_send(target_session, unavail);
-            xmlFreeNode(unavail);
-        }
-    } else {
-        roster_t target_roster;
-        memset(&target_roster, 0, sizeof(target_roster));
-        roster_load_for_user(local, &target_roster);
-        roster_item_t *target_item = roster_find_item(&target_roster, sender_bare);
-        if (target_item) {
-            if (strcmp(target_item->subscription, "to") == 0)
-                snprintf(target_item->subscription, sizeof(target_item->subscription), "none");
-            else if (strcmp(target_item->subscription, "both") == 0)
-                snprintf(target_item->subscription, sizeof(target_item->subscription), "from");
-            target_item->ask_subscribe = 0;
-            roster_save_for_user(local, &target_roster);
-        }
-    }
+    post_contact_update(s, CONTACT_UNSUBSCRIBED, local, sender_bare, target_bare);
 }
 
 /* --- Pending subscribe re-delivery on login --- */
 
-void presence_redeliver_pending_subscribes(session_t *s) {
-    char our_bare[512];
-    jid_bare(s->jid_local, s->jid_domain, our_bare, sizeof(our_bare));
+typedef struct pending_scan {
+    char          our_bare[512];
+    session_ref_t requester;
+} pending_scan_t;
+
+/* Runs on every reactor: scan its sessions for roster entries pointing at
+ * the requester with ask=subscribe */
+static void pending_subscribes_task(void *arg, size_t len) {
+    (void)len;
+    pending_scan_t *ps = arg;
 
-    /* Scan all online sessions for roster entries pointing at us with ask=subscribe */
     session_t **sessions = server_get_sessions();
-    int nfds = server_get_nfds();
+    int nslots = server_get_nslots();
 
-    for (int i = 1; i < nfds; i++) {
+    for (int i = 0; i < nslots; i++) {
         session_t *other = sessions[i];
-        if (!other || other == s || other->jid_local[0] == '\0')
+        if (!other || other->serial == ps->requester.serial ||
+            other->jid_local[0] == '\0')
             continue;
         if (!other->roster.loaded)
             continue;
@@ -421,31 +453,34 @@ void presence_redeliver_pending_subscribes(session_t *s) {
             roster_item_t *ri = &other->roster.items[j];
             if (!ri->ask_subscribe)
                 continue;
-            if (strcmp(ri->jid, our_bare) != 0)
+            if (strcmp(ri->jid, ps->our_bare) != 0)
                 continue;
 
             /* This user has a pending subscribe to us — re-deliver */
             char from_bare[512];
             jid_bare(other->jid_local, other->jid_domain,
                      from_bare, sizeof(from_bare));
-
-            xmlNodePtr sub = xmlNewNode(NULL, (const xmlChar *)"presence");
-            xmlNewProp(sub, (const xmlChar *)"type", (const xmlChar *)"subscribe");
-            xmlNewProp(sub, (const xmlChar *)"from", (const xmlChar *)from_bare);
-            xmlNewProp(sub, (const xmlChar *)"to", (const xmlChar *)our_bare);
-            stanza_send(s, sub);
-            xmlFreeNode(sub);
+            deliver_notification(&ps->requester, "subscribe", from_bare, ps->our_bare);
         }
     }
 }
 
+void presence_redeliver_pending_subscribes(session_t *s) {
+    pending_scan_t ps;
+    jid_bare(s->jid_local, s->jid_domain, ps.our_bare, sizeof(ps.our_bare));
+    session_get_ref(s, &ps.requester);
+
+    server_post_all(pending_subscribes_task, &ps, sizeof(ps));
+}
+
 /* --- Main dispatcher --- */
 
-void handle_presence(session_t *s, xmlNodePtr stanza) {
-    xmlChar *type_attr = xmlGetProp(stanza, (const xmlChar *)"type");
-    xmlChar *to_attr   = xmlGetProp(stanza, (const xmlChar *)"to");
-    const char *type = type_attr ? (const char *)type_attr : "";
-    const char *to   = to_attr ? (const char *)to_attr : "";
+void handle_presence(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr) {
+    const char *type = hdr->type ? hdr->type : "";
+
+    /* Every kind works from the sender's roster */
+    if (!roster_ensure(s, stanza, hdr))
+        return;
 
     if (type[0] == '\0') {
         /* Available presence */
@@ -453,17 +488,14 @@ void handle_presence(session_t *s, xmlNodePtr stanza) {
     } else if (strcmp(type, "unavailable") == 0) {
         presence_handle_unavailable(s, stanza);
     } else if (strcmp(type, "subscribe") == 0) {
-        presence_handle_subscribe(s, stanza, to);
+        presence_handle_subscribe(s, stanza, hdr);
     } else if (strcmp(type, "subscribed") == 0) {
-        presence_handle_subscribed(s, stanza, to);
+        presence_handle_subscribed(s, stanza, hdr);
     } else if (strcmp(type, "unsubscribe") == 0) {
-        presence_handle_unsubscribe(s, stanza, to);
+        presence_handle_unsubscribe(s, stanza, hdr);
     } else if (strcmp(type, "unsubscribed") == 0) {
-        presence_handle_unsubscribed(s, stanza, to);
+        presence_handle_unsubscribed(s, stanza, hdr);
     } else {
         log_write(LOG_WARN, "Unknown presence type '%s' from fd %d", type, s->fd);
     }
-
-    if (type_attr) xmlFree(type_attr);
-    if (to_attr) xmlFree(to_attr);
 }
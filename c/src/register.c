@@ -1,77 +1,134 @@
 #include "register.h"
 #include "session.h"
 #include "stanza.h"
+#include "template.h"
 #include "user.h"
-#include "config.h"
+#include "storage.h"
+#include "stream.h"
 #include "log.h"
 #include "util.h"
 #include <string.h>
-#include <libxml/tree.h>
 
 static void send_result_iq(session_t *s, const char *id, int include_to) {
-    xmlNodePtr result = xmlNewNode(NULL, (const xmlChar *)"iq");
-    xmlNewProp(result, (const xmlChar *)"type", (const xmlChar *)"result");
-    if (id && id[0])
-        xmlNewProp(result, (const xmlChar *)"id", (const xmlChar *)id);
-    xmlNewProp(result, (const xmlChar *)"from", (const xmlChar *)g_config.domain);
+    const char *id_attr = id && id[0] ? id : NULL;
     if (include_to) {
         char full_jid[768];
         jid_full(s->jid_local, s->jid_domain, s->jid_resource,
                  full_jid, sizeof(full_jid));
-        xmlNewProp(result, (const xmlChar *)"to", (const xmlChar *)full_jid);
+        tmpl_send(s, TMPL_IQ_RESULT_FROM_TO, (const char *[]){ id_attr, full_jid });
+    } else {
+        tmpl_send(s, TMPL_IQ_RESULT_FROM, (const char *[]){ id_attr });
+    }
+}
+
+#define REGISTER_FIELD_MAX 1024     /* longest id, username or password + 1 */
+
+/* An account change on its way to the store, and its outcome */
+typedef struct register_job {
+    int  op;
+    char id[REGISTER_FIELD_MAX];
+    char username[REGISTER_FIELD_MAX];
+    char password[REGISTER_FIELD_MAX];
+    int  rc;
+} register_job_t;
+
+enum { REGISTER_CREATE, REGISTER_PASSWORD, REGISTER_DELETE };
+
+static void register_work(void *arg, size_t len) {
+    (void)len;
+    register_job_t *rj = arg;
+    switch (rj->op) {
+    case REGISTER_CREATE:
+        rj->rc = user_create(rj->username, rj->password);
+        break;
+    case REGISTER_PASSWORD:
+        rj->rc = user_change_password(rj->username, rj->password);
+        break;
+    case REGISTER_DELETE:
+        rj->rc = user_delete(rj->username);
+        break;
+    }
+}
+
+/* Back on the session's reactor: answer the IQ */
+static void register_done(session_t *s, void *arg, size_t len) {
+    (void)len;
+    register_job_t *rj = arg;
+    if (!s)
+        return;
+
+    const char *id = rj->id[0] ? rj->id : NULL;
+    if (rj->op == REGISTER_CREATE) {
+        if (rj->rc == 0) {
+            log_write(LOG_INFO, "New account registered: '%s'", rj->username);
+            send_result_iq(s, rj->id, 0);
+        } else if (rj->rc == -1) {
+            stanza_error(s, "iq", id, "cancel", "conflict");
+        } else if (rj->rc == -2) {
+            stanza_error(s, "iq", id, "modify", "not-acceptable");
+        } else {
+            stanza_error(s, "iq", id, "wait", "internal-server-error");
+        }
+    } else {
+        if (rj->rc == 0) {
+            log_write(LOG_INFO, "Password changed for user '%s'", rj->username);
+            send_result_iq(s, rj->id, 1);
+        } else {
+            stanza_error(s, "iq", id, "wait", "internal-server-error");
+        }
+    }
+    session_resume(s);
+}
+
+/* Hand the change to the storage thread owning the account; the IQ is
+ * answered when it is done, the session's other stanzas waiting till then.
+ * Returns -1 if a field is too long to be taken. */
+static int register_submit(session_t *s, int op, const char *id,
+                           const char *username, const char *password)
+{
+    if (strlen(id) >= REGISTER_FIELD_MAX || strlen(username) >= REGISTER_FIELD_MAX ||
+        strlen(password) >= REGISTER_FIELD_MAX)
+        return -1;
+
+    register_job_t rj;
+    memset(&rj, 0, sizeof(rj));
+    rj.op = op;
+    snprintf(rj.id, sizeof(rj.id), "%s", id);
+    snprintf(rj.username, sizeof(rj.username), "%s", username);
+    snprintf(rj.password, sizeof(rj.password), "%s", password);
+
+    if (op == REGISTER_DELETE) {
+        storage_submit(rj.username, NULL, register_work, NULL, &rj, sizeof(rj));
+        return 0;
     }
-    stanza_send(s, result);
-    xmlFreeNode(result);
+    session_ref_t self;
+    session_get_ref(s, &self);
+    session_suspend(s);
+    if (storage_submit(rj.username, &self, register_work, register_done,
+                       &rj, sizeof(rj)) < 0)
+        stream_send_error(s, "resource-constraint");
+    return 0;
 }
 
-void register_handle_iq(session_t *s, xmlNodePtr stanza) {
-    xmlChar *type_attr = xmlGetProp(stanza, (const xmlChar *)"type");
-    xmlChar *id_attr   = xmlGetProp(stanza, (const xmlChar *)"id");
-    const char *type = type_attr ? (const char *)type_attr : "";
-    const char *id   = id_attr   ? (const char *)id_attr   : "";
+void register_handle_iq(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr) {
+    const char *type = hdr->type ? hdr->type : "";
+    const char *id   = hdr->id   ? hdr->id   : "";
 
     if (strcmp(type, "get") == 0) {
         /* Return the registration form */
-        xmlNodePtr result = xmlNewNode(NULL, (const xmlChar *)"iq");
-        xmlNewProp(result, (const xmlChar *)"type", (const xmlChar *)"result");
-        if (id[0])
-            xmlNewProp(result, (const xmlChar *)"id", (const xmlChar *)id);
-        xmlNewProp(result, (const xmlChar *)"from", (const xmlChar *)g_config.domain);
-        if (s->authenticated) {
-            char full_jid[768];
+        char full_jid[768];
+        if (s->authenticated)
             jid_full(s->jid_local, s->jid_domain, s->jid_resource,
                      full_jid, sizeof(full_jid));
-            xmlNewProp(result, (const xmlChar *)"to", (const xmlChar *)full_jid);
-        }
-
-        xmlNodePtr query = xmlNewChild(result, NULL, (const xmlChar *)"query", NULL);
-        xmlNsPtr ns = xmlNewNs(query, (const xmlChar *)"jabber:iq:register", NULL);
-        xmlSetNs(query, ns);
-        xmlNewChild(query, ns, (const xmlChar *)"instructions",
-                    (const xmlChar *)"Choose a username and password.");
-        xmlNewChild(query, ns, (const xmlChar *)"username", NULL);
-        xmlNewChild(query, ns, (const xmlChar *)"password", NULL);
-
-        stanza_send(s, result);
-        xmlFreeNode(result);
+        tmpl_send(s, TMPL_REGISTER_FORM, (const char *[]){
+            id[0] ? id : NULL, s->authenticated ? full_jid : NULL });
 
     } else if (strcmp(type, "set") == 0) {
         /* Find the query child element */
-        xmlNodePtr query = stanza->children;
-        while (query && query->type != XML_ELEMENT_NODE)
-            query = query->next;
+        xml_node_t *query = xml_first_child(stanza);
 
         /* Check for <remove/> inside the query */
-        int has_remove = 0;
-        if (query) {
-            for (xmlNodePtr n = query->children; n; n = n->next) {
-                if (n->type == XML_ELEMENT_NODE &&
-                    strcmp((const char *)n->name, "remove") == 0) {
-                    has_remove = 1;
-                    break;
-                }
-            }
-        }
+        int has_remove = xml_find_child(query, "remove") != NULL;
 
         if (has_remove) {
             /* Account removal — must be authenticated */
@@ -79,67 +136,32 @@ void register_handle_iq(session_t *s, xmlNodePtr stanza) {
                 stanza_send_error(s, stanza, "cancel", "not-allowed");
             } else {
                 send_result_iq(s, id, 1);
-                char username[256];
-                snprintf(username, sizeof(username), "%s", s->jid_local);
-                user_delete(username);
+                register_submit(s, REGISTER_DELETE, "", s->jid_local, "");
                 s->teardown_pending = 1;
             }
         } else {
             /* Extract username and password from the query children */
-            xmlChar *uname = NULL, *pw = NULL;
-            if (query) {
-                for (xmlNodePtr n = query->children; n; n = n->next) {
-                    if (n->type != XML_ELEMENT_NODE)
-                        continue;
-                    if (strcmp((const char *)n->name, "username") == 0)
-                        uname = xmlNodeGetContent(n);
-                    else if (strcmp((const char *)n->name, "password") == 0)
-                        pw = xmlNodeGetContent(n);
-                }
-            }
+            xml_node_t *uname_el = xml_find_child(query, "username");
+            xml_node_t *pw_el    = xml_find_child(query, "password");
+            const char *uname = xml_text(&s->arena, uname_el);
+            const char *pw    = xml_text(&s->arena, pw_el);
 
-            if (!uname || xmlStrlen(uname) == 0 ||
-                !pw   || xmlStrlen(pw)   == 0) {
+            if (uname[0] == '\0' || pw[0] == '\0') {
                 stanza_send_error(s, stanza, "modify", "bad-request");
             } else if (!s->authenticated) {
                 /* Pre-auth: create new account */
-                int rc = user_create((const char *)uname, (const char *)pw);
-                if (rc == 0) {
-                    log_write(LOG_INFO, "New account registered: '%s'",
-                              (const char *)uname);
-                    send_result_iq(s, id, 0);
-                } else if (rc == -1) {
-                    stanza_send_error(s, stanza, "cancel", "conflict");
-                } else if (rc == -2) {
+                if (register_submit(s, REGISTER_CREATE, id, uname, pw) < 0)
                     stanza_send_error(s, stanza, "modify", "not-acceptable");
-                } else {
-                    stanza_send_error(s, stanza, "wait", "internal-server-error");
-                }
             } else {
                 /* Post-auth: password change — username must match */
-                if (strcmp((const char *)uname, s->jid_local) != 0) {
+                if (strcmp(uname, s->jid_local) != 0) {
                     stanza_send_error(s, stanza, "cancel", "not-allowed");
-                } else {
-                    int rc = user_change_password((const char *)uname,
-                                                  (const char *)pw);
-                    if (rc == 0) {
-                        log_write(LOG_INFO, "Password changed for user '%s'",
-                                  (const char *)uname);
-                        send_result_iq(s, id, 1);
-                    } else {
-                        stanza_send_error(s, stanza, "wait",
-                                         "internal-server-error");
-                    }
+                } else if (register_submit(s, REGISTER_PASSWORD, id, uname, pw) < 0) {
+                    stanza_send_error(s, stanza, "modify", "not-acceptable");
                 }
             }
-
-            if (uname) xmlFree(uname);
-            if (pw)    xmlFree(pw);
         }
     } else {
         stanza_send_error(s, stanza, "cancel", "bad-request");
     }
-
-    if (type_attr) xmlFree(type_attr);
-    if (id_attr)   xmlFree(id_attr);
 }
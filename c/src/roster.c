@@ -1,129 +1,150 @@
 #include "roster.h"
 #include "stanza.h"
+#include "template.h"
 #include "config.h"
 #include "log.h"
 #include "util.h"
 #include "xml.h"
+#include "store.h"
+#include "storage.h"
+#include "stream.h"
 #include <string.h>
 #include <stdio.h>
-#include <libxml/parser.h>
-#include <libxml/tree.h>
+#include <stdlib.h>
 
-static int roster_load_from_path(const char *path, roster_t *r) {
-    r->count = 0;
-
-    xmlDocPtr doc = xmlReadFile(path, NULL, 0);
-    if (!doc) {
-        log_write(LOG_DEBUG, "No roster file or parse error: %s", path);
-        r->loaded = 1;
+int roster_reserve(roster_t *r, int n) {
+    if (n <= r->cap)
         return 0;
+    int cap = r->cap ? r->cap : 4;
+    while (cap < n)
+        cap *= 2;
+    if (cap > MAX_ROSTER_ITEMS)
+        cap = MAX_ROSTER_ITEMS;
+
+    roster_item_t *items = realloc(r->items, (size_t)cap * sizeof(*items));
+    if (!items) {
+        log_write(LOG_ERROR, "Failed to grow roster to %d items", cap);
+        return -1;
     }
+    r->items = items;
+    r->cap = cap;
+    return 0;
+}
 
-    xmlNodePtr root = xmlDocGetRootElement(doc);
-    if (!root || xmlStrcmp(root->name, (const xmlChar *)"roster") != 0) {
-        xmlFreeDoc(doc);
-        r->loaded = 1;
-        return 0;
-    }
+void roster_free(roster_t *r) {
+    free(r->items);
+    r->items = NULL;
+    r->count = r->cap = 0;
+    r->loaded = 0;
+}
 
-    for (xmlNodePtr item = root->children; item; item = item->next) {
-        if (item->type != XML_ELEMENT_NODE)
-            continue;
-        if (xmlStrcmp(item->name, (const xmlChar *)"item") != 0)
-            continue;
-        if (r->count >= MAX_ROSTER_ITEMS)
-            break;
-
-        roster_item_t *ri = &r->items[r->count];
-        memset(ri, 0, sizeof(*ri));
-
-        xmlChar *jid = xmlGetProp(item, (const xmlChar *)"jid");
-        xmlChar *name = xmlGetProp(item, (const xmlChar *)"name");
-        xmlChar *sub = xmlGetProp(item, (const xmlChar *)"subscription");
-        xmlChar *ask = xmlGetProp(item, (const xmlChar *)"ask");
-
-        if (jid) {
-            snprintf(ri->jid, sizeof(ri->jid), "%s", (char *)jid);
-            xmlFree(jid);
+/* Give back what doubling overshot; most rosters never change again */
+static void roster_trim(roster_t *r) {
+    if (r->count == 0) {
+        free(r->items);
+        r->items = NULL;
+        r->cap = 0;
+    } else if (r->count < r->cap) {
+        roster_item_t *items = realloc(r->items, (size_t)r->count * sizeof(*items));
+        if (items) {
+            r->items = items;
+            r->cap = r->count;
         }
-        if (name) {
-            snprintf(ri->name, sizeof(ri->name), "%s", (char *)name);
-            xmlFree(name);
-        }
-        if (sub) {
-            snprintf(ri->subscription, sizeof(ri->subscription), "%s", (char *)sub);
-            xmlFree(sub);
-        } else {
-            snprintf(ri->subscription, sizeof(ri->subscription), "none");
-        }
-        if (ask && xmlStrcmp(ask, (const xmlChar *)"subscribe") == 0) {
-            ri->ask_subscribe = 1;
-        }
-        if (ask) xmlFree(ask);
-
-        r->count++;
     }
-
-    xmlFreeDoc(doc);
-    r->loaded = 1;
-    return 0;
 }
 
-static int roster_save_to_path(const char *path, roster_t *r) {
-    xmlDocPtr doc = xmlNewDoc((const xmlChar *)"1.0");
-    xmlNodePtr root = xmlNewNode(NULL, (const xmlChar *)"roster");
-    xmlDocSetRootElement(doc, root);
+/* --- Storage thread side --- */
 
-    for (int i = 0; i < r->count; i++) {
-        roster_item_t *ri = &r->items[i];
-        xmlNodePtr item = xmlNewChild(root, NULL, (const xmlChar *)"item", NULL);
-        xmlNewProp(item, (const xmlChar *)"jid", (const xmlChar *)ri->jid);
-        if (ri->name[0])
-            xmlNewProp(item, (const xmlChar *)"name", (const xmlChar *)ri->name);
-        xmlNewProp(item, (const xmlChar *)"subscription",
-                   (const xmlChar *)ri->subscription);
-        if (ri->ask_subscribe)
-            xmlNewProp(item, (const xmlChar *)"ask", (const xmlChar *)"subscribe");
-    }
+/* A user's roster on its way to or from the store */
+typedef struct roster_job {
+    char     username[256];
+    roster_t roster;            /* items owned by the job */
+} roster_job_t;
 
-    int rc = xmlSaveFormatFile(path, doc, 1);
-    xmlFreeDoc(doc);
+static void roster_load_work(void *arg, size_t len) {
+    (void)len;
+    roster_job_t *rj = arg;
+    roster_load_for_user(rj->username, &rj->roster);
+}
 
-    if (rc < 0) {
-        log_write(LOG_ERROR, "Failed to save roster: %s", path);
-        return -1;
+/* Back on the session's reactor: install the roster and carry on */
+static void roster_load_done(session_t *s, void *arg, size_t len) {
+    (void)len;
+    roster_job_t *rj = arg;
+    if (!s) {
+        roster_free(&rj->roster);
+        return;
     }
-    return 0;
+    if (!s->roster.loaded) {
+        roster_free(&s->roster);
+        s->roster = rj->roster;
+    } else {
+        roster_free(&rj->roster);
+    }
+    session_resume(s);
+}
+
+/* One change to a user's roster on its way to the store */
+typedef struct roster_change {
+    char          username[256];
+    int           op;
+    roster_item_t item;
+} roster_change_t;
+
+static void roster_change_work(void *arg, size_t len) {
+    (void)len;
+    roster_change_t *rc = arg;
+    roster_update_for_user(rc->username, rc->op, &rc->item);
 }
 
 /* --- Public API --- */
 
-int roster_load(session_t *s) {
-    char path[1280];
-    snprintf(path, sizeof(path), "%s/%s/roster.xml",
-             g_config.datadir, s->jid_local);
-    return roster_load_from_path(path, &s->roster);
+int roster_ensure(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr) {
+    if (s->roster.loaded)
+        return 1;
+
+    roster_job_t rj;
+    memset(&rj, 0, sizeof(rj));
+    snprintf(rj.username, sizeof(rj.username), "%s", s->jid_local);
+
+    session_ref_t self;
+    session_get_ref(s, &self);
+    stanza_suspend(s, stanza, hdr);
+    if (storage_submit(rj.username, &self, roster_load_work, roster_load_done,
+                       &rj, sizeof(rj)) < 0)
+        stream_send_error(s, "resource-constraint");
+    return 0;
 }
 
-int roster_save(session_t *s) {
-    char path[1280];
-    snprintf(path, sizeof(path), "%s/%s/roster.xml",
-             g_config.datadir, s->jid_local);
-    return roster_save_to_path(path, &s->roster);
+int roster_save_item(session_t *s, int op, const roster_item_t *item) {
+    roster_change_t rc;
+    memset(&rc, 0, sizeof(rc));
+    snprintf(rc.username, sizeof(rc.username), "%s", s->jid_local);
+    rc.op = op;
+    rc.item = *item;
+
+    return storage_submit(rc.username, NULL, roster_change_work, NULL, &rc, sizeof(rc));
 }
 
 int roster_load_for_user(const char *username, roster_t *r) {
-    char path[1280];
-    snprintf(path, sizeof(path), "%s/%s/roster.xml",
-             g_config.datadir, username);
-    return roster_load_from_path(path, r);
+    r->count = 0;
+    int rc = g_store->roster_load(username, r);
+    r->loaded = 1;
+    roster_trim(r);
+    return rc;
+}
+
+int roster_update_for_user(const char *username, int op, const roster_item_t *item) {
+    return g_store->roster_update(username, op, item);
 }
 
-int roster_save_for_user(const char *username, roster_t *r) {
-    char path[1280];
-    snprintf(path, sizeof(path), "%s/%s/roster.xml",
-             g_config.datadir, username);
-    return roster_save_to_path(path, r);
+int roster_apply(roster_t *r, int op, const roster_item_t *item) {
+    if (op == ROSTER_REMOVE) {
+        roster_remove_item(r, item->jid);
+        return 0;
+    }
+    return roster_add_item(r, item->jid, item->name, item->subscription,
+                           item->ask_subscribe);
 }
 
 roster_item_t *roster_find_item(roster_t *r, const char *jid) {
@@ -148,7 +169,7 @@ int roster_add_item(roster_t *r, const char *jid, const char *name,
         return 0;
     }
 
-    if (r->count >= MAX_ROSTER_ITEMS)
+    if (r->count >= MAX_ROSTER_ITEMS || roster_reserve(r, r->count + 1) < 0)
         return -1;
 
     roster_item_t *ri = &r->items[r->count];
@@ -176,124 +197,92 @@ int roster_remove_item(roster_t *r, const char *jid) {
     return -1;
 }
 
+/* Template arguments for one <item/> */
+static void roster_item_args(const roster_item_t *ri, const char *args[4]) {
+    args[0] = ri->jid;
+    args[1] = ri->name[0] ? ri->name : NULL;
+    args[2] = ri->subscription;
+    args[3] = ri->ask_subscribe ? "subscribe" : NULL;
+}
+
 void roster_push(session_t *s, roster_item_t *item) {
     char push_id[20];
     generate_id(push_id, 8);
 
-    xmlNodePtr iq = xmlNewNode(NULL, (const xmlChar *)"iq");
-    xmlNewProp(iq, (const xmlChar *)"type", (const xmlChar *)"set");
-    xmlNewProp(iq, (const xmlChar *)"id", (const xmlChar *)push_id);
-
     char full_jid[768];
     jid_full(s->jid_local, s->jid_domain, s->jid_resource,
              full_jid, sizeof(full_jid));
-    xmlNewProp(iq, (const xmlChar *)"to", (const xmlChar *)full_jid);
-
-    xmlNodePtr query = xmlNewChild(iq, NULL, (const xmlChar *)"query", NULL);
-    xmlNsPtr ns = xmlNewNs(query, (const xmlChar *)"jabber:iq:roster", NULL);
-    xmlSetNs(query, ns);
-
-    xmlNodePtr item_el = xmlNewChild(query, ns, (const xmlChar *)"item", NULL);
-    xmlNewProp(item_el, (const xmlChar *)"jid", (const xmlChar *)item->jid);
-    if (item->name[0])
-        xmlNewProp(item_el, (const xmlChar *)"name", (const xmlChar *)item->name);
-    xmlNewProp(item_el, (const xmlChar *)"subscription",
-               (const xmlChar *)item->subscription);
-    if (item->ask_subscribe)
-        xmlNewProp(item_el, (const xmlChar *)"ask", (const xmlChar *)"subscribe");
-
-    stanza_send(s, iq);
-    xmlFreeNode(iq);
+
+    tmpl_send(s, TMPL_ROSTER_PUSH, (const char *[]){
+        push_id, full_jid, item->jid, item->name[0] ? item->name : NULL,
+        item->subscription, item->ask_subscribe ? "subscribe" : NULL });
 }
 
-void roster_handle_iq(session_t *s, xmlNodePtr stanza) {
-    xmlChar *type_attr = xmlGetProp(stanza, (const xmlChar *)"type");
-    const char *type = type_attr ? (const char *)type_attr : "";
+void roster_handle_iq(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr) {
+    const char *type = hdr->type ? hdr->type : "";
+    const char *id = hdr->id;
 
-    /* Ensure roster is loaded */
-    if (!s->roster.loaded)
-        roster_load(s);
+    /* Handled once the roster has been loaded */
+    if (!roster_ensure(s, stanza, hdr))
+        return;
 
     if (strcmp(type, "get") == 0) {
         /* Return full roster */
-        xmlChar *id = xmlGetProp(stanza, (const xmlChar *)"id");
-
-        xmlNodePtr result = xmlNewNode(NULL, (const xmlChar *)"iq");
-        xmlNewProp(result, (const xmlChar *)"type", (const xmlChar *)"result");
-        if (id) {
-            xmlNewProp(result, (const xmlChar *)"id", id);
-            xmlFree(id);
-        }
-
         char full_jid[768];
         jid_full(s->jid_local, s->jid_domain, s->jid_resource,
                  full_jid, sizeof(full_jid));
-        xmlNewProp(result, (const xmlChar *)"to", (const xmlChar *)full_jid);
-
-        xmlNodePtr query = xmlNewChild(result, NULL, (const xmlChar *)"query", NULL);
-        xmlNsPtr ns = xmlNewNs(query, (const xmlChar *)"jabber:iq:roster", NULL);
-        xmlSetNs(query, ns);
 
+        /* Sized up front so the whole reply is written in one place */
+        const char *start[] = { id, full_jid };
+        size_t len = tmpl_len(TMPL_ROSTER_RESULT_START, start) +
+                     tmpl_len(TMPL_ROSTER_RESULT_END, NULL);
         for (int i = 0; i < s->roster.count; i++) {
-            roster_item_t *ri = &s->roster.items[i];
-            xmlNodePtr item = xmlNewChild(query, ns, (const xmlChar *)"item", NULL);
-            xmlNewProp(item, (const xmlChar *)"jid", (const xmlChar *)ri->jid);
-            if (ri->name[0])
-                xmlNewProp(item, (const xmlChar *)"name", (const xmlChar *)ri->name);
-            xmlNewProp(item, (const xmlChar *)"subscription",
-                       (const xmlChar *)ri->subscription);
-            if (ri->ask_subscribe)
-                xmlNewProp(item, (const xmlChar *)"ask",
-                           (const xmlChar *)"subscribe");
+            const char *args[4];
+            roster_item_args(&s->roster.items[i], args);
+            len += tmpl_len(TMPL_ROSTER_ITEM, args);
         }
 
-        stanza_send(s, result);
-        xmlFreeNode(result);
+        char *out = session_reserve(s, len);
+        if (!out)
+            return;
+        char *p = tmpl_render(TMPL_ROSTER_RESULT_START, start, out);
+        for (int i = 0; i < s->roster.count; i++) {
+            const char *args[4];
+            roster_item_args(&s->roster.items[i], args);
+            p = tmpl_render(TMPL_ROSTER_ITEM, args, p);
+        }
+        tmpl_render(TMPL_ROSTER_RESULT_END, NULL, p);
+        session_commit(s, out, len);
     } else if (strcmp(type, "set") == 0) {
         /* Add/update or remove a contact */
-        xmlNodePtr query_el = xml_find_child(stanza, "query");
-        xmlNodePtr item_el = query_el ? xml_find_child(query_el, "item") : NULL;
+        xml_node_t *query_el = xml_find_child(stanza, "query");
+        xml_node_t *item_el = query_el ? xml_find_child(query_el, "item") : NULL;
         if (!item_el) {
             stanza_send_error(s, stanza, "modify", "bad-request");
-            if (type_attr) xmlFree(type_attr);
             return;
         }
 
-        xmlChar *jid_attr = xmlGetProp(item_el, (const xmlChar *)"jid");
-        xmlChar *name_attr = xmlGetProp(item_el, (const xmlChar *)"name");
-        xmlChar *sub_attr = xmlGetProp(item_el, (const xmlChar *)"subscription");
+        const char *jid = xml_get_attr(item_el, "jid");
+        const char *name = xml_get_attr(item_el, "name");
+        const char *sub_attr = xml_get_attr(item_el, "subscription");
 
-        if (!jid_attr) {
+        if (!jid) {
             stanza_send_error(s, stanza, "modify", "bad-request");
-            if (name_attr) xmlFree(name_attr);
-            if (sub_attr) xmlFree(sub_attr);
-            if (type_attr) xmlFree(type_attr);
             return;
         }
 
-        const char *jid = (const char *)jid_attr;
-        const char *name = name_attr ? (const char *)name_attr : NULL;
-
-        if (sub_attr && xmlStrcmp(sub_attr, (const xmlChar *)"remove") == 0) {
+        if (sub_attr && strcmp(sub_attr, "remove") == 0) {
             /* Remove item */
+            roster_item_t removed;
+            memset(&removed, 0, sizeof(removed));
+            snprintf(removed.jid, sizeof(removed.jid), "%s", jid);
             roster_remove_item(&s->roster, jid);
-            roster_save(s);
+            roster_save_item(s, ROSTER_REMOVE, &removed);
 
             /* Send result */
-            xmlChar *id = xmlGetProp(stanza, (const xmlChar *)"id");
-            xmlNodePtr result = xmlNewNode(NULL, (const xmlChar *)"iq");
-            xmlNewProp(result, (const xmlChar *)"type", (const xmlChar *)"result");
-            if (id) {
-                xmlNewProp(result, (const xmlChar *)"id", id);
-                xmlFree(id);
-            }
-            stanza_send(s, result);
-            xmlFreeNode(result);
+            tmpl_send(s, TMPL_IQ_RESULT, (const char *[]){ id });
 
             /* Roster push with subscription=remove */
-            roster_item_t removed;
-            memset(&removed, 0, sizeof(removed));
-            snprintf(removed.jid, sizeof(removed.jid), "%s", jid);
             snprintf(removed.subscription, sizeof(removed.subscription), "remove");
             roster_push(s, &removed);
 
@@ -308,31 +297,18 @@ void roster_handle_iq(session_t *s, xmlNodePtr stanza) {
             if (name && existing) {
                 snprintf(existing->name, sizeof(existing->name), "%s", name);
             }
-            roster_save(s);
+            roster_item_t *item = roster_find_item(&s->roster, jid);
+            if (item)
+                roster_save_item(s, ROSTER_SET, item);
 
             /* Send result */
-            xmlChar *id = xmlGetProp(stanza, (const xmlChar *)"id");
-            xmlNodePtr result = xmlNewNode(NULL, (const xmlChar *)"iq");
-            xmlNewProp(result, (const xmlChar *)"type", (const xmlChar *)"result");
-            if (id) {
-                xmlNewProp(result, (const xmlChar *)"id", id);
-                xmlFree(id);
-            }
-            stanza_send(s, result);
-            xmlFreeNode(result);
+            tmpl_send(s, TMPL_IQ_RESULT, (const char *[]){ id });
 
             /* Roster push */
-            roster_item_t *item = roster_find_item(&s->roster, jid);
             if (item)
                 roster_push(s, item);
         }
-
-        xmlFree(jid_attr);
-        if (name_attr) xmlFree(name_attr);
-        if (sub_attr) xmlFree(sub_attr);
     } else {
         stanza_send_error(s, stanza, "cancel", "feature-not-implemented");
     }
-
-    if (type_attr) xmlFree(type_attr);
 }
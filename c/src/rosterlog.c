@@ -0,0 +1,495 @@
+#define _GNU_SOURCE     /* pread, ftruncate, fdatasync */
+#include "rosterlog.h"
+#include "config.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define ROSTERLOG_BUCKETS  256      /* index hash chains (power of two) */
+#define ROSTERLOG_HDR      8        /* record header: length, operation */
+#define ROSTERLOG_MAX_RECORD sizeof(roster_item_t)  /* fields and ask fit */
+
+/* One user's journal. Entries live until shutdown, so the commit thread
+ * may hold on to them. */
+typedef struct roster_log {
+    struct roster_log *next;            /* hash chain */
+    struct roster_log *next_commit;     /* commit queue link */
+    pthread_mutex_t    lock;            /* the journal and everything below */
+    char               username[256];
+    unsigned char     *pending;         /* records not yet written */
+    size_t             pending_len;
+    size_t             pending_cap;
+    int                commit_queued;
+    off_t              size;            /* journal bytes, -1 until known */
+    time_t             since;           /* first record after the snapshot */
+} roster_log_t;
+
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static roster_log_t   *index_buckets[ROSTERLOG_BUCKETS];
+
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  commit_cond = PTHREAD_COND_INITIALIZER;
+static roster_log_t   *commit_queue = NULL;
+static int             commit_stop = 0;
+static int             commit_running = 0;
+static pthread_t       commit_thread;
+
+static rosterlog_load_fn snapshot_load;
+static rosterlog_save_fn snapshot_save;
+
+static void put_le32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static uint32_t get_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+           (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void journal_path(char *buf, size_t size, const char *username) {
+    snprintf(buf, size, "%s/%s/roster.journal", g_config.datadir, username);
+}
+
+/* The index entry for username, created on first use */
+static roster_log_t *log_get(const char *username) {
+    uint32_t h = 2166136261u;
+    for (const char *p = username; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    roster_log_t **head = &index_buckets[h & (ROSTERLOG_BUCKETS - 1)];
+
+    pthread_mutex_lock(&index_lock);
+    roster_log_t *l;
+    for (l = *head; l; l = l->next)
+        if (strcmp(l->username, username) == 0)
+            break;
+    if (!l && (l = calloc(1, sizeof(*l))) != NULL) {
+        pthread_mutex_init(&l->lock, NULL);
+        snprintf(l->username, sizeof(l->username), "%s", username);
+        l->size = -1;
+        l->next = *head;
+        *head = l;
+    }
+    pthread_mutex_unlock(&index_lock);
+    if (!l)
+        log_write(LOG_ERROR, "Out of memory indexing roster journal of %s", username);
+    return l;
+}
+
+/* Apply the records in buf[0, len) to r. Returns the length of the
+ * whole records, short of len if the last one is torn. */
+static size_t records_replay(roster_t *r, const unsigned char *buf, size_t len) {
+    size_t off = 0;
+    while (len - off >= ROSTERLOG_HDR) {
+        uint32_t n = get_le32(buf + off);
+        uint32_t op = get_le32(buf + off + 4);
+        if (n > ROSTERLOG_MAX_RECORD || n > len - off - ROSTERLOG_HDR)
+            break;
+
+        /* jid, name and subscription, NUL-terminated, then ask */
+        const char *p = (const char *)buf + off + ROSTERLOG_HDR;
+        const char *end = p + n;
+        const char *fields[3];
+        for (int i = 0; i < 3; i++) {
+            const char *nul = p < end ? memchr(p, '\0', (size_t)(end - p)) : NULL;
+            if (!nul)
+                return off;
+            fields[i] = p;
+            p = nul + 1;
+        }
+        if (p >= end)
+            return off;
+
+        roster_item_t item;
+        memset(&item, 0, sizeof(item));
+        snprintf(item.jid, sizeof(item.jid), "%s", fields[0]);
+        snprintf(item.name, sizeof(item.name), "%s", fields[1]);
+        snprintf(item.subscription, sizeof(item.subscription), "%s", fields[2]);
+        item.ask_subscribe = *p != 0;
+        roster_apply(r, (int)op, &item);
+
+        off += ROSTERLOG_HDR + n;
+    }
+    return off;
+}
+
+/* Replay the journal over r, dropping a record torn by a crash. Called
+ * with l->lock held. */
+static void journal_replay(roster_log_t *l, roster_t *r) {
+    char path[1280];
+    journal_path(path, sizeof(path), l->username);
+
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            log_write(LOG_ERROR, "Failed to open roster journal %s: %s",
+                      path, strerror(errno));
+        l->size = 0;
+        return;
+    }
+
+    struct stat st;
+    unsigned char *buf = NULL;
+    if (fstat(fd, &st) < 0 ||
+        (st.st_size > 0 && (buf = malloc((size_t)st.st_size)) == NULL)) {
+        log_write(LOG_ERROR, "Failed to read roster journal %s", path);
+        close(fd);
+        return;
+    }
+    size_t len = 0;
+    while (len < (size_t)st.st_size) {
+        ssize_t n = pread(fd, buf + len, (size_t)st.st_size - len, (off_t)len);
+        if (n <= 0)
+            break;
+        len += (size_t)n;
+    }
+
+    size_t whole = records_replay(r, buf, len);
+    if (whole != (size_t)st.st_size) {
+        log_write(LOG_WARN, "Roster journal of %s: dropping %lld bytes of torn record",
+                  l->username, (long long)(st.st_size - (off_t)whole));
+        if (ftruncate(fd, (off_t)whole) < 0)
+            log_write(LOG_ERROR, "Failed to truncate roster journal %s", path);
+    }
+    l->size = (off_t)whole;
+    if (whole && !l->since)
+        l->since = time(NULL);
+    free(buf);
+    close(fd);
+}
+
+int rosterlog_append(const char *username, int op, const roster_item_t *item) {
+    roster_log_t *l = log_get(username);
+    if (!l)
+        return -1;
+
+    size_t jid = strlen(item->jid) + 1, name = 0, sub = 0;
+    if (op != ROSTER_REMOVE) {
+        name = strlen(item->name);
+        sub = strlen(item->subscription);
+    }
+    size_t n = jid + name + 1 + sub + 1 + 1;
+
+    pthread_mutex_lock(&l->lock);
+    if (l->pending_len + ROSTERLOG_HDR + n > l->pending_cap) {
+        size_t cap = l->pending_cap ? l->pending_cap : 256;
+        while (cap < l->pending_len + ROSTERLOG_HDR + n)
+            cap *= 2;
+        unsigned char *p = realloc(l->pending, cap);
+        if (!p) {
+            pthread_mutex_unlock(&l->lock);
+            log_write(LOG_ERROR, "Out of memory journaling roster of %s", username);
+            return -1;
+        }
+        l->pending = p;
+        l->pending_cap = cap;
+    }
+
+    unsigned char *p = l->pending + l->pending_len;
+    put_le32(p, (uint32_t)n);
+    put_le32(p + 4, (uint32_t)op);
+    p += ROSTERLOG_HDR;
+    memcpy(p, item->jid, jid);
+    p += jid;
+    memcpy(p, item->name, name);
+    p[name] = '\0';
+    p += name + 1;
+    memcpy(p, item->subscription, sub);
+    p[sub] = '\0';
+    p += sub + 1;
+    *p = op != ROSTER_REMOVE && item->ask_subscribe;
+    l->pending_len += ROSTERLOG_HDR + n;
+
+    int queue = !l->commit_queued;
+    l->commit_queued = 1;
+    pthread_mutex_unlock(&l->lock);
+
+    if (queue) {
+        pthread_mutex_lock(&commit_lock);
+        l->next_commit = commit_queue;
+        commit_queue = l;
+        pthread_cond_signal(&commit_cond);
+        pthread_mutex_unlock(&commit_lock);
+    }
+    return 0;
+}
+
+int rosterlog_load(const char *username, roster_t *r) {
+    roster_log_t *l = log_get(username);
+    if (!l)
+        return snapshot_load(username, r);
+
+    pthread_mutex_lock(&l->lock);
+    int rc = snapshot_load(username, r);
+    journal_replay(l, r);
+    records_replay(r, l->pending, l->pending_len);
+    pthread_mutex_unlock(&l->lock);
+    return rc;
+}
+
+void rosterlog_forget(const char *username) {
+    roster_log_t *l = log_get(username);
+    if (!l)
+        return;
+
+    pthread_mutex_lock(&l->lock);
+    l->pending_len = 0;
+    l->size = 0;
+    l->since = 0;
+    char path[1280];
+    journal_path(path, sizeof(path), username);
+    if (unlink(path) < 0 && errno != ENOENT)
+        log_write(LOG_ERROR, "Failed to remove roster journal %s", path);
+    pthread_mutex_unlock(&l->lock);
+}
+
+/* --- Commit thread --- */
+
+/* Write l's pending records to its journal. Returns the journal, open
+ * for the caller to sync and close, or -1 if there was nothing to write
+ * or it failed. Called with l->lock held. */
+static int journal_write(roster_log_t *l) {
+    if (l->pending_len == 0)
+        return -1;
+
+    char path[1280];
+    journal_path(path, sizeof(path), l->username);
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        /* No such account (any more): nowhere for the changes to go */
+        if (errno == ENOENT)
+            l->pending_len = 0;
+        else
+            log_write(LOG_ERROR, "Failed to open roster journal %s: %s",
+                      path, strerror(errno));
+        return -1;
+    }
+    if (l->size < 0) {
+        struct stat st;
+        l->size = fstat(fd, &st) == 0 ? st.st_size : 0;
+    }
+
+    ssize_t n = write(fd, l->pending, l->pending_len);
+    if (n != (ssize_t)l->pending_len) {
+        log_write(LOG_ERROR, "Failed to append to roster journal of %s: %s",
+                  l->username, n < 0 ? strerror(errno) : "short write");
+        if (n > 0 && ftruncate(fd, l->size) < 0)
+            log_write(LOG_ERROR, "Failed to drop partial roster record of %s",
+                      l->username);
+        close(fd);
+        return -1;
+    }
+    l->size += (off_t)l->pending_len;
+    l->pending_len = 0;
+    if (!l->since)
+        l->since = time(NULL);
+    return fd;
+}
+
+/* Rewrite roster.xml from snapshot and journal, then empty the journal.
+ * Called with l->lock held and nothing pending. */
+static void journal_snapshot(roster_log_t *l) {
+    roster_t r;
+    memset(&r, 0, sizeof(r));
+    if (snapshot_load(l->username, &r) < 0) {
+        roster_free(&r);
+        return;
+    }
+    journal_replay(l, &r);
+
+    char path[1280];
+    journal_path(path, sizeof(path), l->username);
+    if (snapshot_save(l->username, &r) == 0) {
+        if (truncate(path, 0) == 0) {
+            l->size = 0;
+            l->since = 0;
+        } else {
+            log_write(LOG_ERROR, "Failed to truncate roster journal %s", path);
+        }
+    }
+    roster_free(&r);
+}
+
+/* Write every journal in the queue, then sync them all. Returns those
+ * whose changes could not be written, queued again. */
+static roster_log_t *commit_group(roster_log_t *queue) {
+    int fds[64];
+    roster_log_t *logs[64];
+    roster_log_t *failed = NULL;
+    int n = 0;
+
+    while (queue) {
+        for (n = 0; queue && n < 64; ) {
+            roster_log_t *l = queue;
+            queue = l->next_commit;
+
+            pthread_mutex_lock(&l->lock);
+            l->commit_queued = 0;
+            int fd = journal_write(l);
+            /* Unless a change since has queued it already */
+            if (fd < 0 && l->pending_len > 0 && !l->commit_queued) {
+                l->commit_queued = 1;
+                l->next_commit = failed;
+                failed = l;
+            }
+            pthread_mutex_unlock(&l->lock);
+            if (fd >= 0) {
+                fds[n] = fd;
+                logs[n++] = l;
+            }
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (fdatasync(fds[i]) < 0)
+                log_write(LOG_ERROR, "Failed to sync roster journal of %s: %s",
+                          logs[i]->username, strerror(errno));
+            close(fds[i]);
+        }
+
+        /* Journals that have grown or aged enough: fold into roster.xml */
+        time_t now = time(NULL);
+        for (int i = 0; i < n; i++) {
+            roster_log_t *l = logs[i];
+            pthread_mutex_lock(&l->lock);
+            if (l->pending_len == 0 && l->size > 0 &&
+                (l->size >= ROSTERLOG_SNAPSHOT_MIN ||
+                 now - l->since >= ROSTERLOG_SNAPSHOT_AGE))
+                journal_snapshot(l);
+            pthread_mutex_unlock(&l->lock);
+        }
+    }
+    return failed;
+}
+
+/* ms from now, for pthread_cond_timedwait */
+static struct timespec deadline(long ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return ts;
+}
+
+static void *commit_main(void *arg) {
+    (void)arg;
+    roster_log_t *retry = NULL;         /* failed, tried again at retry_at */
+    struct timespec retry_at = { 0, 0 };
+    long backoff = ROSTERLOG_RETRY_MS;
+
+    pthread_mutex_lock(&commit_lock);
+    for (;;) {
+        int due = 0;
+        while (!commit_queue && !commit_stop && !due) {
+            if (retry)
+                due = pthread_cond_timedwait(&commit_cond, &commit_lock,
+                                             &retry_at) == ETIMEDOUT;
+            else
+                pthread_cond_wait(&commit_cond, &commit_lock);
+        }
+
+        /* Failed ones go with this group once due, and once more when
+         * stopping */
+        if (retry) {
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            if (due || commit_stop || now.tv_sec > retry_at.tv_sec ||
+                (now.tv_sec == retry_at.tv_sec && now.tv_nsec >= retry_at.tv_nsec)) {
+                roster_log_t *tail = retry;
+                while (tail->next_commit)
+                    tail = tail->next_commit;
+                tail->next_commit = commit_queue;
+                commit_queue = retry;
+                retry = NULL;
+            }
+        }
+        if (!commit_queue)
+            break;
+
+        /* Let the group gather */
+        if (!commit_stop) {
+            struct timespec until = deadline(ROSTERLOG_COMMIT_MS);
+            while (!commit_stop &&
+                   pthread_cond_timedwait(&commit_cond, &commit_lock, &until) == 0)
+                ;
+        }
+
+        roster_log_t *queue = commit_queue;
+        commit_queue = NULL;
+        pthread_mutex_unlock(&commit_lock);
+        roster_log_t *failed = commit_group(queue);
+        pthread_mutex_lock(&commit_lock);
+
+        /* When stopping, what failed again is left pending for shutdown
+         * to report */
+        if (!failed) {
+            if (!retry)
+                backoff = ROSTERLOG_RETRY_MS;
+        } else if (!commit_stop) {
+            if (!retry) {
+                retry_at = deadline(backoff);
+                log_write(LOG_WARN, "Roster journal: trying failed writes again in %ld ms",
+                          backoff);
+                backoff = backoff * 2 < ROSTERLOG_RETRY_MAX_MS ?
+                          backoff * 2 : ROSTERLOG_RETRY_MAX_MS;
+            }
+            roster_log_t *tail = failed;
+            while (tail->next_commit)
+                tail = tail->next_commit;
+            tail->next_commit = retry;
+            retry = failed;
+        }
+    }
+    pthread_mutex_unlock(&commit_lock);
+    return NULL;
+}
+
+int rosterlog_init(rosterlog_load_fn load, rosterlog_save_fn save) {
+    snapshot_load = load;
+    snapshot_save = save;
+    commit_stop = 0;
+    if (pthread_create(&commit_thread, NULL, commit_main, NULL) != 0) {
+        log_write(LOG_ERROR, "Failed to start roster journal commit thread");
+        return -1;
+    }
+    commit_running = 1;
+    return 0;
+}
+
+void rosterlog_shutdown(void) {
+    /* The thread commits what is queued before it stops */
+    if (commit_running) {
+        pthread_mutex_lock(&commit_lock);
+        commit_stop = 1;
+        pthread_cond_signal(&commit_cond);
+        pthread_mutex_unlock(&commit_lock);
+        pthread_join(commit_thread, NULL);
+        commit_running = 0;
+    }
+    commit_queue = NULL;
+
+    for (int i = 0; i < ROSTERLOG_BUCKETS; i++) {
+        while (index_buckets[i]) {
+            roster_log_t *l = index_buckets[i];
+            index_buckets[i] = l->next;
+            if (l->pending_len > 0)
+                log_write(LOG_ERROR, "Roster journal: dropping %zu bytes of unwritten "
+                          "changes to the roster of %s", l->pending_len, l->username);
+            pthread_mutex_destroy(&l->lock);
+            free(l->pending);
+            free(l);
+        }
+    }
+}
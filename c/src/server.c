@@ -1,5 +1,13 @@
+#define _GNU_SOURCE     /* accept4 */
 #include "server.h"
 #include "session.h"
+#include "uring.h"
+#include "roster.h"
+#include "admit.h"
+#include "store.h"
+#include "storage.h"
+#include "usercache.h"
+#include "xml.h"
 #include "log.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,50 +16,280 @@
 #include <errno.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <poll.h>
 
-static struct pollfd  pollfds[MAX_CLIENTS];
-static session_t     *sessions[MAX_CLIENTS];
-static int            nfds = 0;
-static int            listen_fd = -1;
-static volatile sig_atomic_t shutdown_flag = 0;
+/*
+ * Cross-reactor work item. The argument is copied in right behind the
+ * header so that the poster's buffers can go away immediately.
+ */
+typedef struct task {
+    struct task     *next;
+    session_ref_t    ref;       /* target session (session tasks only) */
+    session_task_fn  fn;        /* session task, or NULL ... */
+    reactor_task_fn  rfn;       /* ... for a reactor-wide task */
+    size_t           len;
+    void            *arg;
+} task_t;
+
+#define TASK_HDR_SIZE ((sizeof(task_t) + 15) & ~(size_t)15)
+
+/*
+ * One event loop. Each reactor owns its listener socket (SO_REUSEPORT
+ * spreads connections between them), its sessions and its epoll set.
+ * Other threads only ever touch a reactor through its inbox.
+ */
+typedef struct reactor {
+    int            index;
+    pthread_t      thread;
+    int            epoll_fd;
+    int            listen_fd;
+    int            wake_fd;     /* eventfd signalled when the inbox fills */
+
+    /* Session table: slots are stable for a session's lifetime, so a
+     * session's slot number is its registration handle. Free slots are
+     * kept on a stack. */
+    session_t    **sessions;
+    int            nslots;
+    int           *free_slots;
+    int            nfree;
+    slab_t         session_pool;    /* session_t storage */
+
+    /* Sessions with output queued during this iteration, and sessions torn
+     * down during this iteration (freed once no event can refer to them). */
+    session_t     *pending_flush;
+    session_t     *graveyard;
+
+    /* Sessions allowed to read again after being paused by a slow
+     * consumer, resumed at the end of the iteration */
+    session_t     *pending_read;
+
+    /* Sessions that used up their read budget with input still in the
+     * socket, read on once every other ready session has had its turn */
+    session_t     *readable;
+
+    /* Session deadlines; now is sampled once per wakeup */
+    wheel_t        wheel;
+    uint64_t       now;
+
+    /* The listener was left with connections pending after a full batch */
+    int            accept_more;
+
+    /* Lock-free MPSC inbox: producers push onto the head, the owner takes
+     * the whole list at once and reverses it into posting order. */
+    _Atomic(task_t *) inbox;
+
+#ifdef HAVE_IO_URING
+    /* io_uring backend: replaces epoll_fd when enabled */
+    uring_t        ring;
+    uint64_t       wake_val;    /* eventfd counter read by the ring */
+    session_t     *zombies;     /* reaped sessions with requests in flight */
+#endif
+} reactor_t;
+
+static reactor_t     *reactors = NULL;
+static int            nreactors = 0;
+static atomic_int     shutdown_flag = 0;
+static atomic_ullong  next_serial = 1;
+static int            use_uring = 0;
+
+/* Reactor driven by the calling thread */
+static _Thread_local reactor_t *current = NULL;
+
+/* epoll user data for the listener and the inbox eventfd; sessions use
+ * their own pointer */
+static int            listener_tag;
+static int            wake_tag;
 
 static void signal_handler(int sig) {
     (void)sig;
     shutdown_flag = 1;
 }
 
+static uint64_t clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
 static void set_nonblocking(int fd) {
     int flags = fcntl(fd, F_GETFL, 0);
     if (flags >= 0)
         fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
-int server_init(config_t *cfg) {
-    /* Install signal handlers */
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = signal_handler;
-    sigemptyset(&sa.sa_mask);
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
+#ifdef HAVE_IO_URING
+/*
+ * io_uring completions are told apart by user_data: the operation in the
+ * low bits, and for per-session requests the session pointer (malloc
+ * alignment leaves those bits clear) in the rest.
+ */
+enum {
+    URING_OP_ACCEPT = 1,
+    URING_OP_WAKE,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_CANCEL
+};
+#define URING_OP_MASK 7u
 
-    /* Ignore SIGPIPE */
-    signal(SIGPIPE, SIG_IGN);
+static void uring_arm_accept(reactor_t *r) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+    if (!sqe) {
+        log_write(LOG_ERROR, "io_uring: no SQE for accept on reactor %d", r->index);
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = r->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = URING_OP_ACCEPT;
+}
+
+static void uring_arm_wake(reactor_t *r) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+    if (!sqe) {
+        log_write(LOG_ERROR, "io_uring: no SQE for eventfd on reactor %d", r->index);
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = r->wake_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&r->wake_val;
+    sqe->len = sizeof(r->wake_val);
+    sqe->user_data = URING_OP_WAKE;
+}
+
+/* Multishot recv into the reactor's provided buffers: one submission
+ * keeps delivering data until it fails or the buffers run out */
+static int uring_arm_recv(reactor_t *r, session_t *s) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = s->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = (uint64_t)(uintptr_t)s | URING_OP_RECV;
+    s->io_pending++;
+    s->recv_armed = 1;
+    return 0;
+}
+
+/* Stop the multishot recv of a paused session; it is re-armed when the
+ * session is resumed */
+static void uring_cancel_recv(reactor_t *r, session_t *s) {
+    if (!s->recv_armed)
+        return;
+    struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)(uintptr_t)s | URING_OP_RECV;
+    sqe->user_data = URING_OP_CANCEL;
+}
+
+/* Send the head of the session's output chain with one sendmsg. The
+ * chain is consumed when the send completes; session_write only ever
+ * appends behind the bytes in flight. */
+static void uring_start_send(reactor_t *r, session_t *s) {
+    if (s->send_inflight || s->out.len == 0)
+        return;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+    if (!sqe) {
+        log_write(LOG_ERROR, "io_uring: no SQE for send on fd %d", s->fd);
+        session_teardown(s);
+        return;
+    }
+
+    memset(&s->send_msg, 0, sizeof(s->send_msg));
+    s->send_msg.msg_iov = s->send_iov;
+    s->send_msg.msg_iovlen = (size_t)outbuf_iov(&s->out, s->send_iov, OUTBUF_IOV_MAX);
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = s->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&s->send_msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)s | URING_OP_SEND;
+    s->send_inflight = 1;
+    s->io_pending++;
+
+    /* Start the stalled-output deadline if it is not already running */
+    session_sent(s, 0);
+}
+
+/* Stop everything still in flight for a reaped session */
+static void uring_cancel(reactor_t *r, session_t *s) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = s->fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = URING_OP_CANCEL;
+}
+#endif /* HAVE_IO_URING */
+
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        return;
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    log_write(LOG_INFO, "File descriptor limit: %llu",
+              (unsigned long long)rl.rlim_cur);
+}
 
-    /* Create listening socket */
-    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd < 0) {
+static int table_grow(reactor_t *r) {
+    int new_slots = r->nslots ? r->nslots * 2 : SESSION_TABLE_INIT;
+
+    session_t **new_sessions = realloc(r->sessions,
+                                       (size_t)new_slots * sizeof(*r->sessions));
+    if (!new_sessions)
+        return -1;
+    r->sessions = new_sessions;
+
+    int *new_free = realloc(r->free_slots, (size_t)new_slots * sizeof(*r->free_slots));
+    if (!new_free)
+        return -1;
+    r->free_slots = new_free;
+
+    /* Push new slots so the lowest index is handed out first */
+    for (int i = new_slots - 1; i >= r->nslots; i--) {
+        r->sessions[i] = NULL;
+        r->free_slots[r->nfree++] = i;
+    }
+    r->nslots = new_slots;
+    return 0;
+}
+
+static int open_listener(config_t *cfg, int reuseport) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
         log_write(LOG_ERROR, "socket(): %s", strerror(errno));
         return -1;
     }
 
     int opt = 1;
-    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    set_nonblocking(listen_fd);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reuseport &&
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        log_write(LOG_ERROR, "setsockopt(SO_REUSEPORT): %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    set_nonblocking(fd);
 
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
@@ -59,175 +297,880 @@ int server_init(config_t *cfg) {
     addr.sin_port = htons((uint16_t)cfg->port);
     if (inet_pton(AF_INET, cfg->bind_address, &addr.sin_addr) <= 0) {
         log_write(LOG_ERROR, "Invalid bind address: %s", cfg->bind_address);
-        close(listen_fd);
+        close(fd);
         return -1;
     }
 
-    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         log_write(LOG_ERROR, "bind(): %s", strerror(errno));
-        close(listen_fd);
+        close(fd);
         return -1;
     }
 
-    if (listen(listen_fd, 16) < 0) {
+    if (listen(fd, cfg->listen_backlog) < 0) {
         log_write(LOG_ERROR, "listen(): %s", strerror(errno));
-        close(listen_fd);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int reactor_init(reactor_t *r, int index, config_t *cfg) {
+    memset(r, 0, sizeof(*r));
+    r->index = index;
+    r->epoll_fd = r->listen_fd = r->wake_fd = -1;
+    atomic_init(&r->inbox, NULL);
+    r->now = clock_ms();
+    wheel_init(&r->wheel, r->now);
+    slab_init(&r->session_pool, sizeof(session_t));
+
+    r->listen_fd = open_listener(cfg, nreactors > 1);
+    if (r->listen_fd < 0)
+        return -1;
+
+    r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->wake_fd < 0) {
+        log_write(LOG_ERROR, "eventfd(): %s", strerror(errno));
         return -1;
     }
 
-    /* Set up poll array with listener at index 0 */
-    memset(pollfds, 0, sizeof(pollfds));
-    memset(sessions, 0, sizeof(sessions));
-    pollfds[0].fd = listen_fd;
-    pollfds[0].events = POLLIN;
-    sessions[0] = NULL; /* no session for listener */
-    nfds = 1;
+    if (table_grow(r) < 0) {
+        log_write(LOG_ERROR, "Failed to allocate session table");
+        return -1;
+    }
+
+#ifdef HAVE_IO_URING
+    if (use_uring) {
+        if (uring_init(&r->ring, URING_ENTRIES, URING_BUFS, URING_BUF_SIZE) == 0) {
+            uring_arm_accept(r);
+            uring_arm_wake(r);
+            return 0;
+        }
+        /* Fall back before any reactor has committed to io_uring */
+        if (index > 0)
+            return -1;
+        log_write(LOG_WARN, "io_uring unavailable, falling back to epoll");
+        use_uring = 0;
+    }
+#endif
 
-    log_write(LOG_INFO, "Listening on %s:%d", cfg->bind_address, cfg->port);
+    r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epoll_fd < 0) {
+        log_write(LOG_ERROR, "epoll_create1(): %s", strerror(errno));
+        return -1;
+    }
+
+    /* Register the listener, edge-triggered: server_accept drains it */
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &listener_tag;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->listen_fd, &ev) < 0) {
+        log_write(LOG_ERROR, "epoll_ctl(listener): %s", strerror(errno));
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wake_tag;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd, &ev) < 0) {
+        log_write(LOG_ERROR, "epoll_ctl(eventfd): %s", strerror(errno));
+        return -1;
+    }
     return 0;
 }
 
-static void server_accept(void) {
-    struct sockaddr_in client_addr;
-    socklen_t addrlen = sizeof(client_addr);
-    int client_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &addrlen);
-    if (client_fd < 0) {
-        if (errno != EAGAIN && errno != EWOULDBLOCK)
-            log_write(LOG_WARN, "accept(): %s", strerror(errno));
-        return;
+static void reactor_close(reactor_t *r) {
+    if (r->epoll_fd >= 0)
+        close(r->epoll_fd);
+    if (r->listen_fd >= 0)
+        close(r->listen_fd);
+    if (r->wake_fd >= 0)
+        close(r->wake_fd);
+    r->epoll_fd = r->listen_fd = r->wake_fd = -1;
+
+#ifdef HAVE_IO_URING
+    if (r->ring.sq_map)
+        uring_close(&r->ring);
+#endif
+
+    free(r->sessions);
+    free(r->free_slots);
+    slab_destroy(&r->session_pool);
+    r->sessions = NULL;
+    r->free_slots = NULL;
+    r->nslots = r->nfree = 0;
+}
+
+int server_init(config_t *cfg) {
+    /* Install signal handlers */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    /* Ignore SIGPIPE */
+    signal(SIGPIPE, SIG_IGN);
+
+    raise_fd_limit();
+    admit_init(cfg);
+
+    if (cfg->io_backend == IO_BACKEND_URING) {
+#ifdef HAVE_IO_URING
+        use_uring = 1;
+#else
+        log_write(LOG_WARN, "Built without io_uring support, using epoll");
+#endif
+    }
+
+    nreactors = cfg->threads;
+    if (nreactors < 1)
+        nreactors = 1;
+    if (nreactors > MAX_REACTORS)
+        nreactors = MAX_REACTORS;
+
+    reactors = calloc((size_t)nreactors, sizeof(*reactors));
+    if (!reactors) {
+        log_write(LOG_ERROR, "Failed to allocate reactors");
+        return -1;
+    }
+
+    for (int i = 0; i < nreactors; i++) {
+        if (reactor_init(&reactors[i], i, cfg) < 0) {
+            for (int j = 0; j <= i; j++)
+                reactor_close(&reactors[j]);
+            free(reactors);
+            reactors = NULL;
+            return -1;
+        }
+    }
+
+    if (store_open(cfg) < 0 || usercache_init(cfg) < 0 || storage_init(cfg) < 0) {
+        usercache_shutdown();
+        store_close();
+        for (int i = 0; i < nreactors; i++)
+            reactor_close(&reactors[i]);
+        free(reactors);
+        reactors = NULL;
+        return -1;
+    }
+
+    log_write(LOG_INFO, "Listening on %s:%d (%d reactor thread%s, %s)",
+              cfg->bind_address, cfg->port, nreactors, nreactors == 1 ? "" : "s",
+              use_uring ? "io_uring" : "epoll");
+    log_write(LOG_INFO, "Per-session memory: %zu bytes session, ~%zu bytes XML parser, "
+              "%d bytes stanza arena, %zu bytes per roster contact once loaded",
+              sizeof(session_t), xml_parser_footprint(), ARENA_BLOCK_SIZE,
+              sizeof(roster_item_t));
+    return 0;
+}
+
+/* Start watching a new client socket for input */
+static int reactor_watch(reactor_t *r, session_t *s) {
+#ifdef HAVE_IO_URING
+    if (use_uring) {
+        if (uring_arm_recv(r, s) < 0) {
+            log_write(LOG_ERROR, "io_uring: no SQE for recv on fd %d", s->fd);
+            return -1;
+        }
+        return 0;
     }
+#endif
 
-    if (nfds >= MAX_CLIENTS) {
-        log_write(LOG_WARN, "Max clients reached, rejecting connection");
+    /* Client sockets are edge-triggered for both directions: readers
+     * drain until EAGAIN and writers rely on the EPOLLOUT edge only
+     * when a flush came up short. */
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = s;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, s->fd, &ev) < 0) {
+        log_write(LOG_ERROR, "epoll_ctl(fd %d): %s", s->fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int server_add_session(reactor_t *r, session_t *s) {
+    if (r->nfree == 0 && table_grow(r) < 0)
+        return -1;
+
+    int slot = r->free_slots[--r->nfree];
+    if (reactor_watch(r, s) < 0) {
+        r->free_slots[r->nfree++] = slot;
+        return -1;
+    }
+
+    s->reactor = r->index;
+    s->serial = atomic_fetch_add(&next_serial, 1);
+    s->slot = slot;
+    r->sessions[slot] = s;
+    return 0;
+}
+
+/* Set up a session for a freshly accepted, non-blocking client socket */
+static void server_new_client(reactor_t *r, int client_fd,
+                              const struct sockaddr_in *client_addr)
+{
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client_addr->sin_addr, ip, sizeof(ip));
+
+    int verdict = admit_connection(client_addr, r->now);
+    if (verdict != ADMIT_OK) {
+        log_write(LOG_DEBUG, "Refused connection from %s:%d (admission %d)",
+                  ip, ntohs(client_addr->sin_port), verdict);
         close(client_fd);
         return;
     }
 
-    set_nonblocking(client_fd);
-
-    session_t *s = session_create(client_fd);
+    session_t *s = session_create(&r->session_pool, client_fd);
     if (!s) {
         log_write(LOG_ERROR, "Failed to allocate session");
         close(client_fd);
         return;
     }
 
-    s->poll_index = nfds;
-    pollfds[nfds].fd = client_fd;
-    pollfds[nfds].events = POLLIN;
-    pollfds[nfds].revents = 0;
-    sessions[nfds] = s;
-    nfds++;
+    s->preauth = 1;
 
-    char ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip));
-    log_write(LOG_INFO, "Client connected from %s:%d (fd %d)",
-              ip, ntohs(client_addr.sin_port), client_fd);
+    if (server_add_session(r, s) < 0) {
+        session_destroy(s);
+        return;
+    }
+
+    log_write(LOG_INFO, "Client connected from %s:%d (fd %d, reactor %d)",
+              ip, ntohs(client_addr->sin_port), client_fd, r->index);
 }
 
-void server_run(void) {
+/* Drain the listener, but at most ACCEPT_BATCH connections per wakeup so
+ * that a login storm cannot starve established sessions; the rest are
+ * picked up on the next iteration without waiting */
+static void server_accept(reactor_t *r) {
+    r->accept_more = 0;
+    for (int n = 0; n < ACCEPT_BATCH; n++) {
+        struct sockaddr_in client_addr;
+        socklen_t addrlen = sizeof(client_addr);
+        int client_fd = accept4(r->listen_fd, (struct sockaddr *)&client_addr, &addrlen,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_write(LOG_WARN, "accept(): %s", strerror(errno));
+            return;
+        }
+        server_new_client(r, client_fd, &client_addr);
+    }
+    r->accept_more = 1;
+}
+
+static void server_dispatch_session(session_t *s, uint32_t events) {
+    if (s->state == STATE_DISCONNECTED)
+        return;
+
+    if (events & EPOLLERR) {
+        session_teardown(s);
+        return;
+    }
+    /* Peer hangup still goes through the read path so that any data it
+     * sent before closing is processed, and read() == 0 ends the session */
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+        session_on_readable(s);
+        if (s->state == STATE_DISCONNECTED)
+            return;
+    }
+    if (events & EPOLLOUT)
+        session_on_writable(s);
+}
+
+static session_t *reactor_resolve(reactor_t *r, const session_ref_t *ref) {
+    if (ref->slot < 0 || ref->slot >= r->nslots)
+        return NULL;
+    session_t *s = r->sessions[ref->slot];
+    if (!s || s->serial != ref->serial || s->state == STATE_DISCONNECTED)
+        return NULL;
+    return s;
+}
+
+static void reactor_push(reactor_t *r, task_t *t) {
+    task_t *head = atomic_load(&r->inbox);
+    do {
+        t->next = head;
+    } while (!atomic_compare_exchange_weak(&r->inbox, &head, t));
+
+    /* Only the push onto an empty inbox needs to wake the owner */
+    if (!head) {
+        uint64_t one = 1;
+        if (write(r->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            log_write(LOG_WARN, "eventfd write: %s", strerror(errno));
+    }
+}
+
+static task_t *task_new(size_t len, const void *arg) {
+    task_t *t = malloc(TASK_HDR_SIZE + len);
+    if (!t)
+        return NULL;
+    memset(t, 0, sizeof(*t));
+    t->len = len;
+    t->arg = (char *)t + TASK_HDR_SIZE;
+    if (len)
+        memcpy(t->arg, arg, len);
+    return t;
+}
+
+static void reactor_drain_inbox(reactor_t *r) {
+    /* With io_uring the ring has already consumed the eventfd counter */
+    if (!use_uring) {
+        uint64_t n;
+        while (read(r->wake_fd, &n, sizeof(n)) > 0)
+            ;
+    }
+
+    task_t *list = atomic_exchange(&r->inbox, NULL);
+
+    /* Reverse into posting order */
+    task_t *ordered = NULL;
+    while (list) {
+        task_t *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+
+    while (ordered) {
+        task_t *t = ordered;
+        ordered = t->next;
+        if (t->fn)
+            t->fn(reactor_resolve(r, &t->ref), t->arg, t->len);
+        else
+            t->rfn(t->arg, t->len);
+        free(t);
+    }
+}
+
+/* Run what is in r's inbox as if every target session were gone;
+ * reactor-wide tasks are dropped. Returns how many were taken. */
+static int reactor_abandon_inbox(reactor_t *r) {
+    task_t *list = atomic_exchange(&r->inbox, NULL);
+    task_t *ordered = NULL;
+    while (list) {
+        task_t *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+
+    int n = 0;
+    while (ordered) {
+        task_t *t = ordered;
+        ordered = t->next;
+        if (t->fn)
+            t->fn(NULL, t->arg, t->len);
+        free(t);
+        n++;
+    }
+    return n;
+}
+
+static void server_flush_pending(reactor_t *r) {
+    while (r->pending_flush) {
+        session_t *s = r->pending_flush;
+        r->pending_flush = s->next_flush;
+        s->next_flush = NULL;
+        s->flush_queued = 0;
+
+        if (s->state == STATE_DISCONNECTED)
+            continue;
+#ifdef HAVE_IO_URING
+        if (use_uring) {
+            uring_start_send(r, s);
+            continue;
+        }
+#endif
+        session_on_writable(s);
+    }
+}
+
+static void server_read_pending(reactor_t *r) {
+    while (r->pending_read) {
+        session_t *s = r->pending_read;
+        r->pending_read = s->next_read;
+        s->next_read = NULL;
+        s->read_queued = 0;
+
+        if (s->state == STATE_DISCONNECTED || s->read_holds)
+            continue;
+        session_resume_read(s);
+#ifdef HAVE_IO_URING
+        if (use_uring && s->state != STATE_DISCONNECTED && !s->read_holds &&
+            !s->recv_armed && uring_arm_recv(r, s) < 0) {
+            log_write(LOG_ERROR, "io_uring: no SQE for recv on fd %d", s->fd);
+            session_teardown(s);
+        }
+#endif
+    }
+}
+
+static void server_read_more_pending(reactor_t *r) {
+    /* Sessions going over budget again wait for the next iteration */
+    session_t *list = r->readable;
+    r->readable = NULL;
+    while (list) {
+        session_t *s = list;
+        list = s->next_more;
+        s->next_more = NULL;
+        s->more_queued = 0;
+
+        if (s->state == STATE_DISCONNECTED)
+            continue;
+        session_on_readable(s);
+    }
+}
+
+static void server_reap(reactor_t *r) {
+    while (r->graveyard) {
+        session_t *s = r->graveyard;
+        r->graveyard = s->next_dead;
+        /* Torn down after going over its read budget */
+        if (s->more_queued) {
+            session_t **pp = &r->readable;
+            while (*pp != s)
+                pp = &(*pp)->next_more;
+            *pp = s->next_more;
+            s->more_queued = 0;
+        }
+#ifdef HAVE_IO_URING
+        /* The kernel may still be writing into or reading from the
+         * session: cancel and free it once the last completion is in */
+        if (s->io_pending > 0) {
+            uring_cancel(r, s);
+            s->next_dead = r->zombies;
+            r->zombies = s;
+            continue;
+        }
+#endif
+        session_destroy(s);
+    }
+
+#ifdef HAVE_IO_URING
+    session_t **pp = &r->zombies;
+    while (*pp) {
+        session_t *s = *pp;
+        if (s->io_pending > 0) {
+            pp = &s->next_dead;
+            continue;
+        }
+        *pp = s->next_dead;
+        session_destroy(s);
+    }
+#endif
+}
+
+/* Sleep until the next timer is due, but never longer than MAX_WAIT_MS
+ * so that a shutdown signal landing just before the wait is noticed */
+static int reactor_wait_ms(reactor_t *r) {
+    if (r->accept_more || r->readable)
+        return 0;
+    int ms = wheel_timeout(&r->wheel, clock_ms());
+    return (ms < 0 || ms > MAX_WAIT_MS) ? MAX_WAIT_MS : ms;
+}
+
+/* End of a loop iteration: run due timers, give the sessions over their
+ * read budget another go, then write out everything queued by this
+ * batch (one flush per session) and free dead sessions */
+static void reactor_finish_batch(reactor_t *r) {
+    wheel_advance(&r->wheel, r->now);
+    server_read_more_pending(r);
+    /* Output drained by a flush can let paused senders resume, and
+     * whatever they then read queues more output */
+    do {
+        server_read_pending(r);
+        server_flush_pending(r);
+    } while (r->pending_read);
+    server_reap(r);
+}
+
+#ifdef HAVE_IO_URING
+static void uring_complete_recv(reactor_t *r, session_t *s, int res, unsigned flags) {
+    int more = (flags & IORING_CQE_F_MORE) != 0;
+    if (!more) {
+        s->io_pending--;
+        s->recv_armed = 0;
+    }
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && s->state != STATE_DISCONNECTED)
+            session_on_recv(s, uring_buf(&r->ring, bid), (size_t)res);
+        uring_buf_recycle(&r->ring, bid);
+    } else if (res == 0 && s->state != STATE_DISCONNECTED) {
+        session_on_recv(s, NULL, 0);
+    }
+
+    if (s->state == STATE_DISCONNECTED)
+        return;
+    /* Paused: stay quiet until server_read_pending re-arms us */
+    if (s->read_holds && !more)
+        return;
+    /* A live session's recv is only cancelled to pause it, and this pause
+     * may have been lifted before the cancellation came in */
+    if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+        log_write(LOG_WARN, "Read error on fd %d: %s", s->fd, strerror(-res));
+        session_teardown(s);
+        return;
+    }
+    /* The multishot request ended (e.g. buffers ran out): re-arm it */
+    if (!more && uring_arm_recv(r, s) < 0) {
+        log_write(LOG_ERROR, "io_uring: no SQE for recv on fd %d", s->fd);
+        session_teardown(s);
+    }
+}
+
+static void uring_complete_send(reactor_t *r, session_t *s, int res) {
+    s->io_pending--;
+    s->send_inflight = 0;
+    if (s->state == STATE_DISCONNECTED)
+        return;
+    if (res < 0) {
+        log_write(LOG_ERROR, "Write error on fd %d: %s", s->fd, strerror(-res));
+        session_teardown(s);
+        return;
+    }
+
+    /* Whatever is left, including output queued while this send was in
+     * flight, goes out with the next one */
+    session_sent(s, (size_t)res);
+    uring_start_send(r, s);
+}
+
+static void uring_complete(reactor_t *r, uint64_t user_data, int res, unsigned flags) {
+    unsigned op = (unsigned)(user_data & URING_OP_MASK);
+    session_t *s = (session_t *)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK);
+
+    switch (op) {
+    case URING_OP_ACCEPT:
+        if (res >= 0) {
+            struct sockaddr_in client_addr;
+            socklen_t addrlen = sizeof(client_addr);
+            memset(&client_addr, 0, sizeof(client_addr));
+            getpeername(res, (struct sockaddr *)&client_addr, &addrlen);
+            server_new_client(r, res, &client_addr);
+        } else if (res != -ECANCELED) {
+            log_write(LOG_WARN, "accept(): %s", strerror(-res));
+        }
+        if (!(flags & IORING_CQE_F_MORE) && !shutdown_flag)
+            uring_arm_accept(r);
+        break;
+    case URING_OP_WAKE:
+        reactor_drain_inbox(r);
+        if (!shutdown_flag)
+            uring_arm_wake(r);
+        break;
+    case URING_OP_RECV:
+        uring_complete_recv(r, s, res, flags);
+        break;
+    case URING_OP_SEND:
+        uring_complete_send(r, s, res);
+        break;
+    default:
+        break;
+    }
+}
+
+/* One io_uring_enter per iteration both submits everything the previous
+ * batch queued (sends, re-armed requests) and waits for completions */
+static void uring_loop(reactor_t *r) {
     while (!shutdown_flag) {
-        int ready = poll(pollfds, (nfds_t)nfds, 1000);
+        int rc = uring_submit_and_wait(&r->ring, reactor_wait_ms(r));
+        if (rc < 0 && rc != -EINTR) {
+            log_write(LOG_ERROR, "io_uring_enter(): %s", strerror(-rc));
+            break;
+        }
+        r->now = clock_ms();
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&r->ring)) != NULL) {
+            uint64_t user_data = cqe->user_data;
+            int      res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(&r->ring);
+            uring_complete(r, user_data, res, flags);
+        }
+
+        reactor_finish_batch(r);
+    }
+}
+#endif /* HAVE_IO_URING */
+
+static void reactor_loop(reactor_t *r) {
+    struct epoll_event events[MAX_EVENTS];
+
+    current = r;
+#ifdef HAVE_IO_URING
+    if (use_uring) {
+        uring_loop(r);
+        return;
+    }
+#endif
+    while (!shutdown_flag) {
+        int ready = epoll_wait(r->epoll_fd, events, MAX_EVENTS, reactor_wait_ms(r));
         if (ready < 0) {
             if (errno == EINTR)
                 continue;
-            log_write(LOG_ERROR, "poll(): %s", strerror(errno));
+            log_write(LOG_ERROR, "epoll_wait(): %s", strerror(errno));
             break;
         }
+        r->now = clock_ms();
 
-        /* Check listener for new connections */
-        if (pollfds[0].revents & POLLIN)
-            server_accept();
+        if (r->accept_more)
+            server_accept(r);
 
-        /* Process client events */
-        for (int i = 1; i < nfds; i++) {
-            if (!sessions[i])
-                continue;
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == &listener_tag)
+                server_accept(r);
+            else if (events[i].data.ptr == &wake_tag)
+                reactor_drain_inbox(r);
+            else
+                server_dispatch_session(events[i].data.ptr, events[i].events);
+        }
 
-            if (pollfds[i].revents & (POLLERR | POLLHUP)) {
-                session_teardown(sessions[i]);
-                /* After teardown, sessions[i] may have changed (swap) */
-                i--;
-                continue;
-            }
-            if (pollfds[i].revents & POLLIN) {
-                session_on_readable(sessions[i]);
-                if (!sessions[i] || sessions[i]->state == STATE_DISCONNECTED) {
-                    i--;
-                    continue;
-                }
-            }
-            if (pollfds[i].revents & POLLOUT) {
-                session_on_writable(sessions[i]);
-                if (!sessions[i] || sessions[i]->state == STATE_DISCONNECTED) {
-                    i--;
-                    continue;
-                }
-            }
+        reactor_finish_batch(r);
+    }
+}
+
+static void *reactor_thread(void *arg) {
+    reactor_loop(arg);
+    xml_parser_pool_drain();
+    return NULL;
+}
+
+void server_run(void) {
+    /* Worker threads leave SIGINT/SIGTERM to the main thread */
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    int started = 1;
+    for (int i = 1; i < nreactors; i++) {
+        int rc = pthread_create(&reactors[i].thread, NULL, reactor_thread, &reactors[i]);
+        if (rc != 0) {
+            log_write(LOG_ERROR, "pthread_create(): %s", strerror(rc));
+            shutdown_flag = 1;
+            break;
         }
+        started++;
     }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    reactor_loop(&reactors[0]);
+
+    /* Make sure the other reactors notice promptly */
+    shutdown_flag = 1;
+    for (int i = 1; i < started; i++) {
+        uint64_t one = 1;
+        if (write(reactors[i].wake_fd, &one, sizeof(one)) < 0)
+            log_write(LOG_WARN, "eventfd write: %s", strerror(errno));
+    }
+    for (int i = 1; i < started; i++)
+        pthread_join(reactors[i].thread, NULL);
 }
 
 void server_shutdown(void) {
     log_write(LOG_INFO, "Shutting down server");
 
-    /* Send stream close to all active sessions */
-    for (int i = 1; i < nfds; i++) {
-        if (sessions[i]) {
-            session_write_str(sessions[i],
-                "<stream:error>"
-                "<system-shutdown xmlns='urn:ietf:params:xml:ns:xmpp-streams'/>"
-                "</stream:error>"
-                "</stream:stream>");
-            session_flush(sessions[i]);
-            session_destroy(sessions[i]);
-            sessions[i] = NULL;
+    /* Finish the storage work still queued while the reactors' eventfds
+     * can take its completions, run below */
+    storage_shutdown();
+    usercache_shutdown();
+
+    /* Session tasks still queued get their target-gone path (store the
+     * message offline, put a drained batch back, drop a segment). What
+     * they post in turn may land in an inbox already emptied, so go
+     * round until all are empty; the store is still open. */
+    int ran;
+    do {
+        ran = 0;
+        for (int r = 0; r < nreactors; r++) {
+            current = &reactors[r];
+            ran += reactor_abandon_inbox(current);
         }
-    }
-    nfds = 1;
+    } while (ran);
+    current = NULL;
+
+    for (int r = 0; r < nreactors; r++) {
+        reactor_t *re = &reactors[r];
+        current = re;
+
+#ifdef HAVE_IO_URING
+        /* Stop the kernel from touching session buffers before they go */
+        if (re->ring.sq_map)
+            uring_close(&re->ring);
+#endif
 
-    if (listen_fd >= 0) {
-        close(listen_fd);
-        listen_fd = -1;
+        /* Send stream close to all active sessions */
+        for (int i = 0; i < re->nslots; i++) {
+            session_t *s = re->sessions[i];
+            if (s) {
+                session_write_str(s,
+                    "<stream:error>"
+                    "<system-shutdown xmlns='urn:ietf:params:xml:ns:xmpp-streams'/>"
+                    "</stream:error>"
+                    "</stream:stream>");
+                session_flush(s);
+                session_destroy(s);
+                re->sessions[i] = NULL;
+            }
+        }
+        re->pending_flush = NULL;
+        re->pending_read = NULL;
+        re->readable = NULL;
+        while (re->graveyard) {
+            session_t *s = re->graveyard;
+            re->graveyard = s->next_dead;
+            session_destroy(s);
+        }
+#ifdef HAVE_IO_URING
+        while (re->zombies) {
+            session_t *s = re->zombies;
+            re->zombies = s->next_dead;
+            session_destroy(s);
+        }
+#endif
+        reactor_close(re);
     }
+    current = NULL;
+    xml_parser_pool_drain();
+    store_close();
+
+    session_log_backpressure();
+
+    free(reactors);
+    reactors = NULL;
+    nreactors = 0;
 }
 
 /* --- Accessors for session module --- */
 
-struct pollfd *server_get_pollfd(int index) {
-    if (index >= 0 && index < MAX_CLIENTS)
-        return &pollfds[index];
-    return NULL;
+session_t **server_get_sessions(void) {
+    return current ? current->sessions : NULL;
 }
 
-session_t **server_get_sessions(void) {
-    return sessions;
+int server_get_nslots(void) {
+    return current ? current->nslots : 0;
 }
 
-int server_get_nfds(void) {
-    return nfds;
+uint64_t server_now(void) {
+    return current ? current->now : clock_ms();
+}
+
+void server_timer_arm(wheel_timer_t *t, uint64_t delay_ms) {
+    if (current)
+        wheel_arm(&current->wheel, t, current->now + delay_ms);
+}
+
+void server_timer_cancel(wheel_timer_t *t) {
+    if (current && wheel_armed(t))
+        wheel_cancel(&current->wheel, t);
+}
+
+void server_want_write(session_t *s) {
+    if (!s || s->flush_queued || s->slot < 0)
+        return;
+    reactor_t *r = &reactors[s->reactor];
+    s->flush_queued = 1;
+    s->next_flush = r->pending_flush;
+    r->pending_flush = s;
+}
+
+void server_pause_read(session_t *s) {
+#ifdef HAVE_IO_URING
+    /* epoll sessions check read_holds before reading */
+    if (use_uring && s->slot >= 0)
+        uring_cancel_recv(&reactors[s->reactor], s);
+#else
+    (void)s;
+#endif
+}
+
+void server_want_read(session_t *s) {
+    if (!s || s->read_queued || s->slot < 0)
+        return;
+    reactor_t *r = &reactors[s->reactor];
+    s->read_queued = 1;
+    s->next_read = r->pending_read;
+    r->pending_read = s;
+}
+
+void server_read_more(session_t *s) {
+    if (!s || s->more_queued || s->slot < 0)
+        return;
+    reactor_t *r = &reactors[s->reactor];
+    s->more_queued = 1;
+    s->next_more = r->readable;
+    r->readable = s;
 }
 
 void server_remove_session(session_t *s) {
-    if (!s)
+    if (!s || s->slot < 0)
+        return;
+    reactor_t *r = &reactors[s->reactor];
+
+    /* Closing the fd would drop the registration too, but the fd is only
+     * closed when the session is reaped */
+    if (!use_uring)
+        epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+
+    r->sessions[s->slot] = NULL;
+    r->free_slots[r->nfree++] = s->slot;
+    s->slot = -1;
+
+    /* A queued flush is skipped once the session is disconnected */
+    s->next_dead = r->graveyard;
+    r->graveyard = s;
+}
+
+/* --- Cross-reactor delivery --- */
+
+void server_post(const session_ref_t *ref, session_task_fn fn,
+                 const void *arg, size_t len)
+{
+    if (!ref || ref->reactor < 0 || ref->reactor >= nreactors)
         return;
 
-    int idx = s->poll_index;
-    if (idx < 1 || idx >= nfds)
+    reactor_t *r = &reactors[ref->reactor];
+    if (r == current) {
+        fn(reactor_resolve(r, ref), (void *)arg, len);
         return;
+    }
 
-    /* Swap with last entry to compact the array */
-    int last = nfds - 1;
-    if (idx != last) {
-        pollfds[idx] = pollfds[last];
-        sessions[idx] = sessions[last];
-        if (sessions[idx])
-            sessions[idx]->poll_index = idx;
+    task_t *t = task_new(len, arg);
+    if (!t) {
+        log_write(LOG_ERROR, "Failed to allocate cross-reactor task");
+        return;
+    }
+    t->ref = *ref;
+    t->fn = fn;
+    reactor_push(r, t);
+}
+
+void server_post_all(reactor_task_fn fn, const void *arg, size_t len) {
+    for (int i = 0; i < nreactors; i++) {
+        reactor_t *r = &reactors[i];
+        if (r == current)
+            continue;
+        task_t *t = task_new(len, arg);
+        if (!t) {
+            log_write(LOG_ERROR, "Failed to allocate cross-reactor task");
+            continue;
+        }
+        t->rfn = fn;
+        reactor_push(r, t);
     }
 
-    pollfds[last].fd = -1;
-    pollfds[last].events = 0;
-    pollfds[last].revents = 0;
-    sessions[last] = NULL;
-    nfds--;
+    /* Run locally last so remote reactors get started in parallel */
+    if (current)
+        fn((void *)arg, len);
 }
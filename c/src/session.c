@@ -1,8 +1,13 @@
+#define _GNU_SOURCE     /* pthread_rwlock_t */
 #include "session.h"
 #include "server.h"
 #include "stanza.h"
 #include "stream.h"
 #include "presence.h"
+#include "message.h"
+#include "roster.h"
+#include "admit.h"
+#include "template.h"
 #include "config.h"
 #include "xml.h"
 #include "log.h"
@@ -12,23 +17,362 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
-#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*
+ * Directory of bound sessions, keyed by bare JID. It is the only session
+ * state shared between reactors: each entry names the owning reactor and
+ * everything else goes through server_post().
+ *
+ * Chained hash table. Lookups hash the bare part of whatever JID they are
+ * given in place, so routing never has to format a key.
+ */
+typedef struct dir_entry {
+    struct dir_entry *next;
+    uint32_t          hash;
+    session_ref_t     ref;
+    char              bare[];
+} dir_entry_t;
+
+#define DIR_BUCKETS_INIT 256
+
+static dir_entry_t    **dir_buckets = NULL;
+static size_t           dir_nbuckets = 0;       /* power of two */
+static size_t           dir_count = 0;
+static pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* FNV-1a */
+static uint32_t dir_hash(const char *key, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Link pointing at the entry for bare[0..len), or at the NULL ending its
+ * bucket if there is none. The table must have been allocated. */
+static dir_entry_t **dir_find(const char *bare, size_t len, uint32_t hash) {
+    dir_entry_t **pp = &dir_buckets[hash & (dir_nbuckets - 1)];
+    for (; *pp; pp = &(*pp)->next) {
+        dir_entry_t *e = *pp;
+        if (e->hash == hash && strncmp(e->bare, bare, len) == 0 && e->bare[len] == '\0')
+            break;
+    }
+    return pp;
+}
+
+static int dir_resize(size_t nbuckets) {
+    dir_entry_t **buckets = calloc(nbuckets, sizeof(*buckets));
+    if (!buckets)
+        return -1;
+
+    for (size_t i = 0; i < dir_nbuckets; i++) {
+        dir_entry_t *e = dir_buckets[i];
+        while (e) {
+            dir_entry_t *next = e->next;
+            dir_entry_t **head = &buckets[e->hash & (nbuckets - 1)];
+            e->next = *head;
+            *head = e;
+            e = next;
+        }
+    }
+    free(dir_buckets);
+    dir_buckets = buckets;
+    dir_nbuckets = nbuckets;
+    return 0;
+}
+
+/* Register s under its bare JID, replacing any previous owner. Returns 1
+ * and fills prev if the JID was bound to another session. */
+static int dir_register(session_t *s, session_ref_t *prev) {
+    char bare[512];
+    jid_bare(s->jid_local, s->jid_domain, bare, sizeof(bare));
+    size_t len = strlen(bare);
+    uint32_t hash = dir_hash(bare, len);
+    int replaced = 0;
+
+    pthread_rwlock_wrlock(&dir_lock);
+    if (dir_nbuckets == 0 && dir_resize(DIR_BUCKETS_INIT) < 0) {
+        pthread_rwlock_unlock(&dir_lock);
+        log_write(LOG_ERROR, "Failed to allocate session directory");
+        return 0;
+    }
+    /* Keep chains short; if growing fails they just get longer */
+    if (dir_count >= dir_nbuckets)
+        dir_resize(dir_nbuckets * 2);
+
+    dir_entry_t **pp = dir_find(bare, len, hash);
+    dir_entry_t *e = *pp;
+    if (e) {
+        *prev = e->ref;
+        replaced = 1;
+    } else {
+        e = malloc(sizeof(*e) + len + 1);
+        if (!e) {
+            pthread_rwlock_unlock(&dir_lock);
+            log_write(LOG_ERROR, "Failed to grow session directory");
+            return 0;
+        }
+        e->next = NULL;
+        e->hash = hash;
+        memcpy(e->bare, bare, len + 1);
+        *pp = e;
+        dir_count++;
+    }
+    session_get_ref(s, &e->ref);
+    pthread_rwlock_unlock(&dir_lock);
+
+    s->in_directory = 1;
+    return replaced;
+}
+
+/* Drop s from the directory unless a newer session has taken over its JID */
+static void dir_unregister(session_t *s) {
+    char bare[512];
+    jid_bare(s->jid_local, s->jid_domain, bare, sizeof(bare));
+    size_t len = strlen(bare);
+    uint32_t hash = dir_hash(bare, len);
+
+    session_ref_t ref;
+    session_get_ref(s, &ref);
+
+    pthread_rwlock_wrlock(&dir_lock);
+    dir_entry_t **pp = dir_find(bare, len, hash);
+    dir_entry_t *e = *pp;
+    if (e && session_ref_equal(&e->ref, &ref)) {
+        *pp = e->next;
+        free(e);
+        dir_count--;
+    }
+    pthread_rwlock_unlock(&dir_lock);
+
+    s->in_directory = 0;
+}
+
+/* --- Outbound backpressure --- */
+
+/* Session whose input the calling reactor is handling */
+static _Thread_local session_t *reading = NULL;
+
+/* How often each slow-consumer policy fired, process-wide */
+static atomic_ulong bp_congested = 0;
+static atomic_ulong bp_dropped = 0;
+static atomic_ulong bp_throttled = 0;
+static atomic_ulong bp_disconnected = 0;
+
+/* Runs on the sender's reactor */
+static void hold_task(session_t *sender, void *arg, size_t len) {
+    (void)arg; (void)len;
+    if (sender && sender->read_holds++ == 0)
+        server_pause_read(sender);
+}
+
+static void release_task(session_t *sender, void *arg, size_t len) {
+    (void)arg; (void)len;
+    if (sender && sender->read_holds > 0 && --sender->read_holds == 0)
+        server_want_read(sender);
+}
+
+/* Pause reading from sender until s has drained */
+static void session_hold(session_t *s, const session_ref_t *sender) {
+    for (int i = 0; i < s->nholds; i++) {
+        if (session_ref_equal(&s->holds[i], sender))
+            return;
+    }
+    if (s->nholds == s->holds_cap) {
+        int cap = s->holds_cap ? s->holds_cap * 2 : 4;
+        session_ref_t *holds = realloc(s->holds, (size_t)cap * sizeof(*holds));
+        if (!holds)
+            return;
+        s->holds = holds;
+        s->holds_cap = cap;
+    }
+    s->holds[s->nholds++] = *sender;
+    atomic_fetch_add_explicit(&bp_throttled, 1, memory_order_relaxed);
+    server_post(sender, hold_task, NULL, 0);
+}
+
+static void session_release_holds(session_t *s) {
+    for (int i = 0; i < s->nholds; i++)
+        server_post(&s->holds[i], release_task, NULL, 0);
+    s->nholds = 0;
+}
+
+/* Called whenever output has been queued on s */
+static void session_check_backlog(session_t *s) {
+    long high = g_config.out_high_watermark;
+    if (high <= 0 || s->state == STATE_DISCONNECTED)
+        return;
+
+    if (!s->congested) {
+        if (s->out.len < (size_t)high)
+            return;
+        s->congested = 1;
+        atomic_fetch_add_explicit(&bp_congested, 1, memory_order_relaxed);
+        log_write(LOG_WARN, "Slow consumer on fd %d (user=%s): %zu bytes queued",
+                  s->fd, s->jid_local[0] ? s->jid_local : "(none)", s->out.len);
+
+        if (g_config.slow_policy == SLOW_POLICY_DISCONNECT) {
+            atomic_fetch_add_explicit(&bp_disconnected, 1, memory_order_relaxed);
+            if (s->in_xml_parse)
+                s->teardown_pending = 1;
+            else
+                session_teardown(s);
+            return;
+        }
+    }
+
+    /* Output produced while handling input on this reactor is charged to
+     * that input's session, which may be s itself */
+    if (g_config.slow_policy == SLOW_POLICY_THROTTLE && reading) {
+        session_ref_t sender;
+        session_get_ref(reading, &sender);
+        session_hold(s, &sender);
+    }
+}
+
+int session_sender(session_ref_t *ref) {
+    if (!reading)
+        return 0;
+    session_get_ref(reading, ref);
+    return 1;
+}
+
+int session_admit(session_t *s, const session_ref_t *sender, int droppable) {
+    if (!s->congested)
+        return 1;
 
-session_t *session_create(int fd) {
-    session_t *s = calloc(1, sizeof(session_t));
+    if (g_config.slow_policy == SLOW_POLICY_DROP && droppable) {
+        atomic_fetch_add_explicit(&bp_dropped, 1, memory_order_relaxed);
+        return 0;
+    }
+    if (g_config.slow_policy == SLOW_POLICY_THROTTLE && sender)
+        session_hold(s, sender);
+    return 1;
+}
+
+void session_log_backpressure(void) {
+    log_write(LOG_INFO, "Slow consumers: %lu over high watermark, %lu stanzas dropped, "
+              "%lu senders throttled, %lu disconnected",
+              atomic_load(&bp_congested), atomic_load(&bp_dropped),
+              atomic_load(&bp_throttled), atomic_load(&bp_disconnected));
+}
+
+/* --- Deadlines --- */
+
+/* Handshake deadline until the resource is bound, then idle detection:
+ * after idle_timeout of silence send a XEP-0199 ping, and give up if
+ * nothing at all arrives within ping_timeout of it */
+static void session_read_timeout(wheel_timer_t *t) {
+    session_t *s = (session_t *)((char *)t - offsetof(session_t, read_timer));
+    if (s->state == STATE_DISCONNECTED)
+        return;
+
+    if (s->state < STATE_BOUND) {
+        log_write(LOG_INFO, "Handshake timeout on fd %d", s->fd);
+        stream_send_error(s, "connection-timeout");
+        return;
+    }
+    if (g_config.idle_timeout <= 0)
+        return;
+
+    uint64_t now = server_now();
+    uint64_t limit = (uint64_t)g_config.idle_timeout * 1000;
+
+    /* We are not reading what it sends, so silence proves nothing */
+    if (s->read_holds) {
+        s->ping_pending = 0;
+        server_timer_arm(t, limit);
+        return;
+    }
+    uint64_t idle = now - s->last_read;
+
+    if (s->ping_pending) {
+        /* Reading cleared ping_pending, so nothing came back */
+        log_write(LOG_INFO, "Ping timeout for %s (fd %d)", s->jid_local, s->fd);
+        stream_send_error(s, "connection-timeout");
+        return;
+    }
+    if (idle < limit) {
+        server_timer_arm(t, limit - idle);
+        return;
+    }
+    if (g_config.ping_timeout <= 0) {
+        log_write(LOG_INFO, "Idle timeout for %s (fd %d)", s->jid_local, s->fd);
+        stream_send_error(s, "connection-timeout");
+        return;
+    }
+
+    char full_jid[768], id[20];
+    jid_full(s->jid_local, s->jid_domain, s->jid_resource, full_jid, sizeof(full_jid));
+    generate_id(id, 8);
+    tmpl_send(s, TMPL_PING, (const char *[]){ full_jid, id });
+    s->ping_pending = 1;
+    server_timer_arm(t, (uint64_t)g_config.ping_timeout * 1000);
+}
+
+/* Output has been queued without any of it being written for
+ * write_timeout: the client has stopped reading */
+static void session_write_timeout(wheel_timer_t *t) {
+    session_t *s = (session_t *)((char *)t - offsetof(session_t, write_timer));
+    if (s->state == STATE_DISCONNECTED || s->out.len == 0)
+        return;
+
+    uint64_t limit = (uint64_t)g_config.write_timeout * 1000;
+    uint64_t stalled = server_now() - s->last_write;
+    if (stalled < limit) {
+        server_timer_arm(t, limit - stalled);
+        return;
+    }
+
+    log_write(LOG_WARN, "Output stalled on fd %d (%zu bytes queued), disconnecting",
+              s->fd, s->out.len);
+    session_teardown(s);
+}
+
+void session_sent(session_t *s, size_t n) {
+    if (n) {
+        outbuf_consume(&s->out, n);
+        s->out_sent += n;
+        s->last_write = server_now();
+        if (s->offline_unacked && s->out_sent >= s->offline_sent_at)
+            message_offline_sent(s);
+
+        if (s->congested && s->out.len <= (size_t)g_config.out_low_watermark) {
+            s->congested = 0;
+            log_write(LOG_DEBUG, "Slow consumer on fd %d caught up", s->fd);
+            session_release_holds(s);
+        }
+    }
+
+    if (s->out.len == 0) {
+        server_timer_cancel(&s->write_timer);
+    } else if (g_config.write_timeout > 0 && !wheel_armed(&s->write_timer)) {
+        /* Output just started backing up: time it from here */
+        s->last_write = server_now();
+        server_timer_arm(&s->write_timer, (uint64_t)g_config.write_timeout * 1000);
+    }
+}
+
+session_t *session_create(slab_t *slab, int fd) {
+    session_t *s = slab_alloc(slab);
     if (!s)
         return NULL;
 
+    s->slab = slab;
     s->fd = fd;
     s->state = STATE_CONNECTED;
+    s->slot = -1;
 
-    s->write_buf = malloc(WRITE_BUF_INIT);
-    if (!s->write_buf) {
-        free(s);
-        return NULL;
-    }
-    s->write_cap = WRITE_BUF_INIT;
-    s->write_len = 0;
+    s->read_timer.fn = session_read_timeout;
+    s->write_timer.fn = session_write_timeout;
+    s->last_read = s->last_write = server_now();
+    if (g_config.handshake_timeout > 0)
+        server_timer_arm(&s->read_timer, (uint64_t)g_config.handshake_timeout * 1000);
 
     /* Create XML push parser for this session */
     xml_parser_create(s);
@@ -40,133 +384,224 @@ void session_destroy(session_t *s) {
     if (!s)
         return;
 
-    if (s->xml_ctx) {
-        xmlFreeParserCtxt(s->xml_ctx);
-        s->xml_ctx = NULL;
-    }
-    if (s->current_stanza) {
-        xmlFreeNode(s->current_stanza);
-        s->current_stanza = NULL;
-    }
-    if (s->presence_stanza) {
-        xmlFreeNode(s->presence_stanza);
-        s->presence_stanza = NULL;
-    }
+    server_timer_cancel(&s->read_timer);
+    server_timer_cancel(&s->write_timer);
+    if (s->preauth)
+        admit_preauth_done();
+
+    xml_parser_destroy(s);
+    arena_destroy(&s->arena);
+    if (s->presence_stanza)
+        outseg_unref(s->presence_stanza);
+    s->presence_stanza = NULL;
 
-    free(s->write_buf);
+    outbuf_clear(&s->out);
+    outbuf_clear(&s->held_in);
+    stanza_free_deferred(s);
+    free(s->holds);
+    roster_free(&s->roster);
 
     if (s->fd >= 0)
         close(s->fd);
 
-    free(s);
+    slab_free(s->slab, s);
 }
 
 void session_write(session_t *s, const char *data, size_t len) {
     if (!s || !data || len == 0)
         return;
 
-    /* Grow buffer if needed */
-    if (s->write_len + len > s->write_cap) {
-        size_t new_cap = s->write_cap * 2;
-        if (new_cap < s->write_len + len)
-            new_cap = s->write_len + len;
-        char *new_buf = realloc(s->write_buf, new_cap);
-        if (!new_buf) {
-            log_write(LOG_ERROR, "Failed to grow write buffer for fd %d", s->fd);
-            session_teardown(s);
-            return;
-        }
-        s->write_buf = new_buf;
-        s->write_cap = new_cap;
+    if (outbuf_append(&s->out, data, len) < 0) {
+        log_write(LOG_ERROR, "Failed to grow write buffer for fd %d", s->fd);
+        session_teardown(s);
+        return;
     }
 
-    memcpy(s->write_buf + s->write_len, data, len);
-    s->write_len += len;
-
     log_xml_out(data, len);
+    session_check_backlog(s);
 
-    /* Set POLLOUT on this session's pollfd */
-    struct pollfd *pfd = server_get_pollfd(s->poll_index);
-    if (pfd)
-        pfd->events |= POLLOUT;
+    /* Flushed by the reactor once the current batch of events is handled */
+    server_want_write(s);
 }
 
 void session_write_str(session_t *s, const char *str) {
     session_write(s, str, strlen(str));
 }
 
-int session_flush(session_t *s) {
-    if (!s || s->write_len == 0)
-        return 0;
+void session_write_seg(session_t *s, outseg_t *seg) {
+    if (!s || !seg || seg->len == 0)
+        return;
 
-    ssize_t n = write(s->fd, s->write_buf, s->write_len);
-    if (n < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-            return 0;
-        log_write(LOG_ERROR, "Write error on fd %d: %s", s->fd, strerror(errno));
-        return -1;
+    if (outbuf_attach(&s->out, seg) < 0) {
+        log_write(LOG_ERROR, "Failed to grow write buffer for fd %d", s->fd);
+        session_teardown(s);
+        return;
     }
 
-    if ((size_t)n < s->write_len) {
-        memmove(s->write_buf, s->write_buf + n, s->write_len - (size_t)n);
+    log_xml_out(seg->data, seg->len);
+    session_check_backlog(s);
+    server_want_write(s);
+}
+
+char *session_reserve(session_t *s, size_t len) {
+    char *p = outbuf_reserve(&s->out, len);
+    if (!p) {
+        log_write(LOG_ERROR, "Failed to grow write buffer for fd %d", s->fd);
+        session_teardown(s);
     }
-    s->write_len -= (size_t)n;
+    return p;
+}
 
-    /* Clear POLLOUT if buffer drained */
-    if (s->write_len == 0) {
-        struct pollfd *pfd = server_get_pollfd(s->poll_index);
-        if (pfd)
-            pfd->events &= ~POLLOUT;
+void session_commit(session_t *s, const char *data, size_t len) {
+    log_xml_out(data, len);
+    session_check_backlog(s);
+    server_want_write(s);
+}
+
+int session_flush(session_t *s) {
+    if (!s)
+        return 0;
+
+    /* Earlier output is still queued in the kernel; writing now would
+     * overtake it */
+    if (s->send_inflight)
+        return 0;
+
+    while (s->out.len > 0) {
+        struct iovec iov[OUTBUF_IOV_MAX];
+        int iovcnt = outbuf_iov(&s->out, iov, OUTBUF_IOV_MAX);
+
+        ssize_t n = writev(s->fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            log_write(LOG_ERROR, "Write error on fd %d: %s", s->fd, strerror(errno));
+            return -1;
+        }
+
+        /* A partial write only moves the head offset */
+        session_sent(s, (size_t)n);
     }
 
+    /* Anything left is written on the next EPOLLOUT edge */
+    session_sent(s, 0);
     return 0;
 }
 
-session_t *session_find_by_jid(const char *bare_jid) {
-    session_t **sessions = server_get_sessions();
-    int nfds = server_get_nfds();
+void session_get_ref(session_t *s, session_ref_t *ref) {
+    ref->reactor = s->reactor;
+    ref->slot    = s->slot;
+    ref->serial  = s->serial;
+}
 
-    for (int i = 1; i < nfds; i++) {
-        session_t *s = sessions[i];
-        if (!s || s->jid_local[0] == '\0')
-            continue;
+int session_ref_equal(const session_ref_t *a, const session_ref_t *b) {
+    return a->reactor == b->reactor && a->slot == b->slot &&
+           a->serial == b->serial;
+}
 
-        char jid[512];
-        jid_bare(s->jid_local, s->jid_domain, jid, sizeof(jid));
-        if (strcmp(jid, bare_jid) == 0)
-            return s;
+int session_lookup(const char *jid, session_ref_t *ref) {
+    size_t len = strcspn(jid, "/");
+    uint32_t hash = dir_hash(jid, len);
+    int found = 0;
+
+    pthread_rwlock_rdlock(&dir_lock);
+    if (dir_nbuckets) {
+        dir_entry_t *e = *dir_find(jid, len, hash);
+        if (e) {
+            *ref = e->ref;
+            found = 1;
+        }
     }
-    return NULL;
+    pthread_rwlock_unlock(&dir_lock);
+    return found;
 }
 
-void session_on_readable(session_t *s) {
-    ssize_t n = read(s->fd, s->read_buf + s->read_len,
-                     sizeof(s->read_buf) - s->read_len);
-    if (n <= 0) {
-        if (n < 0)
-            log_write(LOG_WARN, "Read error on fd %d: %s", s->fd, strerror(errno));
-        else
-            log_write(LOG_INFO, "Client fd %d closed connection", s->fd);
-        session_teardown(s);
-        return;
-    }
+/* A shared segment on its way to another session. The segment reference
+ * is handed over with the task. */
+typedef struct seg_delivery {
+    outseg_t     *seg;
+    int           droppable;
+    int           has_sender;
+    session_ref_t sender;
+} seg_delivery_t;
+
+static void deliver_seg_task(session_t *target, void *arg, size_t len) {
+    (void)len;
+    seg_delivery_t *sd = arg;
+    if (target && session_admit(target, sd->has_sender ? &sd->sender : NULL,
+                                sd->droppable))
+        session_write_seg(target, sd->seg);
+    outseg_unref(sd->seg);
+}
 
-    log_xml_in(s->read_buf + s->read_len, (size_t)n);
-    s->read_len += (size_t)n;
+void session_deliver_seg(const session_ref_t *ref, outseg_t *seg, int droppable) {
+    seg_delivery_t sd;
+    memset(&sd, 0, sizeof(sd));
+    sd.seg = seg;
+    sd.droppable = droppable;
+    sd.has_sender = session_sender(&sd.sender);
 
-    /* Check for read buffer overflow */
-    if (s->read_len >= sizeof(s->read_buf)) {
-        log_write(LOG_WARN, "Read buffer overflow on fd %d", s->fd);
-        session_teardown(s);
+    outseg_ref(seg);
+    server_post(ref, deliver_seg_task, &sd, sizeof(sd));
+}
+
+void session_deliver(const session_ref_t *ref, const char *data, size_t len,
+                     int droppable)
+{
+    if (len == 0)
+        return;
+    outseg_t *seg = outseg_new(data, len);
+    if (!seg) {
+        log_write(LOG_ERROR, "Failed to allocate delivery of %zu bytes", len);
         return;
     }
+    session_deliver_seg(ref, seg, droppable);
+    outseg_unref(seg);
+}
 
-    /* Feed to XML parser if initialized */
-    if (s->xml_ctx) {
+void session_run_on(const char *bare_jid, session_task_fn fn,
+                    const void *arg, size_t len)
+{
+    session_ref_t ref;
+    if (session_lookup(bare_jid, &ref))
+        server_post(&ref, fn, arg, len);
+    else
+        fn(NULL, (void *)arg, len);
+}
+
+/* Reads land here and go straight to the parser, which keeps whatever
+ * part of a stanza it has not seen the end of. Per thread, so a session
+ * holds no input buffer of its own. */
+static _Thread_local char read_chunk[READ_CHUNK_SIZE];
+
+void session_stanza_too_big(session_t *s) {
+    log_write(LOG_WARN, "Stanza over %ld bytes on fd %d (user=%s)",
+              g_config.max_stanza_size, s->fd,
+              s->jid_local[0] ? s->jid_local : "(none)");
+    /* Nothing more from this stream is looked at */
+    if (s->in_xml_parse)
+        xml_parser_stop(s);
+    stream_send_error(s, "policy-violation");
+}
+
+/* Run the work put off while parsing or suspended: stanzas that came in
+ * meanwhile, the parser reset after SASL success and teardown. Returns
+ * -1 if the session was torn down. */
+static int session_settle(session_t *s) {
+    if (s->state == STATE_DISCONNECTED)
+        return -1;
+
+    if (s->deferred && !s->suspended) {
+        session_t *outer = reading;
+        reading = s;
         s->in_xml_parse = 1;
-        xmlParseChunk(s->xml_ctx, s->read_buf, (int)s->read_len, 0);
+        stanza_replay(s);
         s->in_xml_parse = 0;
-        s->read_len = 0;
+        reading = outer;
+        if (s->state == STATE_DISCONNECTED)
+            return -1;
     }
 
     /* Handle deferred parser reset after SASL success.
@@ -183,6 +618,139 @@ void session_on_readable(session_t *s) {
     if (s->teardown_pending) {
         session_flush(s);
         session_teardown(s);
+        return -1;
+    }
+
+    /* Caught up with what came in while waiting: read on */
+    if (s->suspend_hold && !s->suspended && !s->deferred) {
+        s->suspend_hold = 0;
+        if (--s->read_holds == 0)
+            server_want_read(s);
+    }
+    return 0;
+}
+
+void session_suspend(session_t *s) {
+    if (s->suspended++ == 0 && !s->suspend_hold) {
+        s->suspend_hold = 1;
+        if (s->read_holds++ == 0)
+            server_pause_read(s);
+    }
+}
+
+void session_resume(session_t *s) {
+    if (s->suspended == 0 || --s->suspended > 0)
+        return;
+    /* From inside the parser, session_consume carries on once it returns */
+    if (!s->in_xml_parse)
+        session_settle(s);
+}
+
+/* Feed received bytes to the parser and run the work it deferred.
+ * Returns -1 if the session was torn down. */
+static int session_consume(session_t *s, const char *data, size_t len) {
+    log_xml_in(data, len);
+
+    s->last_read = server_now();
+    s->ping_pending = 0;
+
+    if (s->xml_ctx) {
+        session_t *outer = reading;
+        reading = s;
+        s->in_xml_parse = 1;
+        xml_feed(s, data, len);
+        s->in_xml_parse = 0;
+        reading = outer;
+
+        /* Still inside a stanza: everything since its start is part of
+         * it, whether parsed already or buffered by libxml */
+        if (s->current_stanza && !s->teardown_pending &&
+            g_config.max_stanza_size > 0 &&
+            s->parser_fed - s->stanza_start > (uint64_t)g_config.max_stanza_size)
+            session_stanza_too_big(s);
+    }
+    return session_settle(s);
+}
+
+void session_on_readable(session_t *s) {
+    /* The socket is edge-triggered: keep reading until it is drained,
+     * READ_BUDGET chunks at a time so that one fast client cannot hold
+     * up everyone else on the reactor */
+    for (int reads = 0; ; reads++) {
+        /* A slow consumer we feed wants us to wait; the data stays in
+         * the socket and TCP pushes back on the client */
+        if (s->read_holds) {
+            s->read_blocked = 1;
+            return;
+        }
+        /* No new edge will come for what is left: the reactor reads on
+         * at the end of the batch, and sees a FIN behind it there */
+        if (reads == READ_BUDGET) {
+            server_read_more(s);
+            return;
+        }
+
+        ssize_t n = read(s->fd, read_chunk, sizeof(read_chunk));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            log_write(LOG_WARN, "Read error on fd %d: %s", s->fd, strerror(errno));
+            session_teardown(s);
+            return;
+        }
+        if (n == 0) {
+            log_write(LOG_INFO, "Client fd %d closed connection", s->fd);
+            session_teardown(s);
+            return;
+        }
+
+        /* No stopping at a short read: a FIN that came in the same
+         * edge as the data is only seen by reading on to 0 */
+        if (session_consume(s, read_chunk, (size_t)n) < 0)
+            return;
+    }
+}
+
+void session_on_recv(session_t *s, const char *data, size_t len) {
+    /* Completions that raced with cancelling the recv */
+    if (s->read_holds) {
+        if (len == 0)
+            s->held_eof = 1;
+        else if (outbuf_append(&s->held_in, data, len) < 0) {
+            log_write(LOG_ERROR, "Failed to hold input for fd %d", s->fd);
+            session_teardown(s);
+        }
+        return;
+    }
+    if (len == 0) {
+        log_write(LOG_INFO, "Client fd %d closed connection", s->fd);
+        session_teardown(s);
+        return;
+    }
+    session_consume(s, data, len);
+}
+
+void session_resume_read(session_t *s) {
+    while (s->held_in.len > 0) {
+        if (s->read_holds || s->state == STATE_DISCONNECTED)
+            return;
+        outbuf_node_t *node = s->held_in.head;
+        size_t n = node->seg->len - node->off;
+        if (session_consume(s, node->seg->data + node->off, n) < 0)
+            return;
+        outbuf_consume(&s->held_in, n);
+    }
+    if (s->read_holds || s->state == STATE_DISCONNECTED)
+        return;
+
+    if (s->held_eof) {
+        log_write(LOG_INFO, "Client fd %d closed connection", s->fd);
+        session_teardown(s);
+    } else if (s->read_blocked) {
+        s->read_blocked = 0;
+        session_on_readable(s);
     }
 }
 
@@ -194,84 +762,64 @@ void session_on_writable(session_t *s) {
 
 /* --- Resource Binding (RFC 6120 §7) --- */
 
-void session_handle_bind(session_t *s, xmlNodePtr stanza) {
+/* Runs on the reactor owning the session being replaced */
+static void conflict_task(session_t *existing, void *arg, size_t len) {
+    (void)len;
+    if (!existing)
+        return;
+    log_write(LOG_INFO, "Session conflict for %s — terminating old session fd %d",
+              (const char *)arg, existing->fd);
+    stream_send_error(existing, "conflict");
+}
+
+void session_handle_bind(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr) {
     if (s->state != STATE_AUTHENTICATED && s->state != STATE_STREAM_OPENED) {
         stanza_send_error(s, stanza, "cancel", "not-allowed");
         return;
     }
 
-    xmlChar *id = xmlGetProp(stanza, (const xmlChar *)"id");
+    const char *id = hdr->id;
 
     /* Extract requested resource */
-    xmlNodePtr bind_el = xml_find_child(stanza, "bind");
-    xmlNodePtr res_el = bind_el ? xml_find_child(bind_el, "resource") : NULL;
+    xml_node_t *bind_el = xml_find_child(stanza, "bind");
+    xml_node_t *res_el = bind_el ? xml_find_child(bind_el, "resource") : NULL;
     char resource[256];
     if (res_el) {
-        xmlChar *content = xmlNodeGetContent(res_el);
-        if (content) {
-            snprintf(resource, sizeof(resource), "%s", (char *)content);
-            xmlFree(content);
-        } else {
-            generate_id(resource, 8);
-        }
+        snprintf(resource, sizeof(resource), "%s", xml_text(&s->arena, res_el));
     } else {
         generate_id(resource, 8);
     }
 
-    /* Check for conflict — existing session with same bare JID */
-    char bare[512];
-    jid_bare(s->jid_local, s->jid_domain, bare, sizeof(bare));
-    session_t *existing = session_find_by_jid(bare);
-    if (existing && existing != s) {
-        log_write(LOG_INFO, "Session conflict for %s — terminating old session fd %d",
-                  bare, existing->fd);
-        stream_send_error(existing, "conflict");
-    }
-
     snprintf(s->jid_resource, sizeof(s->jid_resource), "%s", resource);
     s->state = STATE_BOUND;
 
+    /* Take over the bare JID; kick the session we replaced (conflict) */
+    session_ref_t self, existing;
+    session_get_ref(s, &self);
+    if (dir_register(s, &existing) && !session_ref_equal(&existing, &self)) {
+        char bare[512];
+        jid_bare(s->jid_local, s->jid_domain, bare, sizeof(bare));
+        server_post(&existing, conflict_task, bare, strlen(bare) + 1);
+    }
+
     /* Build response */
     char full_jid[768];
     jid_full(s->jid_local, s->jid_domain, s->jid_resource, full_jid, sizeof(full_jid));
 
-    xmlNodePtr result = xmlNewNode(NULL, (const xmlChar *)"iq");
-    xmlNewProp(result, (const xmlChar *)"type", (const xmlChar *)"result");
-    if (id) {
-        xmlNewProp(result, (const xmlChar *)"id", id);
-        xmlFree(id);
-    }
-
-    xmlNodePtr bind_resp = xmlNewChild(result, NULL, (const xmlChar *)"bind", NULL);
-    xmlNsPtr bind_ns = xmlNewNs(bind_resp,
-        (const xmlChar *)"urn:ietf:params:xml:ns:xmpp-bind", NULL);
-    xmlSetNs(bind_resp, bind_ns);
-
-    xmlNewChild(bind_resp, bind_ns, (const xmlChar *)"jid",
-                (const xmlChar *)full_jid);
-
-    stanza_send(s, result);
-    xmlFreeNode(result);
+    tmpl_send(s, TMPL_BIND_RESULT, (const char *[]){ id, full_jid });
 
     log_write(LOG_INFO, "Resource bound: %s", full_jid);
 }
 
 /* --- Session Establishment (RFC 3921, deprecated but Pidgin needs it) --- */
 
-void session_handle_session_iq(session_t *s, xmlNodePtr stanza) {
-    xmlChar *id = xmlGetProp(stanza, (const xmlChar *)"id");
+void session_handle_session_iq(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr) {
+    (void)stanza;
+    const char *id = hdr->id;
 
     s->state = STATE_SESSION_ACTIVE;
 
-    xmlNodePtr result = xmlNewNode(NULL, (const xmlChar *)"iq");
-    xmlNewProp(result, (const xmlChar *)"type", (const xmlChar *)"result");
-    if (id) {
-        xmlNewProp(result, (const xmlChar *)"id", id);
-        xmlFree(id);
-    }
-
-    stanza_send(s, result);
-    xmlFreeNode(result);
+    tmpl_send(s, TMPL_IQ_RESULT, (const char *[]){ id });
 
     char full_jid[768];
     jid_full(s->jid_local, s->jid_domain, s->jid_resource, full_jid, sizeof(full_jid));
@@ -289,7 +837,16 @@ void session_teardown(session_t *s) {
     if (s->available || s->initial_presence_sent)
         presence_broadcast_unavailable(s);
 
+    if (s->in_directory)
+        dir_unregister(s);
+
+    /* Whoever we were holding back can carry on */
+    session_release_holds(s);
+    s->congested = 0;
+
     s->state = STATE_DISCONNECTED;
+
+    /* The reactor frees the session after the current batch of events,
+     * so callers further up the stack may still look at its state */
     server_remove_session(s);
-    session_destroy(s);
 }
@@ -0,0 +1,62 @@
+#include "slab.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+
+#define SLAB_ALIGN      alignof(max_align_t)
+#define SLAB_HDR_SIZE   ((sizeof(slab_chunk_t) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1))
+
+void slab_init(slab_t *slab, size_t obj_size) {
+    memset(slab, 0, sizeof(*slab));
+    if (obj_size < sizeof(void *))
+        obj_size = sizeof(void *);
+    slab->obj_size = (obj_size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+}
+
+void slab_destroy(slab_t *slab) {
+    while (slab->chunks) {
+        slab_chunk_t *chunk = slab->chunks;
+        slab->chunks = chunk->next;
+        free(chunk);
+    }
+    slab->free_list = NULL;
+    slab->nchunks = 0;
+    slab->in_use = 0;
+}
+
+static int slab_grow(slab_t *slab) {
+    slab_chunk_t *chunk = malloc(SLAB_HDR_SIZE + SLAB_CHUNK_OBJS * slab->obj_size);
+    if (!chunk)
+        return -1;
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+    slab->nchunks++;
+
+    /* Thread the new objects onto the free list, first object first */
+    char *base = (char *)chunk + SLAB_HDR_SIZE;
+    for (int i = SLAB_CHUNK_OBJS - 1; i >= 0; i--) {
+        void *obj = base + (size_t)i * slab->obj_size;
+        *(void **)obj = slab->free_list;
+        slab->free_list = obj;
+    }
+    return 0;
+}
+
+void *slab_alloc(slab_t *slab) {
+    if (!slab->free_list && slab_grow(slab) < 0)
+        return NULL;
+
+    void *obj = slab->free_list;
+    slab->free_list = *(void **)obj;
+    slab->in_use++;
+    memset(obj, 0, slab->obj_size);
+    return obj;
+}
+
+void slab_free(slab_t *slab, void *obj) {
+    if (!obj)
+        return;
+    *(void **)obj = slab->free_list;
+    slab->free_list = obj;
+    slab->in_use--;
+}
@@ -7,20 +7,114 @@
 #include "message.h"
 #include "disco.h"
 #include "register.h"
+#include "template.h"
 #include "config.h"
 #include "log.h"
 #include "xml.h"
 #include "util.h"
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <libxml/tree.h>
 
 /* Forward declarations for handlers implemented in other modules */
-void session_handle_bind(session_t *s, xmlNodePtr stanza);
-void session_handle_session_iq(session_t *s, xmlNodePtr stanza);
+void session_handle_bind(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr);
+void session_handle_session_iq(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr);
 
-/* Forward declarations */
-static void handle_iq(session_t *s, xmlNodePtr stanza);
+static void stanza_dispatch(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr);
+
+/* --- Dispatch --- */
+
+/* Session phases a stanza is handled in (STANZA_PREAUTH etc.) */
+static unsigned session_phase(const session_t *s) {
+    if (!s->authenticated)
+        return STANZA_PREAUTH;
+    if (s->state == STATE_BOUND || s->state == STATE_SESSION_ACTIVE)
+        return STANZA_BOUND;
+    return STANZA_AUTHED;
+}
+
+/*
+ * Handlers live in open-addressed tables keyed on (element, namespace),
+ * with the hash worked out at registration. IQs are looked up a second
+ * time, on their payload's namespace alone.
+ */
+typedef struct stanza_handler {
+    const char        *name;        /* NULL in the IQ table */
+    const char        *ns;
+    uint32_t           hash;
+    unsigned           phases;
+    stanza_handler_fn  fn;
+} stanza_handler_t;
+
+static stanza_handler_t stanza_table[STANZA_TABLE_SIZE];
+static stanza_handler_t iq_table[STANZA_TABLE_SIZE];
+
+/* FNV-1a over name, a separator and ns */
+static uint32_t dispatch_hash(const char *name, const char *ns) {
+    uint32_t h = 2166136261u;
+    for (const char *p = name ? name : ""; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    h = (h ^ 0xff) * 16777619u;
+    for (const char *p = ns; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    return h;
+}
+
+static int handler_matches(const stanza_handler_t *h, uint32_t hash,
+                           const char *name, const char *ns)
+{
+    return h->hash == hash && strcmp(h->ns, ns) == 0 &&
+           (!name || strcmp(h->name, name) == 0);
+}
+
+static const stanza_handler_t *dispatch_lookup(const stanza_handler_t *table,
+                                               const char *name, const char *ns)
+{
+    uint32_t hash = dispatch_hash(name, ns);
+    for (uint32_t i = 0; i < STANZA_TABLE_SIZE; i++) {
+        const stanza_handler_t *h = &table[(hash + i) & (STANZA_TABLE_SIZE - 1)];
+        if (!h->fn)
+            return NULL;
+        if (handler_matches(h, hash, name, ns))
+            return h;
+    }
+    return NULL;
+}
+
+static int dispatch_add(stanza_handler_t *table, const char *name, const char *ns,
+                        unsigned phases, stanza_handler_fn fn)
+{
+    uint32_t hash = dispatch_hash(name, ns);
+    for (uint32_t i = 0; i < STANZA_TABLE_SIZE; i++) {
+        stanza_handler_t *h = &table[(hash + i) & (STANZA_TABLE_SIZE - 1)];
+        if (h->fn && handler_matches(h, hash, name, ns)) {
+            log_write(LOG_ERROR, "Stanza handler for <%s xmlns='%s'> registered twice",
+                      name ? name : "iq", ns);
+            return -1;
+        }
+        if (!h->fn) {
+            h->name = name;
+            h->ns = ns;
+            h->hash = hash;
+            h->phases = phases;
+            h->fn = fn;
+            return 0;
+        }
+    }
+    log_write(LOG_ERROR, "Stanza handler table full");
+    return -1;
+}
+
+int stanza_register(const char *name, const char *ns, unsigned phases,
+                    stanza_handler_fn fn)
+{
+    return dispatch_add(stanza_table, name, ns, phases, fn);
+}
+
+int stanza_register_iq(const char *ns, unsigned phases, stanza_handler_fn fn) {
+    return dispatch_add(iq_table, NULL, ns, phases, fn);
+}
 
 static int is_server_jid(const char *to) {
     /* Check if the JID is addressed to the server (no localpart) */
@@ -31,146 +125,235 @@ static int is_server_jid(const char *to) {
     return 0;
 }
 
-void stanza_route(session_t *s, xmlNodePtr stanza) {
-    const char *name = (const char *)stanza->name;
-    const char *ns = stanza->ns ? (const char *)stanza->ns->href : "";
+/* --- Stanzas waiting for a suspended session --- */
 
-    log_write(LOG_DEBUG, "Stanza received on fd %d: <%s> ns='%s' state=%d presence_stanza=%p",
-              s->fd, name, ns, s->state, (void *)s->presence_stanza);
-
-    /* Pre-auth: only SASL and in-band registration allowed */
-    if (s->state == STATE_STREAM_OPENED && !s->authenticated) {
-        if (strcmp(name, "auth") == 0 &&
-            strcmp(ns, "urn:ietf:params:xml:ns:xmpp-sasl") == 0) {
-            auth_handle_sasl(s, stanza);
-        } else if (strcmp(name, "iq") == 0) {
-            /* Allow registration IQs only */
-            xmlNodePtr child = stanza->children;
-            while (child && child->type != XML_ELEMENT_NODE)
-                child = child->next;
-            const char *cns = (child && child->ns && child->ns->href)
-                              ? (const char *)child->ns->href : "";
-            if (strcmp(cns, "jabber:iq:register") == 0)
-                register_handle_iq(s, stanza);
-            else
-                stanza_send_error(s, stanza, "cancel", "not-allowed");
-        } else {
-            stream_send_error(s, "not-authorized");
+/* A stanza copied out of the session's arena, or with stanza NULL the
+ * end of the stream */
+typedef struct deferred_stanza {
+    struct deferred_stanza *next;
+    arena_t          arena;         /* everything below */
+    xml_node_t      *stanza;
+    stanza_header_t *hdr;
+} deferred_stanza_t;
+
+static const char *header_str(arena_t *a, const char *s) {
+    return s ? arena_strndup(a, s, strlen(s)) : NULL;
+}
+
+static stanza_header_t *header_clone(arena_t *a, const stanza_header_t *hdr) {
+    stanza_header_t *h = arena_alloc(a, sizeof(*h));
+    if (!h)
+        return NULL;
+    h->to          = header_str(a, hdr->to);
+    h->from        = header_str(a, hdr->from);
+    h->type        = header_str(a, hdr->type);
+    h->id          = header_str(a, hdr->id);
+    h->to_valid    = hdr->to_valid;
+    h->to_local    = header_str(a, hdr->to_local);
+    h->to_domain   = header_str(a, hdr->to_domain);
+    h->to_resource = header_str(a, hdr->to_resource);
+    if ((hdr->to && !h->to) || (hdr->from && !h->from) ||
+        (hdr->type && !h->type) || (hdr->id && !h->id) ||
+        !h->to_local || !h->to_domain || !h->to_resource)
+        return NULL;
+    return h;
+}
+
+/* Copy of the stanza, or NULL if out of memory */
+static deferred_stanza_t *deferred_new(const xml_node_t *stanza,
+                                       const stanza_header_t *hdr)
+{
+    deferred_stanza_t *d = malloc(sizeof(*d));
+    if (!d)
+        return NULL;
+    d->next = NULL;
+    d->stanza = NULL;
+    d->hdr = NULL;
+    arena_init(&d->arena);
+    if (stanza) {
+        d->stanza = xml_clone(&d->arena, stanza);
+        d->hdr = d->stanza ? header_clone(&d->arena, hdr) : NULL;
+        if (!d->hdr) {
+            arena_destroy(&d->arena);
+            free(d);
+            return NULL;
         }
+    }
+    return d;
+}
+
+static void deferred_free(deferred_stanza_t *d) {
+    arena_destroy(&d->arena);
+    free(d);
+}
+
+void stanza_defer(session_t *s, const xml_node_t *stanza, const stanza_header_t *hdr) {
+    deferred_stanza_t *d = deferred_new(stanza, hdr);
+    if (!d) {
+        log_write(LOG_ERROR, "Out of memory holding a stanza on fd %d", s->fd);
+        stream_send_error(s, "resource-constraint");
         return;
     }
+    if (s->deferred_tail)
+        s->deferred_tail->next = d;
+    else
+        s->deferred = d;
+    s->deferred_tail = d;
+}
 
-    /* Post-auth: IQ for bind/session, then full routing once active */
-    if (strcmp(name, "iq") == 0) {
-        handle_iq(s, stanza);
-    } else if (strcmp(name, "message") == 0) {
-        if (s->state != STATE_SESSION_ACTIVE && s->state != STATE_BOUND) {
-            stream_send_error(s, "not-authorized");
-            return;
-        }
-        handle_message(s, stanza);
-    } else if (strcmp(name, "presence") == 0) {
-        if (s->state != STATE_SESSION_ACTIVE && s->state != STATE_BOUND) {
-            stream_send_error(s, "not-authorized");
-            return;
+void stanza_suspend(session_t *s, const xml_node_t *stanza, const stanza_header_t *hdr) {
+    deferred_stanza_t *d = deferred_new(stanza, hdr);
+    if (!d) {
+        log_write(LOG_ERROR, "Out of memory holding a stanza on fd %d", s->fd);
+        stream_send_error(s, "resource-constraint");
+        return;
+    }
+    d->next = s->deferred;
+    s->deferred = d;
+    if (!s->deferred_tail)
+        s->deferred_tail = d;
+    session_suspend(s);
+}
+
+void stanza_replay(session_t *s) {
+    while (s->deferred && !s->suspended && s->state != STATE_DISCONNECTED &&
+           !s->teardown_pending) {
+        deferred_stanza_t *d = s->deferred;
+        s->deferred = d->next;
+        if (!s->deferred)
+            s->deferred_tail = NULL;
+
+        if (d->stanza) {
+            stanza_dispatch(s, d->stanza, d->hdr);
+        } else {
+            /* Nothing follows the end of the stream */
+            stanza_free_deferred(s);
+            stream_handle_close(s);
         }
-        handle_presence(s, stanza);
-    } else {
-        stream_send_error(s, "unsupported-stanza-type");
+        deferred_free(d);
+
+        /* What the handler allocated, unless a stanza is half parsed */
+        if (!s->current_stanza)
+            arena_reset(&s->arena);
+    }
+}
+
+void stanza_free_deferred(session_t *s) {
+    while (s->deferred) {
+        deferred_stanza_t *d = s->deferred;
+        s->deferred = d->next;
+        deferred_free(d);
+    }
+    s->deferred_tail = NULL;
+}
+
+/* --- Routing --- */
+
+void stanza_route(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr) {
+    /* Waiting on storage: the stanza keeps its place in line */
+    if (s->suspended || s->deferred) {
+        stanza_defer(s, stanza, hdr);
+        return;
     }
+    stanza_dispatch(s, stanza, hdr);
 }
 
-static void handle_iq(session_t *s, xmlNodePtr stanza) {
-    xmlChar *type_attr = xmlGetProp(stanza, (const xmlChar *)"type");
-    xmlChar *to_attr   = xmlGetProp(stanza, (const xmlChar *)"to");
-    const char *type = type_attr ? (const char *)type_attr : "";
-    const char *to   = to_attr ? (const char *)to_attr : "";
+static void stanza_dispatch(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr) {
+    log_write(LOG_DEBUG, "Stanza received on fd %d: <%s> ns='%s' state=%d presence_stanza=%p",
+              s->fd, stanza->name, stanza->ns, s->state, (void *)s->presence_stanza);
+
+    unsigned phase = session_phase(s);
+    const stanza_handler_t *h = dispatch_lookup(stanza_table, stanza->name, stanza->ns);
+    if (h && (h->phases & phase)) {
+        h->fn(s, stanza, hdr);
+        return;
+    }
+
+    /* Nothing but SASL and registration before authentication */
+    if (h || phase == STANZA_PREAUTH)
+        stream_send_error(s, "not-authorized");
+    else
+        stream_send_error(s, "unsupported-stanza-type");
+}
+
+static void handle_iq(session_t *s, xml_node_t *stanza, const stanza_header_t *hdr) {
+    const char *type = hdr->type ? hdr->type : "";
+    const char *to   = hdr->to ? hdr->to : "";
+    unsigned phase = session_phase(s);
 
     /* result/error: route to target user if online, else drop */
-    if (strcmp(type, "result") == 0 || strcmp(type, "error") == 0) {
+    if (phase != STANZA_PREAUTH &&
+        (strcmp(type, "result") == 0 || strcmp(type, "error") == 0)) {
         if (to[0] && !is_server_jid(to)) {
             /* Route to target user */
-            char local[256], domain[256], resource[256];
-            jid_parse(to, local, sizeof(local), domain, sizeof(domain),
-                      resource, sizeof(resource));
-            char bare[512];
-            jid_bare(local, domain, bare, sizeof(bare));
-            session_t *target = session_find_by_jid(bare);
-            if (target) {
-                /* Set from to sender's full JID */
-                char from_jid[768];
-                jid_full(s->jid_local, s->jid_domain, s->jid_resource,
-                         from_jid, sizeof(from_jid));
-                xmlSetProp(stanza, (const xmlChar *)"from",
-                           (const xmlChar *)from_jid);
-                stanza_send(target, stanza);
-            }
+            session_ref_t target;
+            if (session_lookup(to, &target))
+                stanza_forward(s, &target, stanza);
         }
-        if (type_attr) xmlFree(type_attr);
-        if (to_attr) xmlFree(to_attr);
         return;
     }
 
-    /* get/set: identify child element namespace for dispatch */
-    xmlNodePtr child = stanza->children;
-    while (child && child->type != XML_ELEMENT_NODE)
-        child = child->next;
-
-    const char *child_ns = "";
-    if (child && child->ns && child->ns->href)
-        child_ns = (const char *)child->ns->href;
-
-    if (strcmp(child_ns, "urn:ietf:params:xml:ns:xmpp-bind") == 0) {
-        session_handle_bind(s, stanza);
-    } else if (strcmp(child_ns, "urn:ietf:params:xml:ns:xmpp-session") == 0) {
-        session_handle_session_iq(s, stanza);
-    } else if (strcmp(child_ns, "jabber:iq:roster") == 0) {
-        if (s->state != STATE_SESSION_ACTIVE && s->state != STATE_BOUND) {
-            stanza_send_error(s, stanza, "cancel", "not-allowed");
-        } else {
-            roster_handle_iq(s, stanza);
-        }
-    } else if (strcmp(child_ns, "http://jabber.org/protocol/disco#info") == 0) {
-        if (s->state != STATE_SESSION_ACTIVE && s->state != STATE_BOUND) {
+    /* get/set: dispatch on the payload's namespace */
+    xml_node_t *child = xml_first_child(stanza);
+    const stanza_handler_t *h = dispatch_lookup(iq_table, NULL, child ? child->ns : "");
+    if (h) {
+        if (h->phases & phase)
+            h->fn(s, stanza, hdr);
+        else
             stanza_send_error(s, stanza, "cancel", "not-allowed");
-        } else {
-            disco_handle_info(s, stanza);
-        }
-    } else if (strcmp(child_ns, "http://jabber.org/protocol/disco#items") == 0) {
-        if (s->state != STATE_SESSION_ACTIVE && s->state != STATE_BOUND) {
-            stanza_send_error(s, stanza, "cancel", "not-allowed");
-        } else {
-            disco_handle_items(s, stanza);
-        }
-    } else if (strcmp(child_ns, "jabber:iq:register") == 0) {
-        register_handle_iq(s, stanza);
-    } else {
-        /* Unknown namespace: if addressed to another user, route; else error */
-        if (to[0] && !is_server_jid(to) &&
-            (s->state == STATE_SESSION_ACTIVE || s->state == STATE_BOUND)) {
-            char local[256], domain[256], resource[256];
-            jid_parse(to, local, sizeof(local), domain, sizeof(domain),
-                      resource, sizeof(resource));
-            char bare[512];
-            jid_bare(local, domain, bare, sizeof(bare));
-            session_t *target = session_find_by_jid(bare);
-            if (target) {
-                char from_jid[768];
-                jid_full(s->jid_local, s->jid_domain, s->jid_resource,
-                         from_jid, sizeof(from_jid));
-                xmlSetProp(stanza, (const xmlChar *)"from",
-                           (const xmlChar *)from_jid);
-                stanza_send(target, stanza);
-            } else {
-                stanza_send_error(s, stanza, "cancel", "service-unavailable");
-            }
+        return;
+    }
+
+    /* Unknown namespace: if addressed to another user, route; else error */
+    if (phase == STANZA_PREAUTH) {
+        stanza_send_error(s, stanza, "cancel", "not-allowed");
+    } else if (phase == STANZA_BOUND && to[0] && !is_server_jid(to)) {
+        session_ref_t target;
+        if (session_lookup(to, &target)) {
+            stanza_forward(s, &target, stanza);
         } else {
             stanza_send_error(s, stanza, "cancel", "service-unavailable");
         }
+    } else {
+        stanza_send_error(s, stanza, "cancel", "service-unavailable");
     }
+}
 
-    if (type_attr) xmlFree(type_attr);
-    if (to_attr) xmlFree(to_attr);
+int stanza_init(void) {
+    static const struct {
+        const char        *name;
+        const char        *ns;
+        unsigned           phases;
+        stanza_handler_fn  fn;
+    } stanzas[] = {
+        { "auth",     "urn:ietf:params:xml:ns:xmpp-sasl", STANZA_PREAUTH, auth_handle_sasl },
+        { "iq",       "jabber:client", STANZA_ANY,   handle_iq },
+        { "message",  "jabber:client", STANZA_BOUND, handle_message },
+        { "presence", "jabber:client", STANZA_BOUND, handle_presence },
+    };
+    static const struct {
+        const char        *ns;
+        unsigned           phases;
+        stanza_handler_fn  fn;
+    } iqs[] = {
+        { "urn:ietf:params:xml:ns:xmpp-bind",       STANZA_AUTHED | STANZA_BOUND, session_handle_bind },
+        { "urn:ietf:params:xml:ns:xmpp-session",    STANZA_AUTHED | STANZA_BOUND, session_handle_session_iq },
+        { "jabber:iq:roster",                       STANZA_BOUND, roster_handle_iq },
+        { "http://jabber.org/protocol/disco#info",  STANZA_BOUND, disco_handle_info },
+        { "http://jabber.org/protocol/disco#items", STANZA_BOUND, disco_handle_items },
+        { "jabber:iq:register",                     STANZA_ANY,   register_handle_iq },
+    };
+
+    for (size_t i = 0; i < sizeof(stanzas) / sizeof(stanzas[0]); i++) {
+        if (stanza_register(stanzas[i].name, stanzas[i].ns,
+                            stanzas[i].phases, stanzas[i].fn) < 0)
+            return -1;
+    }
+    for (size_t i = 0; i < sizeof(iqs) / sizeof(iqs[0]); i++) {
+        if (stanza_register_iq(iqs[i].ns, iqs[i].phases, iqs[i].fn) < 0)
+            return -1;
+    }
+    return 0;
 }
 
 /* --- Serialization utilities --- */
@@ -210,32 +393,126 @@ void stanza_send(session_t *s, xmlNodePtr node) {
     }
 }
 
-void stanza_send_error(session_t *s, xmlNodePtr original,
-                       const char *error_type, const char *condition)
+int stanza_droppable(const xml_node_t *node) {
+    if (strcmp(node->name, "presence") == 0)
+        return xml_get_attr(node, "type") == NULL;
+    if (strcmp(node->name, "message") != 0 || xml_find_child(node, "body"))
+        return 0;
+    for (xml_node_t *child = node->children; child; child = child->next) {
+        if (child->type == XML_NODE_ELEMENT &&
+            strcmp(child->ns, "http://jabber.org/protocol/chatstates") == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/* Lex the start tag of a well-formed stanza: returns where the element
+ * name ends, and sets the span of a from attribute (with the whitespace
+ * before it) if there is one, else leaves from_end at 0 */
+static size_t scan_start_tag(const char *raw, size_t len,
+                             size_t *from_start, size_t *from_end)
 {
-    const char *tag = (const char *)original->name;
-    xmlChar *id = xmlGetProp(original, (const xmlChar *)"id");
+    size_t i = 1;
+    while (i < len && !is_space(raw[i]) && raw[i] != '/' && raw[i] != '>')
+        i++;
+    size_t name_end = i;
 
-    xmlNodePtr err = xmlNewNode(NULL, (const xmlChar *)tag);
-    xmlNewProp(err, (const xmlChar *)"type", (const xmlChar *)"error");
-    if (id) {
-        xmlNewProp(err, (const xmlChar *)"id", id);
-        xmlFree(id);
+    *from_start = *from_end = 0;
+    for (;;) {
+        size_t ws = i;
+        while (i < len && is_space(raw[i]))
+            i++;
+        if (i >= len || raw[i] == '/' || raw[i] == '>')
+            break;
+        size_t name = i;
+        while (i < len && raw[i] != '=' && !is_space(raw[i]))
+            i++;
+        size_t name_len = i - name;
+        while (i < len && raw[i] != '"' && raw[i] != '\'')
+            i++;
+        if (i >= len)
+            break;
+        char quote = raw[i++];
+        while (i < len && raw[i] != quote)
+            i++;
+        if (i >= len)
+            break;
+        i++;
+        if (name_len == 4 && memcmp(raw + name, "from", 4) == 0) {
+            *from_start = ws;
+            *from_end = i;
+        }
     }
-    xmlNewProp(err, (const xmlChar *)"from", (const xmlChar *)g_config.domain);
+    return name_end;
+}
 
-    char full_jid[768];
-    jid_full(s->jid_local, s->jid_domain, s->jid_resource, full_jid, sizeof(full_jid));
-    xmlNewProp(err, (const xmlChar *)"to", (const xmlChar *)full_jid);
+outseg_t *stanza_wire(session_t *s, xml_node_t *stanza) {
+    char from_jid[768];
+    jid_full(s->jid_local, s->jid_domain, s->jid_resource,
+             from_jid, sizeof(from_jid));
 
-    xmlNodePtr error_el = xmlNewChild(err, NULL, (const xmlChar *)"error", NULL);
-    xmlNewProp(error_el, (const xmlChar *)"type", (const xmlChar *)error_type);
+    /* Pass the bytes on as received, with our from in place of theirs */
+    size_t raw_len, jid_len;
+    const char *raw = xml_stanza_bytes(s, &raw_len);
+    const char *jid = raw ? xml_escape_attr(&s->arena, from_jid, &jid_len) : NULL;
+    if (jid) {
+        size_t from_start, from_end;
+        size_t name_end = scan_start_tag(raw, raw_len, &from_start, &from_end);
+        if (!from_end)
+            from_start = from_end = name_end;
 
-    xmlNodePtr cond = xmlNewChild(error_el, NULL, (const xmlChar *)condition, NULL);
-    xmlNsPtr ns = xmlNewNs(cond,
-        (const xmlChar *)"urn:ietf:params:xml:ns:xmpp-stanzas", NULL);
-    xmlSetNs(cond, ns);
+        static const char attr[] = " from=\"";
+        size_t len = from_start + sizeof(attr) - 1 + jid_len + 1 + (raw_len - from_end);
+        outseg_t *seg = outseg_reserve(len);
+        if (!seg)
+            return NULL;
+        char *p = seg->data;
+        memcpy(p, raw, from_start);
+        p += from_start;
+        memcpy(p, attr, sizeof(attr) - 1);
+        p += sizeof(attr) - 1;
+        memcpy(p, jid, jid_len);
+        p += jid_len;
+        *p++ = '"';
+        memcpy(p, raw + from_end, raw_len - from_end);
+        return seg;
+    }
+
+    /* The stanza cannot be sent verbatim: serialize the tree */
+    if (xml_set_attr(&s->arena, stanza, "from", from_jid) < 0)
+        return NULL;
+    size_t len;
+    char *xml = xml_serialize(&s->arena, stanza, &len);
+    return xml ? outseg_new(xml, len) : NULL;
+}
+
+void stanza_forward(session_t *s, const session_ref_t *target, xml_node_t *stanza) {
+    outseg_t *seg = stanza_wire(s, stanza);
+    if (!seg) {
+        log_write(LOG_ERROR, "Out of memory forwarding stanza from fd %d", s->fd);
+        return;
+    }
+    session_deliver_seg(target, seg, stanza_droppable(stanza));
+    outseg_unref(seg);
+}
+
+void stanza_send_error(session_t *s, const xml_node_t *original,
+                       const char *error_type, const char *condition)
+{
+    stanza_error(s, original->name, xml_get_attr(original, "id"),
+                 error_type, condition);
+}
+
+void stanza_error(session_t *s, const char *tag, const char *id,
+                  const char *error_type, const char *condition)
+{
+    char full_jid[768];
+    jid_full(s->jid_local, s->jid_domain, s->jid_resource, full_jid, sizeof(full_jid));
 
-    stanza_send(s, err);
-    xmlFreeNode(err);
+    tmpl_send(s, TMPL_STANZA_ERROR, (const char *[]){
+        tag, id, full_jid, error_type, condition });
 }
@@ -0,0 +1,153 @@
+#include "storage.h"
+#include "server.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* A job and its argument, copied in right behind the header */
+typedef struct storage_job {
+    struct storage_job *next;
+    int                 has_ref;
+    session_ref_t       ref;
+    storage_work_fn     work;
+    session_task_fn     done;
+    size_t              len;
+    void               *arg;
+} storage_job_t;
+
+#define JOB_HDR_SIZE ((sizeof(storage_job_t) + 15) & ~(size_t)15)
+
+typedef struct storage_worker {
+    pthread_t        thread;
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+    storage_job_t   *head;          /* FIFO */
+    storage_job_t   *tail;
+    int              stop;
+} storage_worker_t;
+
+static storage_worker_t *workers = NULL;
+static int               nworkers = 0;
+
+/* FNV-1a */
+static uint32_t key_hash(const char *key) {
+    uint32_t h = 2166136261u;
+    for (; *key; key++)
+        h = (h ^ (unsigned char)*key) * 16777619u;
+    return h;
+}
+
+static void job_run(storage_job_t *job) {
+    job->work(job->arg, job->len);
+    if (job->done && job->has_ref)
+        server_post(&job->ref, job->done, job->arg, job->len);
+}
+
+static void *worker_main(void *arg) {
+    storage_worker_t *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->head && !w->stop)
+            pthread_cond_wait(&w->cond, &w->lock);
+        storage_job_t *job = w->head;
+        if (!job)
+            break;
+        w->head = job->next;
+        if (!w->head)
+            w->tail = NULL;
+        pthread_mutex_unlock(&w->lock);
+
+        job_run(job);
+        free(job);
+        pthread_mutex_lock(&w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+int storage_init(const config_t *cfg) {
+    int n = cfg->storage_threads > 0 ? cfg->storage_threads : 1;
+
+    workers = calloc((size_t)n, sizeof(*workers));
+    if (!workers) {
+        log_write(LOG_ERROR, "Failed to allocate storage workers");
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        storage_worker_t *w = &workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            log_write(LOG_ERROR, "Failed to start storage thread");
+            pthread_mutex_destroy(&w->lock);
+            pthread_cond_destroy(&w->cond);
+            storage_shutdown();
+            return -1;
+        }
+        nworkers++;
+    }
+    log_write(LOG_INFO, "Storage: %d worker thread%s", n, n == 1 ? "" : "s");
+    return 0;
+}
+
+void storage_shutdown(void) {
+    for (int i = 0; i < nworkers; i++) {
+        storage_worker_t *w = &workers[i];
+        pthread_mutex_lock(&w->lock);
+        w->stop = 1;
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+    }
+    for (int i = 0; i < nworkers; i++) {
+        storage_worker_t *w = &workers[i];
+        pthread_join(w->thread, NULL);
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+    }
+    free(workers);
+    workers = NULL;
+    nworkers = 0;
+}
+
+int storage_submit(const char *key, const session_ref_t *ref,
+                   storage_work_fn work, session_task_fn done,
+                   const void *arg, size_t len)
+{
+    /* Never run here instead: that would block the reactor on the disk
+     * and overtake the jobs already queued for key */
+    if (!nworkers) {
+        log_write(LOG_ERROR, "No storage workers for a job of %s", key);
+        return -1;
+    }
+    storage_job_t *job = malloc(JOB_HDR_SIZE + len);
+    if (!job) {
+        log_write(LOG_ERROR, "Failed to allocate storage job for %s", key);
+        return -1;
+    }
+
+    memset(job, 0, sizeof(*job));
+    if (ref) {
+        job->has_ref = 1;
+        job->ref = *ref;
+    }
+    job->work = work;
+    job->done = done;
+    job->len = len;
+    job->arg = (char *)job + JOB_HDR_SIZE;
+    if (len)
+        memcpy(job->arg, arg, len);
+
+    storage_worker_t *w = &workers[key_hash(key) % (uint32_t)nworkers];
+    pthread_mutex_lock(&w->lock);
+    if (w->tail)
+        w->tail->next = job;
+    else
+        w->head = job;
+    w->tail = job;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
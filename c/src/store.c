@@ -0,0 +1,20 @@
+#include "store.h"
+#include "log.h"
+
+const store_backend_t *g_store = &store_files;
+
+int store_open(const config_t *cfg) {
+    const store_backend_t *b = cfg->storage == STORAGE_MMAP ? &store_mmap : &store_files;
+    if (b->open(cfg) < 0) {
+        log_write(LOG_ERROR, "Failed to open %s storage in %s", b->name, cfg->datadir);
+        return -1;
+    }
+    g_store = b;
+    log_write(LOG_INFO, "Storage: %s", b->name);
+    return 0;
+}
+
+void store_close(void) {
+    g_store->close();
+    g_store = &store_files;
+}
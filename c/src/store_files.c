@@ -0,0 +1,298 @@
+#include "store.h"
+#include "roster.h"
+#include "rosterlog.h"
+#include "config.h"
+#include "log.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+/* The directory per user layout: <datadir>/<user>/user.conf, roster.xml
+ * and roster.journal (see rosterlog.h), and offline/ (see offline.h) */
+
+static int files_roster_load(const char *username, roster_t *r);
+static int files_roster_save(const char *username, const roster_t *r);
+
+static int files_open(const config_t *cfg) {
+    (void)cfg;
+    if (offline_init() < 0)
+        return -1;
+    if (rosterlog_init(files_roster_load, files_roster_save) < 0) {
+        offline_shutdown();
+        return -1;
+    }
+    return 0;
+}
+
+static void files_close(void) {
+    rosterlog_shutdown();
+    offline_shutdown();
+}
+
+static int files_user_exists(const char *username) {
+    char path[1280];
+    snprintf(path, sizeof(path), "%s/%s/user.conf", g_config.datadir, username);
+
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
+static int files_user_password(const char *username, char *buf, size_t size) {
+    char path[1280];
+    snprintf(path, sizeof(path), "%s/%s/user.conf", g_config.datadir, username);
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        log_write(LOG_DEBUG, "User file not found: %s", path);
+        return 0;
+    }
+
+    char line[1024];
+    int found = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n\r")] = '\0';
+
+        /* Skip comments and blanks */
+        char *s = line;
+        while (isspace((unsigned char)*s)) s++;
+        if (*s == '#' || *s == '\0')
+            continue;
+
+        char *eq = strchr(s, '=');
+        if (!eq)
+            continue;
+
+        *eq = '\0';
+        /* Trim key */
+        char *key = s;
+        char *kend = eq - 1;
+        while (kend > key && isspace((unsigned char)*kend)) *kend-- = '\0';
+
+        /* Trim value */
+        char *val = eq + 1;
+        while (isspace((unsigned char)*val)) val++;
+        char *vend = val + strlen(val) - 1;
+        while (vend > val && isspace((unsigned char)*vend)) *vend-- = '\0';
+
+        if (strcmp(key, "password") == 0) {
+            snprintf(buf, size, "%s", val);
+            found = 1;
+            break;
+        }
+    }
+
+    fclose(fp);
+    return found;
+}
+
+static int files_user_create(const char *username, const char *password) {
+    if (files_user_exists(username))
+        return -1;
+
+    char userdir[1280];
+    snprintf(userdir, sizeof(userdir), "%s/%s", g_config.datadir, username);
+
+    if (mkdir(userdir, 0755) < 0) {
+        log_write(LOG_WARN, "user_create: mkdir %s failed", userdir);
+        return -3;
+    }
+
+    char path[1536];
+
+    /* Write user.conf */
+    snprintf(path, sizeof(path), "%s/user.conf", userdir);
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        log_write(LOG_WARN, "user_create: fopen %s failed", path);
+        return -3;
+    }
+    fprintf(fp, "password = %s\n", password);
+    fclose(fp);
+
+    /* Write empty roster.xml */
+    snprintf(path, sizeof(path), "%s/roster.xml", userdir);
+    fp = fopen(path, "w");
+    if (!fp) {
+        log_write(LOG_WARN, "user_create: fopen %s failed", path);
+        return -3;
+    }
+    fprintf(fp, "<?xml version=\"1.0\"?>\n<roster/>\n");
+    fclose(fp);
+
+    /* Create offline directory */
+    snprintf(path, sizeof(path), "%s/offline", userdir);
+    if (mkdir(path, 0755) < 0) {
+        log_write(LOG_WARN, "user_create: mkdir %s failed", path);
+        return -3;
+    }
+
+    return 0;
+}
+
+static int files_user_set_password(const char *username, const char *password) {
+    char path[1280];
+    snprintf(path, sizeof(path), "%s/%s/user.conf", g_config.datadir, username);
+
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        log_write(LOG_WARN, "user_change_password: fopen %s failed", path);
+        return -1;
+    }
+    fprintf(fp, "password = %s\n", password);
+    fclose(fp);
+    return 0;
+}
+
+static int files_user_delete(const char *username) {
+    char userdir[1280];
+    snprintf(userdir, sizeof(userdir), "%s/%s", g_config.datadir, username);
+
+    /* Remove offline messages */
+    char offlinedir[1536];
+    snprintf(offlinedir, sizeof(offlinedir), "%s/offline", userdir);
+    DIR *d = opendir(offlinedir);
+    if (d) {
+        struct dirent *ent;
+        while ((ent = readdir(d)) != NULL) {
+            if (ent->d_name[0] == '.')
+                continue;
+            char fpath[1792];
+            snprintf(fpath, sizeof(fpath), "%s/%s", offlinedir, ent->d_name);
+            unlink(fpath);
+        }
+        closedir(d);
+    }
+    rmdir(offlinedir);
+
+    /* Remove per-user files */
+    rosterlog_forget(username);
+    char path[1536];
+    snprintf(path, sizeof(path), "%s/user.conf", userdir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/roster.xml", userdir);
+    unlink(path);
+
+    rmdir(userdir);
+    return 0;
+}
+
+static int files_roster_load(const char *username, roster_t *r) {
+    char path[1280];
+    snprintf(path, sizeof(path), "%s/%s/roster.xml", g_config.datadir, username);
+
+    xmlDocPtr doc = xmlReadFile(path, NULL, 0);
+    if (!doc) {
+        log_write(LOG_DEBUG, "No roster file or parse error: %s", path);
+        return 0;
+    }
+
+    xmlNodePtr root = xmlDocGetRootElement(doc);
+    if (!root || xmlStrcmp(root->name, (const xmlChar *)"roster") != 0) {
+        xmlFreeDoc(doc);
+        return 0;
+    }
+
+    for (xmlNodePtr item = root->children; item; item = item->next) {
+        if (item->type != XML_ELEMENT_NODE)
+            continue;
+        if (xmlStrcmp(item->name, (const xmlChar *)"item") != 0)
+            continue;
+        if (r->count >= MAX_ROSTER_ITEMS || roster_reserve(r, r->count + 1) < 0)
+            break;
+
+        roster_item_t *ri = &r->items[r->count];
+        memset(ri, 0, sizeof(*ri));
+
+        xmlChar *jid = xmlGetProp(item, (const xmlChar *)"jid");
+        xmlChar *name = xmlGetProp(item, (const xmlChar *)"name");
+        xmlChar *sub = xmlGetProp(item, (const xmlChar *)"subscription");
+        xmlChar *ask = xmlGetProp(item, (const xmlChar *)"ask");
+
+        if (jid) {
+            snprintf(ri->jid, sizeof(ri->jid), "%s", (char *)jid);
+            xmlFree(jid);
+        }
+        if (name) {
+            snprintf(ri->name, sizeof(ri->name), "%s", (char *)name);
+            xmlFree(name);
+        }
+        if (sub) {
+            snprintf(ri->subscription, sizeof(ri->subscription), "%s", (char *)sub);
+            xmlFree(sub);
+        } else {
+            snprintf(ri->subscription, sizeof(ri->subscription), "none");
+        }
+        if (ask && xmlStrcmp(ask, (const xmlChar *)"subscribe") == 0) {
+            ri->ask_subscribe = 1;
+        }
+        if (ask) xmlFree(ask);
+
+        r->count++;
+    }
+
+    xmlFreeDoc(doc);
+    return 0;
+}
+
+/* The snapshot under rosterlog.h, written aside and renamed so that a
+ * crash leaves the old one or the new. Both are synced before this
+ * returns, since the journal is emptied once it does. */
+static int files_roster_save(const char *username, const roster_t *r) {
+    char dir[1280], path[1344], tmp[1408];
+    snprintf(dir, sizeof(dir), "%s/%s", g_config.datadir, username);
+    snprintf(path, sizeof(path), "%s/roster.xml", dir);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    xmlDocPtr doc = xmlNewDoc((const xmlChar *)"1.0");
+    xmlNodePtr root = xmlNewNode(NULL, (const xmlChar *)"roster");
+    xmlDocSetRootElement(doc, root);
+
+    for (int i = 0; i < r->count; i++) {
+        const roster_item_t *ri = &r->items[i];
+        xmlNodePtr item = xmlNewChild(root, NULL, (const xmlChar *)"item", NULL);
+        xmlNewProp(item, (const xmlChar *)"jid", (const xmlChar *)ri->jid);
+        if (ri->name[0])
+            xmlNewProp(item, (const xmlChar *)"name", (const xmlChar *)ri->name);
+        xmlNewProp(item, (const xmlChar *)"subscription",
+                   (const xmlChar *)ri->subscription);
+        if (ri->ask_subscribe)
+            xmlNewProp(item, (const xmlChar *)"ask", (const xmlChar *)"subscribe");
+    }
+
+    int rc = xmlSaveFormatFile(tmp, doc, 1);
+    xmlFreeDoc(doc);
+
+    if (rc < 0 || fsync_path(tmp) < 0 || rename(tmp, path) < 0) {
+        log_write(LOG_ERROR, "Failed to save roster: %s", path);
+        unlink(tmp);
+        return -1;
+    }
+    if (fsync_path(dir) < 0) {
+        log_write(LOG_ERROR, "Failed to sync %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+const store_backend_t store_files = {
+    .name              = "files",
+    .open              = files_open,
+    .close             = files_close,
+    .user_exists       = files_user_exists,
+    .user_password     = files_user_password,
+    .user_create       = files_user_create,
+    .user_set_password = files_user_set_password,
+    .user_delete       = files_user_delete,
+    .roster_load       = rosterlog_load,
+    .roster_update     = rosterlog_append,
+    .offline_append    = offline_append,
+    .offline_peek      = offline_peek,
+    .offline_ack       = offline_ack,
+};
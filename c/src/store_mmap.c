@@ -0,0 +1,421 @@
+#include "store.h"
+#include "roster.h"
+#include "kvstore.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Everything in one kvstore file. Per user:
+ *   u:<user>             password
+ *   r:<user>             roster items, each: 2-byte jid length and jid,
+ *                        2-byte name length and name, 1-byte subscription
+ *                        length and subscription, 1-byte ask flag
+ *   q:<user>             next offline sequence number
+ *   o:<user>:<sequence>  one offline message
+ * Lengths and sequence numbers are big-endian, so that a user's messages
+ * are kept in the order they came.
+ */
+
+#define SEQ_LEN 8
+
+static kv_store_t *db;
+
+static void put_be(unsigned char *p, uint64_t v, int n) {
+    for (int i = n - 1; i >= 0; i--, v >>= 8)
+        p[i] = (unsigned char)v;
+}
+
+static uint64_t get_be(const unsigned char *p, int n) {
+    uint64_t v = 0;
+    for (int i = 0; i < n; i++)
+        v = v << 8 | p[i];
+    return v;
+}
+
+/* prefix and username; 0 if the username is too long for a key */
+static size_t make_key(char *buf, const char *prefix, const char *username) {
+    int n = snprintf(buf, KV_MAX_KEY + 1, "%s%s", prefix, username);
+    return n > 0 && n + 1 + SEQ_LEN <= KV_MAX_KEY ? (size_t)n : 0;
+}
+
+static int db_begin(int write) {
+    if (kv_begin(db, write) < 0) {
+        log_write(LOG_ERROR, "Store: %s", kv_error(db));
+        return -1;
+    }
+    return 0;
+}
+
+static int db_commit(void) {
+    if (kv_commit(db) < 0) {
+        log_write(LOG_ERROR, "Store: commit failed: %s", kv_error(db));
+        return -1;
+    }
+    return 0;
+}
+
+/* Abort after a failed operation */
+static int db_fail(void) {
+    log_write(LOG_ERROR, "Store: %s", kv_error(db));
+    kv_abort(db);
+    return -1;
+}
+
+static int mmap_open(const config_t *cfg) {
+    char path[1280], err[512];
+    snprintf(path, sizeof(path), "%s/%s", cfg->datadir, KV_STORE_FILE);
+    db = kv_open(path, 1, err, sizeof(err));
+    if (!db) {
+        log_write(LOG_ERROR, "Failed to open store %s", err);
+        return -1;
+    }
+    return 0;
+}
+
+static void mmap_close(void) {
+    kv_close(db);
+    db = NULL;
+}
+
+static int mmap_user_password(const char *username, char *buf, size_t size) {
+    char key[KV_MAX_KEY + 1];
+    size_t klen = make_key(key, KV_KEY_USER, username);
+    if (!klen || db_begin(0) < 0)
+        return klen ? -1 : 0;
+
+    const void *val;
+    size_t vlen;
+    int r = kv_get(db, key, klen, &val, &vlen);
+    if (r == 1 && buf) {
+        if (vlen >= size)
+            vlen = size - 1;
+        memcpy(buf, val, vlen);
+        buf[vlen] = '\0';
+    }
+    kv_commit(db);
+    return r;
+}
+
+static int mmap_user_exists(const char *username) {
+    return mmap_user_password(username, NULL, 0) == 1;
+}
+
+static int mmap_user_create(const char *username, const char *password) {
+    char key[KV_MAX_KEY + 1];
+    size_t klen = make_key(key, KV_KEY_USER, username);
+    if (!klen || db_begin(1) < 0)
+        return -3;
+
+    const void *val;
+    size_t vlen;
+    int r = kv_get(db, key, klen, &val, &vlen);
+    if (r != 0) {
+        kv_abort(db);
+        return r == 1 ? -1 : -3;
+    }
+    if (kv_put(db, key, klen, password, strlen(password)) < 0) {
+        db_fail();
+        return -3;
+    }
+    return db_commit() < 0 ? -3 : 0;
+}
+
+static int mmap_user_set_password(const char *username, const char *password) {
+    char key[KV_MAX_KEY + 1];
+    size_t klen = make_key(key, KV_KEY_USER, username);
+    if (!klen || db_begin(1) < 0)
+        return -1;
+    if (kv_put(db, key, klen, password, strlen(password)) < 0)
+        return db_fail();
+    return db_commit();
+}
+
+typedef struct seq_list {
+    uint64_t *seq;
+    size_t    count;
+    size_t    max;
+} seq_list_t;
+
+static int collect_seq(void *ctx, const void *key, size_t klen,
+                       const void *val, size_t vlen)
+{
+    (void)val;
+    (void)vlen;
+    seq_list_t *l = ctx;
+    if (klen >= SEQ_LEN)
+        l->seq[l->count++] = get_be((const unsigned char *)key + klen - SEQ_LEN, SEQ_LEN);
+    return l->count == l->max;
+}
+
+/* Remove the messages of username with the sequence numbers in l */
+static int offline_remove(const char *username, const seq_list_t *l) {
+    char key[KV_MAX_KEY + 1];
+    size_t klen = make_key(key, KV_KEY_OFFLINE, username);
+    key[klen++] = ':';
+    for (size_t i = 0; i < l->count; i++) {
+        put_be((unsigned char *)key + klen, l->seq[i], SEQ_LEN);
+        if (kv_del(db, key, klen + SEQ_LEN) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int mmap_user_delete(const char *username) {
+    static const char *const prefixes[] = { KV_KEY_USER, KV_KEY_ROSTER, KV_KEY_QUEUE };
+    char key[KV_MAX_KEY + 1];
+    if (!make_key(key, KV_KEY_OFFLINE, username) || db_begin(1) < 0)
+        return -1;
+
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+        size_t klen = make_key(key, prefixes[i], username);
+        if (kv_del(db, key, klen) < 0)
+            return db_fail();
+    }
+
+    /* The offline queue, a batch at a time as keys cannot go mid-scan */
+    uint64_t seq[256];
+    seq_list_t l = { seq, 0, 256 };
+    size_t klen = make_key(key, KV_KEY_OFFLINE, username);
+    key[klen++] = ':';
+    do {
+        l.count = 0;
+        if (kv_scan(db, key, klen, collect_seq, &l) < 0 ||
+            offline_remove(username, &l) < 0)
+            return db_fail();
+    } while (l.count == l.max);
+    return db_commit();
+}
+
+static int mmap_roster_load(const char *username, roster_t *r) {
+    char key[KV_MAX_KEY + 1];
+    size_t klen = make_key(key, KV_KEY_ROSTER, username);
+    if (!klen || db_begin(0) < 0)
+        return klen ? -1 : 0;
+
+    const void *val = NULL;
+    size_t vlen = 0;
+    int rc = kv_get(db, key, klen, &val, &vlen);
+    const unsigned char *p = val, *end = rc == 1 ? p + vlen : p;
+    while (rc == 1 && p < end && r->count < MAX_ROSTER_ITEMS) {
+        if (roster_reserve(r, r->count + 1) < 0)
+            break;
+        roster_item_t *ri = &r->items[r->count];
+        memset(ri, 0, sizeof(*ri));
+
+        /* jid, name, subscription, ask; cut short if the value is */
+        size_t len;
+        if (end - p < 2 || (len = get_be(p, 2)) > (size_t)(end - p - 2))
+            break;
+        snprintf(ri->jid, sizeof(ri->jid), "%.*s", (int)len, (const char *)p + 2);
+        p += 2 + len;
+        if (end - p < 2 || (len = get_be(p, 2)) > (size_t)(end - p - 2))
+            break;
+        snprintf(ri->name, sizeof(ri->name), "%.*s", (int)len, (const char *)p + 2);
+        p += 2 + len;
+        if (end - p < 1 || (len = *p) > (size_t)(end - p - 1))
+            break;
+        snprintf(ri->subscription, sizeof(ri->subscription), "%.*s",
+                 (int)len, (const char *)p + 1);
+        p += 1 + len;
+        if (end - p < 1)
+            break;
+        ri->ask_subscribe = *p++ != 0;
+        r->count++;
+    }
+    kv_commit(db);
+    return rc < 0 ? -1 : 0;
+}
+
+static int mmap_roster_save(const char *username, const roster_t *r) {
+    char key[KV_MAX_KEY + 1];
+    size_t klen = make_key(key, KV_KEY_ROSTER, username);
+    if (!klen)
+        return -1;
+
+    size_t size = 0;
+    for (int i = 0; i < r->count; i++)
+        size += 6 + strlen(r->items[i].jid) + strlen(r->items[i].name) +
+                strlen(r->items[i].subscription);
+    unsigned char *buf = malloc(size ? size : 1), *p = buf;
+    if (!buf) {
+        log_write(LOG_ERROR, "Out of memory saving roster of %s", username);
+        return -1;
+    }
+    for (int i = 0; i < r->count; i++) {
+        const roster_item_t *ri = &r->items[i];
+        size_t len = strlen(ri->jid);
+        put_be(p, len, 2);
+        memcpy(p + 2, ri->jid, len);
+        p += 2 + len;
+        len = strlen(ri->name);
+        put_be(p, len, 2);
+        memcpy(p + 2, ri->name, len);
+        p += 2 + len;
+        len = strlen(ri->subscription);
+        *p++ = (unsigned char)len;
+        memcpy(p, ri->subscription, len);
+        p += len;
+        *p++ = ri->ask_subscribe != 0;
+    }
+
+    int rc = db_begin(1);
+    if (rc == 0) {
+        rc = size ? kv_put(db, key, klen, buf, size) : kv_del(db, key, klen);
+        rc = rc < 0 ? db_fail() : db_commit();
+    }
+    free(buf);
+    if (rc < 0)
+        log_write(LOG_ERROR, "Failed to save roster of %s", username);
+    return rc;
+}
+
+/* The roster is one value: read it, change it and put it back. A user's
+ * changes come from one storage thread at a time, so none is lost
+ * between the two transactions. */
+static int mmap_roster_update(const char *username, int op, const roster_item_t *item) {
+    roster_t r;
+    memset(&r, 0, sizeof(r));
+    int rc = mmap_roster_load(username, &r);
+    if (rc == 0)
+        rc = roster_apply(&r, op, item) < 0 ? -1 : mmap_roster_save(username, &r);
+    roster_free(&r);
+    return rc;
+}
+
+static int64_t mmap_offline_append(const char *username, const struct iovec *iov,
+                                   int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if (len > OFFLINE_MAX_RECORD) {
+        log_write(LOG_WARN, "Offline message for %s too large (%zu bytes)",
+                  username, len);
+        return -1;
+    }
+
+    char qkey[KV_MAX_KEY + 1], key[KV_MAX_KEY + 1];
+    size_t qlen = make_key(qkey, KV_KEY_QUEUE, username);
+    size_t klen = make_key(key, KV_KEY_OFFLINE, username);
+    char *data = malloc(len ? len : 1);
+    if (!qlen || !data) {
+        free(data);
+        return -1;
+    }
+    size_t off = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(data + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+
+    int64_t seq = -1;
+    if (db_begin(1) == 0) {
+        const void *val;
+        size_t vlen;
+        int r = kv_get(db, qkey, qlen, &val, &vlen);
+        uint64_t next = r == 1 && vlen == SEQ_LEN ? get_be(val, SEQ_LEN) : 1;
+        unsigned char nbuf[SEQ_LEN];
+        put_be(nbuf, next + 1, SEQ_LEN);
+        key[klen] = ':';
+        put_be((unsigned char *)key + klen + 1, next, SEQ_LEN);
+
+        if (r < 0 || kv_put(db, key, klen + 1 + SEQ_LEN, data, len) < 0 ||
+            kv_put(db, qkey, qlen, nbuf, SEQ_LEN) < 0)
+            db_fail();
+        else if (db_commit() == 0)
+            seq = (int64_t)next;
+    }
+    free(data);
+    return seq;
+}
+
+typedef struct peek_ctx {
+    offline_fn  fn;
+    void       *ctx;
+    int         max;
+    int         taken;
+    int64_t    *last;
+} peek_ctx_t;
+
+static int peek_one(void *ctx, const void *key, size_t klen,
+                    const void *val, size_t vlen)
+{
+    peek_ctx_t *p = ctx;
+    if (klen < SEQ_LEN || p->fn(p->ctx, val, vlen))
+        return 1;
+    *p->last = (int64_t)get_be((const unsigned char *)key + klen - SEQ_LEN, SEQ_LEN);
+    return ++p->taken == p->max;
+}
+
+static int mmap_offline_peek(const char *username, int max, offline_fn fn,
+                             void *ctx, int64_t *last)
+{
+    char key[KV_MAX_KEY + 1];
+    size_t klen = make_key(key, KV_KEY_OFFLINE, username);
+    if (!klen || max <= 0)
+        return klen ? 0 : -1;
+    key[klen++] = ':';
+
+    /* Passed on straight from the map */
+    peek_ctx_t p = { fn, ctx, max, 0, last };
+    if (db_begin(0) < 0)
+        return -1;
+    long n = kv_scan(db, key, klen, peek_one, &p);
+    kv_commit(db);
+    return n < 0 ? -1 : p.taken;
+}
+
+/* collect_seq, stopping before the first message after last */
+typedef struct ack_ctx {
+    seq_list_t  list;
+    uint64_t    last;
+} ack_ctx_t;
+
+static int ack_collect(void *ctx, const void *key, size_t klen,
+                       const void *val, size_t vlen)
+{
+    ack_ctx_t *a = ctx;
+    if (klen < SEQ_LEN ||
+        get_be((const unsigned char *)key + klen - SEQ_LEN, SEQ_LEN) > a->last)
+        return 1;
+    return collect_seq(&a->list, key, klen, val, vlen);
+}
+
+static int mmap_offline_ack(const char *username, int64_t last) {
+    char key[KV_MAX_KEY + 1];
+    size_t klen = make_key(key, KV_KEY_OFFLINE, username);
+    if (!klen || db_begin(1) < 0)
+        return -1;
+    key[klen++] = ':';
+
+    /* A batch at a time, as keys cannot go mid-scan */
+    uint64_t seq[256];
+    ack_ctx_t a = { { seq, 0, 256 }, (uint64_t)last };
+    int removed = 0;
+    do {
+        a.list.count = 0;
+        if (kv_scan(db, key, klen, ack_collect, &a) < 0 ||
+            offline_remove(username, &a.list) < 0)
+            return db_fail();
+        removed += (int)a.list.count;
+    } while (a.list.count == a.list.max);
+    return db_commit() < 0 ? -1 : removed;
+}
+
+const store_backend_t store_mmap = {
+    .name              = "mmap",
+    .open              = mmap_open,
+    .close             = mmap_close,
+    .user_exists       = mmap_user_exists,
+    .user_password     = mmap_user_password,
+    .user_create       = mmap_user_create,
+    .user_set_password = mmap_user_set_password,
+    .user_delete       = mmap_user_delete,
+    .roster_load       = mmap_roster_load,
+    .roster_update     = mmap_roster_update,
+    .offline_append    = mmap_offline_append,
+    .offline_peek      = mmap_offline_peek,
+    .offline_ack       = mmap_offline_ack,
+};
@@ -1,5 +1,6 @@
 #include "stream.h"
 #include "session.h"
+#include "stanza.h"
 #include "config.h"
 #include "log.h"
 #include "util.h"
@@ -57,6 +58,11 @@ void stream_handle_open(session_t *s, const char *to, const char *xmlns) {
 }
 
 void stream_handle_close(session_t *s) {
+    /* Stanzas before it are still waiting to be handled */
+    if (s->suspended || s->deferred) {
+        stanza_defer(s, NULL, NULL);
+        return;
+    }
     log_write(LOG_DEBUG, "Stream close from fd %d", s->fd);
     session_write_str(s, "</stream:stream>");
     if (s->in_xml_parse)
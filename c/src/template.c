@@ -0,0 +1,251 @@
+#include "template.h"
+#include "session.h"
+#include "config.h"
+#include "log.h"
+#include "xml.h"
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    OP_TEXT,                    /* literal bytes */
+    OP_ARG,                     /* escaped argument */
+    OP_ATTR                     /* ` name="` escaped argument `"`, if given */
+};
+
+typedef struct tmpl_op {
+    int    kind;
+    int    arg;
+    size_t off;                 /* into the template's text */
+    size_t len;
+} tmpl_op_t;
+
+typedef struct tmpl {
+    char      *text;            /* literals, with the domain filled in */
+    tmpl_op_t *ops;
+    int        nops;
+} tmpl_t;
+
+static const char *const sources[TMPL_COUNT] = {
+    [TMPL_IQ_RESULT] =
+        "<iq type=\"result\"{ id=0}/>",
+    [TMPL_IQ_RESULT_FROM] =
+        "<iq type=\"result\"{ id=0} from=\"{domain}\"/>",
+    [TMPL_IQ_RESULT_FROM_TO] =
+        "<iq type=\"result\"{ id=0} from=\"{domain}\" to=\"{1}\"/>",
+    [TMPL_BIND_RESULT] =
+        "<iq type=\"result\"{ id=0}>"
+        "<bind xmlns=\"urn:ietf:params:xml:ns:xmpp-bind\"><jid>{1}</jid></bind>"
+        "</iq>",
+    [TMPL_REGISTER_FORM] =
+        "<iq type=\"result\"{ id=0} from=\"{domain}\"{ to=1}>"
+        "<query xmlns=\"jabber:iq:register\">"
+        "<instructions>Choose a username and password.</instructions>"
+        "<username/><password/>"
+        "</query></iq>",
+    [TMPL_DISCO_INFO] =
+        "<iq type=\"result\" from=\"{domain}\" to=\"{0}\"{ id=1}>"
+        "<query xmlns=\"http://jabber.org/protocol/disco#info\">"
+        "<identity category=\"server\" type=\"im\" name=\"xmppd\"/>"
+        "<feature var=\"http://jabber.org/protocol/disco#info\"/>"
+        "<feature var=\"http://jabber.org/protocol/disco#items\"/>"
+        "<feature var=\"jabber:iq:roster\"/>"
+        "<feature var=\"jabber:iq:register\"/>"
+        "<feature var=\"urn:xmpp:delay\"/>"
+        "</query></iq>",
+    [TMPL_DISCO_ITEMS] =
+        "<iq type=\"result\" from=\"{domain}\" to=\"{0}\"{ id=1}>"
+        "<query xmlns=\"http://jabber.org/protocol/disco#items\"/>"
+        "</iq>",
+    [TMPL_ROSTER_RESULT_START] =
+        "<iq type=\"result\"{ id=0} to=\"{1}\"><query xmlns=\"jabber:iq:roster\">",
+    [TMPL_ROSTER_ITEM] =
+        "<item jid=\"{0}\"{ name=1} subscription=\"{2}\"{ ask=3}/>",
+    [TMPL_ROSTER_RESULT_END] =
+        "</query></iq>",
+    [TMPL_ROSTER_PUSH] =
+        "<iq type=\"set\" id=\"{0}\" to=\"{1}\"><query xmlns=\"jabber:iq:roster\">"
+        "<item jid=\"{2}\"{ name=3} subscription=\"{4}\"{ ask=5}/>"
+        "</query></iq>",
+    [TMPL_STANZA_ERROR] =
+        "<{0} type=\"error\"{ id=1} from=\"{domain}\" to=\"{2}\">"
+        "<error type=\"{3}\">"
+        "<{4} xmlns=\"urn:ietf:params:xml:ns:xmpp-stanzas\"/>"
+        "</error></{0}>",
+    [TMPL_PRESENCE] =
+        "<presence type=\"{0}\" from=\"{1}\"{ to=2}/>",
+    [TMPL_PING] =
+        "<iq type=\"get\" from=\"{domain}\" to=\"{0}\" id=\"ping-{1}\">"
+        "<ping xmlns=\"urn:xmpp:ping\"/></iq>",
+};
+
+static tmpl_t templates[TMPL_COUNT];
+
+static int parse_arg(const char *s, size_t len) {
+    if (len != 1 || s[0] < '0' || s[0] >= '0' + TMPL_MAX_ARGS)
+        return -1;
+    return s[0] - '0';
+}
+
+static int tmpl_compile(tmpl_t *t, const char *src,
+                        const char *domain, size_t domain_len)
+{
+    size_t slots = 0;
+    for (const char *p = src; *p; p++)
+        slots += *p == '{';
+
+    /* Every slot may end a literal and add an op of its own */
+    t->ops = calloc(2 * slots + 1, sizeof(*t->ops));
+    t->text = malloc(strlen(src) + slots * domain_len + 1);
+    if (!t->ops || !t->text)
+        return -1;
+
+    size_t used = 0;
+    tmpl_op_t *lit = NULL;
+    const char *p = src;
+    while (*p) {
+        if (*p != '{') {
+            if (!lit) {
+                lit = &t->ops[t->nops++];
+                lit->kind = OP_TEXT;
+                lit->off = used;
+            }
+            t->text[used++] = *p++;
+            lit->len++;
+            continue;
+        }
+
+        const char *slot = p + 1;
+        const char *end = strchr(slot, '}');
+        if (!end)
+            return -1;
+        size_t slot_len = (size_t)(end - slot);
+        p = end + 1;
+
+        if (slot_len == 6 && memcmp(slot, "domain", 6) == 0) {
+            if (!lit) {
+                lit = &t->ops[t->nops++];
+                lit->kind = OP_TEXT;
+                lit->off = used;
+            }
+            memcpy(t->text + used, domain, domain_len);
+            used += domain_len;
+            lit->len += domain_len;
+            continue;
+        }
+
+        tmpl_op_t *op = &t->ops[t->nops++];
+        lit = NULL;
+        if (slot[0] != ' ') {
+            op->kind = OP_ARG;
+            op->arg = parse_arg(slot, slot_len);
+            if (op->arg < 0)
+                return -1;
+            continue;
+        }
+
+        /* { name=N}: the literal part is ` name="` */
+        const char *eq = memchr(slot, '=', slot_len);
+        if (!eq)
+            return -1;
+        op->kind = OP_ATTR;
+        op->arg = parse_arg(eq + 1, (size_t)(end - eq - 1));
+        if (op->arg < 0)
+            return -1;
+        size_t name_len = (size_t)(eq - slot);
+        op->off = used;
+        op->len = name_len + 2;
+        memcpy(t->text + used, slot, name_len);
+        memcpy(t->text + used + name_len, "=\"", 2);
+        used += op->len;
+    }
+    return 0;
+}
+
+int tmpl_init(void) {
+    /* The domain is fixed for the life of the process: escape it once */
+    size_t raw_len = strlen(g_config.domain);
+    size_t domain_len = xml_attr_escaped_len(g_config.domain, raw_len);
+    char *domain = malloc(domain_len + 1);
+    if (!domain)
+        return -1;
+    xml_attr_escape(domain, g_config.domain, raw_len);
+
+    for (int i = 0; i < TMPL_COUNT; i++) {
+        if (tmpl_compile(&templates[i], sources[i], domain, domain_len) < 0) {
+            log_write(LOG_ERROR, "Failed to compile response template %d", i);
+            free(domain);
+            tmpl_cleanup();
+            return -1;
+        }
+    }
+    free(domain);
+    return 0;
+}
+
+void tmpl_cleanup(void) {
+    for (int i = 0; i < TMPL_COUNT; i++) {
+        free(templates[i].text);
+        free(templates[i].ops);
+        memset(&templates[i], 0, sizeof(templates[i]));
+    }
+}
+
+size_t tmpl_len(tmpl_id_t id, const char *const *args) {
+    const tmpl_t *t = &templates[id];
+    size_t len = 0;
+    for (int i = 0; i < t->nops; i++) {
+        const tmpl_op_t *op = &t->ops[i];
+        if (op->kind == OP_TEXT) {
+            len += op->len;
+            continue;
+        }
+
+        const char *arg = args[op->arg];
+        if (!arg)
+            continue;
+        len += xml_attr_escaped_len(arg, strlen(arg));
+        if (op->kind == OP_ATTR)
+            len += op->len + 1;
+    }
+    return len;
+}
+
+char *tmpl_render(tmpl_id_t id, const char *const *args, char *out) {
+    const tmpl_t *t = &templates[id];
+    for (int i = 0; i < t->nops; i++) {
+        const tmpl_op_t *op = &t->ops[i];
+        if (op->kind == OP_TEXT) {
+            memcpy(out, t->text + op->off, op->len);
+            out += op->len;
+            continue;
+        }
+
+        const char *arg = args[op->arg];
+        if (!arg)
+            continue;
+        if (op->kind == OP_ATTR) {
+            memcpy(out, t->text + op->off, op->len);
+            out += op->len;
+        }
+        out = xml_attr_escape(out, arg, strlen(arg));
+        if (op->kind == OP_ATTR)
+            *out++ = '"';
+    }
+    return out;
+}
+
+void tmpl_send(session_t *s, tmpl_id_t id, const char *const *args) {
+    size_t len = tmpl_len(id, args);
+    char *out = session_reserve(s, len);
+    if (!out)
+        return;
+    tmpl_render(id, args, out);
+    session_commit(s, out, len);
+}
+
+outseg_t *tmpl_seg(tmpl_id_t id, const char *const *args) {
+    outseg_t *seg = outseg_reserve(tmpl_len(id, args));
+    if (seg)
+        tmpl_render(id, args, seg->data);
+    return seg;
+}
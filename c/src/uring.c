@@ -0,0 +1,296 @@
+#define _GNU_SOURCE     /* mmap flags, syscall */
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+
+/* Features we rely on: one mmap for both rings, timeouts through
+ * io_uring_enter's extended argument, and no silently dropped CQEs */
+#define URING_REQUIRED_FEATURES \
+    (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP)
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags, const void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned opcode, const void *arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+static int setup_buffers(uring_t *u, unsigned buf_count, unsigned buf_size) {
+    u->br_len = buf_count * sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->br_len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED) {
+        u->br = NULL;
+        log_write(LOG_ERROR, "mmap(buffer ring): %s", strerror(errno));
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+    reg.ring_entries = buf_count;
+    reg.bgid = 0;
+    if (sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        log_write(LOG_WARN, "io_uring provided buffer rings unsupported: %s",
+                  strerror(errno));
+        return -1;
+    }
+
+    u->bufs = malloc((size_t)buf_count * buf_size);
+    if (!u->bufs) {
+        log_write(LOG_ERROR, "Failed to allocate io_uring receive buffers");
+        return -1;
+    }
+    u->buf_count = buf_count;
+    u->buf_size = buf_size;
+
+    for (unsigned i = 0; i < buf_count; i++) {
+        struct io_uring_buf *b = &u->br->bufs[i];
+        b->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)i * buf_size);
+        b->len = buf_size;
+        b->bid = (uint16_t)i;
+    }
+    __atomic_store_n(&u->br->tail, (uint16_t)buf_count, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Multishot recv (and multishot accept, which is older) is not implied
+ * by any feature flag or by buffer ring support. Try one on a socket
+ * pair: a kernel that has it reports the data with IORING_CQE_F_MORE
+ * set, one that does not fails the recv. */
+static int probe_multishot(uring_t *u) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        log_write(LOG_ERROR, "socketpair(): %s", strerror(errno));
+        return -1;
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (!sqe) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sv[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+
+    int ok = 0, more = 1, first = 1;
+    if (write(sv[1], "x", 1) != 1)
+        more = 0;
+
+    /* Then end it with EOF, so no completion of it is left behind */
+    while (more) {
+        struct io_uring_cqe *cqe;
+        if (uring_submit_and_wait(u, 1000) < 0 || !(cqe = uring_peek_cqe(u))) {
+            ok = 0;
+            break;
+        }
+        more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+        if (first) {
+            ok = cqe->res == 1 && more;
+            first = 0;
+            shutdown(sv[1], SHUT_WR);
+        }
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+            uring_buf_recycle(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        uring_cqe_seen(u);
+    }
+
+    close(sv[0]);
+    close(sv[1]);
+    if (!ok) {
+        log_write(LOG_WARN, "io_uring multishot recv unsupported");
+        return -1;
+    }
+    return 0;
+}
+
+int uring_init(uring_t *u, unsigned entries, unsigned buf_count, unsigned buf_size) {
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+
+    /* Multishot recv can post many completions per submission, so give
+     * the CQ plenty of headroom over the SQ */
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+              IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = entries * 4;
+    u->fd = sys_setup(entries, &p);
+    if (u->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        u->fd = sys_setup(entries, &p);
+    }
+    if (u->fd < 0) {
+        log_write(LOG_WARN, "io_uring_setup(): %s", strerror(errno));
+        return -1;
+    }
+    if ((p.features & URING_REQUIRED_FEATURES) != URING_REQUIRED_FEATURES) {
+        log_write(LOG_WARN, "io_uring lacks required features (0x%x)", p.features);
+        uring_close(u);
+        return -1;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sq_map_len = sq_len > cq_len ? sq_len : cq_len;
+    u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED) {
+        u->sq_map = NULL;
+        log_write(LOG_ERROR, "mmap(io_uring rings): %s", strerror(errno));
+        uring_close(u);
+        return -1;
+    }
+
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        log_write(LOG_ERROR, "mmap(io_uring sqes): %s", strerror(errno));
+        uring_close(u);
+        return -1;
+    }
+
+    char *sq = u->sq_map;
+    u->sq_head    = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail    = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask    = *(unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sq_array   = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head    = (unsigned *)(sq + p.cq_off.head);
+    u->cq_tail    = (unsigned *)(sq + p.cq_off.tail);
+    u->cq_mask    = *(unsigned *)(sq + p.cq_off.ring_mask);
+    u->cqes       = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+
+    /* SQ slots map one-to-one onto SQEs */
+    for (unsigned i = 0; i < u->sq_entries; i++)
+        u->sq_array[i] = i;
+    u->sq_local_tail = u->sq_submitted = *u->sq_tail;
+
+    if (setup_buffers(u, buf_count, buf_size) < 0 || probe_multishot(u) < 0) {
+        uring_close(u);
+        return -1;
+    }
+    return 0;
+}
+
+void uring_close(uring_t *u) {
+    if (u->fd >= 0)
+        close(u->fd);
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_len);
+    if (u->sq_map)
+        munmap(u->sq_map, u->sq_map_len);
+    if (u->br)
+        munmap(u->br, u->br_len);
+    free(u->bufs);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+/* Make SQEs handed out so far visible to the kernel */
+static unsigned uring_publish(uring_t *u) {
+    unsigned n = u->sq_local_tail - u->sq_submitted;
+    if (n) {
+        __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+        u->sq_submitted = u->sq_local_tail;
+    }
+    return n;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *u) {
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sq_local_tail - head >= u->sq_entries) {
+        /* Full: hand the queued batch to the kernel without waiting */
+        unsigned n = uring_publish(u);
+        if (sys_enter(u->fd, n, 0, 0, NULL, 0) < 0 && errno != EINTR) {
+            log_write(LOG_ERROR, "io_uring_enter(): %s", strerror(errno));
+            return NULL;
+        }
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (u->sq_local_tail - head >= u->sq_entries)
+            return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &u->sqes[u->sq_local_tail & u->sq_mask];
+    u->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit_and_wait(uring_t *u, int timeout_ms) {
+    unsigned n = uring_publish(u);
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    /* Completions already waiting make blocking pointless */
+    unsigned min_complete = uring_peek_cqe(u) ? 0 : 1;
+    int rc = sys_enter(u->fd, n, min_complete,
+                       IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                       &arg, sizeof(arg));
+    if (rc < 0 && errno != ETIME)
+        return -errno;
+    return 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *u) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &u->cqes[head & u->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+char *uring_buf(uring_t *u, unsigned bid) {
+    return u->bufs + (size_t)bid * u->buf_size;
+}
+
+void uring_buf_recycle(uring_t *u, unsigned bid) {
+    uint16_t tail = u->br->tail;
+    struct io_uring_buf *b = &u->br->bufs[tail & (u->buf_count - 1)];
+    b->addr = (uint64_t)(uintptr_t)uring_buf(u, bid);
+    b->len = u->buf_size;
+    b->bid = (uint16_t)bid;
+    __atomic_store_n(&u->br->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
+
+#else
+
+/* Keep the translation unit non-empty when io_uring is compiled out */
+typedef int uring_disabled_t;
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,425 @@
+#define _GNU_SOURCE     /* pthread_rwlock_t, strdup */
+#include "usercache.h"
+#include "kvstore.h"
+#include "config.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+/* Chained hash table of usernames, like the session directory */
+typedef struct user_entry {
+    struct user_entry *next;
+    uint32_t           hash;
+    int                exists;
+    char              *password;        /* NULL if not cached */
+    char               username[];
+} user_entry_t;
+
+#define CACHE_BUCKETS_INIT 1024
+#define WATCH_BUCKETS      1024         /* power of two */
+
+static user_entry_t   **cache_buckets = NULL;
+static size_t           cache_nbuckets = 0;     /* power of two */
+static size_t           cache_count = 0;
+static size_t           cache_missing = 0;      /* entries with exists 0 */
+static pthread_rwlock_t cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+static _Atomic uint64_t cache_gen = 1;
+static atomic_int       enabled = 0;    /* the watcher is running */
+
+/* Watched user directories, by watch descriptor (storage = files) */
+typedef struct user_watch {
+    struct user_watch *next;
+    int                wd;
+    char               username[];
+} user_watch_t;
+
+static pthread_mutex_t  watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static user_watch_t    *watch_buckets[WATCH_BUCKETS];
+static int              watch_users = 0;
+static int              inotify_fd = -1;
+static int              datadir_wd = -1;
+static int              stop_fd = -1;
+static int              watch_running = 0;
+static pthread_t        watch_thread;
+
+/* FNV-1a */
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (; *name; name++)
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    return h;
+}
+
+/* --- The cache --- */
+
+/* Link pointing at username's entry, or at the NULL ending its bucket.
+ * The table must have been allocated. */
+static user_entry_t **cache_find(const char *username, uint32_t hash) {
+    user_entry_t **pp = &cache_buckets[hash & (cache_nbuckets - 1)];
+    for (; *pp; pp = &(*pp)->next)
+        if ((*pp)->hash == hash && strcmp((*pp)->username, username) == 0)
+            break;
+    return pp;
+}
+
+static int cache_resize(size_t nbuckets) {
+    user_entry_t **buckets = calloc(nbuckets, sizeof(*buckets));
+    if (!buckets)
+        return -1;
+
+    for (size_t i = 0; i < cache_nbuckets; i++) {
+        user_entry_t *e = cache_buckets[i];
+        while (e) {
+            user_entry_t *next = e->next;
+            user_entry_t **head = &buckets[e->hash & (nbuckets - 1)];
+            e->next = *head;
+            *head = e;
+            e = next;
+        }
+    }
+    free(cache_buckets);
+    cache_buckets = buckets;
+    cache_nbuckets = nbuckets;
+    return 0;
+}
+
+static void entry_free(user_entry_t *e) {
+    free(e->password);
+    free(e);
+}
+
+/* Drop every entry. Called with cache_lock held for writing. */
+static void cache_clear_locked(void) {
+    for (size_t i = 0; i < cache_nbuckets; i++) {
+        while (cache_buckets[i]) {
+            user_entry_t *e = cache_buckets[i];
+            cache_buckets[i] = e->next;
+            entry_free(e);
+        }
+    }
+    cache_count = cache_missing = 0;
+    atomic_fetch_add(&cache_gen, 1);
+}
+
+static void cache_clear(void) {
+    pthread_rwlock_wrlock(&cache_lock);
+    cache_clear_locked();
+    pthread_rwlock_unlock(&cache_lock);
+}
+
+int usercache_exists(const char *username) {
+    if (!enabled)
+        return -1;
+    uint32_t hash = name_hash(username);
+    int rc = -1;
+
+    pthread_rwlock_rdlock(&cache_lock);
+    if (cache_nbuckets) {
+        user_entry_t *e = *cache_find(username, hash);
+        if (e)
+            rc = e->exists;
+    }
+    pthread_rwlock_unlock(&cache_lock);
+    return rc;
+}
+
+int usercache_password(const char *username, char *buf, size_t size) {
+    if (!enabled)
+        return -1;
+    uint32_t hash = name_hash(username);
+    int rc = -1;
+
+    pthread_rwlock_rdlock(&cache_lock);
+    if (cache_nbuckets) {
+        user_entry_t *e = *cache_find(username, hash);
+        if (e && !e->exists) {
+            rc = 0;
+        } else if (e && e->password) {
+            snprintf(buf, size, "%s", e->password);
+            rc = 1;
+        }
+    }
+    pthread_rwlock_unlock(&cache_lock);
+    return rc;
+}
+
+uint64_t usercache_generation(void) {
+    return atomic_load(&cache_gen);
+}
+
+/* --- Watches on user directories --- */
+
+/* Watch username's directory for its user.conf changing. Returns -1 if
+ * it cannot be watched. */
+static int watch_add(const char *username) {
+    char path[1280];
+    snprintf(path, sizeof(path), "%s/%s", g_config.datadir, username);
+    int wd = inotify_add_watch(inotify_fd, path,
+                               IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                               IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+    if (wd < 0)
+        return -1;
+
+    size_t len = strlen(username);
+    user_watch_t **head = &watch_buckets[(unsigned)wd & (WATCH_BUCKETS - 1)];
+    pthread_mutex_lock(&watch_lock);
+    user_watch_t *w;
+    for (w = *head; w; w = w->next)
+        if (w->wd == wd)
+            break;
+    if (!w && (w = malloc(sizeof(*w) + len + 1)) != NULL) {
+        w->wd = wd;
+        memcpy(w->username, username, len + 1);
+        w->next = *head;
+        *head = w;
+    }
+    pthread_mutex_unlock(&watch_lock);
+    if (!w) {
+        inotify_rm_watch(inotify_fd, wd);
+        return -1;
+    }
+    return 0;
+}
+
+/* Copy the username watched under wd into buf; 0 if there is none */
+static int watch_name(int wd, char *buf, size_t size, int remove) {
+    user_watch_t **pp = &watch_buckets[(unsigned)wd & (WATCH_BUCKETS - 1)];
+    int found = 0;
+    pthread_mutex_lock(&watch_lock);
+    for (; *pp; pp = &(*pp)->next) {
+        if ((*pp)->wd != wd)
+            continue;
+        user_watch_t *w = *pp;
+        snprintf(buf, size, "%s", w->username);
+        found = 1;
+        if (remove) {
+            *pp = w->next;
+            free(w);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&watch_lock);
+    return found;
+}
+
+void usercache_fill(const char *username, int exists, const char *password,
+                    uint64_t gen)
+{
+    if (!enabled)
+        return;
+
+    /* An account's password is only cached while its user.conf is
+     * watched; its existence is covered by the datadir watch */
+    if (exists && password && watch_users && watch_add(username) < 0)
+        password = NULL;
+
+    size_t len = strlen(username);
+    uint32_t hash = name_hash(username);
+    char *pw = exists && password ? strdup(password) : NULL;
+
+    pthread_rwlock_wrlock(&cache_lock);
+    if (atomic_load(&cache_gen) != gen ||
+        (cache_nbuckets == 0 && cache_resize(CACHE_BUCKETS_INIT) < 0)) {
+        pthread_rwlock_unlock(&cache_lock);
+        free(pw);
+        return;
+    }
+    if (cache_count >= cache_nbuckets)
+        cache_resize(cache_nbuckets * 2);
+
+    user_entry_t **pp = cache_find(username, hash);
+    user_entry_t *e = *pp;
+    if (!e) {
+        if (!exists && cache_missing >= USERCACHE_MAX_MISSING)
+            e = NULL;
+        else if ((e = malloc(sizeof(*e) + len + 1)) != NULL) {
+            e->next = NULL;
+            e->hash = hash;
+            e->exists = 0;
+            e->password = NULL;
+            memcpy(e->username, username, len + 1);
+            *pp = e;
+            cache_count++;
+            cache_missing++;
+        }
+    }
+    if (e) {
+        if (!e->exists && exists)
+            cache_missing--;
+        else if (e->exists && !exists)
+            cache_missing++;
+        e->exists = exists;
+        if (pw || !exists) {
+            free(e->password);
+            e->password = pw;
+            pw = NULL;
+        }
+    }
+    pthread_rwlock_unlock(&cache_lock);
+    free(pw);
+}
+
+void usercache_forget(const char *username) {
+    if (!enabled)
+        return;
+    uint32_t hash = name_hash(username);
+
+    pthread_rwlock_wrlock(&cache_lock);
+    atomic_fetch_add(&cache_gen, 1);
+    if (cache_nbuckets) {
+        user_entry_t **pp = cache_find(username, hash);
+        user_entry_t *e = *pp;
+        if (e) {
+            *pp = e->next;
+            if (!e->exists)
+                cache_missing--;
+            cache_count--;
+            entry_free(e);
+        }
+    }
+    pthread_rwlock_unlock(&cache_lock);
+}
+
+/* --- inotify --- */
+
+static void handle_event(const struct inotify_event *ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        log_write(LOG_WARN, "User cache: inotify queue overflowed, emptying cache");
+        cache_clear();
+        return;
+    }
+
+    if (ev->wd == datadir_wd) {
+        if (ev->mask & IN_IGNORED) {
+            log_write(LOG_WARN, "User cache: datadir no longer watched");
+            cache_clear();
+            datadir_wd = -1;
+            return;
+        }
+        if (ev->len == 0)
+            return;
+        if (!watch_users) {
+            /* Another process (useradd) has written to the store */
+            if (strcmp(ev->name, KV_STORE_FILE) == 0)
+                cache_clear();
+            return;
+        }
+        if (!(ev->mask & IN_ISDIR))
+            return;
+        /* A new directory may get its user.conf before any watch on it
+         * is in place, so watch first and forget after */
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+            watch_add(ev->name);
+        usercache_forget(ev->name);
+        return;
+    }
+
+    char username[256];
+    if (ev->mask & IN_IGNORED) {
+        watch_name(ev->wd, username, sizeof(username), 1);
+        return;
+    }
+    if (ev->len && strcmp(ev->name, "user.conf") == 0 &&
+        watch_name(ev->wd, username, sizeof(username), 0))
+        usercache_forget(username);
+}
+
+static void *watch_main(void *arg) {
+    (void)arg;
+    union {
+        struct inotify_event ev;
+        char                 buf[4096];
+    } u;
+
+    for (;;) {
+        struct pollfd fds[2] = {
+            { .fd = inotify_fd, .events = POLLIN },
+            { .fd = stop_fd,    .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            log_write(LOG_ERROR, "User cache: poll failed: %s", strerror(errno));
+            break;
+        }
+        if (fds[1].revents)
+            break;
+
+        ssize_t n = read(inotify_fd, u.buf, sizeof(u.buf));
+        if (n <= 0)
+            continue;
+        for (char *p = u.buf; p < u.buf + n; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            handle_event(ev);
+            p += sizeof(*ev) + ev->len;
+        }
+    }
+
+    /* Nothing tells us of changes any more */
+    enabled = 0;
+    cache_clear();
+    return NULL;
+}
+
+int usercache_init(const config_t *cfg) {
+    watch_users = cfg->storage == STORAGE_FILES;
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (inotify_fd >= 0)
+        datadir_wd = inotify_add_watch(inotify_fd, cfg->datadir,
+                                       IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                       IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR);
+    if (inotify_fd < 0 || stop_fd < 0 || datadir_wd < 0) {
+        log_write(LOG_WARN, "User cache: cannot watch %s (%s), not caching",
+                  cfg->datadir, strerror(errno));
+        usercache_shutdown();
+        return 0;
+    }
+    if (pthread_create(&watch_thread, NULL, watch_main, NULL) != 0) {
+        log_write(LOG_ERROR, "Failed to start user cache watcher thread");
+        usercache_shutdown();
+        return -1;
+    }
+    watch_running = 1;
+    enabled = 1;
+    return 0;
+}
+
+void usercache_shutdown(void) {
+    enabled = 0;
+    if (watch_running) {
+        uint64_t one = 1;
+        if (write(stop_fd, &one, sizeof(one)) == (ssize_t)sizeof(one))
+            pthread_join(watch_thread, NULL);
+        watch_running = 0;
+    }
+    if (inotify_fd >= 0)
+        close(inotify_fd);
+    if (stop_fd >= 0)
+        close(stop_fd);
+    inotify_fd = stop_fd = datadir_wd = -1;
+
+    pthread_rwlock_wrlock(&cache_lock);
+    cache_clear_locked();
+    free(cache_buckets);
+    cache_buckets = NULL;
+    cache_nbuckets = 0;
+    pthread_rwlock_unlock(&cache_lock);
+
+    for (int i = 0; i < WATCH_BUCKETS; i++) {
+        while (watch_buckets[i]) {
+            user_watch_t *w = watch_buckets[i];
+            watch_buckets[i] = w->next;
+            free(w);
+        }
+    }
+}
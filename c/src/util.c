@@ -1,7 +1,11 @@
+#define _GNU_SOURCE     /* fsync, arc4random_buf */
 #include "util.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 /* --- JID utilities --- */
 
@@ -162,3 +166,16 @@ void generate_id(char *buf, size_t len) {
     }
     buf[len] = '\0';
 }
+
+/* --- File durability --- */
+
+int fsync_path(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    int rc = fsync(fd);
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return rc;
+}
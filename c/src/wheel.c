@@ -0,0 +1,155 @@
+#include "wheel.h"
+#include <string.h>
+#include <limits.h>
+
+#define LEVEL_SHIFT(l)  ((unsigned)(l) * WHEEL_BITS)
+#define SLOT_MASK       ((uint64_t)WHEEL_SLOTS - 1)
+#define WHEEL_SPAN      ((uint64_t)1 << LEVEL_SHIFT(WHEEL_LEVELS))
+
+void wheel_init(wheel_t *w, uint64_t now) {
+    memset(w, 0, sizeof(*w));
+    w->now = now;
+}
+
+/* Link t into the slot for its expiry, treating anything earlier than
+ * base as due at base. The level is picked by distance from w->now. */
+static void wheel_place(wheel_t *w, wheel_timer_t *t, uint64_t base) {
+    uint64_t expires = t->expires > base ? t->expires : base;
+    uint64_t delta = expires - w->now;
+
+    /* Beyond the top level: park in the furthest slot and re-place
+     * from there when it comes due */
+    if (delta >= WHEEL_SPAN) {
+        expires = w->now + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+
+    unsigned level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+           delta >= ((uint64_t)1 << LEVEL_SHIFT(level + 1)))
+        level++;
+
+    unsigned slot = (unsigned)((expires >> LEVEL_SHIFT(level)) & SLOT_MASK);
+    wheel_timer_t **head = &w->slots[level][slot];
+    t->next = *head;
+    if (t->next)
+        t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+    t->where = level * WHEEL_SLOTS + slot;
+    w->occupied[level] |= (uint64_t)1 << slot;
+}
+
+static void wheel_unlink(wheel_t *w, wheel_timer_t *t) {
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+
+    unsigned level = t->where / WHEEL_SLOTS;
+    unsigned slot = t->where % WHEEL_SLOTS;
+    if (!w->slots[level][slot])
+        w->occupied[level] &= ~((uint64_t)1 << slot);
+}
+
+void wheel_arm(wheel_t *w, wheel_timer_t *t, uint64_t expires) {
+    if (t->pprev)
+        wheel_unlink(w, t);
+    else
+        w->count++;
+    t->expires = expires;
+    wheel_place(w, t, w->now + 1);
+}
+
+void wheel_cancel(wheel_t *w, wheel_timer_t *t) {
+    if (!t->pprev)
+        return;
+    wheel_unlink(w, t);
+    w->count--;
+}
+
+/* Index of the first occupied slot at or after start, wrapping around */
+static unsigned first_from(uint64_t occupied, unsigned start) {
+    uint64_t rot = start ? (occupied >> start) | (occupied << (WHEEL_SLOTS - start))
+                         : occupied;
+    return (unsigned)__builtin_ctzll(rot);
+}
+
+int wheel_timeout(const wheel_t *w, uint64_t now) {
+    if (w->count == 0)
+        return -1;
+
+    uint64_t next = UINT64_MAX;
+    for (unsigned level = 0; level < WHEEL_LEVELS; level++) {
+        if (!w->occupied[level])
+            continue;
+
+        /* Slots run (level 0) or move down (upper levels) at the start of
+         * their granule; the current granule's slot is already done */
+        uint64_t granule = w->now >> LEVEL_SHIFT(level);
+        unsigned start = (unsigned)((granule + 1) & SLOT_MASK);
+        uint64_t due = (granule + 1 + first_from(w->occupied[level], start))
+                       << LEVEL_SHIFT(level);
+        if (due < next)
+            next = due;
+    }
+
+    if (next <= now)
+        return 0;
+    if (next - now > INT_MAX)
+        return INT_MAX;
+    return (int)(next - now);
+}
+
+/* Move the timers of an upper-level slot down now that it is due */
+static void wheel_cascade(wheel_t *w, unsigned level, unsigned slot) {
+    wheel_timer_t *t = w->slots[level][slot];
+    w->slots[level][slot] = NULL;
+    w->occupied[level] &= ~((uint64_t)1 << slot);
+
+    while (t) {
+        wheel_timer_t *next = t->next;
+        wheel_place(w, t, w->now);
+        t = next;
+    }
+}
+
+void wheel_advance(wheel_t *w, uint64_t now) {
+    while (w->now < now) {
+        if (w->count == 0) {
+            w->now = now;
+            return;
+        }
+
+        /* Nothing can fire before the next level-0 wrap */
+        if (!w->occupied[0]) {
+            uint64_t wrap = (w->now | SLOT_MASK) + 1;
+            if (wrap > now) {
+                w->now = now;
+                return;
+            }
+            w->now = wrap - 1;
+        }
+
+        uint64_t tick = ++w->now;
+
+        /* Upper slots starting at this tick, outermost first so that
+         * timers they move down get cascaded further in the same pass */
+        unsigned top = 0;
+        while (top + 1 < WHEEL_LEVELS &&
+               (tick & (((uint64_t)1 << LEVEL_SHIFT(top + 1)) - 1)) == 0)
+            top++;
+        for (unsigned level = top; level > 0; level--)
+            wheel_cascade(w, level, (unsigned)((tick >> LEVEL_SHIFT(level)) & SLOT_MASK));
+
+        /* Timers armed by callbacks land on a later tick, so this ends */
+        wheel_timer_t **head = &w->slots[0][tick & SLOT_MASK];
+        while (*head) {
+            wheel_timer_t *t = *head;
+            wheel_unlink(w, t);
+            w->count--;
+            t->fn(t);
+        }
+    }
+}
@@ -1,12 +1,18 @@
 #include "xml.h"
 #include "session.h"
 #include "stanza.h"
+#include "config.h"
 #include "log.h"
+#include "util.h"
 #include <string.h>
 #include <stdlib.h>
+#include <malloc.h>
 #include <libxml/parser.h>
 #include <libxml/parserInternals.h>
 #include <libxml/xmlerror.h>
+#ifdef NATIVE_XML
+#include "xmlscan.h"
+#endif
 
 /* Forward declarations for stream handlers (Phase 4) */
 void stream_handle_open(session_t *s, const char *to, const char *xmlns);
@@ -14,6 +20,13 @@ void stream_handle_close(session_t *s);
 
 static xmlSAXHandler sax_handler;
 
+/* Document offset the parser has reached, with xmlByteConsumed's meaning */
+#ifdef NATIVE_XML
+#define parser_consumed(ctx) ((long)xml_scanner_consumed(ctx))
+#else
+#define parser_consumed(ctx) xmlByteConsumed(ctx)
+#endif
+
 /*
  * Extract a named attribute from the SAX2 attributes array.
  * Returns a malloc'd string or NULL. Caller must free with xmlFree().
@@ -42,6 +55,267 @@ static xmlChar *sax_get_attribute(const xmlChar **attributes,
     return NULL;
 }
 
+/* --- Verbatim input --- */
+
+#define CARRY_KEEP 4096     /* carry buffer kept while empty up to this size */
+
+/* Byte at stream offset off, or -1 if it is no longer held */
+static int input_byte(const session_t *s, uint64_t off) {
+    uint64_t chunk_base = s->parser_fed;
+    if (s->feed_chunk && off >= chunk_base && off - chunk_base < s->feed_len)
+        return (unsigned char)s->feed_chunk[off - chunk_base];
+    if (off >= s->carry_base && off - s->carry_base < s->carry_len)
+        return (unsigned char)s->carry[off - s->carry_base];
+    return -1;
+}
+
+static void carry_clear(session_t *s, uint64_t base) {
+    s->carry_len = 0;
+    s->carry_base = base;
+    if (s->carry_cap > CARRY_KEEP) {
+        free(s->carry);
+        s->carry = NULL;
+        s->carry_cap = 0;
+    }
+}
+
+/* Copy the chunk's bytes from the end of carry up to stream offset to */
+static int carry_extend(session_t *s, uint64_t to) {
+    uint64_t chunk_base = s->parser_fed;
+    uint64_t from = s->carry_base + s->carry_len;
+    if (from < chunk_base)
+        return -1;      /* lost track of some input */
+    if (to <= from)
+        return 0;
+
+    size_t n = (size_t)(to - from);
+    if (s->carry_len + n > s->carry_cap) {
+        size_t cap = s->carry_cap ? s->carry_cap : 1024;
+        while (cap < s->carry_len + n)
+            cap *= 2;
+        char *grown = realloc(s->carry, cap);
+        if (!grown)
+            return -1;
+        s->carry = grown;
+        s->carry_cap = cap;
+    }
+    memcpy(s->carry + s->carry_len, s->feed_chunk + (from - chunk_base), n);
+    s->carry_len += n;
+    return 0;
+}
+
+/* After a chunk: hold on to whatever the stanza in progress, or the next
+ * one, may need from it. That is everything from the start of the
+ * current stanza, or else from where the parser has got to. */
+static void keep_input(session_t *s) {
+    uint64_t fed_end = s->parser_fed + s->feed_len;
+    long consumed = parser_consumed(s->xml_ctx);
+    uint64_t keep;
+
+    if (s->stanza_depth >= 2)
+        keep = s->stanza_verbatim ? s->stanza_start : fed_end;
+    else
+        keep = consumed >= 0 ? (uint64_t)consumed : fed_end;
+
+    if (keep >= fed_end) {
+        carry_clear(s, fed_end);
+        return;
+    }
+
+    if (keep >= s->carry_base + s->carry_len) {
+        carry_clear(s, keep);
+    } else if (keep > s->carry_base) {
+        size_t drop = (size_t)(keep - s->carry_base);
+        memmove(s->carry, s->carry + drop, s->carry_len - drop);
+        s->carry_len -= drop;
+        s->carry_base = keep;
+    }
+    if (carry_extend(s, fed_end) < 0) {
+        /* The stanza in progress will be re-serialized instead */
+        s->stanza_verbatim = 0;
+        carry_clear(s, fed_end);
+    }
+}
+
+/* Nearest declaration of prefix in scope at node, counting only the
+ * declarations inside the stanza (it is serialized on its own) */
+static int ns_in_scope(const xml_node_t *node, const char *prefix, const char *uri) {
+    if (prefix && strcmp(prefix, "xml") == 0)
+        return 1;
+    for (; node; node = node->parent) {
+        for (const xml_nsdef_t *d = node->nsdefs; d; d = d->next) {
+            if ((d->prefix == NULL) != (prefix == NULL))
+                continue;
+            if (prefix && strcmp(d->prefix, prefix) != 0)
+                continue;
+            return strcmp(d->uri, uri) == 0;
+        }
+    }
+    /* Undeclared default namespace is the empty one */
+    return prefix == NULL && uri[0] == '\0';
+}
+
+static int add_nsdef(arena_t *a, xml_node_t *node, const xmlChar *prefix,
+                     const xmlChar *uri)
+{
+    xml_nsdef_t *d = arena_alloc(a, sizeof(*d));
+    if (!d)
+        return -1;
+    d->next = NULL;
+    d->prefix = prefix ? arena_strndup(a, (const char *)prefix,
+                                       strlen((const char *)prefix)) : NULL;
+    d->uri = arena_strndup(a, uri ? (const char *)uri : "",
+                           uri ? strlen((const char *)uri) : 0);
+    if ((prefix && !d->prefix) || !d->uri)
+        return -1;
+
+    xml_nsdef_t **pp = &node->nsdefs;
+    while (*pp)
+        pp = &(*pp)->next;
+    *pp = d;
+    return 0;
+}
+
+static const char *arena_xstrdup(arena_t *a, const xmlChar *s) {
+    return s ? arena_strndup(a, (const char *)s, strlen((const char *)s)) : NULL;
+}
+
+/* Attribute value as the document means it. Without entity substitution
+ * libxml2 resolves every reference in a value except that an '&' in any
+ * form is passed on as "&#38;". */
+static char *attr_value_dup(arena_t *a, const xmlChar *start, const xmlChar *end) {
+    size_t len = (size_t)(end - start);
+    char *value = arena_strndup(a, (const char *)start, len);
+    if (!value || !memchr(value, '&', len))
+        return value;
+
+    char *w = value;
+    for (const char *r = value; *r; ) {
+        if (strncmp(r, "&#38;", 5) == 0) {
+            *w++ = '&';
+            r += 5;
+        } else {
+            *w++ = *r++;
+        }
+    }
+    *w = '\0';
+    return value;
+}
+
+/* Build the element in the stanza arena. Returns NULL if out of memory. */
+static xml_node_t *build_element(session_t *s, const xmlChar *localname,
+                                 const xmlChar *prefix, const xmlChar *URI,
+                                 int nb_namespaces, const xmlChar **namespaces,
+                                 int nb_attributes, const xmlChar **attributes)
+{
+    arena_t *a = &s->arena;
+    xml_node_t *node = arena_alloc(a, sizeof(*node));
+    if (!node)
+        return NULL;
+    memset(node, 0, sizeof(*node));
+    node->type   = XML_NODE_ELEMENT;
+    node->parent = s->current_node;
+    node->name   = arena_xstrdup(a, localname);
+    node->prefix = arena_xstrdup(a, prefix);
+    node->ns     = URI ? arena_xstrdup(a, URI) : "";
+    if (!node->name || (prefix && !node->prefix) || !node->ns)
+        return NULL;
+
+    /* Declarations made on this element */
+    for (int i = 0; i < nb_namespaces; i++) {
+        if (add_nsdef(a, node, namespaces[i * 2], namespaces[i * 2 + 1]) < 0)
+            return NULL;
+    }
+
+    /* Declare the element's own namespace if it came from outside the
+     * stanza (the stream header), so the stanza stands on its own */
+    if (!ns_in_scope(node, node->prefix, node->ns)) {
+        if (add_nsdef(a, node, prefix, URI) < 0)
+            return NULL;
+        /* The receiving stream only supplies jabber:client, as the
+         * default namespace of the stanza itself */
+        if (node->parent || node->prefix || strcmp(node->ns, "jabber:client") != 0)
+            s->stanza_verbatim = 0;
+    }
+
+    /* Copy attributes, keeping their order */
+    xml_attr_t **tail = &node->attrs;
+    for (int i = 0; i < nb_attributes; i++) {
+        const xmlChar *attr_prefix = attributes[i * 5 + 1];
+        const xmlChar *attr_uri    = attributes[i * 5 + 2];
+        const xmlChar *val_start   = attributes[i * 5 + 3];
+        const xmlChar *val_end     = attributes[i * 5 + 4];
+
+        xml_attr_t *attr = arena_alloc(a, sizeof(*attr));
+        if (!attr)
+            return NULL;
+        attr->next   = NULL;
+        attr->name   = arena_xstrdup(a, attributes[i * 5]);
+        attr->prefix = arena_xstrdup(a, attr_prefix);
+        attr->value  = attr_value_dup(a, val_start, val_end);
+        if (!attr->name || (attr_prefix && !attr->prefix) || !attr->value)
+            return NULL;
+
+        if (attr->prefix && attr_uri &&
+            !ns_in_scope(node, attr->prefix, (const char *)attr_uri)) {
+            if (add_nsdef(a, node, attr_prefix, attr_uri) < 0)
+                return NULL;
+            s->stanza_verbatim = 0;
+        }
+
+        *tail = attr;
+        tail = &attr->next;
+    }
+
+    return node;
+}
+
+/* The routing header of a stanza rooted at node, from attributes it
+ * already holds. Returns NULL if out of memory. */
+static stanza_header_t *build_header(arena_t *a, const xml_node_t *node) {
+    stanza_header_t *h = arena_alloc(a, sizeof(*h));
+    if (!h)
+        return NULL;
+    memset(h, 0, sizeof(*h));
+    for (const xml_attr_t *attr = node->attrs; attr; attr = attr->next) {
+        if (attr->prefix)
+            continue;
+        if (strcmp(attr->name, "to") == 0)
+            h->to = attr->value;
+        else if (strcmp(attr->name, "from") == 0)
+            h->from = attr->value;
+        else if (strcmp(attr->name, "type") == 0)
+            h->type = attr->value;
+        else if (strcmp(attr->name, "id") == 0)
+            h->id = attr->value;
+    }
+
+    h->to_local = h->to_domain = h->to_resource = "";
+    if (h->to && h->to[0]) {
+        /* No part is longer than the whole */
+        size_t len = strlen(h->to) + 1;
+        char *parts = arena_alloc(a, 3 * len);
+        if (!parts)
+            return NULL;
+        if (jid_parse(h->to, parts, len, parts + len, len, parts + 2 * len, len) == 0) {
+            h->to_valid    = 1;
+            h->to_local    = parts;
+            h->to_domain   = parts + len;
+            h->to_resource = parts + 2 * len;
+        }
+    }
+    return h;
+}
+
+static void append_child(xml_node_t *parent, xml_node_t *child) {
+    child->parent = parent;
+    if (parent->last_child)
+        parent->last_child->next = child;
+    else
+        parent->children = child;
+    parent->last_child = child;
+}
+
 static void on_start_element_ns(
     void *ctx,
     const xmlChar *localname,
@@ -59,7 +333,7 @@ static void on_start_element_ns(
     s->stanza_depth++;
 
     if (s->stanza_depth == 1) {
-        /* <stream:stream> — extract attributes, don't build DOM */
+        /* <stream:stream> — extract attributes, don't build a tree */
         xmlChar *to = sax_get_attribute(attributes, nb_attributes, "to");
         stream_handle_open(s, to ? (const char *)to : "",
                            URI ? (const char *)URI : "");
@@ -67,76 +341,50 @@ static void on_start_element_ns(
         return;
     }
 
-    /* Build a DOM node for this element */
-    xmlNodePtr node = xmlNewNode(NULL, localname);
-    if (!node) {
-        log_write(LOG_ERROR, "xmlNewNode failed");
-        return;
-    }
-
-    /* Attach namespace declarations from this element */
-    for (int i = 0; i < nb_namespaces; i++) {
-        const xmlChar *ns_prefix = namespaces[i * 2];
-        const xmlChar *ns_uri    = namespaces[i * 2 + 1];
-        xmlNsPtr ns = xmlNewNs(node, ns_uri, ns_prefix);
-        /* If this namespace matches the element's own URI, set it */
-        if (URI && xmlStrEqual(ns_uri, URI) &&
-            ((prefix == NULL && ns_prefix == NULL) ||
-             (prefix && ns_prefix && xmlStrEqual(prefix, ns_prefix)))) {
-            xmlSetNs(node, ns);
-        }
-    }
-
-    /* If the element has a URI but we haven't set a namespace yet */
-    if (!node->ns && URI) {
-        /* Search existing ns declarations on this node */
-        xmlNsPtr ns = NULL;
-        for (xmlNsPtr cur = node->nsDef; cur; cur = cur->next) {
-            if (xmlStrEqual(cur->href, URI)) {
-                ns = cur;
+    if (s->stanza_depth == 2) {
+        /* Root of a new stanza; its size is measured from here. The
+         * parser has just read the start tag, so back up to its '<'
+         * (attribute values cannot contain one). */
+        uint64_t off = (uint64_t)parser_consumed(s->xml_ctx);
+        s->stanza_start = off;
+        s->stanza_verbatim = 0;
+        while (off > 0) {
+            int c = input_byte(s, --off);
+            if (c < 0)
+                break;
+            if (c == '<') {
+                s->stanza_start = off;
+                s->stanza_verbatim = 1;
                 break;
             }
         }
-        if (!ns)
-            ns = xmlNewNs(node, URI, prefix);
-        xmlSetNs(node, ns);
+        s->current_node = NULL;
+    } else if (!s->current_node) {
+        return;     /* the stanza could not be built */
     }
 
-    /* Copy attributes */
-    for (int i = 0; i < nb_attributes; i++) {
-        const xmlChar *attr_local  = attributes[i * 5 + 0];
-        const xmlChar *attr_prefix = attributes[i * 5 + 1];
-        const xmlChar *attr_uri    = attributes[i * 5 + 2];
-        const xmlChar *val_start   = attributes[i * 5 + 3];
-        const xmlChar *val_end     = attributes[i * 5 + 4];
-        xmlChar *value = xmlStrndup(val_start, (int)(val_end - val_start));
-
-        if (attr_uri && attr_uri[0]) {
-            xmlNsPtr attr_ns = NULL;
-            for (xmlNsPtr cur = node->nsDef; cur; cur = cur->next) {
-                if (xmlStrEqual(cur->href, attr_uri)) {
-                    attr_ns = cur;
-                    break;
-                }
-            }
-            if (!attr_ns)
-                attr_ns = xmlNewNs(node, attr_uri, attr_prefix);
-            xmlNewNsProp(node, attr_ns, attr_local, value);
-        } else {
-            xmlNewProp(node, attr_local, value);
-        }
-        xmlFree(value);
+    xml_node_t *node = build_element(s, localname, prefix, URI,
+                                     nb_namespaces, namespaces,
+                                     nb_attributes, attributes);
+    stanza_header_t *header = NULL;
+    if (node && s->stanza_depth == 2)
+        header = build_header(&s->arena, node);
+    if (!node || (s->stanza_depth == 2 && !header)) {
+        log_write(LOG_ERROR, "Out of memory building stanza on fd %d", s->fd);
+        arena_reset(&s->arena);
+        s->current_stanza = NULL;
+        s->current_header = NULL;
+        s->current_node   = NULL;
+        return;
     }
 
     if (s->stanza_depth == 2) {
-        /* Root of a new stanza */
         s->current_stanza = node;
-        s->current_node   = node;
+        s->current_header = header;
     } else {
-        /* Child element inside a stanza */
-        xmlAddChild(s->current_node, node);
-        s->current_node = node;
+        append_child(s->current_node, node);
     }
+    s->current_node = node;
 }
 
 static void on_end_element_ns(void *ctx,
@@ -155,23 +403,55 @@ static void on_end_element_ns(void *ctx,
     } else if (s->stanza_depth == 1) {
         /* Complete stanza — dispatch */
         if (s->current_stanza) {
-            stanza_route(s, s->current_stanza);
-            xmlFreeNode(s->current_stanza);
-            s->current_stanza = NULL;
-            s->current_node   = NULL;
+            s->stanza_end = (uint64_t)parser_consumed(s->xml_ctx);
+            if (g_config.max_stanza_size > 0 &&
+                s->stanza_end - s->stanza_start > (uint64_t)g_config.max_stanza_size) {
+                session_stanza_too_big(s);
+                return;
+            }
+            stanza_route(s, s->current_stanza, s->current_header);
         }
+        /* The whole tree goes at once */
+        arena_reset(&s->arena);
+        s->current_stanza = NULL;
+        s->current_header = NULL;
+        s->current_node   = NULL;
     } else {
         /* Move up to parent */
-        if (s->current_node && s->current_node->parent)
+        if (s->current_node)
             s->current_node = s->current_node->parent;
     }
 }
 
 static void on_characters(void *ctx, const xmlChar *ch, int len) {
     session_t *s = (session_t *)ctx;
-    if (s->stanza_depth >= 2 && s->current_node) {
-        xmlNodeAddContentLen(s->current_node, ch, len);
+    xml_node_t *parent = s->current_node;
+    if (s->stanza_depth < 2 || !parent || len <= 0)
+        return;
+
+    /* libxml hands text over in pieces; extend the text node they go to
+     * (in place, as nothing else is allocated in between) */
+    xml_node_t *text = parent->last_child;
+    if (text && text->type == XML_NODE_TEXT) {
+        char *grown = arena_grow(&s->arena, text->text, text->text_len + 1,
+                                 text->text_len + (size_t)len + 1);
+        if (!grown)
+            return;
+        text->text = grown;
+    } else {
+        text = arena_alloc(&s->arena, sizeof(*text));
+        if (!text)
+            return;
+        memset(text, 0, sizeof(*text));
+        text->type = XML_NODE_TEXT;
+        text->text = arena_alloc(&s->arena, (size_t)len + 1);
+        if (!text->text)
+            return;
+        append_child(parent, text);
     }
+    memcpy(text->text + text->text_len, ch, (size_t)len);
+    text->text_len += (size_t)len;
+    text->text[text->text_len] = '\0';
 }
 
 static void on_structured_error(void *ctx, xmlErrorPtr error) {
@@ -194,6 +474,80 @@ static void on_structured_error(void *ctx, xmlErrorPtr error) {
         session_teardown(s);
 }
 
+/* --- Parser pool --- */
+
+/*
+ * Idle push parsers of this thread (each reactor has its own). A parser
+ * is reset for its next stream with xmlCtxtResetPush, which keeps its
+ * dictionary and SAX setup, so a login pays for neither. One that has
+ * interned more than XML_PARSER_DICT_MAX names is freed instead: its
+ * dictionary would otherwise keep whatever made-up names it was fed.
+ * Native scanners intern nothing and keep only small buffers.
+ */
+static _Thread_local xml_parser_t parser_pool[XML_PARSER_POOL_MAX];
+static _Thread_local int parser_pool_len;
+
+#ifdef NATIVE_XML
+
+static xml_parser_t parser_get(session_t *s) {
+    if (parser_pool_len > 0) {
+        xml_parser_t sc = parser_pool[--parser_pool_len];
+        xml_scanner_reset(sc, s);
+        return sc;
+    }
+    return xml_scanner_new(&sax_handler, s);
+}
+
+static void parser_put(xml_parser_t sc) {
+    if (parser_pool_len < XML_PARSER_POOL_MAX) {
+        xml_scanner_reset(sc, NULL);
+        parser_pool[parser_pool_len++] = sc;
+    } else {
+        xml_scanner_free(sc);
+    }
+}
+
+static void parser_free(xml_parser_t sc) {
+    xml_scanner_free(sc);
+}
+
+#else
+
+static xml_parser_t parser_get(session_t *s) {
+    if (parser_pool_len > 0) {
+        xml_parser_t ctx = parser_pool[--parser_pool_len];
+        ctx->userData = s;
+        return ctx;
+    }
+
+    xml_parser_t ctx = xmlCreatePushParserCtxt(&sax_handler, s, NULL, 0, NULL);
+    if (ctx)
+        xmlCtxtUseOptions(ctx, XML_PARSE_NONET);
+    return ctx;
+}
+
+static void parser_put(xml_parser_t ctx) {
+    if (parser_pool_len < XML_PARSER_POOL_MAX &&
+        xmlDictSize(ctx->dict) <= XML_PARSER_DICT_MAX &&
+        xmlCtxtResetPush(ctx, NULL, 0, NULL, NULL) == 0) {
+        ctx->userData = NULL;
+        parser_pool[parser_pool_len++] = ctx;
+    } else {
+        xmlFreeParserCtxt(ctx);
+    }
+}
+
+static void parser_free(xml_parser_t ctx) {
+    xmlFreeParserCtxt(ctx);
+}
+
+#endif
+
+void xml_parser_pool_drain(void) {
+    while (parser_pool_len > 0)
+        parser_free(parser_pool[--parser_pool_len]);
+}
+
 /* --- Public API --- */
 
 void xml_init_sax_handler(void) {
@@ -207,94 +561,401 @@ void xml_init_sax_handler(void) {
 
 void xml_parser_create(session_t *s) {
     if (s->xml_ctx) {
-        xmlFreeParserCtxt(s->xml_ctx);
+        parser_put(s->xml_ctx);
         s->xml_ctx = NULL;
     }
 
-    s->xml_ctx = xmlCreatePushParserCtxt(&sax_handler, s, NULL, 0, NULL);
+    s->xml_ctx = parser_get(s);
     if (!s->xml_ctx) {
         log_write(LOG_ERROR, "Failed to create XML push parser for fd %d", s->fd);
         return;
     }
 
-    xmlCtxtUseOptions(s->xml_ctx, XML_PARSE_NONET);
-
     s->stanza_depth   = 0;
     s->current_stanza = NULL;
+    s->current_header = NULL;
     s->current_node   = NULL;
+    s->parser_fed     = 0;
+    s->stanza_verbatim = 0;
+    carry_clear(s, 0);
 }
 
 void xml_parser_reset(session_t *s) {
-    /* Destroy existing parser and create fresh one for stream restart */
-    if (s->xml_ctx) {
-        xmlFreeParserCtxt(s->xml_ctx);
-        s->xml_ctx = NULL;
-    }
-    if (s->current_stanza) {
-        xmlFreeNode(s->current_stanza);
-        s->current_stanza = NULL;
-    }
-    s->current_node = NULL;
-    s->stanza_depth = 0;
+    /* Stream restart: the parser goes back to the pool and, being the
+     * most recent there, normally comes straight back reset */
+    arena_reset(&s->arena);
+    s->current_stanza = NULL;
+    s->current_header = NULL;
+    s->current_node   = NULL;
+    s->stanza_depth   = 0;
 
     xml_parser_create(s);
 }
 
 void xml_parser_destroy(session_t *s) {
     if (s->xml_ctx) {
-        xmlFreeParserCtxt(s->xml_ctx);
+        parser_put(s->xml_ctx);
         s->xml_ctx = NULL;
     }
-    if (s->current_stanza) {
-        xmlFreeNode(s->current_stanza);
-        s->current_stanza = NULL;
-    }
-    s->current_node = NULL;
-    s->stanza_depth = 0;
+    free(s->carry);
+    s->carry = NULL;
+    s->carry_len = s->carry_cap = 0;
+    arena_reset(&s->arena);
+    s->current_stanza = NULL;
+    s->current_header = NULL;
+    s->current_node   = NULL;
+    s->stanza_depth   = 0;
+}
+
+void xml_parser_stop(session_t *s) {
+#ifdef NATIVE_XML
+    xml_scanner_stop(s->xml_ctx);
+#else
+    xmlStopParser(s->xml_ctx);
+#endif
 }
 
-void xml_feed(session_t *s, const char *data, int len) {
-    if (!s->xml_ctx || !data || len <= 0)
+size_t xml_parser_footprint(void) {
+#ifdef NATIVE_XML
+    return xml_scanner_footprint();
+#elif defined(__GLIBC__)
+    size_t before = mallinfo2().uordblks;
+    xml_parser_t ctx = xmlCreatePushParserCtxt(&sax_handler, NULL, NULL, 0, NULL);
+    if (!ctx)
+        return 0;
+    size_t after = mallinfo2().uordblks;
+    xmlFreeParserCtxt(ctx);
+    return after > before ? after - before : 0;
+#else
+    return 0;
+#endif
+}
+
+void xml_feed(session_t *s, const char *data, size_t len) {
+    if (!s->xml_ctx || !data || len == 0)
         return;
-    xmlParseChunk(s->xml_ctx, data, len, 0);
+    s->feed_chunk = data;
+    s->feed_len = len;
+#ifdef NATIVE_XML
+    xml_scanner_feed(s->xml_ctx, data, len);
+#else
+    xmlParseChunk(s->xml_ctx, data, (int)len, 0);
+#endif
+    keep_input(s);
+    s->feed_chunk = NULL;
+    s->feed_len = 0;
+    s->parser_fed += len;
 }
 
-/* --- DOM helper utilities --- */
+const char *xml_stanza_bytes(session_t *s, size_t *len) {
+    if (!s->stanza_verbatim || !s->feed_chunk || s->stanza_end <= s->stanza_start)
+        return NULL;
+    *len = (size_t)(s->stanza_end - s->stanza_start);
+
+    /* Usually the whole stanza is in the chunk being parsed */
+    if (s->stanza_start >= s->parser_fed)
+        return s->feed_chunk + (s->stanza_start - s->parser_fed);
 
-const char *xml_get_attr(xmlNodePtr node, const char *name) {
+    /* It began in an earlier one: the rest joins it in carry */
+    if (s->stanza_start < s->carry_base || carry_extend(s, s->stanza_end) < 0)
+        return NULL;
+    return s->carry + (s->stanza_start - s->carry_base);
+}
+
+/* --- Stanza tree utilities --- */
+
+const char *xml_get_attr(const xml_node_t *node, const char *name) {
     if (!node)
         return NULL;
-    xmlChar *val = xmlGetProp(node, (const xmlChar *)name);
-    /* Note: returns internal libxml2 string. The caller should NOT free this
-     * unless they use xmlGetProp (which returns a copy). Since we want a
-     * simple const char*, we return the copy and the caller must be aware.
-     * Actually, xmlGetProp returns a copy that must be freed with xmlFree.
-     * For convenience we return it as const char* but callers of this function
-     * should be careful. In practice for short-lived use during stanza
-     * processing this is acceptable with the understanding that it leaks
-     * if not freed. We'll use a different pattern below. */
-    return (const char *)val;
-}
-
-xmlNodePtr xml_find_child(xmlNodePtr node, const char *name) {
+    for (const xml_attr_t *attr = node->attrs; attr; attr = attr->next) {
+        if (!attr->prefix && strcmp(attr->name, name) == 0)
+            return attr->value;
+    }
+    return NULL;
+}
+
+int xml_set_attr(arena_t *a, xml_node_t *node, const char *name, const char *value) {
+    const char *copy = arena_strndup(a, value, strlen(value));
+    if (!copy)
+        return -1;
+
+    xml_attr_t **pp = &node->attrs;
+    for (; *pp; pp = &(*pp)->next) {
+        if (!(*pp)->prefix && strcmp((*pp)->name, name) == 0) {
+            (*pp)->value = copy;
+            return 0;
+        }
+    }
+
+    xml_attr_t *attr = arena_alloc(a, sizeof(*attr));
+    if (!attr)
+        return -1;
+    attr->next   = NULL;
+    attr->name   = name;    /* callers pass literals */
+    attr->prefix = NULL;
+    attr->value  = copy;
+    *pp = attr;
+    return 0;
+}
+
+xml_node_t *xml_first_child(const xml_node_t *node) {
     if (!node)
         return NULL;
-    for (xmlNodePtr child = node->children; child; child = child->next) {
-        if (child->type == XML_ELEMENT_NODE &&
-            xmlStrcmp(child->name, (const xmlChar *)name) == 0)
+    for (xml_node_t *child = node->children; child; child = child->next) {
+        if (child->type == XML_NODE_ELEMENT)
             return child;
     }
     return NULL;
 }
 
-xmlNodePtr xml_find_child_ns(xmlNodePtr node, const char *name, const char *ns) {
+xml_node_t *xml_find_child(const xml_node_t *node, const char *name) {
     if (!node)
         return NULL;
-    for (xmlNodePtr child = node->children; child; child = child->next) {
-        if (child->type == XML_ELEMENT_NODE &&
-            xmlStrcmp(child->name, (const xmlChar *)name) == 0 &&
-            child->ns && xmlStrcmp(child->ns->href, (const xmlChar *)ns) == 0)
+    for (xml_node_t *child = node->children; child; child = child->next) {
+        if (child->type == XML_NODE_ELEMENT && strcmp(child->name, name) == 0)
             return child;
     }
     return NULL;
 }
+
+xml_node_t *xml_find_child_ns(const xml_node_t *node, const char *name, const char *ns) {
+    if (!node)
+        return NULL;
+    for (xml_node_t *child = node->children; child; child = child->next) {
+        if (child->type == XML_NODE_ELEMENT && strcmp(child->name, name) == 0 &&
+            strcmp(child->ns, ns) == 0)
+            return child;
+    }
+    return NULL;
+}
+
+static const char *clone_str(arena_t *a, const char *s) {
+    return s ? arena_strndup(a, s, strlen(s)) : NULL;
+}
+
+xml_node_t *xml_clone(arena_t *a, const xml_node_t *node) {
+    xml_node_t *copy = arena_alloc(a, sizeof(*copy));
+    if (!copy)
+        return NULL;
+    memset(copy, 0, sizeof(*copy));
+    copy->type = node->type;
+
+    if (node->type == XML_NODE_TEXT) {
+        copy->text = arena_strndup(a, node->text, node->text_len);
+        copy->text_len = node->text_len;
+        return copy->text ? copy : NULL;
+    }
+
+    copy->name   = clone_str(a, node->name);
+    copy->prefix = clone_str(a, node->prefix);
+    copy->ns     = clone_str(a, node->ns);
+    if (!copy->name || (node->prefix && !copy->prefix) || !copy->ns)
+        return NULL;
+
+    xml_attr_t **attr_tail = &copy->attrs;
+    for (const xml_attr_t *attr = node->attrs; attr; attr = attr->next) {
+        xml_attr_t *c = arena_alloc(a, sizeof(*c));
+        if (!c)
+            return NULL;
+        c->next   = NULL;
+        c->name   = clone_str(a, attr->name);
+        c->prefix = clone_str(a, attr->prefix);
+        c->value  = clone_str(a, attr->value);
+        if (!c->name || (attr->prefix && !c->prefix) || !c->value)
+            return NULL;
+        *attr_tail = c;
+        attr_tail = &c->next;
+    }
+
+    xml_nsdef_t **def_tail = &copy->nsdefs;
+    for (const xml_nsdef_t *d = node->nsdefs; d; d = d->next) {
+        xml_nsdef_t *c = arena_alloc(a, sizeof(*c));
+        if (!c)
+            return NULL;
+        c->next   = NULL;
+        c->prefix = clone_str(a, d->prefix);
+        c->uri    = clone_str(a, d->uri);
+        if ((d->prefix && !c->prefix) || !c->uri)
+            return NULL;
+        *def_tail = c;
+        def_tail = &c->next;
+    }
+
+    for (const xml_node_t *child = node->children; child; child = child->next) {
+        xml_node_t *c = xml_clone(a, child);
+        if (!c)
+            return NULL;
+        append_child(copy, c);
+    }
+    return copy;
+}
+
+static size_t text_length(const xml_node_t *node) {
+    size_t n = 0;
+    for (const xml_node_t *c = node->children; c; c = c->next)
+        n += c->type == XML_NODE_TEXT ? c->text_len : text_length(c);
+    return n;
+}
+
+static char *text_copy(const xml_node_t *node, char *p) {
+    for (const xml_node_t *c = node->children; c; c = c->next) {
+        if (c->type == XML_NODE_TEXT) {
+            memcpy(p, c->text, c->text_len);
+            p += c->text_len;
+        } else {
+            p = text_copy(c, p);
+        }
+    }
+    return p;
+}
+
+const char *xml_text(arena_t *a, const xml_node_t *node) {
+    if (!node)
+        return "";
+    /* The usual case, a lone text child, needs no copy */
+    const xml_node_t *c = node->children;
+    if (!c)
+        return "";
+    if (c->type == XML_NODE_TEXT && !c->next)
+        return c->text;
+
+    size_t len = text_length(node);
+    char *text = arena_alloc(a, len + 1);
+    if (!text)
+        return "";
+    *text_copy(node, text) = '\0';
+    return text;
+}
+
+/* --- Serialization --- */
+
+/* Sized in a first pass with buf == NULL, then written */
+typedef struct xml_out {
+    char  *buf;
+    size_t len;
+} xml_out_t;
+
+static void out_put(xml_out_t *o, const char *data, size_t len) {
+    if (o->buf)
+        memcpy(o->buf + o->len, data, len);
+    o->len += len;
+}
+
+static void out_str(xml_out_t *o, const char *str) {
+    out_put(o, str, strlen(str));
+}
+
+/* Escape as xmlNodeDump does: markup characters in text, and quotes and
+ * whitespace that would be normalized away in attribute values */
+static void out_escaped(xml_out_t *o, const char *s, size_t len, int attr) {
+    size_t run = 0;
+    for (size_t i = 0; i < len; i++) {
+        const char *rep;
+        switch (s[i]) {
+        case '&':  rep = "&amp;"; break;
+        case '<':  rep = "&lt;"; break;
+        case '>':  rep = "&gt;"; break;
+        case '\r': rep = "&#13;"; break;
+        case '"':  rep = attr ? "&quot;" : NULL; break;
+        case '\n': rep = attr ? "&#10;" : NULL; break;
+        case '\t': rep = attr ? "&#9;" : NULL; break;
+        default:   rep = NULL; break;
+        }
+        if (!rep)
+            continue;
+        out_put(o, s + run, i - run);
+        out_str(o, rep);
+        run = i + 1;
+    }
+    out_put(o, s + run, len - run);
+}
+
+static void out_qname(xml_out_t *o, const char *prefix, const char *name) {
+    if (prefix) {
+        out_str(o, prefix);
+        out_put(o, ":", 1);
+    }
+    out_str(o, name);
+}
+
+static void out_node(xml_out_t *o, const xml_node_t *node) {
+    if (node->type == XML_NODE_TEXT) {
+        out_escaped(o, node->text, node->text_len, 0);
+        return;
+    }
+
+    out_put(o, "<", 1);
+    out_qname(o, node->prefix, node->name);
+    for (const xml_nsdef_t *d = node->nsdefs; d; d = d->next) {
+        out_str(o, d->prefix ? " xmlns:" : " xmlns");
+        if (d->prefix)
+            out_str(o, d->prefix);
+        out_put(o, "=\"", 2);
+        out_escaped(o, d->uri, strlen(d->uri), 1);
+        out_put(o, "\"", 1);
+    }
+    for (const xml_attr_t *attr = node->attrs; attr; attr = attr->next) {
+        out_put(o, " ", 1);
+        out_qname(o, attr->prefix, attr->name);
+        out_put(o, "=\"", 2);
+        out_escaped(o, attr->value, strlen(attr->value), 1);
+        out_put(o, "\"", 1);
+    }
+
+    if (!node->children) {
+        out_put(o, "/>", 2);
+        return;
+    }
+    out_put(o, ">", 1);
+    for (const xml_node_t *c = node->children; c; c = c->next)
+        out_node(o, c);
+    out_put(o, "</", 2);
+    out_qname(o, node->prefix, node->name);
+    out_put(o, ">", 1);
+}
+
+char *xml_serialize(arena_t *a, const xml_node_t *node, size_t *out_len) {
+    xml_out_t o = { NULL, 0 };
+    out_node(&o, node);
+
+    o.buf = arena_alloc(a, o.len + 1);
+    if (!o.buf)
+        return NULL;
+    o.len = 0;
+    out_node(&o, node);
+    o.buf[o.len] = '\0';
+    if (out_len)
+        *out_len = o.len;
+    return o.buf;
+}
+
+const char *xml_escape_attr(arena_t *a, const char *value, size_t *out_len) {
+    size_t len = strlen(value);
+    xml_out_t o = { NULL, 0 };
+    out_escaped(&o, value, len, 1);
+    if (o.len == len) {
+        *out_len = len;
+        return value;
+    }
+
+    o.buf = arena_alloc(a, o.len + 1);
+    if (!o.buf)
+        return NULL;
+    o.len = 0;
+    out_escaped(&o, value, len, 1);
+    o.buf[o.len] = '\0';
+    *out_len = o.len;
+    return o.buf;
+}
+
+size_t xml_attr_escaped_len(const char *value, size_t len) {
+    xml_out_t o = { NULL, 0 };
+    out_escaped(&o, value, len, 1);
+    return o.len;
+}
+
+char *xml_attr_escape(char *out, const char *value, size_t len) {
+    xml_out_t o = { out, 0 };
+    out_escaped(&o, value, len, 1);
+    return out + o.len;
+}
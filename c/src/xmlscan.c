@@ -0,0 +1,1037 @@
+#include "xmlscan.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define SCAN_KEEP 4096          /* buffer bytes kept across resets */
+#define SCAN_REF_MAX 12         /* longest reference, "&#x10FFFF;", and some */
+
+#define NONE   ((size_t)-1)     /* no string */
+#define XML_NS ((size_t)-2)     /* the namespace bound to the xml prefix */
+
+static const char xml_ns_uri[] = "http://www.w3.org/XML/1998/namespace";
+
+typedef struct scan_buf {
+    char  *data;
+    size_t len;
+    size_t cap;
+} scan_buf_t;
+
+/* Namespace declaration in scope; offsets into names */
+typedef struct scan_ns {
+    size_t prefix;              /* NONE for the default namespace */
+    size_t uri;                 /* "" undeclares the default namespace */
+} scan_ns_t;
+
+/* Open element; offsets into names */
+typedef struct scan_elem {
+    size_t names;               /* where its strings start: qname, prefix */
+    size_t qname_len;
+    size_t local;               /* the tail of the qname */
+    size_t prefix;              /* NONE if unprefixed */
+    size_t uri;                 /* NONE if in no namespace */
+    int    nsdefs;              /* declarations it made, atop the ns stack */
+} scan_elem_t;
+
+/* Attribute of the start tag being parsed; offsets into scratch */
+typedef struct scan_attr {
+    const char *qname;          /* in the input */
+    size_t      qname_len;
+    size_t      local;
+    size_t      prefix;         /* NONE if unprefixed */
+    size_t      value;
+    size_t      value_end;
+    int         nsdef;          /* an xmlns or xmlns:prefix declaration */
+} scan_attr_t;
+
+struct xml_scanner {
+    const xmlSAXHandler *sax;
+    void          *ctx;
+    uint64_t       fed;         /* document bytes taken so far */
+    uint64_t       consumed;
+    int            stopped;
+    int            root_seen;
+    int            root_done;
+
+    /* An unfinished token, parsed again once more input arrives. A start
+     * tag is searched for its end only once: resume records how far. */
+    scan_buf_t     pending;
+    uint64_t       resume_tok;  /* document offset of the tag */
+    size_t         resume;      /* bytes of it searched, 0 if none */
+    char           resume_quote;
+
+    /* UTF-8 sequence split across feeds */
+    int            u8_need;
+    unsigned char  u8_lo;
+    unsigned char  u8_hi;
+
+    /* Open elements, and the strings they and their declarations need */
+    scan_elem_t   *elems;
+    int            depth;
+    int            elems_cap;
+    scan_ns_t     *ns;
+    int            ns_len;
+    int            ns_cap;
+    scan_buf_t     names;
+
+    /* The start tag being parsed, and the arrays handed to the SAX call */
+    scan_buf_t     scratch;
+    scan_attr_t   *attrs;
+    const xmlChar **sax_ns;
+    const xmlChar **sax_attrs;
+    int            attrs_cap;
+    int            sax_cap;     /* entries in each of sax_ns and sax_attrs */
+};
+
+/* --- Vector search --- */
+
+#if defined(__AVX2__)
+#define VEC_WIDTH 32
+typedef __m256i vec_t;
+#define vec_load(p)    _mm256_loadu_si256((const __m256i *)(const void *)(p))
+#define vec_splat(c)   _mm256_set1_epi8((char)(c))
+#define vec_eq(a, b)   _mm256_cmpeq_epi8(a, b)
+#define vec_or(a, b)   _mm256_or_si256(a, b)
+#define vec_le_u(a, b) _mm256_cmpeq_epi8(_mm256_min_epu8(a, b), a)
+#define vec_lt_s(a, b) _mm256_cmpgt_epi8(b, a)
+#define vec_mask(v)    ((uint32_t)_mm256_movemask_epi8(v))
+#elif defined(__SSE2__)
+#define VEC_WIDTH 16
+typedef __m128i vec_t;
+#define vec_load(p)    _mm_loadu_si128((const __m128i *)(const void *)(p))
+#define vec_splat(c)   _mm_set1_epi8((char)(c))
+#define vec_eq(a, b)   _mm_cmpeq_epi8(a, b)
+#define vec_or(a, b)   _mm_or_si128(a, b)
+#define vec_le_u(a, b) _mm_cmpeq_epi8(_mm_min_epu8(a, b), a)
+#define vec_lt_s(a, b) _mm_cmplt_epi8(a, b)
+#define vec_mask(v)    ((uint32_t)_mm_movemask_epi8(v))
+#endif
+
+/* First of a, b or c in [p, end), or NULL */
+static const char *find3(const char *p, const char *end, char a, char b, char c) {
+#ifdef VEC_WIDTH
+    vec_t va = vec_splat(a), vb = vec_splat(b), vc = vec_splat(c);
+    for (; end - p >= VEC_WIDTH; p += VEC_WIDTH) {
+        vec_t v = vec_load(p);
+        uint32_t m = vec_mask(vec_or(vec_or(vec_eq(v, va), vec_eq(v, vb)),
+                                     vec_eq(v, vc)));
+        if (m)
+            return p + __builtin_ctz(m);
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == a || *p == b || *p == c)
+            return p;
+    }
+    return NULL;
+}
+
+/* First of a, b or a control character in [p, end), or NULL */
+static const char *find2_ctl(const char *p, const char *end, char a, char b) {
+#ifdef VEC_WIDTH
+    vec_t va = vec_splat(a), vb = vec_splat(b), ctl = vec_splat(0x1f);
+    for (; end - p >= VEC_WIDTH; p += VEC_WIDTH) {
+        vec_t v = vec_load(p);
+        uint32_t m = vec_mask(vec_or(vec_or(vec_eq(v, va), vec_eq(v, vb)),
+                                     vec_le_u(v, ctl)));
+        if (m)
+            return p + __builtin_ctz(m);
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == a || *p == b || (unsigned char)*p < 0x20)
+            return p;
+    }
+    return NULL;
+}
+
+/* Length of the prefix of p that is UTF-8 made of XML characters. A
+ * sequence cut off at the end is finished on the next call. */
+static size_t valid_prefix(xml_scanner_t *sc, const unsigned char *p, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        if (sc->u8_need) {
+            if (p[i] < sc->u8_lo || p[i] > sc->u8_hi)
+                return i;
+            sc->u8_lo = 0x80;
+            sc->u8_hi = 0xbf;
+            sc->u8_need--;
+            i++;
+            continue;
+        }
+#ifdef VEC_WIDTH
+        /* Printable ASCII a block at a time: as signed bytes, everything
+         * else is below 0x20 */
+        vec_t low = vec_splat(0x20);
+        while (len - i >= VEC_WIDTH && !vec_mask(vec_lt_s(vec_load(p + i), low)))
+            i += VEC_WIDTH;
+        if (i == len)
+            break;
+#endif
+        unsigned char c = p[i];
+        if (c < 0x80) {
+            if (c < 0x20 && c != '\t' && c != '\n' && c != '\r')
+                return i;
+            i++;
+            continue;
+        }
+
+        sc->u8_lo = 0x80;
+        sc->u8_hi = 0xbf;
+        if (c >= 0xc2 && c <= 0xdf) {
+            sc->u8_need = 1;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            sc->u8_need = 2;
+            if (c == 0xe0)
+                sc->u8_lo = 0xa0;   /* overlong */
+            else if (c == 0xed)
+                sc->u8_hi = 0x9f;   /* surrogates */
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            sc->u8_need = 3;
+            if (c == 0xf0)
+                sc->u8_lo = 0x90;   /* overlong */
+            else if (c == 0xf4)
+                sc->u8_hi = 0x8f;   /* past U+10FFFF */
+        } else {
+            return i;
+        }
+        i++;
+    }
+    return len;
+}
+
+/* --- Buffers --- */
+
+static int buf_reserve(scan_buf_t *b, size_t extra) {
+    if (b->len + extra <= b->cap)
+        return 0;
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < b->len + extra)
+        cap *= 2;
+    char *data = realloc(b->data, cap);
+    if (!data)
+        return -1;
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+static int buf_put(scan_buf_t *b, const char *data, size_t len) {
+    if (buf_reserve(b, len) < 0)
+        return -1;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+/* Append a NUL-terminated copy; returns its offset, or NONE */
+static size_t buf_str(scan_buf_t *b, const char *s, size_t len) {
+    size_t off = b->len;
+    if (buf_reserve(b, len + 1) < 0)
+        return NONE;
+    memcpy(b->data + off, s, len);
+    b->data[off + len] = '\0';
+    b->len += len + 1;
+    return off;
+}
+
+static void buf_trim(scan_buf_t *b) {
+    b->len = 0;
+    if (b->cap > SCAN_KEEP) {
+        free(b->data);
+        b->data = NULL;
+        b->cap = 0;
+    }
+}
+
+/* arr, of *cap entries of size sz, with room for n; NULL if out of
+ * memory, leaving arr as it was */
+static void *grow(void *arr, int *cap, int n, size_t sz) {
+    if (n <= *cap)
+        return arr;
+    int c = *cap ? *cap : 8;
+    while (c < n)
+        c *= 2;
+    void *p = realloc(arr, (size_t)c * sz);
+    if (p)
+        *cap = c;
+    return p;
+}
+
+/* --- Errors --- */
+
+static void scan_error(xml_scanner_t *sc, const char *fmt, ...) {
+    char msg[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    sc->stopped = 1;
+    if (!sc->sax->serror)
+        return;
+    xmlError err;
+    memset(&err, 0, sizeof(err));
+    err.domain  = XML_FROM_PARSER;
+    err.level   = XML_ERR_FATAL;
+    err.message = msg;
+    sc->sax->serror(sc->ctx, &err);
+}
+
+/* --- Lexical helpers --- */
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static int is_name_start(char c) {
+    unsigned char u = (unsigned char)c;
+    return (u >= 'a' && u <= 'z') || (u >= 'A' && u <= 'Z') || u == '_' ||
+           u == ':' || u >= 0x80;
+}
+
+static int is_name_char(char c) {
+    unsigned char u = (unsigned char)c;
+    return is_name_start(c) || (u >= '0' && u <= '9') || u == '-' || u == '.';
+}
+
+static const char *skip_name(const char *p, const char *end) {
+    while (p < end && is_name_char(*p))
+        p++;
+    return p;
+}
+
+/* Split a qname at its colon: returns the colon, NULL if there is none,
+ * or sets *bad if the name is not a valid qname */
+static const char *qname_colon(const char *name, size_t len, int *bad) {
+    const char *colon = memchr(name, ':', len);
+    *bad = colon && (colon == name || colon == name + len - 1 ||
+                     memchr(colon + 1, ':', len - (size_t)(colon - name) - 1));
+    return colon;
+}
+
+static int is_xml_char(uint32_t c) {
+    return c == 0x9 || c == 0xa || c == 0xd || (c >= 0x20 && c <= 0xd7ff) ||
+           (c >= 0xe000 && c <= 0xfffd) || (c >= 0x10000 && c <= 0x10ffff);
+}
+
+static size_t utf8_encode(uint32_t c, char *out) {
+    if (c < 0x80) {
+        out[0] = (char)c;
+        return 1;
+    }
+    if (c < 0x800) {
+        out[0] = (char)(0xc0 | (c >> 6));
+        out[1] = (char)(0x80 | (c & 0x3f));
+        return 2;
+    }
+    if (c < 0x10000) {
+        out[0] = (char)(0xe0 | (c >> 12));
+        out[1] = (char)(0x80 | ((c >> 6) & 0x3f));
+        out[2] = (char)(0x80 | (c & 0x3f));
+        return 3;
+    }
+    out[0] = (char)(0xf0 | (c >> 18));
+    out[1] = (char)(0x80 | ((c >> 12) & 0x3f));
+    out[2] = (char)(0x80 | ((c >> 6) & 0x3f));
+    out[3] = (char)(0x80 | (c & 0x3f));
+    return 4;
+}
+
+/* Resolve the reference at p ('&'). Returns 1 with the character and
+ * what follows, 0 if it may be cut off at end and final is not set, or
+ * -1 after reporting an error. */
+static int parse_ref(xml_scanner_t *sc, const char *p, const char *end, int final,
+                     uint32_t *out, const char **next)
+{
+    size_t avail = (size_t)(end - p);
+    const char *semi = memchr(p, ';', avail < SCAN_REF_MAX ? avail : SCAN_REF_MAX);
+    if (!semi) {
+        if (!final && avail < SCAN_REF_MAX)
+            return 0;
+        scan_error(sc, "EntityRef: expecting ';'");
+        return -1;
+    }
+
+    const char *name = p + 1;
+    size_t len = (size_t)(semi - name);
+    uint32_t c = 0;
+    if (len >= 2 && name[0] == '#') {
+        int hex = name[1] == 'x';
+        const char *d = name + 1 + hex;
+        if (d == semi)
+            goto bad_charref;
+        for (; d < semi; d++) {
+            int v;
+            if (*d >= '0' && *d <= '9')
+                v = *d - '0';
+            else if (hex && *d >= 'a' && *d <= 'f')
+                v = *d - 'a' + 10;
+            else if (hex && *d >= 'A' && *d <= 'F')
+                v = *d - 'A' + 10;
+            else
+                goto bad_charref;
+            c = c * (hex ? 16 : 10) + (uint32_t)v;
+            if (c > 0x10ffff)
+                goto bad_charref;
+        }
+        if (!is_xml_char(c))
+            goto bad_charref;
+    } else if (len == 2 && memcmp(name, "lt", 2) == 0) {
+        c = '<';
+    } else if (len == 2 && memcmp(name, "gt", 2) == 0) {
+        c = '>';
+    } else if (len == 3 && memcmp(name, "amp", 3) == 0) {
+        c = '&';
+    } else if (len == 4 && memcmp(name, "quot", 4) == 0) {
+        c = '"';
+    } else if (len == 4 && memcmp(name, "apos", 4) == 0) {
+        c = '\'';
+    } else {
+        scan_error(sc, "Entity '%.*s' not defined", (int)len, name);
+        return -1;
+    }
+    *out = c;
+    *next = semi + 1;
+    return 1;
+
+bad_charref:
+    scan_error(sc, "xmlParseCharRef: invalid xmlChar value");
+    return -1;
+}
+
+/* --- Namespaces --- */
+
+static const char *ns_uri(const xml_scanner_t *sc, size_t off) {
+    if (off == NONE)
+        return NULL;
+    return off == XML_NS ? xml_ns_uri : sc->names.data + off;
+}
+
+/* Namespace bound to prefix[0..len) (the default namespace if prefix is
+ * NULL): an offset, NONE for no namespace, or XML_NS. Sets *unbound if
+ * a prefix has no binding. */
+static size_t ns_lookup(const xml_scanner_t *sc, const char *prefix, size_t len,
+                        int *unbound)
+{
+    *unbound = 0;
+    if (prefix && len == 3 && memcmp(prefix, "xml", 3) == 0)
+        return XML_NS;
+    for (int i = sc->ns_len - 1; i >= 0; i--) {
+        const scan_ns_t *d = &sc->ns[i];
+        if ((d->prefix == NONE) != (prefix == NULL))
+            continue;
+        if (prefix) {
+            const char *p = sc->names.data + d->prefix;
+            if (strlen(p) != len || memcmp(p, prefix, len) != 0)
+                continue;
+        }
+        return sc->names.data[d->uri] ? d->uri : NONE;
+    }
+    *unbound = prefix != NULL;
+    return NONE;
+}
+
+/* --- Elements --- */
+
+static void end_element(xml_scanner_t *sc) {
+    scan_elem_t *e = &sc->elems[sc->depth - 1];
+    if (sc->sax->endElementNs) {
+        const char *names = sc->names.data;
+        sc->sax->endElementNs(sc->ctx, (const xmlChar *)(names + e->local),
+                              (const xmlChar *)(e->prefix == NONE ? NULL : names + e->prefix),
+                              (const xmlChar *)ns_uri(sc, e->uri));
+    }
+    sc->ns_len -= e->nsdefs;
+    sc->names.len = e->names;
+    if (--sc->depth == 0)
+        sc->root_done = 1;
+}
+
+/* Append an attribute value to scratch with references resolved and
+ * literal whitespace made spaces. An '&' goes in as "&#38;". */
+static int put_value(xml_scanner_t *sc, const char *p, const char *end) {
+    while (p < end) {
+        const char *q = find2_ctl(p, end, '&', '<');
+        if (!q)
+            q = end;
+        if (buf_put(&sc->scratch, p, (size_t)(q - p)) < 0)
+            goto oom;
+        if (q == end)
+            break;
+
+        if (*q == '<') {
+            scan_error(sc, "Unescaped '<' not allowed in attributes values");
+            return -1;
+        }
+        if (*q != '&') {
+            /* \t, \n, \r, and \r\n as one */
+            if (buf_put(&sc->scratch, " ", 1) < 0)
+                goto oom;
+            p = q + (q[0] == '\r' && q + 1 < end && q[1] == '\n' ? 2 : 1);
+            continue;
+        }
+
+        uint32_t c;
+        if (parse_ref(sc, q, end, 1, &c, &p) < 0)
+            return -1;
+        char u[5];
+        size_t n = c == '&' ? 5 : utf8_encode(c, u);
+        if (buf_put(&sc->scratch, c == '&' ? "&#38;" : u, n) < 0)
+            goto oom;
+    }
+    return 0;
+
+oom:
+    scan_error(sc, "Out of memory");
+    return -1;
+}
+
+/* Parse the attributes of the start tag [lt, gt] into sc->attrs.
+ * Returns their number, and sets *empty for "/>"; -1 on error. */
+static int parse_attrs(xml_scanner_t *sc, const char *p, const char *gt, int *empty) {
+    int n = 0;
+    *empty = 0;
+    sc->scratch.len = 0;
+    for (;;) {
+        const char *ws = p;
+        while (p < gt && is_space(*p))
+            p++;
+        if (p == gt)
+            return n;
+        if (*p == '/') {
+            if (p + 1 != gt)
+                break;
+            *empty = 1;
+            return n;
+        }
+        if (p == ws)
+            break;
+
+        const char *name = p;
+        p = skip_name(p, gt);
+        if (p == name || !is_name_start(*name))
+            break;
+        size_t name_len = (size_t)(p - name);
+        while (p < gt && is_space(*p))
+            p++;
+        if (p == gt || *p != '=') {
+            scan_error(sc, "Specification mandates value for attribute %.*s",
+                       (int)name_len, name);
+            return -1;
+        }
+        p++;
+        while (p < gt && is_space(*p))
+            p++;
+        if (p == gt || (*p != '"' && *p != '\''))
+            break;
+        const char *value = p + 1;
+        const char *value_end = memchr(value, *p, (size_t)(gt - value));
+        if (!value_end)
+            break;
+        p = value_end + 1;
+
+        for (int i = 0; i < n; i++) {
+            if (sc->attrs[i].qname_len == name_len &&
+                memcmp(sc->attrs[i].qname, name, name_len) == 0) {
+                scan_error(sc, "Attribute %.*s redefined", (int)name_len, name);
+                return -1;
+            }
+        }
+
+        scan_attr_t *attrs = grow(sc->attrs, &sc->attrs_cap, n + 1, sizeof(*attrs));
+        if (!attrs)
+            goto oom;
+        sc->attrs = attrs;
+        scan_attr_t *a = &sc->attrs[n++];
+        int bad;
+        const char *colon = qname_colon(name, name_len, &bad);
+        if (bad) {
+            scan_error(sc, "Failed to parse QName '%.*s'", (int)name_len, name);
+            return -1;
+        }
+        a->qname = name;
+        a->qname_len = name_len;
+        if (colon) {
+            a->prefix = buf_str(&sc->scratch, name, (size_t)(colon - name));
+            a->local = buf_str(&sc->scratch, colon + 1,
+                               name_len - (size_t)(colon - name) - 1);
+        } else {
+            a->prefix = NONE;
+            a->local = buf_str(&sc->scratch, name, name_len);
+        }
+        if (a->local == NONE || (colon && a->prefix == NONE))
+            goto oom;
+        a->nsdef = colon ? (colon - name == 5 && memcmp(name, "xmlns", 5) == 0)
+                         : (name_len == 5 && memcmp(name, "xmlns", 5) == 0);
+
+        a->value = sc->scratch.len;
+        if (put_value(sc, value, value_end) < 0)
+            return -1;
+        a->value_end = sc->scratch.len;
+        if (buf_put(&sc->scratch, "", 1) < 0)
+            goto oom;
+    }
+
+    scan_error(sc, "attributes construct error");
+    return -1;
+
+oom:
+    scan_error(sc, "Out of memory");
+    return -1;
+}
+
+/* The start tag [lt, gt], at document offset off */
+static int start_element(xml_scanner_t *sc, const char *lt, const char *gt, uint64_t off) {
+    const char *name = lt + 1;
+    const char *name_end = skip_name(name, gt);
+    size_t qname_len = (size_t)(name_end - name);
+    int bad;
+    const char *colon = qname_colon(name, qname_len, &bad);
+    if (name_end == name || !is_name_start(*name) || bad) {
+        scan_error(sc, "StartTag: invalid element name");
+        return -1;
+    }
+    if (sc->depth >= XML_SCAN_MAX_DEPTH) {
+        scan_error(sc, "Excessive depth in document: %d", sc->depth);
+        return -1;
+    }
+
+    int empty;
+    int nattrs = parse_attrs(sc, name_end, gt, &empty);
+    if (nattrs < 0)
+        return -1;
+
+    scan_elem_t *elems = grow(sc->elems, &sc->elems_cap, sc->depth + 1, sizeof(*elems));
+    if (!elems)
+        goto oom;
+    sc->elems = elems;
+    scan_ns_t *ns = grow(sc->ns, &sc->ns_cap, sc->ns_len + nattrs + 1, sizeof(*ns));
+    if (!ns)
+        goto oom;
+    sc->ns = ns;
+
+    /* The element's strings, then its declarations, go on names */
+    scan_elem_t *e = &sc->elems[sc->depth];
+    e->names = sc->names.len;
+    e->qname_len = qname_len;
+    if (buf_str(&sc->names, name, qname_len) == NONE)
+        goto oom;
+    e->local = e->names + (colon ? (size_t)(colon - name) + 1 : 0);
+    e->prefix = colon ? buf_str(&sc->names, name, (size_t)(colon - name)) : NONE;
+    if (colon && e->prefix == NONE)
+        goto oom;
+
+    int ns_base = sc->ns_len;
+    for (int i = 0; i < nattrs; i++) {
+        const scan_attr_t *a = &sc->attrs[i];
+        if (!a->nsdef)
+            continue;
+        const char *uri = sc->scratch.data + a->value;
+        size_t uri_len = a->value_end - a->value;
+        const char *prefix = a->prefix == NONE ? NULL : sc->scratch.data + a->local;
+        if (prefix && strcmp(prefix, "xml") == 0) {
+            if (strcmp(uri, xml_ns_uri) != 0) {
+                scan_error(sc, "xml namespace prefix mapped to wrong URI");
+                return -1;
+            }
+            continue;
+        }
+        if (prefix && (uri_len == 0 || strcmp(prefix, "xmlns") == 0)) {
+            scan_error(sc, "xmlns:%s: invalid namespace declaration", prefix);
+            return -1;
+        }
+        scan_ns_t *d = &sc->ns[sc->ns_len];
+        d->prefix = prefix ? buf_str(&sc->names, prefix, strlen(prefix)) : NONE;
+        d->uri = buf_str(&sc->names, uri, uri_len);
+        if ((prefix && d->prefix == NONE) || d->uri == NONE)
+            goto oom;
+        sc->ns_len++;
+    }
+    e->nsdefs = sc->ns_len - ns_base;
+
+    int unbound;
+    e->uri = ns_lookup(sc, colon ? name : NULL, colon ? (size_t)(colon - name) : 0,
+                       &unbound);
+    if (unbound) {
+        scan_error(sc, "Namespace prefix %.*s on %.*s is not defined",
+                   (int)(colon - name), name, (int)qname_len, name);
+        sc->ns_len = ns_base;
+        return -1;
+    }
+    sc->depth++;
+    sc->root_seen = 1;
+
+    /* Everything is in place: hand out pointers. Both arrays are the
+     * same size, and never empty so that they exist. */
+    int want = (nattrs + 1) * 5;
+    int sax_cap = sc->sax_cap;
+    const xmlChar **sax_ns = grow(sc->sax_ns, &sax_cap, want, sizeof(*sax_ns));
+    if (!sax_ns)
+        goto oom;
+    sc->sax_ns = sax_ns;
+    const xmlChar **sax_attrs = grow(sc->sax_attrs, &sc->sax_cap, want, sizeof(*sax_attrs));
+    if (!sax_attrs)
+        goto oom;
+    sc->sax_attrs = sax_attrs;
+
+    for (int i = 0; i < e->nsdefs; i++) {
+        const scan_ns_t *d = &sc->ns[ns_base + i];
+        sax_ns[i * 2]     = (const xmlChar *)(d->prefix == NONE ? NULL
+                                              : sc->names.data + d->prefix);
+        sax_ns[i * 2 + 1] = (const xmlChar *)(sc->names.data + d->uri);
+    }
+    int n = 0;
+    for (int i = 0; i < nattrs; i++) {
+        const scan_attr_t *a = &sc->attrs[i];
+        if (a->nsdef)
+            continue;
+        size_t uri = NONE;
+        if (a->prefix != NONE) {
+            const char *prefix = sc->scratch.data + a->prefix;
+            uri = ns_lookup(sc, prefix, strlen(prefix), &unbound);
+            if (unbound) {
+                scan_error(sc, "Namespace prefix %s for %s on %.*s is not defined",
+                           prefix, sc->scratch.data + a->local, (int)qname_len, name);
+                return -1;
+            }
+        }
+        sax_attrs[n * 5]     = (const xmlChar *)(sc->scratch.data + a->local);
+        sax_attrs[n * 5 + 1] = (const xmlChar *)(a->prefix == NONE ? NULL
+                                                 : sc->scratch.data + a->prefix);
+        sax_attrs[n * 5 + 2] = (const xmlChar *)ns_uri(sc, uri);
+        sax_attrs[n * 5 + 3] = (const xmlChar *)(sc->scratch.data + a->value);
+        sax_attrs[n * 5 + 4] = (const xmlChar *)(sc->scratch.data + a->value_end);
+        n++;
+    }
+
+    sc->consumed = off + (uint64_t)(gt - lt) - (uint64_t)empty;
+    if (sc->sax->startElementNs) {
+        const char *names = sc->names.data;
+        sc->sax->startElementNs(sc->ctx, (const xmlChar *)(names + e->local),
+                                (const xmlChar *)(e->prefix == NONE ? NULL : names + e->prefix),
+                                (const xmlChar *)ns_uri(sc, e->uri),
+                                e->nsdefs, sax_ns, n, 0, sax_attrs);
+    }
+    if (empty && !sc->stopped) {
+        sc->consumed = off + (uint64_t)(gt - lt) + 1;
+        end_element(sc);
+    }
+    return 0;
+
+oom:
+    scan_error(sc, "Out of memory");
+    return -1;
+}
+
+/* --- Tokens --- */
+
+/* The '>' ending a start tag, searching from p, which is inside a quoted
+ * value if *quote is set; NULL if it is not in [p, end) */
+static const char *find_tag_end(const char *p, const char *end, char *quote) {
+    while (p < end) {
+        if (*quote) {
+            p = memchr(p, *quote, (size_t)(end - p));
+            if (!p)
+                return NULL;
+            *quote = 0;
+            p++;
+            continue;
+        }
+        p = find3(p, end, '>', '"', '\'');
+        if (!p)
+            return NULL;
+        if (*p == '>')
+            return p;
+        *quote = *p++;
+    }
+    return NULL;
+}
+
+static const char *scan_start_tag(xml_scanner_t *sc, const char *p, const char *end,
+                                  uint64_t off)
+{
+    const char *from = p + 1;
+    char quote = 0;
+    if (sc->resume && sc->resume_tok == off) {
+        from = p + sc->resume;
+        quote = sc->resume_quote;
+    }
+    const char *gt = find_tag_end(from, end, &quote);
+    if (!gt) {
+        sc->resume_tok = off;
+        sc->resume = (size_t)(end - p);
+        sc->resume_quote = quote;
+        return NULL;
+    }
+    sc->resume = 0;
+
+    if (sc->root_done) {
+        scan_error(sc, "Extra content at the end of the document");
+        return NULL;
+    }
+    return start_element(sc, p, gt, off) < 0 ? NULL : gt + 1;
+}
+
+static const char *scan_end_tag(xml_scanner_t *sc, const char *p, const char *end,
+                                uint64_t off)
+{
+    const char *gt = memchr(p + 2, '>', (size_t)(end - p - 2));
+    if (!gt)
+        return NULL;
+
+    const char *name = p + 2;
+    const char *q = skip_name(name, gt);
+    size_t len = (size_t)(q - name);
+    while (q < gt && is_space(*q))
+        q++;
+    if (q != gt || len == 0) {
+        scan_error(sc, "expected '>'");
+        return NULL;
+    }
+    if (sc->depth == 0) {
+        scan_error(sc, "Unexpected end tag : %.*s", (int)len, name);
+        return NULL;
+    }
+    const scan_elem_t *e = &sc->elems[sc->depth - 1];
+    const char *open = sc->names.data + e->names;
+    if (e->qname_len != len || memcmp(open, name, len) != 0) {
+        scan_error(sc, "Opening and ending tag mismatch: %s and %.*s",
+                   open, (int)len, name);
+        return NULL;
+    }
+
+    sc->consumed = off + (uint64_t)(gt + 1 - p);
+    end_element(sc);
+    return gt + 1;
+}
+
+/* "<?": only the XML declaration, and only at the very start */
+static const char *scan_pi(xml_scanner_t *sc, const char *p, const char *end,
+                           uint64_t off)
+{
+    const char *q = p + 2;
+    for (;;) {
+        q = memchr(q, '?', (size_t)(end - q));
+        if (!q || q + 1 >= end)
+            return NULL;
+        if (q[1] == '>')
+            break;
+        q++;
+    }
+
+    if (off != 0 || q - p < 5 || memcmp(p + 2, "xml", 3) != 0 || !is_space(p[5])) {
+        scan_error(sc, "Processing instructions are not allowed");
+        return NULL;
+    }
+    return q + 2;
+}
+
+/* "<!": CDATA sections; comments and DTDs are not allowed */
+static const char *scan_bang(xml_scanner_t *sc, const char *p, const char *end) {
+    static const char cdata[] = "<![CDATA[";
+    size_t avail = (size_t)(end - p);
+    size_t n = sizeof(cdata) - 1;
+    if (avail < n && memcmp(p, cdata, avail) == 0)
+        return NULL;
+    if (avail < n || memcmp(p, cdata, n) != 0) {
+        scan_error(sc, "Comments and markup declarations are not allowed");
+        return NULL;
+    }
+    if (sc->depth == 0) {
+        scan_error(sc, "CDATA section outside the root element");
+        return NULL;
+    }
+
+    const char *text = p + n;
+    for (const char *q = text; ; q++) {
+        q = memchr(q, ']', (size_t)(end - q));
+        if (!q || end - q < 3)
+            return NULL;
+        if (q[1] == ']' && q[2] == '>') {
+            if (q > text && sc->sax->characters)
+                sc->sax->characters(sc->ctx, (const xmlChar *)text, (int)(q - text));
+            return q + 3;
+        }
+    }
+}
+
+static void characters(xml_scanner_t *sc, const char *text, size_t len) {
+    if (sc->sax->characters)
+        sc->sax->characters(sc->ctx, (const xmlChar *)text, (int)len);
+}
+
+/* Character data up to the next markup, a reference, or a line end */
+static const char *scan_text(xml_scanner_t *sc, const char *p, const char *end) {
+    const char *q = find3(p, end, '<', '&', '\r');
+    if (!q)
+        q = end;
+    if (q > p) {
+        if (sc->depth > 0) {
+            characters(sc, p, (size_t)(q - p));
+            return q;
+        }
+        for (const char *c = p; c < q; c++) {
+            if (!is_space(*c)) {
+                scan_error(sc, sc->root_done ? "Extra content at the end of the document"
+                                             : "Start tag expected, '<' not found");
+                return NULL;
+            }
+        }
+        return q;
+    }
+
+    if (*p == '\r') {
+        /* Line ends are \n however they were sent */
+        if (p + 1 == end)
+            return NULL;
+        if (sc->depth > 0)
+            characters(sc, "\n", 1);
+        return p + (p[1] == '\n' ? 2 : 1);
+    }
+
+    uint32_t c;
+    const char *next;
+    int r = parse_ref(sc, p, end, 0, &c, &next);
+    if (r <= 0)
+        return NULL;
+    if (sc->depth == 0) {
+        scan_error(sc, "Reference outside the root element");
+        return NULL;
+    }
+    char u[4];
+    characters(sc, u, utf8_encode(c, u));
+    return next;
+}
+
+/* Parse complete tokens from buf, whose first byte is at document offset
+ * base. Returns the bytes used; the rest is an unfinished token. */
+static size_t scan(xml_scanner_t *sc, const char *buf, size_t len, uint64_t base) {
+    const char *p = buf;
+    const char *end = buf + len;
+    while (p < end && !sc->stopped) {
+        const char *next;
+        uint64_t off = base + (uint64_t)(p - buf);
+        if (*p != '<')
+            next = scan_text(sc, p, end);
+        else if (end - p < 2)
+            next = NULL;
+        else if (p[1] == '/')
+            next = scan_end_tag(sc, p, end, off);
+        else if (p[1] == '?')
+            next = scan_pi(sc, p, end, off);
+        else if (p[1] == '!')
+            next = scan_bang(sc, p, end);
+        else
+            next = scan_start_tag(sc, p, end, off);
+        if (!next)
+            break;
+        p = next;
+    }
+    return (size_t)(p - buf);
+}
+
+/* --- Public API --- */
+
+xml_scanner_t *xml_scanner_new(const xmlSAXHandler *sax, void *ctx) {
+    xml_scanner_t *sc = calloc(1, sizeof(*sc));
+    if (!sc)
+        return NULL;
+    sc->sax = sax;
+    sc->ctx = ctx;
+    return sc;
+}
+
+void xml_scanner_free(xml_scanner_t *sc) {
+    if (!sc)
+        return;
+    free(sc->pending.data);
+    free(sc->names.data);
+    free(sc->scratch.data);
+    free(sc->elems);
+    free(sc->ns);
+    free(sc->attrs);
+    free(sc->sax_ns);
+    free(sc->sax_attrs);
+    free(sc);
+}
+
+void xml_scanner_reset(xml_scanner_t *sc, void *ctx) {
+    sc->ctx = ctx;
+    sc->fed = sc->consumed = 0;
+    sc->stopped = sc->root_seen = sc->root_done = 0;
+    sc->resume = 0;
+    sc->u8_need = 0;
+    sc->depth = 0;
+    sc->ns_len = 0;
+    buf_trim(&sc->pending);
+    buf_trim(&sc->names);
+    buf_trim(&sc->scratch);
+}
+
+int xml_scanner_feed(xml_scanner_t *sc, const char *data, size_t len) {
+    if (sc->stopped)
+        return -1;
+
+    size_t valid = valid_prefix(sc, (const unsigned char *)data, len);
+    const char *buf = data;
+    size_t buf_len = valid;
+    uint64_t base = sc->fed;
+
+    /* Usually the chunk is parsed where it lies; a token cut off by the
+     * previous one is finished in pending */
+    if (sc->pending.len) {
+        base -= sc->pending.len;
+        if (buf_put(&sc->pending, data, valid) < 0) {
+            scan_error(sc, "Out of memory");
+            return -1;
+        }
+        buf = sc->pending.data;
+        buf_len = sc->pending.len;
+    }
+    sc->fed += len;
+
+    size_t used = scan(sc, buf, buf_len, base);
+    size_t rest = buf_len - used;
+    sc->consumed = base + used;
+    if (sc->stopped)
+        return -1;
+
+    if (rest > XML_SCAN_MAX_TOKEN) {
+        scan_error(sc, "Unfinished markup over %d bytes", XML_SCAN_MAX_TOKEN);
+        return -1;
+    }
+    if (buf == sc->pending.data) {
+        memmove(sc->pending.data, sc->pending.data + used, rest);
+        sc->pending.len = rest;
+    } else if (rest && buf_put(&sc->pending, buf + used, rest) < 0) {
+        scan_error(sc, "Out of memory");
+        return -1;
+    }
+
+    if (valid < len) {
+        scan_error(sc, "Input is not proper UTF-8, or holds a character not "
+                       "allowed in XML (byte 0x%02X)", (unsigned char)data[valid]);
+        return -1;
+    }
+    return 0;
+}
+
+void xml_scanner_stop(xml_scanner_t *sc) {
+    sc->stopped = 1;
+}
+
+uint64_t xml_scanner_consumed(const xml_scanner_t *sc) {
+    return sc->consumed;
+}
+
+size_t xml_scanner_footprint(void) {
+    return sizeof(xml_scanner_t);
+}
@@ -1,3 +1,4 @@
+#include "kvstore.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,34 +17,82 @@ static int valid_username(const char *s) {
     return 1;
 }
 
+/* Add the account to the server's single-file store (storage = mmap) */
+static int add_to_store(const char *datadir, const char *username,
+                        const char *password, const char *domain)
+{
+    char path[1280], err[512], key[KV_MAX_KEY + 1];
+    snprintf(path, sizeof(path), "%s/%s", datadir, KV_STORE_FILE);
+    int klen = snprintf(key, sizeof(key), "%s%s", KV_KEY_USER, username);
+    if (klen >= (int)sizeof(key) - 16) {
+        fprintf(stderr, "Error: Username '%s' too long.\n", username);
+        return 1;
+    }
+
+    kv_store_t *kv = kv_open(path, 1, err, sizeof(err));
+    if (!kv) {
+        fprintf(stderr, "Error: %s\n", err);
+        return 1;
+    }
+    if (kv_begin(kv, 1) < 0) {
+        fprintf(stderr, "Error: %s: %s\n", path, kv_error(kv));
+        kv_close(kv);
+        return 1;
+    }
+
+    const void *val;
+    size_t vlen;
+    int rc = 1;
+    int r = kv_get(kv, key, (size_t)klen, &val, &vlen);
+    if (r == 1)
+        fprintf(stderr, "Error: User '%s@%s' already exists.\n", username, domain);
+    else if (r < 0 || kv_put(kv, key, (size_t)klen, password, strlen(password)) < 0 ||
+             kv_commit(kv) < 0)
+        fprintf(stderr, "Error: %s: %s\n", path, kv_error(kv));
+    else
+        rc = 0;
+    kv_abort(kv);       /* nothing left to undo after a commit */
+    kv_close(kv);
+
+    if (rc == 0)
+        printf("User '%s@%s' created successfully.\n", username, domain);
+    return rc;
+}
+
 int main(int argc, char **argv) {
     const char *datadir = NULL;
     const char *username = NULL;
     const char *password = NULL;
     const char *domain = "localhost";
+    const char *storage = NULL;
 
     static struct option long_opts[] = {
         { "datadir",  required_argument, NULL, 'd' },
         { "user",     required_argument, NULL, 'u' },
         { "password", required_argument, NULL, 'p' },
         { "domain",   required_argument, NULL, 'D' },
+        { "storage",  required_argument, NULL, 's' },
         { "help",     no_argument,       NULL, 'h' },
         { NULL, 0, NULL, 0 }
     };
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "d:u:p:D:h", long_opts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "d:u:p:D:s:h", long_opts, NULL)) != -1) {
         switch (opt) {
         case 'd': datadir = optarg; break;
         case 'u': username = optarg; break;
         case 'p': password = optarg; break;
         case 'D': domain = optarg; break;
+        case 's': storage = optarg; break;
         case 'h':
             printf("Usage: useradd -d <datadir> -u <username> -p <password> [-D <domain>]\n"
+                   "               [-s files|mmap]\n"
                    "  -d, --datadir <path>     Data directory\n"
                    "  -u, --user <username>    Username (localpart of JID)\n"
                    "  -p, --password <pass>    Password in plain text\n"
                    "  -D, --domain <domain>    Domain (default: localhost)\n"
+                   "  -s, --storage <name>     Server storage: files or mmap (default:\n"
+                   "                           mmap if the datadir has a store, else files)\n"
                    "  -h, --help               Show usage\n");
             return 0;
         default:
@@ -62,11 +111,23 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    /* Same choice as the server's storage option */
+    char dbpath[1280];
+    struct stat st;
+    snprintf(dbpath, sizeof(dbpath), "%s/%s", datadir, KV_STORE_FILE);
+    if (!storage)
+        storage = stat(dbpath, &st) == 0 ? "mmap" : "files";
+    if (strcmp(storage, "mmap") == 0)
+        return add_to_store(datadir, username, password, domain);
+    if (strcmp(storage, "files") != 0) {
+        fprintf(stderr, "Error: Unknown storage '%s'.\n", storage);
+        return 1;
+    }
+
     /* Check if user directory already exists */
     char userdir[1280];
     snprintf(userdir, sizeof(userdir), "%s/%s", datadir, username);
 
-    struct stat st;
     if (stat(userdir, &st) == 0) {
         fprintf(stderr, "Error: User '%s@%s' already exists.\n", username, domain);
         return 1;
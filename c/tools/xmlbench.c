@@ -0,0 +1,217 @@
+/*
+ * Stream parsing throughput: the libxml2 push parser against the native
+ * scanner, on the same synthetic client stream fed in the same chunks to
+ * the same SAX handler. Build with make xmlbench.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <libxml/parser.h>
+#include "xmlscan.h"
+
+typedef struct counts {
+    long elements;
+    long stanzas;
+    long text_bytes;
+    long attrs;
+    int  depth;
+    int  errors;
+} counts_t;
+
+static void on_start(void *ctx, const xmlChar *localname, const xmlChar *prefix,
+                     const xmlChar *URI, int nb_namespaces, const xmlChar **namespaces,
+                     int nb_attributes, int nb_defaulted, const xmlChar **attributes)
+{
+    (void)localname; (void)prefix; (void)URI; (void)nb_namespaces;
+    (void)namespaces; (void)nb_defaulted; (void)attributes;
+    counts_t *c = ctx;
+    c->elements++;
+    c->attrs += nb_attributes;
+    c->depth++;
+}
+
+static void on_end(void *ctx, const xmlChar *localname, const xmlChar *prefix,
+                   const xmlChar *URI)
+{
+    (void)localname; (void)prefix; (void)URI;
+    counts_t *c = ctx;
+    if (--c->depth == 1)
+        c->stanzas++;
+}
+
+static void on_characters(void *ctx, const xmlChar *ch, int len) {
+    (void)ch;
+    ((counts_t *)ctx)->text_bytes += len;
+}
+
+static void on_error(void *ctx, xmlErrorPtr error) {
+    counts_t *c = ctx;
+    if (error->level >= XML_ERR_ERROR && c->errors++ == 0)
+        fprintf(stderr, "parse error: %s\n", error->message ? error->message : "?");
+}
+
+/* A client stream of n stanzas: chat messages, presence, roster gets */
+static char *make_stream(int n, size_t *out_len) {
+    size_t cap = 256 + (size_t)n * 512;
+    char *buf = malloc(cap);
+    if (!buf)
+        return NULL;
+    size_t len = (size_t)snprintf(buf, cap,
+        "<?xml version='1.0'?><stream:stream to='localhost' "
+        "xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' "
+        "version='1.0'>");
+    for (int i = 0; i < n; i++) {
+        switch (i % 4) {
+        case 0:
+        case 1:
+            len += (size_t)snprintf(buf + len, cap - len,
+                "<message to='bob@localhost/desk' type='chat' id='m%d'>"
+                "<body>Message %d: the quick brown fox jumps over the lazy dog "
+                "&amp; keeps running &lt;fast&gt; across the field</body>"
+                "<active xmlns='http://jabber.org/protocol/chatstates'/>"
+                "</message>", i, i);
+            break;
+        case 2:
+            len += (size_t)snprintf(buf + len, cap - len,
+                "<presence id='p%d'><show>away</show>"
+                "<status>Out for lunch, back at 2</status>"
+                "<priority>5</priority></presence>", i);
+            break;
+        default:
+            len += (size_t)snprintf(buf + len, cap - len,
+                "<iq type='get' id='r%d'><query xmlns='jabber:iq:roster'/></iq>", i);
+            break;
+        }
+    }
+    *out_len = len;
+    return buf;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static xmlSAXHandler sax;
+
+static double run_libxml(const char *doc, size_t len, size_t chunk, counts_t *c) {
+    double t = now();
+    xmlParserCtxtPtr ctx = xmlCreatePushParserCtxt(&sax, c, NULL, 0, NULL);
+    if (!ctx)
+        return -1;
+    xmlCtxtUseOptions(ctx, XML_PARSE_NONET);
+    for (size_t off = 0; off < len; off += chunk) {
+        size_t n = len - off < chunk ? len - off : chunk;
+        xmlParseChunk(ctx, doc + off, (int)n, 0);
+    }
+    xmlFreeParserCtxt(ctx);
+    return now() - t;
+}
+
+static double run_native(const char *doc, size_t len, size_t chunk, counts_t *c) {
+    double t = now();
+    xml_scanner_t *sc = xml_scanner_new(&sax, c);
+    if (!sc)
+        return -1;
+    for (size_t off = 0; off < len; off += chunk) {
+        size_t n = len - off < chunk ? len - off : chunk;
+        if (xml_scanner_feed(sc, doc + off, n) < 0)
+            break;
+    }
+    xml_scanner_free(sc);
+    return now() - t;
+}
+
+static void report(const char *name, double secs, size_t bytes, long stanzas) {
+    printf("%-8s %8.1f MB/s %12.0f stanzas/s\n", name,
+           (double)bytes / secs / 1e6, (double)stanzas / secs);
+}
+
+int main(int argc, char **argv) {
+    int stanzas = 100000;
+    size_t chunk = 4096;
+    int rounds = 5;
+
+    static struct option long_opts[] = {
+        { "stanzas", required_argument, NULL, 'n' },
+        { "chunk",   required_argument, NULL, 'c' },
+        { "rounds",  required_argument, NULL, 'r' },
+        { "help",    no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:c:r:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'n': stanzas = atoi(optarg); break;
+        case 'c': chunk = (size_t)atol(optarg); break;
+        case 'r': rounds = atoi(optarg); break;
+        case 'h':
+            printf("Usage: xmlbench [-n <stanzas>] [-c <chunk>] [-r <rounds>]\n"
+                   "  -n, --stanzas <n>    Stanzas in the stream (default: 100000)\n"
+                   "  -c, --chunk <bytes>  Bytes fed at a time (default: 4096)\n"
+                   "  -r, --rounds <n>     Runs of each parser, best kept (default: 5)\n"
+                   "  -h, --help           Show usage\n");
+            return 0;
+        default:
+            return 1;
+        }
+    }
+    if (stanzas <= 0 || chunk == 0 || rounds <= 0) {
+        fprintf(stderr, "Error: -n, -c and -r must be positive.\n");
+        return 1;
+    }
+
+    size_t len;
+    char *doc = make_stream(stanzas, &len);
+    if (!doc) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+
+    memset(&sax, 0, sizeof(sax));
+    sax.initialized    = XML_SAX2_MAGIC;
+    sax.startElementNs = on_start;
+    sax.endElementNs   = on_end;
+    sax.characters     = on_characters;
+    sax.serror         = on_error;
+
+    double best_lx = 0, best_nat = 0;
+    counts_t lx = {0}, nat = {0};
+    for (int i = 0; i < rounds; i++) {
+        memset(&lx, 0, sizeof(lx));
+        memset(&nat, 0, sizeof(nat));
+        double a = run_libxml(doc, len, chunk, &lx);
+        double b = run_native(doc, len, chunk, &nat);
+        if (a < 0 || b < 0) {
+            fprintf(stderr, "Error: cannot create parser\n");
+            return 1;
+        }
+        if (i == 0 || a < best_lx)
+            best_lx = a;
+        if (i == 0 || b < best_nat)
+            best_nat = b;
+    }
+
+    if (lx.errors || nat.errors || lx.elements != nat.elements ||
+        lx.attrs != nat.attrs || lx.text_bytes != nat.text_bytes) {
+        fprintf(stderr, "Error: parsers disagree: libxml2 %ld elements, %ld attrs, "
+                "%ld text bytes; native %ld, %ld, %ld\n",
+                lx.elements, lx.attrs, lx.text_bytes,
+                nat.elements, nat.attrs, nat.text_bytes);
+        return 1;
+    }
+
+    printf("%d stanzas, %zu bytes, fed %zu at a time, best of %d\n",
+           stanzas, len, chunk, rounds);
+    report("libxml2", best_lx, len, lx.stanzas);
+    report("native", best_nat, len, nat.stanzas);
+    printf("speedup  %8.2fx\n", best_lx / best_nat);
+
+    free(doc);
+    xmlCleanupParser();
+    return 0;
+}
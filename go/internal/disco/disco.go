@@ -1,58 +1,54 @@
 package disco
 
 import (
-	"fmt"
 	"jabber/internal/session"
 	"jabber/internal/xml"
-	"strings"
 )
 
+// features are the disco#info features the server announces.
+var features = []string{
+	"http://jabber.org/protocol/disco#info",
+	"http://jabber.org/protocol/disco#items",
+	"jabber:iq:roster",
+	"jabber:iq:register",
+	"urn:xmpp:delay",
+}
+
 // HandleInfo responds to disco#info queries.
 func HandleInfo(reg session.Registry, s *session.Session, node *xml.XMLNode) session.RouteResult {
-	id := node.Attr("id")
-	fullJID := s.FullJID()
-
-	var b strings.Builder
-	fmt.Fprintf(&b, "<iq type='result' from='%s' to='%s'", reg.Domain(), escAttr(fullJID))
-	if id != "" {
-		fmt.Fprintf(&b, " id='%s'", escAttr(id))
-	}
-	b.WriteString("><query xmlns='http://jabber.org/protocol/disco#info'>")
-	b.WriteString("<identity category='server' type='im' name='xmppd'/>")
-
-	features := []string{
-		"http://jabber.org/protocol/disco#info",
-		"http://jabber.org/protocol/disco#items",
-		"jabber:iq:roster",
-		"jabber:iq:register",
-		"urn:xmpp:delay",
-	}
+	buf := xml.GetBuffer()
+	b := appendResult(*buf, reg, s, node.Attr("id"))
+	b = append(b, "><query xmlns='http://jabber.org/protocol/disco#info'>"...)
+	b = append(b, "<identity category='server' type='im' name='xmppd'/>"...)
 	for _, f := range features {
-		fmt.Fprintf(&b, "<feature var='%s'/>", escAttr(f))
+		b = append(b, "<feature"...)
+		b = xml.AppendAttr(b, "var", f)
+		b = append(b, "/>"...)
 	}
-	b.WriteString("</query></iq>")
-	s.Send(b.String())
+	*buf = append(b, "</query></iq>"...)
+	s.SendBytes(*buf)
+	xml.PutBuffer(buf)
 	return session.RouteOK
 }
 
 // HandleItems responds to disco#items queries (empty list).
 func HandleItems(reg session.Registry, s *session.Session, node *xml.XMLNode) session.RouteResult {
-	id := node.Attr("id")
-	fullJID := s.FullJID()
-
-	var b strings.Builder
-	fmt.Fprintf(&b, "<iq type='result' from='%s' to='%s'", reg.Domain(), escAttr(fullJID))
-	if id != "" {
-		fmt.Fprintf(&b, " id='%s'", escAttr(id))
-	}
-	b.WriteString("><query xmlns='http://jabber.org/protocol/disco#items'/></iq>")
-	s.Send(b.String())
+	buf := xml.GetBuffer()
+	b := appendResult(*buf, reg, s, node.Attr("id"))
+	*buf = append(b, "><query xmlns='http://jabber.org/protocol/disco#items'/></iq>"...)
+	s.SendBytes(*buf)
+	xml.PutBuffer(buf)
 	return session.RouteOK
 }
 
-func escAttr(s string) string {
-	s = strings.ReplaceAll(s, "&", "&amp;")
-	s = strings.ReplaceAll(s, "'", "&apos;")
-	s = strings.ReplaceAll(s, "<", "&lt;")
-	return s
+// appendResult appends the open start tag of an IQ result from the server
+// to the session.
+func appendResult(b []byte, reg session.Registry, s *session.Session, id string) []byte {
+	b = append(b, "<iq type='result'"...)
+	b = xml.AppendAttr(b, "from", reg.Domain())
+	b = xml.AppendAttr(b, "to", s.FullJID())
+	if id != "" {
+		b = xml.AppendAttr(b, "id", id)
+	}
+	return b
 }
@@ -45,7 +45,7 @@ func Handle(reg session.Registry, s *session.Session, node *xml.XMLNode) session
 	target := reg.FindByBareJID(targetBare)
 
 	if target != nil {
-		target.Send(node.Serialize())
+		target.SendNode(node)
 	} else if msgType != "error" {
 		storeOffline(reg.DataDir(), reg.Domain(), targetLocal, node)
 	}
@@ -79,7 +79,7 @@ func DeliverOffline(reg session.Registry, s *session.Session) {
 			_ = os.Remove(path)
 			continue
 		}
-		s.Send(string(data))
+		s.SendBytes(data)
 		slog.Info("delivered offline message", "user", s.JIDLocal, "file", name)
 		_ = os.Remove(path)
 	}
@@ -113,9 +113,12 @@ func storeOffline(dataDir, domain, username string, node *xml.XMLNode) {
 	node.Children = append(node.Children, delay)
 
 	// Serialize and write.
-	data := node.Serialize()
+	buf := xml.GetBuffer()
+	*buf = node.AppendTo(*buf)
 	path := filepath.Join(dir, fmt.Sprintf("%04d.xml", maxSeq+1))
-	if err := os.WriteFile(path, []byte(data), 0644); err != nil {
+	err := os.WriteFile(path, *buf, 0644)
+	xml.PutBuffer(buf)
+	if err != nil {
 		slog.Error("failed to write offline message", "path", path, "err", err)
 	} else {
 		slog.Info("stored offline message", "user", username, "path", path)
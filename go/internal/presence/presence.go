@@ -1,7 +1,6 @@
 package presence
 
 import (
-	"fmt"
 	"jabber/internal/message"
 	"jabber/internal/roster"
 	"jabber/internal/session"
@@ -53,7 +52,9 @@ func BroadcastUnavailable(reg session.Registry, s *session.Session) {
 		s.Roster = roster.Load(reg.DataDir(), s.JIDLocal)
 	}
 
-	unavail := fmt.Sprintf("<presence type='unavailable' from='%s'/>", escAttr(s.FullJID()))
+	buf := xml.GetBuffer()
+	defer xml.PutBuffer(buf)
+	*buf = appendPresence(*buf, "unavailable", s.FullJID(), "")
 
 	for _, item := range s.Roster.Items {
 		if !roster.SubHasFrom(item.Subscription) {
@@ -62,7 +63,7 @@ func BroadcastUnavailable(reg session.Registry, s *session.Session) {
 		bare := bareJID(item.JID)
 		contact := reg.FindByBareJID(bare)
 		if contact != nil && contact != s {
-			contact.Send(unavail)
+			contact.SendBytes(*buf)
 		}
 	}
 	s.Available = false
@@ -82,7 +83,10 @@ func handleAvailable(reg session.Registry, s *session.Session, node *xml.XMLNode
 		s.Roster = roster.Load(reg.DataDir(), s.JIDLocal)
 	}
 
-	presXML := pres.Serialize()
+	// Encoded once for every contact
+	buf := xml.GetBuffer()
+	defer xml.PutBuffer(buf)
+	*buf = pres.AppendTo(*buf)
 
 	// Broadcast our presence to contacts who have 'from' or 'both' subscription.
 	for _, item := range s.Roster.Items {
@@ -92,7 +96,7 @@ func handleAvailable(reg session.Registry, s *session.Session, node *xml.XMLNode
 		bare := bareJID(item.JID)
 		contact := reg.FindByBareJID(bare)
 		if contact != nil {
-			contact.Send(presXML)
+			contact.SendBytes(*buf)
 		}
 	}
 
@@ -104,7 +108,7 @@ func handleAvailable(reg session.Registry, s *session.Session, node *xml.XMLNode
 		bare := bareJID(item.JID)
 		contact := reg.FindByBareJID(bare)
 		if contact != nil && contact.Available && contact.PresenceStanza != nil {
-			s.Send(contact.PresenceStanza.Serialize())
+			s.SendNode(contact.PresenceStanza)
 		}
 	}
 
@@ -140,15 +144,12 @@ func handleSubscribe(reg session.Registry, s *session.Session, to string) {
 		item.AskSubscribe = true
 	}
 	_ = roster.Save(reg.DataDir(), s.JIDLocal, &s.Roster)
-	roster.Push(s.Send, s.FullJID(), item)
+	roster.Push(s.SendBytes, s.FullJID(), item)
 
 	// Deliver to target if online.
 	target := reg.FindByBareJID(targetBare)
 	if target != nil {
-		target.Send(fmt.Sprintf(
-			"<presence type='subscribe' from='%s' to='%s'/>",
-			escAttr(senderBare), escAttr(targetBare),
-		))
+		sendPresence(target, "subscribe", senderBare, targetBare)
 	}
 }
 
@@ -177,7 +178,7 @@ func handleSubscribed(reg session.Registry, s *session.Session, to string) {
 	}
 	_ = roster.Save(reg.DataDir(), s.JIDLocal, &s.Roster)
 	if senderItem != nil {
-		roster.Push(s.Send, s.FullJID(), senderItem)
+		roster.Push(s.SendBytes, s.FullJID(), senderItem)
 	}
 
 	// Update requester's roster: none→to, from→both; clear ask.
@@ -201,19 +202,16 @@ func handleSubscribed(reg session.Registry, s *session.Session, to string) {
 		}
 		_ = roster.Save(reg.DataDir(), targetLocal, &targetSession.Roster)
 		if targetItem != nil {
-			roster.Push(targetSession.Send, targetSession.FullJID(), targetItem)
+			roster.Push(targetSession.SendBytes, targetSession.FullJID(), targetItem)
 		}
 		targetSession.RosterMu.Unlock()
 
 		// Send sender's current presence to target.
 		if s.Available && s.PresenceStanza != nil {
-			targetSession.Send(s.PresenceStanza.Serialize())
+			targetSession.SendNode(s.PresenceStanza)
 		}
 		// Send subscribed notification.
-		targetSession.Send(fmt.Sprintf(
-			"<presence type='subscribed' from='%s' to='%s'/>",
-			escAttr(senderBare), escAttr(targetBare),
-		))
+		sendPresence(targetSession, "subscribed", senderBare, targetBare)
 	} else {
 		// Target offline: modify roster on disk.
 		modifyDiskRoster(reg.DataDir(), targetLocal, func(r *roster.Roster) {
@@ -252,7 +250,7 @@ func handleUnsubscribe(reg session.Registry, s *session.Session, to string) {
 		}
 		senderItem.AskSubscribe = false
 		_ = roster.Save(reg.DataDir(), s.JIDLocal, &s.Roster)
-		roster.Push(s.Send, s.FullJID(), senderItem)
+		roster.Push(s.SendBytes, s.FullJID(), senderItem)
 	}
 
 	// Update target's roster: from→none, both→to.
@@ -273,21 +271,15 @@ func handleUnsubscribe(reg session.Registry, s *session.Session, to string) {
 				targetItem.Subscription = "to"
 			}
 			_ = roster.Save(reg.DataDir(), targetLocal, &targetSession.Roster)
-			roster.Push(targetSession.Send, targetSession.FullJID(), targetItem)
+			roster.Push(targetSession.SendBytes, targetSession.FullJID(), targetItem)
 		}
 		targetSession.RosterMu.Unlock()
 
 		// Deliver unsubscribe notification.
-		targetSession.Send(fmt.Sprintf(
-			"<presence type='unsubscribe' from='%s' to='%s'/>",
-			escAttr(senderBare), escAttr(targetBare),
-		))
+		sendPresence(targetSession, "unsubscribe", senderBare, targetBare)
 		// Send unavailable from sender if they're available.
 		if s.Available {
-			targetSession.Send(fmt.Sprintf(
-				"<presence type='unavailable' from='%s'/>",
-				escAttr(s.FullJID()),
-			))
+			sendPresence(targetSession, "unavailable", s.FullJID(), "")
 		}
 	} else {
 		modifyDiskRoster(reg.DataDir(), targetLocal, func(r *roster.Roster) {
@@ -324,7 +316,7 @@ func handleUnsubscribed(reg session.Registry, s *session.Session, to string) {
 			senderItem.Subscription = "to"
 		}
 		_ = roster.Save(reg.DataDir(), s.JIDLocal, &s.Roster)
-		roster.Push(s.Send, s.FullJID(), senderItem)
+		roster.Push(s.SendBytes, s.FullJID(), senderItem)
 	}
 
 	// Update target's roster: to→none, both→from; clear ask.
@@ -346,21 +338,15 @@ func handleUnsubscribed(reg session.Registry, s *session.Session, to string) {
 			}
 			targetItem.AskSubscribe = false
 			_ = roster.Save(reg.DataDir(), targetLocal, &targetSession.Roster)
-			roster.Push(targetSession.Send, targetSession.FullJID(), targetItem)
+			roster.Push(targetSession.SendBytes, targetSession.FullJID(), targetItem)
 		}
 		targetSession.RosterMu.Unlock()
 
 		// Deliver unsubscribed notification.
-		targetSession.Send(fmt.Sprintf(
-			"<presence type='unsubscribed' from='%s' to='%s'/>",
-			escAttr(senderBare), escAttr(targetBare),
-		))
+		sendPresence(targetSession, "unsubscribed", senderBare, targetBare)
 		// Send unavailable from sender if they're available.
 		if s.Available {
-			targetSession.Send(fmt.Sprintf(
-				"<presence type='unavailable' from='%s'/>",
-				escAttr(s.FullJID()),
-			))
+			sendPresence(targetSession, "unavailable", s.FullJID(), "")
 		}
 	} else {
 		modifyDiskRoster(reg.DataDir(), targetLocal, func(r *roster.Roster) {
@@ -396,10 +382,7 @@ func RedeliverPendingSubscribes(reg session.Registry, s *session.Session) {
 			if bareJID(item.JID) != ourBare {
 				continue
 			}
-			s.Send(fmt.Sprintf(
-				"<presence type='subscribe' from='%s' to='%s'/>",
-				escAttr(other.BareJID()), escAttr(ourBare),
-			))
+			sendPresence(s, "subscribe", other.BareJID(), ourBare)
 		}
 	}
 }
@@ -414,11 +397,33 @@ func clonePresence(node *xml.XMLNode, fromJID string) *xml.XMLNode {
 		}
 	}
 	clone.Attrs = append(clone.Attrs, xml.XMLAttr{Name: "from", Value: fromJID})
-	clone.Children = node.Children
+	// Kept as the session's presence: the decoder reuses the nodes
+	for _, c := range node.Children {
+		clone.Children = append(clone.Children, c.Clone())
+	}
 	clone.Text = node.Text
 	return clone
 }
 
+// sendPresence sends a presence of the given type, with no payload, to dst.
+// to is left out if empty.
+func sendPresence(dst *session.Session, ptype, from, to string) {
+	buf := xml.GetBuffer()
+	*buf = appendPresence(*buf, ptype, from, to)
+	dst.SendBytes(*buf)
+	xml.PutBuffer(buf)
+}
+
+func appendPresence(b []byte, ptype, from, to string) []byte {
+	b = append(b, "<presence"...)
+	b = xml.AppendAttr(b, "type", ptype)
+	b = xml.AppendAttr(b, "from", from)
+	if to != "" {
+		b = xml.AppendAttr(b, "to", to)
+	}
+	return append(b, "/>"...)
+}
+
 // modifyDiskRoster loads a user's roster file, applies fn, and saves it.
 func modifyDiskRoster(dataDir, username string, fn func(*roster.Roster)) {
 	r := roster.Load(dataDir, username)
@@ -441,10 +446,3 @@ func localPart(jid string) string {
 	}
 	return jid
 }
-
-func escAttr(s string) string {
-	s = strings.ReplaceAll(s, "&", "&amp;")
-	s = strings.ReplaceAll(s, "'", "&apos;")
-	s = strings.ReplaceAll(s, "<", "&lt;")
-	return s
-}
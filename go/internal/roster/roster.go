@@ -3,8 +3,10 @@ package roster
 import (
 	"encoding/xml"
 	"fmt"
+	jxml "jabber/internal/xml"
 	"os"
 	"path/filepath"
+	"strconv"
 	"strings"
 )
 
@@ -136,36 +138,35 @@ func (r *Roster) Remove(jid string) bool {
 }
 
 // Push sends a roster-push IQ to the given session via the send function.
-// send is typically session.Send; fullJID is the session's full JID.
-func Push(send func(string), fullJID string, item *Item) {
-	id := pushID()
-	var b strings.Builder
-	fmt.Fprintf(&b, "<iq type='set' id='%s' to='%s'>", id, escAttr(fullJID))
-	b.WriteString("<query xmlns='jabber:iq:roster'>")
-	fmt.Fprintf(&b, "<item jid='%s'", escAttr(item.JID))
+// send is typically session.SendBytes; fullJID is the session's full JID.
+func Push(send func([]byte), fullJID string, item *Item) {
+	buf := jxml.GetBuffer()
+	b := append(*buf, "<iq type='set' id='rp"...)
+	pushCounter++
+	b = strconv.AppendUint(b, pushCounter, 10)
+	b = append(b, '\'')
+	b = jxml.AppendAttr(b, "to", fullJID)
+	b = append(b, "><query xmlns='jabber:iq:roster'>"...)
+	b = AppendItem(b, item)
+	*buf = append(b, "</query></iq>"...)
+	send(*buf)
+	jxml.PutBuffer(buf)
+}
+
+// AppendItem appends item as the <item/> of a roster query to b.
+func AppendItem(b []byte, item *Item) []byte {
+	b = append(b, "<item"...)
+	b = jxml.AppendAttr(b, "jid", item.JID)
 	if item.Name != "" {
-		fmt.Fprintf(&b, " name='%s'", escAttr(item.Name))
+		b = jxml.AppendAttr(b, "name", item.Name)
 	}
-	fmt.Fprintf(&b, " subscription='%s'", item.Subscription)
+	b = jxml.AppendAttr(b, "subscription", item.Subscription)
 	if item.AskSubscribe {
-		b.WriteString(" ask='subscribe'")
+		b = append(b, " ask='subscribe'"...)
 	}
-	b.WriteString("/></query></iq>")
-	send(b.String())
+	return append(b, "/>"...)
 }
 
-// pushID generates a short random ID for roster-push stanzas.
-// Uses math/rand for simplicity since these don't require cryptographic quality.
+// pushCounter numbers roster-push stanzas: their ids need only be unique
+// to the stream.
 var pushCounter uint64
-
-func pushID() string {
-	pushCounter++
-	return fmt.Sprintf("rp%d", pushCounter)
-}
-
-func escAttr(s string) string {
-	s = strings.ReplaceAll(s, "&", "&amp;")
-	s = strings.ReplaceAll(s, "'", "&apos;")
-	s = strings.ReplaceAll(s, "<", "&lt;")
-	return s
-}
@@ -2,12 +2,10 @@ package session
 
 import (
 	"bufio"
-	"fmt"
 	"jabber/internal/roster"
 	"jabber/internal/xml"
 	"log/slog"
 	"net"
-	"strings"
 	"sync"
 	"sync/atomic"
 )
@@ -115,6 +113,16 @@ func (s *Session) RemoteAddr() string {
 // Send writes data to the connection. Safe to call from any goroutine.
 // Silently drops the write if the session is already dead.
 func (s *Session) Send(data string) {
+	buf := xml.GetBuffer()
+	*buf = append(*buf, data...)
+	s.SendBytes(*buf)
+	xml.PutBuffer(buf)
+}
+
+// SendBytes writes an encoded stanza to the connection as it is, the way
+// Send does. data is not kept once SendBytes returns, so one encoding can
+// go to many sessions and its buffer be reused.
+func (s *Session) SendBytes(data []byte) {
 	if s.dead.Load() {
 		return
 	}
@@ -123,38 +131,48 @@ func (s *Session) Send(data string) {
 	if s.dead.Load() {
 		return
 	}
-	if _, err := s.conn.Write([]byte(data)); err != nil {
+	if _, err := s.conn.Write(data); err != nil {
 		slog.Debug("write error", "jid", s.BareJID(), "err", err)
 	}
 }
 
 // SendNode serializes node and sends it.
 func (s *Session) SendNode(node *xml.XMLNode) {
-	s.Send(node.Serialize())
+	buf := xml.GetBuffer()
+	*buf = node.AppendTo(*buf)
+	s.SendBytes(*buf)
+	xml.PutBuffer(buf)
 }
 
 // SendStanzaError sends an RFC 6120 stanza-level error response.
 // The original stanza's tag name and id are preserved; the connection remains open.
 func (s *Session) SendStanzaError(original *xml.XMLNode, errType, condition string) {
-	var b strings.Builder
-	fmt.Fprintf(&b, "<%s type='error'", original.Name)
+	buf := xml.GetBuffer()
+	b := append(*buf, '<')
+	b = append(b, original.Name...)
+	b = append(b, " type='error'"...)
 	if id := original.Attr("id"); id != "" {
-		fmt.Fprintf(&b, " id='%s'", escAttr(id))
+		b = xml.AppendAttr(b, "id", id)
 	}
-	fmt.Fprintf(&b, " from='%s'", escAttr(s.JIDDomain))
+	b = xml.AppendAttr(b, "from", s.JIDDomain)
 	if jid := s.FullJID(); jid != "" {
-		fmt.Fprintf(&b, " to='%s'", escAttr(jid))
+		b = xml.AppendAttr(b, "to", jid)
 	}
-	fmt.Fprintf(&b, "><error type='%s'>", errType)
-	fmt.Fprintf(&b, "<%s xmlns='urn:ietf:params:xml:ns:xmpp-stanzas'/>", condition)
-	fmt.Fprintf(&b, "</error></%s>", original.Name)
-	s.Send(b.String())
+	b = append(b, "><error type='"...)
+	b = append(b, errType...)
+	b = append(b, "'><"...)
+	b = append(b, condition...)
+	b = append(b, " xmlns='urn:ietf:params:xml:ns:xmpp-stanzas'/></error></"...)
+	b = append(b, original.Name...)
+	*buf = append(b, '>')
+	s.SendBytes(*buf)
+	xml.PutBuffer(buf)
 }
 
-// RestartDecoder replaces the XML decoder with a fresh one on the same
+// RestartDecoder starts the XML decoder over on a new stream from the same
 // bufio.Reader. Called after SASL success; buffered bytes are preserved.
 func (s *Session) RestartDecoder() {
-	s.Dec = xml.NewStreamDecoder(s.br)
+	s.Dec.Reset()
 }
 
 // Close marks the session dead and closes the TCP connection.
@@ -165,10 +183,3 @@ func (s *Session) Close() {
 		s.conn.Close()
 	})
 }
-
-func escAttr(s string) string {
-	s = strings.ReplaceAll(s, "&", "&amp;")
-	s = strings.ReplaceAll(s, "'", "&apos;")
-	s = strings.ReplaceAll(s, "<", "&lt;")
-	return s
-}
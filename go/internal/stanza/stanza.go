@@ -1,7 +1,6 @@
 package stanza
 
 import (
-	"fmt"
 	"jabber/internal/auth"
 	"jabber/internal/disco"
 	"jabber/internal/message"
@@ -81,7 +80,7 @@ func handleIQ(reg session.Registry, s *session.Session, node *xml.XMLNode) sessi
 			target := reg.FindByBareJID(targetBare)
 			if target != nil {
 				setAttr(node, "from", s.FullJID())
-				target.Send(node.Serialize())
+				target.SendNode(node)
 			}
 		}
 		return session.RouteOK
@@ -127,7 +126,7 @@ func handleIQ(reg session.Registry, s *session.Session, node *xml.XMLNode) sessi
 			target := reg.FindByBareJID(targetBare)
 			if target != nil {
 				setAttr(node, "from", s.FullJID())
-				target.Send(node.Serialize())
+				target.SendNode(node)
 				return session.RouteOK
 			}
 		}
@@ -168,15 +167,13 @@ func handleBind(reg session.Registry, s *session.Session, node *xml.XMLNode) ses
 	}
 
 	// Send bind result.
-	var b strings.Builder
-	fmt.Fprintf(&b, "<iq type='result'")
-	if id != "" {
-		fmt.Fprintf(&b, " id='%s'", escAttr(id))
-	}
-	b.WriteString("><bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'>")
-	fmt.Fprintf(&b, "<jid>%s</jid>", escText(fullJID))
-	b.WriteString("</bind></iq>")
-	s.Send(b.String())
+	buf := xml.GetBuffer()
+	b := appendResult(*buf, id)
+	b = append(b, "><bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'><jid>"...)
+	b = xml.AppendText(b, fullJID)
+	*buf = append(b, "</jid></bind></iq>"...)
+	s.SendBytes(*buf)
+	xml.PutBuffer(buf)
 
 	slog.Info("resource bound", "jid", fullJID)
 	return session.RouteOK
@@ -187,13 +184,7 @@ func handleSessionIQ(s *session.Session, node *xml.XMLNode) session.RouteResult
 	id := node.Attr("id")
 	s.State = session.StateSessionActive
 
-	var b strings.Builder
-	b.WriteString("<iq type='result'")
-	if id != "" {
-		fmt.Fprintf(&b, " id='%s'", escAttr(id))
-	}
-	b.WriteString("/>")
-	s.Send(b.String())
+	sendResult(s, id)
 
 	slog.Info("session established", "jid", s.FullJID())
 	return session.RouteOK
@@ -210,26 +201,16 @@ func handleRosterIQ(reg session.Registry, s *session.Session, node *xml.XMLNode)
 
 	switch iqType {
 	case "get":
-		var b strings.Builder
-		fmt.Fprintf(&b, "<iq type='result'")
-		if id != "" {
-			fmt.Fprintf(&b, " id='%s'", escAttr(id))
+		buf := xml.GetBuffer()
+		b := appendResult(*buf, id)
+		b = xml.AppendAttr(b, "to", s.FullJID())
+		b = append(b, "><query xmlns='jabber:iq:roster'>"...)
+		for i := range s.Roster.Items {
+			b = roster.AppendItem(b, &s.Roster.Items[i])
 		}
-		fmt.Fprintf(&b, " to='%s'", escAttr(s.FullJID()))
-		b.WriteString("><query xmlns='jabber:iq:roster'>")
-		for _, item := range s.Roster.Items {
-			fmt.Fprintf(&b, "<item jid='%s'", escAttr(item.JID))
-			if item.Name != "" {
-				fmt.Fprintf(&b, " name='%s'", escAttr(item.Name))
-			}
-			fmt.Fprintf(&b, " subscription='%s'", item.Subscription)
-			if item.AskSubscribe {
-				b.WriteString(" ask='subscribe'")
-			}
-			b.WriteString("/>")
-		}
-		b.WriteString("</query></iq>")
-		s.Send(b.String())
+		*buf = append(b, "</query></iq>"...)
+		s.SendBytes(*buf)
+		xml.PutBuffer(buf)
 
 	case "set":
 		queryEl := firstChild(node)
@@ -255,16 +236,10 @@ func handleRosterIQ(reg session.Registry, s *session.Session, node *xml.XMLNode)
 			_ = roster.Save(reg.DataDir(), s.JIDLocal, &s.Roster)
 
 			// Send result.
-			var b strings.Builder
-			b.WriteString("<iq type='result'")
-			if id != "" {
-				fmt.Fprintf(&b, " id='%s'", escAttr(id))
-			}
-			b.WriteString("/>")
-			s.Send(b.String())
+			sendResult(s, id)
 
 			// Roster push with subscription=remove.
-			roster.Push(s.Send, s.FullJID(), &roster.Item{
+			roster.Push(s.SendBytes, s.FullJID(), &roster.Item{
 				JID:          jid,
 				Subscription: "remove",
 			})
@@ -283,17 +258,11 @@ func handleRosterIQ(reg session.Registry, s *session.Session, node *xml.XMLNode)
 			}
 			_ = roster.Save(reg.DataDir(), s.JIDLocal, &s.Roster)
 
-			var b strings.Builder
-			b.WriteString("<iq type='result'")
-			if id != "" {
-				fmt.Fprintf(&b, " id='%s'", escAttr(id))
-			}
-			b.WriteString("/>")
-			s.Send(b.String())
+			sendResult(s, id)
 
 			updated := s.Roster.Find(jid)
 			if updated != nil {
-				roster.Push(s.Send, s.FullJID(), updated)
+				roster.Push(s.SendBytes, s.FullJID(), updated)
 			}
 		}
 
@@ -337,16 +306,20 @@ func setAttr(node *xml.XMLNode, name, value string) {
 	node.Attrs = append(node.Attrs, xml.XMLAttr{Name: name, Value: value})
 }
 
-func escAttr(s string) string {
-	s = strings.ReplaceAll(s, "&", "&amp;")
-	s = strings.ReplaceAll(s, "'", "&apos;")
-	s = strings.ReplaceAll(s, "<", "&lt;")
-	return s
+// appendResult appends the start of an <iq type='result'/> answering id,
+// its tag left open for more attributes.
+func appendResult(b []byte, id string) []byte {
+	b = append(b, "<iq type='result'"...)
+	if id != "" {
+		b = xml.AppendAttr(b, "id", id)
+	}
+	return b
 }
 
-func escText(s string) string {
-	s = strings.ReplaceAll(s, "&", "&amp;")
-	s = strings.ReplaceAll(s, "<", "&lt;")
-	s = strings.ReplaceAll(s, ">", "&gt;")
-	return s
+// sendResult sends an empty IQ result answering id.
+func sendResult(s *session.Session, id string) {
+	buf := xml.GetBuffer()
+	*buf = append(appendResult(*buf, id), "/>"...)
+	s.SendBytes(*buf)
+	xml.PutBuffer(buf)
 }
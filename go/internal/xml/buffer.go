@@ -0,0 +1,31 @@
+package xml
+
+import "sync"
+
+const (
+	bufferSize    = 512     // initial capacity of a pooled buffer
+	maxBufferSize = 1 << 16 // larger buffers are left to the GC, not pooled
+)
+
+var bufferPool = sync.Pool{
+	New: func() any {
+		b := make([]byte, 0, bufferSize)
+		return &b
+	},
+}
+
+// GetBuffer returns an empty buffer from the pool to append a stanza to.
+// Give it back with PutBuffer once the bytes have been written.
+func GetBuffer() *[]byte {
+	return bufferPool.Get().(*[]byte)
+}
+
+// PutBuffer returns a buffer from GetBuffer to the pool, keeping what it
+// grew to. Nothing may use *b afterwards.
+func PutBuffer(b *[]byte) {
+	if cap(*b) > maxBufferSize {
+		return
+	}
+	*b = (*b)[:0]
+	bufferPool.Put(b)
+}
@@ -1,26 +1,135 @@
 package xml
 
 import (
-	"encoding/xml"
+	"bufio"
+	"bytes"
+	"errors"
+	"fmt"
 	"io"
+	"unicode/utf8"
 )
 
-// StreamDecoder wraps encoding/xml.Decoder to produce XMLNode trees from an
-// ongoing XMPP stream. Call ReadStanza() repeatedly to get each stanza.
+const (
+	xmlNamespace    = "http://www.w3.org/XML/1998/namespace"
+	streamNamespace = "http://etherx.jabber.org/streams"
+
+	slabSize     = 64      // nodes, attributes or child pointers per slab chunk
+	maxInterned  = 64      // namespace URIs and prefixes kept per decoder
+	maxTokenSize = 1 << 20 // bytes of one unfinished tag or text run
+)
+
+var (
+	errTokenTooLarge = errors.New("xml: token too large")
+	errInvalidUTF8   = errors.New("xml: invalid UTF-8")
+	errIllegalChar   = errors.New("xml: illegal character code")
+)
+
+// StreamDecoder reads XMPP stanzas as XMLNode trees straight from the bytes
+// of the session's bufio.Reader. It understands the XML an XMPP stream
+// carries: elements, attributes, namespaces, character data, CDATA and the
+// predefined and numeric character references. Comments, processing
+// instructions and declarations are skipped. Like encoding/xml in
+// non-strict mode, an '&' that does not start a known reference is taken
+// literally.
 //
-// The caller supplies an *bufio.Reader (or any io.ByteReader) so that the
-// underlying buffer persists across decoder restarts for stream re-negotiation.
+// Nothing is allocated per token. The strings of a stanza (names, attribute
+// values, text) are sub-slices of a single string made when the stanza
+// is complete, and stay valid indefinitely. Nodes, attribute slices and
+// child slices come from slabs the decoder reuses, so a tree is only valid
+// until the next ReadStanza call; use Clone to keep one longer.
 type StreamDecoder struct {
-	d *xml.Decoder
+	r *bufio.Reader
+
+	tok   []byte // a tag or text run spanning several reads
+	depth int    // elements open below the stream root
+
+	// Namespace declarations in scope, the stream root's first.
+	ns       []nsBinding
+	interned []string
+
+	stack []openElem
+	kids  []*XMLNode // children of open elements, in order
+
+	// Strings of the stanza being read, made into one string at its end.
+	// Each fixup is a string field to point into that string.
+	sbuf   []byte
+	fixups []fixup
+
+	nodes    slab[XMLNode]
+	attrs    slab[XMLAttr]
+	children slab[*XMLNode]
+}
+
+type nsBinding struct {
+	prefix string // "" for the default namespace
+	uri    string
+}
+
+type openElem struct {
+	node    *XMLNode
+	qname   span // prefix:local, in sbuf
+	nsLen   int  // len(ns) before the element's declarations
+	kidsLen int  // len(kids) when it opened
+	text    span
+}
+
+type span struct{ off, len int }
+
+type fixup struct {
+	dst *string
+	s   span
+}
+
+// slab hands out stable pointers and cap-limited slices from chunks that
+// are reused once reset.
+type slab[T any] struct {
+	chunks [][]T
+	chunk  int // chunk being allocated from
+	used   int // entries used in it
 }
 
-// NewStreamDecoder creates a StreamDecoder reading from r.
-// r should be a *bufio.Reader to avoid double-buffering and to allow safe
-// decoder replacement after SASL auth without losing buffered bytes.
-func NewStreamDecoder(r io.Reader) *StreamDecoder {
-	d := xml.NewDecoder(r)
-	d.Strict = false
-	return &StreamDecoder{d: d}
+func (sl *slab[T]) reset() {
+	sl.chunk, sl.used = 0, 0
+}
+
+// take returns n zeroed, contiguous entries, capped so that append copies.
+func (sl *slab[T]) take(n int) []T {
+	for {
+		if sl.chunk == len(sl.chunks) {
+			size := slabSize
+			if n > size {
+				size = n
+			}
+			sl.chunks = append(sl.chunks, make([]T, size))
+		}
+		c := sl.chunks[sl.chunk]
+		if len(c)-sl.used >= n {
+			s := c[sl.used : sl.used+n : sl.used+n]
+			sl.used += n
+			clear(s)
+			return s
+		}
+		sl.chunk++
+		sl.used = 0
+	}
+}
+
+// NewStreamDecoder creates a StreamDecoder reading from r. r is kept, with
+// whatever it has buffered, across Reset for stream re-negotiation.
+func NewStreamDecoder(r *bufio.Reader) *StreamDecoder {
+	return &StreamDecoder{r: r}
+}
+
+// Reset starts over on a new stream from the same reader (after SASL
+// success), keeping the decoder's buffers.
+func (sd *StreamDecoder) Reset() {
+	sd.tok = sd.tok[:0]
+	sd.depth = 0
+	sd.ns = sd.ns[:0]
+	sd.stack = sd.stack[:0]
+	sd.kids = sd.kids[:0]
+	sd.sbuf = sd.sbuf[:0]
+	sd.fixups = sd.fixups[:0]
 }
 
 // ReadStanza reads the next complete stanza from the stream.
@@ -34,79 +143,473 @@ func NewStreamDecoder(r io.Reader) *StreamDecoder {
 // The stream:stream element is NOT pushed onto the internal stack so depth
 // counting is relative to stanza depth, not document depth.
 func (sd *StreamDecoder) ReadStanza() (*XMLNode, error) {
-	var stack []*XMLNode
+	sd.nodes.reset()
+	sd.attrs.reset()
+	sd.children.reset()
 
 	for {
-		tok, err := sd.d.Token()
+		chunk, err := sd.readChunk()
 		if err != nil {
 			return nil, err
 		}
 
-		switch t := tok.(type) {
-		case xml.ProcInst:
-			// Skip <?xml version='1.0'?> and similar.
+		// Character data up to the markup, if any
+		lt := bytes.IndexByte(chunk, '<')
+		if lt < 0 {
+			lt = len(chunk)
+		}
+		if lt > 0 && len(sd.stack) > 0 {
+			if err := sd.text(chunk[:lt], false); err != nil {
+				return nil, err
+			}
+		}
+		if lt == len(chunk) {
 			continue
+		}
 
-		case xml.StartElement:
-			node := startToNode(t)
+		node, err := sd.markup(chunk[lt:])
+		if node != nil || err != nil {
+			return node, err
+		}
+	}
+}
 
-			if len(stack) == 0 {
-				if node.IsStreamOpen() {
-					// Stream open — return sentinel without pushing to stack.
-					return node, nil
-				}
-				// First child of stream:stream — start of a new stanza.
+// readChunk returns the input up to the next '>' that ends a tag, comment,
+// CDATA section or processing instruction, with any text before it. The
+// result is only valid until the next read.
+func (sd *StreamDecoder) readChunk() ([]byte, error) {
+	sd.tok = sd.tok[:0]
+	for {
+		sl, err := sd.r.ReadSlice('>')
+		if err == bufio.ErrBufferFull {
+			if len(sd.tok)+len(sl) > maxTokenSize {
+				return nil, errTokenTooLarge
+			}
+			sd.tok = append(sd.tok, sl...)
+			continue
+		}
+		if err != nil {
+			if err == io.EOF && len(sd.tok)+len(sl) > 0 {
+				return nil, io.ErrUnexpectedEOF
 			}
-			stack = append(stack, node)
+			return nil, err
+		}
 
-		case xml.EndElement:
-			if len(stack) == 0 {
-				// </stream:stream> — clean close.
-				return nil, io.EOF
+		chunk := sl
+		if len(sd.tok) > 0 {
+			sd.tok = append(sd.tok, sl...)
+			chunk = sd.tok
+		}
+		if markupComplete(chunk) {
+			return chunk, nil
+		}
+		if len(sd.tok) == 0 {
+			sd.tok = append(sd.tok, sl...)
+		}
+		if len(sd.tok) > maxTokenSize {
+			return nil, errTokenTooLarge
+		}
+	}
+}
+
+// markupComplete reports whether chunk, which ends in '>', ends with the
+// end of its markup rather than a '>' inside it (or in plain text).
+func markupComplete(chunk []byte) bool {
+	lt := bytes.IndexByte(chunk, '<')
+	if lt < 0 {
+		return true // text only; it goes on
+	}
+	m := chunk[lt:]
+	switch {
+	case bytes.HasPrefix(m, []byte("<!--")):
+		return len(m) >= 7 && bytes.HasSuffix(m, []byte("-->"))
+	case bytes.HasPrefix(m, []byte("<![CDATA[")):
+		return len(m) >= 12 && bytes.HasSuffix(m, []byte("]]>"))
+	case bytes.HasPrefix(m, []byte("<?")):
+		return len(m) >= 4 && bytes.HasSuffix(m, []byte("?>"))
+	}
+	// A tag: the '>' must not be in a quoted value
+	var quote byte
+	for _, c := range m {
+		if quote != 0 {
+			if c == quote {
+				quote = 0
 			}
+		} else if c == '"' || c == '\'' {
+			quote = c
+		}
+	}
+	return quote == 0
+}
+
+// markup handles one complete piece of markup. It returns a node when a
+// stanza (or the stream header) is complete.
+func (sd *StreamDecoder) markup(m []byte) (*XMLNode, error) {
+	switch {
+	case bytes.HasPrefix(m, []byte("<![CDATA[")):
+		if len(sd.stack) > 0 {
+			return nil, sd.text(m[9:len(m)-3], true)
+		}
+		return nil, nil
+	case bytes.HasPrefix(m, []byte("<!")), bytes.HasPrefix(m, []byte("<?")):
+		// Comments, declarations and the XML declaration
+		return nil, nil
+	case bytes.HasPrefix(m, []byte("</")):
+		return sd.endElement(m)
+	}
+	return sd.startElement(m)
+}
+
+func isSpace(c byte) bool {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r'
+}
+
+func skipSpace(b []byte, i int) int {
+	for i < len(b) && isSpace(b[i]) {
+		i++
+	}
+	return i
+}
+
+// nameEnd returns the end of the name starting at b[i].
+func nameEnd(b []byte, i int) int {
+	for i < len(b) {
+		c := b[i]
+		if isSpace(c) || c == '/' || c == '>' || c == '=' {
+			break
+		}
+		i++
+	}
+	return i
+}
+
+func splitQName(q []byte) (prefix, local []byte) {
+	if i := bytes.IndexByte(q, ':'); i > 0 {
+		return q[:i], q[i+1:]
+	}
+	return nil, q
+}
+
+// intern returns s as a string the decoder keeps, so that repeated
+// namespace declarations cost nothing.
+func (sd *StreamDecoder) intern(s []byte) string {
+	for _, v := range sd.interned {
+		if v == string(s) {
+			return v
+		}
+	}
+	v := string(s)
+	if len(sd.interned) < maxInterned {
+		sd.interned = append(sd.interned, v)
+	}
+	return v
+}
+
+// lookup resolves a prefix ("" for the default namespace). As encoding/xml
+// does when not strict, an unbound prefix stands for itself.
+func (sd *StreamDecoder) lookup(prefix []byte) string {
+	if string(prefix) == "xml" {
+		return xmlNamespace
+	}
+	for i := len(sd.ns) - 1; i >= 0; i-- {
+		if sd.ns[i].prefix == string(prefix) {
+			return sd.ns[i].uri
+		}
+	}
+	if len(prefix) == 0 {
+		return ""
+	}
+	return sd.intern(prefix)
+}
 
-			// Pop completed node.
-			top := stack[len(stack)-1]
-			stack = stack[:len(stack)-1]
+// put appends s to the stanza's strings.
+func (sd *StreamDecoder) put(s []byte) span {
+	off := len(sd.sbuf)
+	sd.sbuf = append(sd.sbuf, s...)
+	return span{off, len(s)}
+}
 
-			if len(stack) == 0 {
-				// This was a top-level stanza.
-				return top, nil
+func (sd *StreamDecoder) fix(dst *string, s span) {
+	if s.len > 0 {
+		sd.fixups = append(sd.fixups, fixup{dst, s})
+	}
+}
+
+func (sd *StreamDecoder) startElement(m []byte) (*XMLNode, error) {
+	body := m[1 : len(m)-1]
+	selfClose := len(body) > 0 && body[len(body)-1] == '/'
+	if selfClose {
+		body = body[:len(body)-1]
+	}
+	qend := nameEnd(body, 0)
+	if qend == 0 {
+		return nil, fmt.Errorf("xml: expected element name after <")
+	}
+	qname := body[:qend]
+	nsLen := len(sd.ns)
+
+	// Declarations first, as they apply to the element's own name
+	nattrs := 0
+	for i := skipSpace(body, qend); i < len(body); {
+		name, value, next, err := nextAttr(body, i)
+		if err != nil {
+			return nil, err
+		}
+		i = next
+		prefix, local := splitQName(name)
+		switch {
+		case prefix == nil && string(local) == "xmlns":
+			sd.ns = append(sd.ns, nsBinding{"", sd.intern(value)})
+		case string(prefix) == "xmlns":
+			sd.ns = append(sd.ns, nsBinding{sd.intern(local), sd.intern(value)})
+		default:
+			nattrs++
+		}
+	}
+
+	node := &sd.nodes.take(1)[0]
+	prefix, local := splitQName(qname)
+	node.NS = sd.lookup(prefix)
+	q := sd.put(qname)
+	if prefix != nil {
+		sd.fix(&node.Name, span{q.off + len(prefix) + 1, q.len - len(prefix) - 1})
+	} else {
+		sd.fix(&node.Name, q)
+	}
+
+	if nattrs > 0 {
+		node.Attrs = sd.attrs.take(nattrs)
+		n := 0
+		for i := skipSpace(body, qend); i < len(body); {
+			name, value, next, _ := nextAttr(body, i)
+			i = next
+			prefix, local := splitQName(name)
+			if (prefix == nil && string(local) == "xmlns") || string(prefix) == "xmlns" {
+				continue
 			}
-			// Attach to parent.
-			parent := stack[len(stack)-1]
-			parent.Children = append(parent.Children, top)
+			a := &node.Attrs[n]
+			n++
+			if prefix != nil {
+				a.NS = sd.lookup(prefix)
+			}
+			sd.fix(&a.Name, sd.put(local))
+			v, err := sd.decode(value, false)
+			if err != nil {
+				return nil, err
+			}
+			sd.fix(&a.Value, v)
+		}
+	}
+
+	if len(sd.stack) == 0 && string(local) == "stream" && node.NS == streamNamespace {
+		// Stream open: its declarations stay for the whole stream
+		return sd.finish(node), nil
+	}
+
+	sd.stack = append(sd.stack, openElem{node: node, qname: q, nsLen: nsLen, kidsLen: len(sd.kids)})
+	if selfClose {
+		return sd.closeTop(), nil
+	}
+	return nil, nil
+}
+
+// nextAttr parses name="value" at b[i], returning the value still encoded
+// and where to continue.
+func nextAttr(b []byte, i int) (name, value []byte, next int, err error) {
+	end := nameEnd(b, i)
+	if end == i {
+		return nil, nil, 0, fmt.Errorf("xml: expected attribute name")
+	}
+	name = b[i:end]
+	i = skipSpace(b, end)
+	if i == len(b) || b[i] != '=' {
+		return nil, nil, 0, fmt.Errorf("xml: attribute %s without value", name)
+	}
+	i = skipSpace(b, i+1)
+	if i == len(b) || (b[i] != '"' && b[i] != '\'') {
+		return nil, nil, 0, fmt.Errorf("xml: unquoted value of attribute %s", name)
+	}
+	q := bytes.IndexByte(b[i+1:], b[i])
+	if q < 0 {
+		return nil, nil, 0, fmt.Errorf("xml: unterminated value of attribute %s", name)
+	}
+	value = b[i+1 : i+1+q]
+	return name, value, skipSpace(b, i+2+q), nil
+}
+
+func (sd *StreamDecoder) endElement(m []byte) (*XMLNode, error) {
+	qname := m[2 : len(m)-1]
+	for len(qname) > 0 && isSpace(qname[len(qname)-1]) {
+		qname = qname[:len(qname)-1]
+	}
+	if len(sd.stack) == 0 {
+		// </stream:stream> — clean close.
+		return nil, io.EOF
+	}
+	top := &sd.stack[len(sd.stack)-1]
+	open := sd.sbuf[top.qname.off : top.qname.off+top.qname.len]
+	if !bytes.Equal(open, qname) {
+		return nil, fmt.Errorf("xml: element <%s> closed by </%s>", open, qname)
+	}
+	return sd.closeTop(), nil
+}
+
+// closeTop ends the innermost open element, returning it if that completes
+// a stanza.
+func (sd *StreamDecoder) closeTop() *XMLNode {
+	top := sd.stack[len(sd.stack)-1]
+	sd.stack = sd.stack[:len(sd.stack)-1]
+	sd.ns = sd.ns[:top.nsLen]
+
+	node := top.node
+	if kids := sd.kids[top.kidsLen:]; len(kids) > 0 {
+		node.Children = sd.children.take(len(kids))
+		copy(node.Children, kids)
+		sd.kids = sd.kids[:top.kidsLen]
+	}
+	sd.fix(&node.Text, top.text)
 
-		case xml.CharData:
-			if len(stack) > 0 {
-				stack[len(stack)-1].Text += string(t)
+	if len(sd.stack) > 0 {
+		sd.kids = append(sd.kids, node)
+		return nil
+	}
+	return sd.finish(node)
+}
+
+// finish turns the stanza's collected strings into one and points every
+// string field of the tree into it.
+func (sd *StreamDecoder) finish(node *XMLNode) *XMLNode {
+	s := string(sd.sbuf)
+	for _, f := range sd.fixups {
+		*f.dst = s[f.s.off : f.s.off+f.s.len]
+	}
+	sd.sbuf = sd.sbuf[:0]
+	sd.fixups = sd.fixups[:0]
+	return node
+}
+
+// text adds character data to the innermost open element.
+func (sd *StreamDecoder) text(b []byte, cdata bool) error {
+	top := &sd.stack[len(sd.stack)-1]
+	if top.text.len > 0 && top.text.off+top.text.len != len(sd.sbuf) {
+		// A child came in between: bring the text so far to the end
+		off := len(sd.sbuf)
+		sd.sbuf = append(sd.sbuf, sd.sbuf[top.text.off:top.text.off+top.text.len]...)
+		top.text.off = off
+	}
+	s, err := sd.decode(b, cdata)
+	if err != nil {
+		return err
+	}
+	if top.text.len == 0 {
+		top.text.off = s.off
+	}
+	top.text.len += s.len
+	return nil
+}
+
+// decode appends b to the stanza's strings with line ends made "\n" and,
+// unless raw, references resolved.
+func (sd *StreamDecoder) decode(b []byte, raw bool) (span, error) {
+	if !utf8.Valid(b) {
+		return span{}, errInvalidUTF8
+	}
+	off := len(sd.sbuf)
+	for len(b) > 0 {
+		i := 0
+		for i < len(b) {
+			c := b[i]
+			if (c == '&' && !raw) || c < 0x20 && c != '\t' && c != '\n' {
+				break
 			}
+			i++
+		}
+		sd.sbuf = append(sd.sbuf, b[:i]...)
+		if i == len(b) {
+			break
+		}
 
-		case xml.Comment, xml.Directive:
-			// ignore
+		switch c := b[i]; {
+		case c == '\r':
+			sd.sbuf = append(sd.sbuf, '\n')
+			i++
+			if i < len(b) && b[i] == '\n' {
+				i++
+			}
+		case c == '&':
+			r, n := entity(b[i:])
+			if n == 0 {
+				sd.sbuf = append(sd.sbuf, '&')
+				i++
+			} else {
+				sd.sbuf = utf8.AppendRune(sd.sbuf, r)
+				i += n
+			}
+		default:
+			return span{}, errIllegalChar
 		}
+		b = b[i:]
 	}
+	return span{off, len(sd.sbuf) - off}, nil
 }
 
-func startToNode(t xml.StartElement) *XMLNode {
-	node := &XMLNode{
-		Name: t.Name.Local,
-		NS:   t.Name.Space,
+// entity resolves the reference at the start of b, returning its length,
+// or 0 if it is not one.
+func entity(b []byte) (rune, int) {
+	semi := bytes.IndexByte(b, ';')
+	if semi < 2 || semi > 10 {
+		return 0, 0
 	}
-	for _, a := range t.Attr {
-		// encoding/xml strips xmlns and xmlns:prefix attributes; those appear
-		// as Name.Space on elements instead.  We keep everything else.
-		if a.Name.Space == "xmlns" {
-			continue
+	name := b[1:semi]
+	switch string(name) {
+	case "lt":
+		return '<', semi + 1
+	case "gt":
+		return '>', semi + 1
+	case "amp":
+		return '&', semi + 1
+	case "quot":
+		return '"', semi + 1
+	case "apos":
+		return '\'', semi + 1
+	}
+	if name[0] != '#' || len(name) < 2 {
+		return 0, 0
+	}
+	base, digits := rune(10), name[1:]
+	if digits[0] == 'x' {
+		base, digits = 16, digits[1:]
+	}
+	if len(digits) == 0 {
+		return 0, 0
+	}
+	var r rune
+	for _, c := range digits {
+		var d rune
+		switch {
+		case c >= '0' && c <= '9':
+			d = rune(c - '0')
+		case base == 16 && c >= 'a' && c <= 'f':
+			d = rune(c-'a') + 10
+		case base == 16 && c >= 'A' && c <= 'F':
+			d = rune(c-'A') + 10
+		default:
+			return 0, 0
 		}
-		if a.Name.Space == "" && a.Name.Local == "xmlns" {
-			continue
+		r = r*base + d
+		if r > utf8.MaxRune {
+			return 0, 0
 		}
-		node.Attrs = append(node.Attrs, XMLAttr{
-			Name:  a.Name.Local,
-			NS:    a.Name.Space,
-			Value: a.Value,
-		})
 	}
-	return node
+	if !isInCharacterRange(r) {
+		return 0, 0
+	}
+	return r, semi + 1
+}
+
+func isInCharacterRange(r rune) bool {
+	return r == 0x09 || r == 0x0A || r == 0x0D ||
+		r >= 0x20 && r <= 0xD7FF ||
+		r >= 0xE000 && r <= 0xFFFD ||
+		r >= 0x10000 && r <= 0x10FFFF
 }
@@ -0,0 +1,190 @@
+package xml
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/xml"
+	"fmt"
+	"io"
+	"reflect"
+	"strings"
+	"testing"
+)
+
+// stdDecoder is the encoding/xml based decoder StreamDecoder replaced,
+// kept as the reference it is checked and measured against.
+type stdDecoder struct {
+	d *xml.Decoder
+}
+
+func newStdDecoder(r io.Reader) *stdDecoder {
+	d := xml.NewDecoder(r)
+	d.Strict = false
+	return &stdDecoder{d: d}
+}
+
+func (sd *stdDecoder) ReadStanza() (*XMLNode, error) {
+	var stack []*XMLNode
+	for {
+		tok, err := sd.d.Token()
+		if err != nil {
+			return nil, err
+		}
+		switch t := tok.(type) {
+		case xml.StartElement:
+			node := &XMLNode{Name: t.Name.Local, NS: t.Name.Space}
+			for _, a := range t.Attr {
+				if a.Name.Space == "xmlns" || (a.Name.Space == "" && a.Name.Local == "xmlns") {
+					continue
+				}
+				node.Attrs = append(node.Attrs, XMLAttr{Name: a.Name.Local, NS: a.Name.Space, Value: a.Value})
+			}
+			if len(stack) == 0 && node.IsStreamOpen() {
+				return node, nil
+			}
+			stack = append(stack, node)
+		case xml.EndElement:
+			if len(stack) == 0 {
+				return nil, io.EOF
+			}
+			top := stack[len(stack)-1]
+			stack = stack[:len(stack)-1]
+			if len(stack) == 0 {
+				return top, nil
+			}
+			parent := stack[len(stack)-1]
+			parent.Children = append(parent.Children, top)
+		case xml.CharData:
+			if len(stack) > 0 {
+				stack[len(stack)-1].Text += string(t)
+			}
+		}
+	}
+}
+
+const streamHeader = "<?xml version='1.0'?><stream:stream to='localhost' " +
+	"xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' version='1.0'>"
+
+// sampleStanzas is a client's traffic: chat, presence, roster and IQs with
+// references, foreign namespaces and prefixes.
+var sampleStanzas = []string{
+	"<message to='bob@localhost/desk' type='chat' id='m1'>" +
+		"<body>The quick brown fox &amp; the lazy dog &lt;3 caf&#233; &#x1F600;</body>" +
+		"<active xmlns='http://jabber.org/protocol/chatstates'/></message>",
+	"<presence id='p1'><show>away</show><status>Out for lunch\r\nback at 2</status>" +
+		"<priority>5</priority></presence>",
+	"<iq type='get' id='r1'><query xmlns='jabber:iq:roster'/></iq>",
+	"<iq type='set' id='r2'><query xmlns='jabber:iq:roster'>" +
+		"<item jid='alice@localhost' name='Alice &quot;A&quot; Smith'><group>Friends</group></item>" +
+		"</query></iq>",
+	"<message to='bob@localhost' xml:lang='en'>\n  <body><![CDATA[<raw> & unparsed]]></body>\n" +
+		"  <x:data xmlns:x='urn:example' x:kind='demo'>a > b</x:data>\n</message>",
+}
+
+func sampleStream(n int) []byte {
+	var b bytes.Buffer
+	b.WriteString(streamHeader)
+	for i := 0; i < n; i++ {
+		b.WriteString(sampleStanzas[i%len(sampleStanzas)])
+	}
+	b.WriteString("</stream:stream>")
+	return b.Bytes()
+}
+
+type stanzaReader interface {
+	ReadStanza() (*XMLNode, error)
+}
+
+func readAll(t *testing.T, d stanzaReader) []*XMLNode {
+	var out []*XMLNode
+	for {
+		node, err := d.ReadStanza()
+		if err == io.EOF {
+			return out
+		}
+		if err != nil {
+			t.Fatalf("ReadStanza: %v", err)
+		}
+		out = append(out, node.Clone())
+	}
+}
+
+func TestStreamDecoderMatchesEncodingXML(t *testing.T) {
+	data := sampleStream(len(sampleStanzas))
+	want := readAll(t, newStdDecoder(bytes.NewReader(data)))
+
+	// Small buffers split tags, text and references across reads
+	for _, size := range []int{16, 17, 64, 4096} {
+		r := bufio.NewReaderSize(bytes.NewReader(data), size)
+		got := readAll(t, NewStreamDecoder(r))
+		if !reflect.DeepEqual(got, want) {
+			for i := range want {
+				if i >= len(got) || !reflect.DeepEqual(got[i], want[i]) {
+					t.Fatalf("buffer %d, stanza %d:\n got %s\nwant %s", size, i,
+						dump(got, i), dump(want, i))
+				}
+			}
+			t.Fatalf("buffer %d: %d stanzas, want %d", size, len(got), len(want))
+		}
+	}
+}
+
+func dump(nodes []*XMLNode, i int) string {
+	if i >= len(nodes) {
+		return "(none)"
+	}
+	return fmt.Sprintf("%+v", *nodes[i])
+}
+
+// repeatReader serves the same stream header and then stanzas forever.
+type repeatReader struct {
+	data []byte
+	off  int
+}
+
+func (r *repeatReader) Read(p []byte) (int, error) {
+	n := 0
+	for n < len(p) {
+		c := copy(p[n:], r.data[r.off:])
+		n += c
+		r.off += c
+		if r.off == len(r.data) {
+			r.off = 0
+		}
+	}
+	return n, nil
+}
+
+func benchmarkDecoder(b *testing.B, newDec func(io.Reader) stanzaReader) {
+	var body strings.Builder
+	for _, s := range sampleStanzas {
+		body.WriteString(s)
+	}
+	src := &repeatReader{data: []byte(body.String())}
+	r := bufio.NewReader(io.MultiReader(strings.NewReader(streamHeader), src))
+	d := newDec(r)
+	if _, err := d.ReadStanza(); err != nil {
+		b.Fatal(err)
+	}
+
+	b.ReportAllocs()
+	b.SetBytes(int64(body.Len() / len(sampleStanzas)))
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if _, err := d.ReadStanza(); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+// Each op is one stanza: allocs/op and ns/op are per stanza.
+func BenchmarkReadStanza(b *testing.B) {
+	b.Run("scanner", func(b *testing.B) {
+		benchmarkDecoder(b, func(r io.Reader) stanzaReader {
+			return NewStreamDecoder(r.(*bufio.Reader))
+		})
+	})
+	b.Run("encoding_xml", func(b *testing.B) {
+		benchmarkDecoder(b, func(r io.Reader) stanzaReader { return newStdDecoder(r) })
+	})
+}
@@ -3,7 +3,6 @@ package xml
 import (
 	"crypto/rand"
 	"encoding/hex"
-	"strings"
 )
 
 // XMLAttr holds a single XML attribute.
@@ -54,24 +53,41 @@ func (n *XMLNode) FindChildNS(name, ns string) *XMLNode {
 	return nil
 }
 
+// Clone returns a deep copy of n that shares no storage with the decoder,
+// for keeping a stanza past the next ReadStanza.
+func (n *XMLNode) Clone() *XMLNode {
+	c := &XMLNode{Name: n.Name, NS: n.NS, Text: n.Text}
+	if len(n.Attrs) > 0 {
+		c.Attrs = append([]XMLAttr(nil), n.Attrs...)
+	}
+	for _, child := range n.Children {
+		c.Children = append(c.Children, child.Clone())
+	}
+	return c
+}
+
 // IsStreamOpen returns true if this node represents a <stream:stream> open.
 func (n *XMLNode) IsStreamOpen() bool {
-	return n.Name == "stream" && n.NS == "http://etherx.jabber.org/streams"
+	return n.Name == "stream" && n.NS == streamNamespace
 }
 
 // Serialize serializes the node to an XML string suitable for sending over
 // an XMPP stream whose default namespace is jabber:client.
 func (n *XMLNode) Serialize() string {
-	var b strings.Builder
-	n.serialize("", &b)
-	return b.String()
+	return string(n.AppendTo(nil))
 }
 
-// serialize writes the node into b, tracking parentNS to avoid redundant
+// AppendTo appends the node's serialization, as Serialize returns it, to b
+// and returns the extended buffer.
+func (n *XMLNode) AppendTo(b []byte) []byte {
+	return n.appendTo("", b)
+}
+
+// appendTo appends the node to b, tracking parentNS to avoid redundant
 // xmlns declarations.
-func (n *XMLNode) serialize(parentNS string, b *strings.Builder) {
-	b.WriteByte('<')
-	b.WriteString(n.Name)
+func (n *XMLNode) appendTo(parentNS string, b []byte) []byte {
+	b = append(b, '<')
+	b = append(b, n.Name...)
 
 	// Determine effective NS. jabber:client is the stream default — omit it.
 	effectiveNS := n.NS
@@ -79,48 +95,78 @@ func (n *XMLNode) serialize(parentNS string, b *strings.Builder) {
 		effectiveNS = ""
 	}
 	if effectiveNS != "" && effectiveNS != parentNS {
-		b.WriteString(" xmlns='")
-		b.WriteString(escapeAttr(effectiveNS))
-		b.WriteByte('\'')
+		b = AppendAttr(b, "xmlns", effectiveNS)
 	}
 
 	for _, a := range n.Attrs {
-		b.WriteByte(' ')
-		b.WriteString(a.Name)
-		b.WriteString("='")
-		b.WriteString(escapeAttr(a.Value))
-		b.WriteByte('\'')
+		b = AppendAttr(b, a.Name, a.Value)
 	}
 
 	if len(n.Children) == 0 && n.Text == "" {
-		b.WriteString("/>")
-		return
+		return append(b, "/>"...)
 	}
 
-	b.WriteByte('>')
-	if n.Text != "" {
-		b.WriteString(escapeText(n.Text))
-	}
+	b = append(b, '>')
+	b = AppendText(b, n.Text)
 	for _, c := range n.Children {
-		c.serialize(effectiveNS, b)
+		b = c.appendTo(effectiveNS, b)
 	}
-	b.WriteString("</")
-	b.WriteString(n.Name)
-	b.WriteByte('>')
+	b = append(b, "</"...)
+	b = append(b, n.Name...)
+	return append(b, '>')
 }
 
-func escapeAttr(s string) string {
-	s = strings.ReplaceAll(s, "&", "&amp;")
-	s = strings.ReplaceAll(s, "<", "&lt;")
-	s = strings.ReplaceAll(s, "'", "&apos;")
-	return s
+// AppendAttr appends " name='value'" to b, the value escaped.
+func AppendAttr(b []byte, name, value string) []byte {
+	b = append(b, ' ')
+	b = append(b, name...)
+	b = append(b, "='"...)
+	b = AppendEscapedAttr(b, value)
+	return append(b, '\'')
 }
 
-func escapeText(s string) string {
-	s = strings.ReplaceAll(s, "&", "&amp;")
-	s = strings.ReplaceAll(s, "<", "&lt;")
-	s = strings.ReplaceAll(s, ">", "&gt;")
-	return s
+// AppendEscapedAttr appends s escaped for a single-quoted attribute value.
+func AppendEscapedAttr(b []byte, s string) []byte {
+	last := 0
+	for i := 0; i < len(s); i++ {
+		var esc string
+		switch s[i] {
+		case '&':
+			esc = "&amp;"
+		case '<':
+			esc = "&lt;"
+		case '\'':
+			esc = "&apos;"
+		default:
+			continue
+		}
+		b = append(b, s[last:i]...)
+		b = append(b, esc...)
+		last = i + 1
+	}
+	return append(b, s[last:]...)
+}
+
+// AppendText appends s escaped as character data.
+func AppendText(b []byte, s string) []byte {
+	last := 0
+	for i := 0; i < len(s); i++ {
+		var esc string
+		switch s[i] {
+		case '&':
+			esc = "&amp;"
+		case '<':
+			esc = "&lt;"
+		case '>':
+			esc = "&gt;"
+		default:
+			continue
+		}
+		b = append(b, s[last:i]...)
+		b = append(b, esc...)
+		last = i + 1
+	}
+	return append(b, s[last:]...)
 }
 
 // GenerateID returns a random hex string of length n.
@@ -0,0 +1,58 @@
+package xml
+
+import (
+	"bufio"
+	"bytes"
+	"reflect"
+	"testing"
+)
+
+// Serialized stanzas decode back to the same trees, but for the namespaces
+// of prefixed attributes, which serialization has never kept.
+func TestAppendToRoundTrip(t *testing.T) {
+	want := readAll(t, NewStreamDecoder(bufio.NewReader(bytes.NewReader(sampleStream(len(sampleStanzas))))))
+
+	var out bytes.Buffer
+	out.WriteString(streamHeader)
+	buf := GetBuffer()
+	for _, node := range want[1:] {
+		*buf = node.AppendTo((*buf)[:0])
+		out.Write(*buf)
+	}
+	PutBuffer(buf)
+	out.WriteString("</stream:stream>")
+
+	got := readAll(t, NewStreamDecoder(bufio.NewReader(&out)))
+	for _, node := range want {
+		dropAttrNS(node)
+	}
+	for i := range want {
+		if i >= len(got) || !reflect.DeepEqual(got[i], want[i]) {
+			t.Fatalf("stanza %d:\n got %s\nwant %s", i, dump(got, i), dump(want, i))
+		}
+	}
+}
+
+func dropAttrNS(n *XMLNode) {
+	for i := range n.Attrs {
+		n.Attrs[i].NS = ""
+	}
+	for _, c := range n.Children {
+		dropAttrNS(c)
+	}
+}
+
+func TestAppendEscaping(t *testing.T) {
+	n := &XMLNode{Name: "body", NS: "jabber:client",
+		Attrs: []XMLAttr{{Name: "a", Value: `it's <"&">`}}, Text: `1 < 2 & 3 > "0"`}
+	const want = `<body a='it&apos;s &lt;"&amp;">'>1 &lt; 2 &amp; 3 &gt; "0"</body>`
+	if got := string(n.AppendTo(nil)); got != want {
+		t.Fatalf("got  %s\nwant %s", got, want)
+	}
+	if got := n.Serialize(); got != want {
+		t.Fatalf("Serialize: got %s", got)
+	}
+	if got := string(AppendText([]byte("x"), "plain")); got != "xplain" {
+		t.Fatalf("AppendText: got %s", got)
+	}
+}
@@ -11,6 +11,10 @@ REPO   = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
 DOMAIN = 'localhost'
 PORT   = 5222
 
+# Storage backend of the server under test: files, or mmap for a run of
+# run_all.py against a fresh store (XMPPD_STORAGE=mmap)
+STORAGE = os.environ.get('XMPPD_STORAGE', 'files')
+
 PASS_COUNT = 0
 FAIL_COUNT = 0
 
@@ -51,20 +55,25 @@ def summary():
     return FAIL_COUNT == 0
 
 
+def data_dir():
+    """The server's data directory."""
+    return os.environ.get('XMPPD_DATA', os.path.join(REPO, 'data'))
+
+
 def create_user(username, password):
     """Create a user via the useradd tool."""
     useradd = os.environ.get('USERADD_BIN', os.path.join(REPO, 'go', 'useradd'))
-    datadir = os.environ.get('XMPPD_DATA', os.path.join(REPO, 'data'))
-    result = subprocess.run(
-        [useradd, '-d', datadir, '-u', username, '-p', password],
-        capture_output=True, text=True
-    )
+    args = [useradd, '-d', data_dir(), '-u', username, '-p', password]
+    if STORAGE != 'files':
+        args += ['-s', STORAGE]
+    result = subprocess.run(args, capture_output=True, text=True)
     return result.returncode == 0
 
 
 def delete_user(username):
-    """Remove a user's data directory."""
-    user_dir = os.path.join(REPO, 'data', username)
+    """Remove a user's data directory. With storage = mmap the run starts
+    from an empty store, so there is nothing left over to remove."""
+    user_dir = os.path.join(data_dir(), username)
     if os.path.exists(user_dir):
         shutil.rmtree(user_dir)
 
@@ -9,13 +9,21 @@ use-after-free in stream error handling from within SAX startElement callbacks).
 Usage:
     python3 tests/run_all.py          # run everything
     python3 -m tests.run_all          # alternate invocation
+
+With XMPPD_STORAGE=mmap the server is run with storage = mmap on a fresh
+store in a temporary data directory. With XMPPD_THREADS=N it is run with
+N reactor threads, and with XMPPD_IO_BACKEND=io_uring on the io_uring
+event loop (epoll where the kernel or build lacks it).
 """
 
 import os
+import re
 import sys
 import time
+import shutil
 import subprocess
 import socket
+import tempfile
 
 # Add repo root to path so `import tests.*` works when run from repo root
 REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
@@ -23,11 +31,14 @@ sys.path.insert(0, REPO)
 
 from tests import (test_auth, test_session, test_roster,
                    test_presence, test_message, test_disco,
-                   test_registration)
+                   test_registration, test_store, test_reactors)
+from tests.common import STORAGE, create_user
 
 XMPPD    = os.environ.get('XMPPD_BIN', os.path.join(REPO, 'go', 'xmppd'))
 CONF     = os.path.join(REPO, 'config', 'xmppd.conf.example')
 PORT     = 5222
+THREADS  = os.environ.get('XMPPD_THREADS')       # reactor threads, if not the config's
+IO_BACKEND = os.environ.get('XMPPD_IO_BACKEND')  # epoll or io_uring, likewise
 
 
 def _wait_for_port(host='127.0.0.1', port=PORT, timeout=3.0):
@@ -52,6 +63,31 @@ def _kill_existing():
         pass
 
 
+def config_setup():
+    """For a run with settings other than the example config's: a
+    temporary directory holding a config with them. With another storage
+    backend it is the data directory too, with the accounts the tests
+    expect to exist. Returns the directory."""
+    global CONF
+    tmpdir = tempfile.mkdtemp(prefix='xmppd-test-')
+    with open(CONF) as f:
+        conf = f.read()
+    if THREADS:
+        conf = re.sub(r'(?m)^threads\s*=.*$', f'threads = {THREADS}', conf)
+    if IO_BACKEND:
+        conf = re.sub(r'(?m)^io_backend\s*=.*$', f'io_backend = {IO_BACKEND}', conf)
+    if STORAGE != 'files':
+        os.environ['XMPPD_DATA'] = tmpdir
+        conf = re.sub(r'(?m)^storage\s*=.*$', f'storage = {STORAGE}', conf)
+        conf = re.sub(r'(?m)^datadir\s*=.*$', f'datadir = {tmpdir}', conf)
+    CONF = os.path.join(tmpdir, 'xmppd.conf')
+    with open(CONF, 'w') as f:
+        f.write(conf)
+    if STORAGE != 'files':
+        create_user('alice', 'secret')
+    return tmpdir
+
+
 def start_server():
     """Start xmppd in the background. Returns the Popen object."""
     _kill_existing()
@@ -110,8 +146,9 @@ def run_module(name, mod, proc):
 
 
 def main():
+    tmpdir = config_setup() if STORAGE != 'files' or THREADS or IO_BACKEND else None
     proc = start_server()
-    print(f'xmppd started (pid {proc.pid})')
+    print(f'xmppd started (pid {proc.pid}, storage = {STORAGE})')
 
     modules = [
         ('registration', test_registration),
@@ -121,6 +158,8 @@ def main():
         ('presence',     test_presence),
         ('message',      test_message),
         ('disco',        test_disco),
+        ('store',        test_store),
+        ('reactors',     test_reactors),
     ]
 
     total_pass = 0
@@ -132,6 +171,8 @@ def main():
         total_fail += failed
 
     stop_server(proc)
+    if tmpdir:
+        shutil.rmtree(tmpdir, ignore_errors=True)
     print(f'\n{"═"*50}')
     print(f'GRAND TOTAL: {total_pass} passed, {total_fail} failed')
     print('═'*50)
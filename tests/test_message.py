@@ -1,11 +1,13 @@
 #!/usr/bin/env python3
-"""Tests for message routing: online delivery, offline storage, errors (6 scenarios)."""
+"""Tests for message routing: online delivery, offline storage, errors (10 scenarios)."""
 
 import os
 import re
+import socket
+import struct
 import time
-from .common import (XMPPConn, check, reset_counters, summary, REPO,
-                     create_user, delete_user, sasl_plain, DOMAIN)
+from .common import (XMPPConn, check, reset_counters, summary, STORAGE,
+                     create_user, delete_user, sasl_plain, DOMAIN, data_dir)
 
 
 def _login(username, password, resource='test'):
@@ -27,6 +29,30 @@ def _login(username, password, resource='test'):
     return c
 
 
+def _stored_offline(offline_dir):
+    """Messages queued in offline_dir: NNNN.xml files, or records of an
+    append-only messages.log (length and sequence header, then the stanza)."""
+    if not os.path.isdir(offline_dir):
+        return []
+    stored = sorted(f for f in os.listdir(offline_dir) if f.endswith('.xml'))
+    log = os.path.join(offline_dir, 'messages.log')
+    if os.path.exists(log):
+        cursor = 0
+        idx = os.path.join(offline_dir, 'messages.idx')
+        if os.path.exists(idx):
+            with open(idx) as f:
+                cursor = int(f.read().split()[0])
+        with open(log, 'rb') as f:
+            data = f.read()
+        off = cursor
+        while off + 8 <= len(data):
+            length = int.from_bytes(data[off:off + 4], 'little')
+            seq = int.from_bytes(data[off + 4:off + 8], 'little')
+            stored.append(f'messages.log#{seq}')
+            off += 8 + length
+    return stored
+
+
 def run():
     reset_counters()
 
@@ -80,11 +106,12 @@ def run():
     )
     time.sleep(0.3)
 
-    offline_dir = os.path.join(REPO, 'data', 'msguser2', 'offline')
-    xml_files = [f for f in os.listdir(offline_dir) if f.endswith('.xml')] \
-                if os.path.isdir(offline_dir) else []
-    check('offline file created', len(xml_files) > 0,
-          f'offline dir={offline_dir}, files={xml_files}')
+    # The queue is only looked at on disk with storage = files
+    offline_dir = os.path.join(data_dir(), 'msguser2', 'offline')
+    if STORAGE == 'files':
+        stored = _stored_offline(offline_dir)
+        check('offline message stored', len(stored) > 0,
+              f'offline dir={offline_dir}, stored={stored}')
 
     # ── 5. Offline delivery on login: msguser2 reconnects, receives delayed msg
     print('\n[msg-5] Offline delivery on login with delay stamp')
@@ -96,6 +123,10 @@ def run():
     # Verify timestamp format YYYY-MM-DDTHH:MM:SSZ
     stamp_match = re.search(r'stamp=["\'](\d{4}-\d{2}-\d{2}T\d{2}:\d{2}:\d{2}Z)["\']', resp2)
     check('delay stamp is valid UTC format', stamp_match is not None, resp2)
+    if STORAGE == 'files':
+        time.sleep(0.2)  # removed from the queue once sent
+        stored = _stored_offline(offline_dir)
+        check('delivered message removed from queue', len(stored) == 0, f'stored={stored}')
 
     # ── 6. <message type='error'> to offline user → NOT stored ───────────────
     print('\n[msg-6] Error message to offline user → not stored in offline dir')
@@ -105,7 +136,7 @@ def run():
     c1 = _login('msguser1', 'msgpass1', resource='r1b')
 
     # Clear msguser1's offline dir if present
-    m1_offline = os.path.join(REPO, 'data', 'msguser1', 'offline')
+    m1_offline = os.path.join(data_dir(), 'msguser1', 'offline')
     if os.path.isdir(m1_offline):
         for f in os.listdir(m1_offline):
             os.unlink(os.path.join(m1_offline, f))
@@ -116,18 +147,108 @@ def run():
     )
     time.sleep(0.3)
 
-    stored = []
-    if os.path.isdir(m1_offline):
-        stored = [f for f in os.listdir(m1_offline) if f.endswith('.xml')]
-    check('error message not stored offline', len(stored) == 0,
-          f'found files: {stored}')
+    if STORAGE == 'files':
+        stored = _stored_offline(m1_offline)
+        check('error message not stored offline', len(stored) == 0,
+              f'found: {stored}')
 
-    c1.close()
+    # ── 7. Slow reader: large backlog arrives complete and in order ──────────
+    print('\n[msg-7] Slow reader: 400 KB backlog delivered intact and in order')
+    c1.recv(timeout=0.3)
+    c2.recv(timeout=0.3)
+    # Without Nagle the sender's writes reach the server one stanza at a time
+    c1.s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    filler = 'x' * 1000
+    for i in range(400):
+        c1.send(
+            f"<message to='msguser2@{DOMAIN}' id='bulk{i}'>"
+            f"<body>{i}:{filler}</body></message>"
+        )
+        time.sleep(0.002)  # keep each server read well under one buffer
+    time.sleep(0.5)  # c2 has not read anything yet
+    resp2 = c2.recv(timeout=2.0)
+    seen = [int(n) for n in re.findall(r'<body[^>]*>(\d+):x{1000}</body>', resp2)]
+    check('all 400 messages delivered', len(seen) == 400, f'got {len(seen)}')
+    check('delivered in sending order', seen == list(range(400)), seen[:10])
+
+    # ── 8. A stanza much larger than one socket read ─────────────────────────
+    print('\n[msg-8] 100 KB message in one write is delivered intact')
+    big = 'y' * 100000
+    c1.send(f"<message to='msguser2@{DOMAIN}' id='big1'><body>{big}</body></message>")
+    resp2 = c2.recv(timeout=2.0)
+    check('large message delivered', re.search(r'<body[^>]*>y{100000}</body>', resp2) is not None,
+          f'got {len(resp2)} bytes')
+    c1.send(f"<message to='msguser2@{DOMAIN}' id='after'><body>still here</body></message>")
+    resp2 = c2.recv(timeout=1.0)
+    check('sender still connected', 'still here' in resp2, resp2[:200])
+
+    # ── 9. Recipient gone mid-backlog: what it did not read stays stored ─────
+    print('\n[msg-9] Recipient reset with offline backlog unread → kept for next login')
+    c2.close()
+    time.sleep(0.3)
+    chunk = 'w' * 16000
+    for i in range(500):    # 8 MB, far more than the socket buffers hold
+        c1.send(f"<message to='msguser2@{DOMAIN}' id='back{i}'><body>{i}:{chunk}</body></message>")
+    # Answered once everything sent before it has been handled
+    c1.send(f"<iq type='get' id='sync9' to='{DOMAIN}'>"
+            "<query xmlns='http://jabber.org/protocol/disco#info'/></iq>")
+    c1.recv(timeout=3.0)
+    c2 = _login('msguser2', 'msgpass2')
+    c2.send('<presence/>')
+    time.sleep(1.0)         # the backlog is queued, the socket full
+    c2.s.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack('ii', 1, 0))
+    c2.close()              # reset, nothing read
+    time.sleep(0.5)
+    c2 = _login('msguser2', 'msgpass2')
+    c2.send('<presence/>')
+    resp2 = c2.recv(timeout=3.0)
+    seen = [int(n) for n in re.findall(r'<body[^>]*>(\d+):w{16000}</body>', resp2)]
+    check('unread messages delivered on next login', 499 in seen,
+          f'got {len(seen)}')
+    c2.recv(timeout=0.5)
     c2.close()
 
+    c1.close()
+
+    # ── 10. Old NNNN.xml files beside a log: moved once, never twice ─────────
+    # The queue is only laid out on disk with storage = files
+    if STORAGE == 'files':
+        print('\n[msg-10] Old-layout files left beside a log → moved on login, once')
+        delete_user('msguser3')
+        create_user('msguser3', 'msgpass3')
+        d = os.path.join(data_dir(), 'msguser3', 'offline')
+        os.makedirs(d, exist_ok=True)
+
+        def stanza(text):
+            return (f"<message to='msguser3@{DOMAIN}' from='msguser1@{DOMAIN}/r1' "
+                    f"type='chat'><body>{text}</body></message>")
+
+        # One record in the log, and an index saying files up to 5.xml
+        # are in it already: a migration that stopped before unlinking
+        rec = stanza('from the log').encode()
+        with open(os.path.join(d, 'messages.log'), 'wb') as f:
+            f.write(len(rec).to_bytes(4, 'little') + (1).to_bytes(4, 'little') + rec)
+        with open(os.path.join(d, 'messages.idx'), 'w') as f:
+            f.write('0 2 5\n')
+        with open(os.path.join(d, '3.xml'), 'w') as f:
+            f.write(stanza('moved before'))
+        with open(os.path.join(d, '7.xml'), 'w') as f:
+            f.write(stanza('left behind'))
+
+        c3 = _login('msguser3', 'msgpass3')
+        c3.send('<presence/>')
+        resp3 = c3.recv(timeout=1.0)
+        check('message in the log delivered', 'from the log' in resp3, resp3)
+        check('file not yet moved delivered', 'left behind' in resp3, resp3)
+        check('file already moved not delivered again', 'moved before' not in resp3, resp3)
+        check('no old files left',
+              not [f for f in os.listdir(d) if f.endswith('.xml')], os.listdir(d))
+        c3.close()
+
     # Teardown
     delete_user('msguser1')
     delete_user('msguser2')
+    delete_user('msguser3')
 
     return summary()
 
@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+"""Tests across reactor threads: users whose sessions SO_REUSEPORT spreads
+over the reactors see each other's presence, exchange messages, and a
+login taking over a resource ends the session it replaces (3 scenarios).
+
+With threads = 1 (the example config) everything runs on one reactor;
+run with XMPPD_THREADS set (make test-c-mt) for the cross-reactor paths.
+"""
+
+import time
+from .common import (XMPPConn, check, reset_counters, summary,
+                     create_user, delete_user, sasl_plain, DOMAIN)
+
+# Users, one connection each. With two reactors, all of them landing on
+# the same one is a 1 in 2**(_USERS - 1) chance.
+_USERS = 6
+
+
+def _login(username, password, resource='mt'):
+    """Connect, authenticate, bind. Returns XMPPConn."""
+    c = XMPPConn()
+    c.open_stream()
+    c.send(
+        "<auth xmlns='urn:ietf:params:xml:ns:xmpp-sasl' mechanism='PLAIN'>"
+        f"{sasl_plain(username, password)}</auth>"
+    )
+    c.recv(timeout=0.5)
+    c.open_stream()
+    c.send(
+        f"<iq type='set' id='bind1'>"
+        f"<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'>"
+        f"<resource>{resource}</resource></bind></iq>"
+    )
+    c.recv(timeout=0.3)
+    return c
+
+
+def _user(i):
+    return f'mtuser{i % _USERS}'
+
+
+def _drain(conns, timeout=0.3):
+    """Everything each connection has received, in order."""
+    time.sleep(timeout)
+    return [c.recv(timeout=0.1) for c in conns]
+
+
+def run():
+    reset_counters()
+
+    for i in range(_USERS):
+        delete_user(_user(i))
+        create_user(_user(i), 'mtpass')
+    conns = [_login(_user(i), 'mtpass') for i in range(_USERS)]
+
+    # ── 1. Presence: each user subscribed to the next, in a ring ─────────────
+    print(f'\n[mt-1] {_USERS} users in a subscription ring → presence reaches each')
+    for i, c in enumerate(conns):
+        c.send('<presence/>')
+        c.send(f"<presence type='subscribe' to='{_user(i + 1)}@{DOMAIN}'/>")
+    _drain(conns, timeout=0.5)
+    for i in range(_USERS):
+        conns[(i + 1) % _USERS].send(
+            f"<presence type='subscribed' to='{_user(i)}@{DOMAIN}'/>")
+    _drain(conns, timeout=0.5)
+    for i, c in enumerate(conns):
+        c.send(f'<presence><status>here {i}</status></presence>')
+    got = _drain(conns, timeout=0.5)
+    missing = [i for i in range(_USERS)
+               if f'here {(i + 1) % _USERS}' not in got[i]]
+    check('every user sees its contact come online', not missing,
+          f'missing for users {missing}')
+
+    # ── 2. Messages around the ring ──────────────────────────────────────────
+    print('\n[mt-2] Each user messages the next → every message delivered')
+    for i, c in enumerate(conns):
+        c.send(f"<message to='{_user(i + 1)}@{DOMAIN}' type='chat' id='ring{i}'>"
+               f"<body>ring from {i}</body></message>")
+    got = _drain(conns)
+    missing = [i for i in range(_USERS)
+               if f'ring from {(i - 1) % _USERS}' not in got[i]]
+    check('every message delivered', not missing, f'missing for users {missing}')
+
+    # ── 3. Every user logs in again: the old sessions end in conflict ────────
+    print('\n[mt-3] Second login of each user → old session gets <conflict/>')
+    again = [_login(_user(i), 'mtpass') for i in range(_USERS)]
+    got = _drain(conns)
+    missing = [i for i in range(_USERS) if 'conflict' not in got[i]]
+    check('every replaced session told of the conflict', not missing,
+          f'missing for users {missing}')
+    for i, c in enumerate(again):
+        c.send(f"<message to='{_user(i + 1)}@{DOMAIN}' type='chat' id='again{i}'>"
+               f"<body>again from {i}</body></message>")
+    got = _drain(again)
+    missing = [i for i in range(_USERS)
+               if f'again from {(i - 1) % _USERS}' not in got[i]]
+    check('messages go to the new sessions', not missing,
+          f'missing for users {missing}')
+
+    for c in conns + again:
+        c.close()
+
+    # Teardown
+    for i in range(_USERS):
+        delete_user(_user(i))
+
+    return summary()
+
+
+if __name__ == '__main__':
+    import sys
+    sys.exit(0 if run() else 1)
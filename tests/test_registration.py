@@ -4,17 +4,29 @@
 import os
 import shutil
 from .common import (XMPPConn, check, reset_counters, summary,
-                     sasl_plain, REPO, DOMAIN)
+                     sasl_plain, DOMAIN, STORAGE, data_dir)
 
-NEWUSER_DIR = os.path.join(REPO, 'data', 'newuser')
+
+def _auth_ok(username, password):
+    """Whether SASL PLAIN succeeds on a fresh connection."""
+    c = XMPPConn()
+    c.open_stream()
+    c.send(
+        "<auth xmlns='urn:ietf:params:xml:ns:xmpp-sasl' mechanism='PLAIN'>"
+        f"{sasl_plain(username, password)}</auth>"
+    )
+    resp = c.recv(timeout=1.0)
+    c.close()
+    return '<success' in resp
 
 
 def run():
     reset_counters()
+    newuser_dir = os.path.join(data_dir(), 'newuser')
 
     # Clean up any leftover newuser from a previous run
-    if os.path.exists(NEWUSER_DIR):
-        shutil.rmtree(NEWUSER_DIR)
+    if os.path.exists(newuser_dir):
+        shutil.rmtree(newuser_dir)
 
     # ── 1. Pre-auth stream features ───────────────────────────────────────────
     print('\n[reg-1] Pre-auth stream features')
@@ -53,11 +65,16 @@ def run():
     c.close()
 
     # ── 4. Verify data directory ──────────────────────────────────────────────
-    print('\n[reg-4] data/newuser/ created on disk')
-    check('data/newuser/ exists',   os.path.isdir(NEWUSER_DIR))
-    check('user.conf exists',       os.path.isfile(f'{NEWUSER_DIR}/user.conf'))
-    check('roster.xml exists',      os.path.isfile(f'{NEWUSER_DIR}/roster.xml'))
-    check('offline/ exists',        os.path.isdir(f'{NEWUSER_DIR}/offline'))
+    if STORAGE == 'files':
+        print('\n[reg-4] data/newuser/ created on disk')
+        check('data/newuser/ exists',   os.path.isdir(newuser_dir))
+        check('user.conf exists',       os.path.isfile(f'{newuser_dir}/user.conf'))
+        check('roster.xml exists',      os.path.isfile(f'{newuser_dir}/roster.xml'))
+        check('offline/ exists',        os.path.isdir(f'{newuser_dir}/offline'))
+    else:
+        print(f'\n[reg-4] newuser kept in the {STORAGE} store')
+        check('store file exists',      os.path.isfile(os.path.join(data_dir(), 'xmppd.db')))
+        check('no data/newuser/',       not os.path.exists(newuser_dir))
 
     # ── 5. Authenticate as newuser ────────────────────────────────────────────
     print('\n[reg-5] Authenticate as newuser / testpass')
@@ -105,9 +122,12 @@ def run():
     resp = c.recv()
     check('result IQ returned',
           'type="result"' in resp or "type='result'" in resp, resp)
-    conf_path = f'{NEWUSER_DIR}/user.conf'
-    conf = open(conf_path).read() if os.path.exists(conf_path) else ''
-    check('user.conf contains newpass', 'newpass' in conf, conf)
+    if STORAGE == 'files':
+        conf_path = f'{newuser_dir}/user.conf'
+        conf = open(conf_path).read() if os.path.exists(conf_path) else ''
+        check('user.conf contains newpass', 'newpass' in conf, conf)
+    else:
+        check('newpass accepted',       _auth_ok('newuser', 'newpass'))
 
     # ── 8. Account removal ────────────────────────────────────────────────────
     print('\n[reg-8] Post-auth account removal')
@@ -120,7 +140,10 @@ def run():
           'type="result"' in resp or "type='result'" in resp, resp)
     import time
     time.sleep(0.5)
-    check('data/newuser/ removed', not os.path.exists(NEWUSER_DIR))
+    if STORAGE == 'files':
+        check('data/newuser/ removed', not os.path.exists(newuser_dir))
+    else:
+        check('newuser no longer accepted', not _auth_ok('newuser', 'newpass'))
     c.close()
 
     # ── 9. disco#info includes jabber:iq:register ──────────────────────────────
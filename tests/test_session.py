@@ -1,6 +1,7 @@
 #!/usr/bin/env python3
-"""Tests for stream negotiation, resource binding, and session IQ (8 scenarios)."""
+"""Tests for stream negotiation, resource binding, and session IQ (11 scenarios)."""
 
+import time
 from .common import (XMPPConn, check, reset_counters, summary,
                      create_user, delete_user, sasl_plain, DOMAIN)
 
@@ -144,8 +145,62 @@ def run():
     check('not-authorized stream error', 'not-authorized' in resp, resp)
     c.close()
 
+    # ── 9. Many concurrent connections are all served ─────────────────────────
+    print('\n[sess-9] 40 concurrent connections → all receive stream features')
+    conns = [XMPPConn() for _ in range(40)]
+    for c in conns:
+        c.send(
+            "<?xml version='1.0'?>"
+            f"<stream:stream to='{DOMAIN}' "
+            "xmlns='jabber:client' "
+            "xmlns:stream='http://etherx.jabber.org/streams' "
+            "version='1.0'>"
+        )
+    time.sleep(0.5)
+    served = sum(1 for c in conns if 'stream:features' in c.recv(timeout=0.1))
+    check('all 40 connections served', served == len(conns), served)
+    for c in conns:
+        c.close()
+
+    # ── 10. Stanza and close arriving together → session ends ────────────────
+    print('\n[sess-10] Stanza followed at once by close → session unbound')
+    delete_user('sessuser2')
+    create_user('sessuser2', 'sesspass2')
+    c = XMPPConn()
+    c.login('sessuser1', 'sesspass1', 'gone')
+    c.send('<presence/>')
+    c.close()
+    time.sleep(0.3)
+    c2 = XMPPConn()
+    c2.login('sessuser2', 'sesspass2')
+    c2.send(f"<message to='sessuser1@{DOMAIN}' id='s10'><body>after close</body></message>")
+    time.sleep(0.3)
+    c2.close()
+    c = XMPPConn()
+    c.login('sessuser1', 'sesspass1', 'back')
+    c.send('<presence/>')
+    resp = c.recv(timeout=1.0)
+    check('message kept offline for the next login', 'after close' in resp, resp)
+    c.close()
+
+    # ── 11. A burst longer than one read budget, then close ──────────────────
+    print('\n[sess-11] 1 MB burst followed at once by close → read to the end')
+    c = XMPPConn()
+    c.login('sessuser1', 'sesspass1', 'burst')
+    c.send('<presence/>' + ' ' * (1 << 20) +
+           f"<message to='sessuser2@{DOMAIN}' id='s11'><body>end of burst</body></message>")
+    c.close()
+    time.sleep(0.5)
+    c2 = XMPPConn()
+    c2.login('sessuser2', 'sesspass2')
+    c2.send('<presence/>')
+    resp = c2.recv(timeout=1.0)
+    check('last stanza of the burst handled', 'end of burst' in resp, resp)
+    c2.close()
+
     # Teardown
     delete_user('sessuser1')
+    delete_user('sessuser2')
 
     return summary()
 
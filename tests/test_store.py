@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+"""Tests for the account store: accounts added while the server runs, many
+accounts, values over 1 KiB, account removal (5 scenarios)."""
+
+import re
+import time
+from .common import (XMPPConn, check, reset_counters, summary,
+                     create_user, delete_user, sasl_plain, DOMAIN)
+
+_MANY = 400     # accounts, enough for the store to split its leaves
+
+
+def _login(username, password, resource='test'):
+    """Connect, authenticate, bind. Returns XMPPConn, or None if refused."""
+    c = XMPPConn()
+    c.open_stream()
+    c.send(
+        "<auth xmlns='urn:ietf:params:xml:ns:xmpp-sasl' mechanism='PLAIN'>"
+        f"{sasl_plain(username, password)}</auth>"
+    )
+    if '<success' not in c.recv(timeout=1.0):
+        c.close()
+        return None
+    c.open_stream()
+    c.send(
+        f"<iq type='set' id='bind1'>"
+        f"<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'>"
+        f"<resource>{resource}</resource></bind></iq>"
+    )
+    c.recv(timeout=0.5)
+    return c
+
+
+def _auth_ok(username, password):
+    c = _login(username, password)
+    if c:
+        c.close()
+    return c is not None
+
+
+def _user(i):
+    return f'storeuser{i}'
+
+
+def run():
+    reset_counters()
+
+    for i in range(_MANY):
+        delete_user(_user(i))
+
+    # ── 1. Account added by useradd while the server runs ────────────────────
+    print('\n[store-1] useradd while the server is running')
+    check('unknown account refused', not _auth_ok(_user(0), 'pw0'))
+    create_user(_user(0), 'pw0')
+    check('account accepted once added', _auth_ok(_user(0), 'pw0'))
+
+    # ── 2. Many accounts ─────────────────────────────────────────────────────
+    print(f'\n[store-2] {_MANY} accounts')
+    for i in range(1, _MANY):
+        create_user(_user(i), f'pw{i}')
+    check('first account accepted', _auth_ok(_user(1), 'pw1'))
+    check('middle account accepted',
+          _auth_ok(_user(_MANY // 2), f'pw{_MANY // 2}'))
+    check('last account accepted',
+          _auth_ok(_user(_MANY - 1), f'pw{_MANY - 1}'))
+    check('wrong password refused', not _auth_ok(_user(_MANY - 1), 'pw0'))
+
+    # ── 3. Offline message over 1 KiB ────────────────────────────────────────
+    print('\n[store-3] 3 KB offline message kept intact and delivered once')
+    big = 'z' * 3000
+    c1 = _login(_user(1), 'pw1')
+    c1.send(f"<message to='{_user(2)}@{DOMAIN}' id='s3'><body>{big}</body></message>")
+    time.sleep(0.3)
+    c2 = _login(_user(2), 'pw2')
+    c2.send('<presence/>')
+    resp = c2.recv(timeout=1.0)
+    check('large offline message delivered',
+          re.search(r'<body[^>]*>z{3000}</body>', resp) is not None,
+          f'got {len(resp)} bytes')
+    c2.close()
+    time.sleep(0.2)
+    c2 = _login(_user(2), 'pw2')
+    c2.send('<presence/>')
+    resp = c2.recv(timeout=0.5)
+    check('not delivered again', 'zzz' not in resp, resp[:200])
+    c2.close()
+
+    # ── 4. Roster over 1 KiB ─────────────────────────────────────────────────
+    print('\n[store-4] 40-item roster kept across logins')
+    for i in range(40):
+        c1.send(
+            f"<iq type='set' id='r{i}'><query xmlns='jabber:iq:roster'>"
+            f"<item jid='{_user(100 + i)}@{DOMAIN}' name='contact number {i:02d} "
+            f"with a rather long name'/></query></iq>"
+        )
+    c1.recv(timeout=0.5)
+    c1.close()
+    time.sleep(0.2)
+    c1 = _login(_user(1), 'pw1')
+    c1.send("<iq type='get' id='r'><query xmlns='jabber:iq:roster'/></iq>")
+    resp = c1.recv(timeout=1.0)
+    names = re.findall(r'contact number (\d\d) with', resp)
+    check('all 40 items loaded', sorted(names) == [f'{i:02d}' for i in range(40)],
+          f'got {len(names)}')
+    c1.close()
+
+    # ── 5. Account removal ───────────────────────────────────────────────────
+    print('\n[store-5] Removed account leaves nothing behind')
+    c3 = _login(_user(3), 'pw3')
+    c3.send(
+        f"<iq type='set' id='r1'><query xmlns='jabber:iq:roster'>"
+        f"<item jid='{_user(4)}@{DOMAIN}' name='old friend'/></query></iq>"
+    )
+    c3.recv(timeout=0.5)
+    c4 = _login(_user(4), 'pw4')
+    c4.send(f"<message to='{_user(3)}@{DOMAIN}' id='s5'><body>left behind</body></message>")
+    c4.close()
+    time.sleep(0.3)
+    c3.send("<iq type='set' id='rm1'><query xmlns='jabber:iq:register'><remove/></query></iq>")
+    c3.recv(timeout=0.5)
+    c3.close()
+    time.sleep(0.3)
+    check('removed account refused', not _auth_ok(_user(3), 'pw3'))
+    check('account added again', create_user(_user(3), 'pw3b'))
+    c3 = _login(_user(3), 'pw3b')
+    check('new account accepted', c3 is not None)
+    if c3:
+        c3.send("<iq type='get' id='r'><query xmlns='jabber:iq:roster'/></iq>")
+        c3.send('<presence/>')
+        resp = c3.recv(timeout=1.0)
+        check('old roster gone', 'old friend' not in resp, resp)
+        check('old offline message gone', 'left behind' not in resp, resp)
+        c3.close()
+
+    # Teardown
+    for i in range(_MANY):
+        delete_user(_user(i))
+
+    return summary()
+
+
+if __name__ == '__main__':
+    import sys
+    sys.exit(0 if run() else 1)